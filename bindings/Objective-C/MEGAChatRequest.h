@@ -34,7 +34,8 @@ typedef NS_ENUM (NSInteger, MEGAChatRequestType) {
     MEGAChatRequestTypeArchiveChatRoom,
     MEGAChatRequestTypePushReceived,
     MEGAChatRequestTypeSetLastGreenVisible,
-    MEGAChatRequestTypeSetLastGreen
+    MEGAChatRequestTypeSetLastGreen,
+    MEGAChatRequestTypeSearchMessages
 };
 
 enum {
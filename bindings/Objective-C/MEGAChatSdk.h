@@ -211,6 +211,9 @@ typedef NS_ENUM (NSInteger, MEGAChatConnection) {
 
 - (MEGAChatSource)loadMessagesForChat:(uint64_t)chatId count:(NSInteger)count;
 - (BOOL)isFullHistoryLoadedForChat:(uint64_t)chatId;
+- (void)setHistoryBudgetPerChat:(NSUInteger)perChat global:(NSUInteger)global;
+- (void)searchMessagesInChat:(uint64_t)chatId text:(NSString *)text limit:(NSInteger)limit delegate:(id<MEGAChatRequestDelegate>)delegate;
+- (void)searchMessagesInChat:(uint64_t)chatId text:(NSString *)text limit:(NSInteger)limit;
 
 - (MEGAChatMessage *)messageForChat:(uint64_t)chatId messageId:(uint64_t)messageId;
 - (MEGAChatMessage *)messageFromNodeHistoryForChat:(uint64_t)chatId messageId:(uint64_t)messageId;
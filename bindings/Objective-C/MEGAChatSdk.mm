@@ -642,6 +642,18 @@ static DelegateMEGAChatLoggerListener *externalLogger = NULL;
     return self.megaChatApi->isFullHistoryLoaded(chatId);
 }
 
+- (void)setHistoryBudgetPerChat:(NSUInteger)perChat global:(NSUInteger)global {
+    self.megaChatApi->setHistoryBudget((unsigned int)perChat, (unsigned int)global);
+}
+
+- (void)searchMessagesInChat:(uint64_t)chatId text:(NSString *)text limit:(NSInteger)limit delegate:(id<MEGAChatRequestDelegate>)delegate {
+    self.megaChatApi->searchMessages(chatId, text ? [text UTF8String] : NULL, (int)limit, [self createDelegateMEGAChatRequestListener:delegate singleListener:YES]);
+}
+
+- (void)searchMessagesInChat:(uint64_t)chatId text:(NSString *)text limit:(NSInteger)limit {
+    self.megaChatApi->searchMessages(chatId, text ? [text UTF8String] : NULL, (int)limit);
+}
+
 - (MEGAChatMessage *)messageForChat:(uint64_t)chatId messageId:(uint64_t)messageId {
     return self.megaChatApi->getMessage(chatId, messageId) ? [[MEGAChatMessage alloc] initWithMegaChatMessage:self.megaChatApi->getMessage(chatId, messageId) cMemoryOwn:YES] : nil;
 }
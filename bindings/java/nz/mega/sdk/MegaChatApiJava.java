@@ -1427,6 +1427,20 @@ public class MegaChatApiJava {
         return megaChatApi.loadMessages(chatid, count);
     }
 
+    /**
+     * Limits the number of messages of the history kept in memory
+     *
+     * By default, all the messages loaded, received and sent are kept in memory while
+     * the session is alive. When a budget is set, the messages beyond it that are not
+     * needed anymore are released from memory, and reloaded from the local cache on demand.
+     *
+     * @param perChat Max number of messages kept in memory for every chat, 0 for unlimited (default)
+     * @param global Max number of messages kept in memory for all chats together, 0 for unlimited (default)
+     */
+    public void setHistoryBudget(int perChat, int global){
+        megaChatApi.setHistoryBudget(perChat, global);
+    }
+
     /**
      * Returns the MegaChatMessage specified from the chat room.
      *
@@ -2009,6 +2023,29 @@ public class MegaChatApiJava {
         megaChatApi.pushReceived(beep, chatid, createDelegateRequestListener(listener));
     }
 
+    /**
+     * Searches the local history for messages containing some words
+     *
+     * It searches the history cached locally, without loading the chatrooms, in the text of
+     * the messages and in the names of the attached files and contacts. The matching ignores
+     * the case of ASCII letters only. The messages are ranked by the number of words found,
+     * and then from newest to oldest.
+     *
+     * The associated request type with this request is MegaChatRequest::TYPE_SEARCH_MESSAGES
+     * Valid data in the MegaChatRequest object received in onRequestFinish when the error code
+     * is MegaError::ERROR_OK:
+     * - MegaChatRequest::getMegaHandleList - Returns the list of chatids with messages found
+     * - MegaChatRequest::getMegaHandleListByChat - Returns the list of msgids found in each chat
+     *
+     * @param chatid MegaChatHandle that identifies the chat room, or MEGACHAT_INVALID_HANDLE for all chats
+     * @param text Words to search
+     * @param limit Maximum number of messages to return
+     * @param listener MegaChatRequestListener to track this request
+     */
+    public void searchMessages(long chatid, String text, int limit, MegaChatRequestListenerInterface listener){
+        megaChatApi.searchMessages(chatid, text, limit, createDelegateRequestListener(listener));
+    }
+
     // Call management
     /**
      * Start a call in a chat room
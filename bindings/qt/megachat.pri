@@ -93,6 +93,7 @@ HEADERS  += asyncTest-framework.h \
             autoHandle.h \
             chatCommon.h  \
             chatdMsg.h \
+            msgIndex.h \
             dummyCrypto.h  \
             megachatapi.h  \
             rtcCrypto.h \
@@ -120,12 +121,18 @@ HEADERS  += asyncTest-framework.h \
             base/logger.h \
             base/loggerFile.h \
             base/loggerConsole.h \
+            base/loggerAsync.h \
+            base/mpscQueue.h \
+            base/objectPool.h \
             base/retryHandler.h \
             base/promise.h \
             base/services.h \
             base/timers.hpp \
+            base/timerWheel.h \
             base/trackDelete.h \
+            base/workerPool.h \
             net/libwebsocketsIO.h \
+            net/bufferPool.h \
             net/websocketsIO.h \
             rtcModule/IDeviceListImpl.h \
             rtcModule/IRtcCrypto.h \
@@ -143,6 +143,12 @@ public:
 
         /** @brief Called when the chat is un/archived */
         virtual void onChatArchived(bool /*archived*/) {}
+
+        /** @brief Called when the name or email of a member, or the privilege of
+         * the peer of a 1on1 chat, has changed. Unlike the changes of members, these
+         * are notified to the chat handler only if the chatroom is open
+         */
+        virtual void onMembersInfoChanged() {}
     };
 
     /**
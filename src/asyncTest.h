@@ -7,6 +7,8 @@
 
 #include <vector>
 #include <map>
+#include <memory>
+#include <functional>
 #include <mutex>
 #include <thread>
 #include <string.h> //for strcmp
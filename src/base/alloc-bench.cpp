@@ -0,0 +1,185 @@
+// Benchmark of the heap allocations made by the app's thread for each incoming message:
+// the receiving thread marshals the message to the app's thread, which processes it
+// through a chain of promises (as decryption does) and sets and cancels a timeout.
+// It counts the calls to the global operator new, so building it with and without
+// KARERE_DISABLE_OBJECT_POOL shows the allocations per message without and with
+// the object pool (see objectPool.h).
+//
+// Usage: alloc-bench [message-count]
+// Build (from src/base, libuv required):
+// g++ -std=c++11 -O2 -I. -I.. alloc-bench.cpp cservices.cpp -luv -lpthread -o alloc-bench
+// g++ -std=c++11 -O2 -I. -I.. -DKARERE_DISABLE_OBJECT_POOL alloc-bench.cpp cservices.cpp -luv -lpthread -o alloc-bench-nopool
+// With CMake, enable optKarereBuildBenchmarks (targets alloc-bench, alloc-bench-nopool).
+
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include "timers.hpp"
+#include "promise.h"
+
+namespace karere
+{
+bool gCatchException = false;
+}
+
+// no logging, so the logger (and the SDK it depends on) is not needed
+static KarereLogChannel gLogChannels[krLogChannelCount];
+KarereLogChannel* krLoggerChannels = gLogChannels;
+void krLoggerLog(krLogChannelNo, krLogLevel, const char*, ...) {}
+
+static std::atomic<uint64_t> gAllocCount(0);
+
+void* operator new(size_t size)
+{
+    gAllocCount.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+static uv_loop_t* gLoop;
+static karere::TimerWheel* gWheel;
+
+// the app's message queue
+static std::mutex gMutex;
+static std::condition_variable gCond;
+static std::deque<void*> gMessages;
+
+static void postMessage(void* msg, void*)
+{
+    std::lock_guard<std::mutex> lock(gMutex);
+    gMessages.push_back(msg);
+    gCond.notify_one();
+}
+
+namespace karere
+{
+TimerWheel* get_timer_wheel(void*)
+{
+    return gWheel;
+}
+}
+
+struct Message
+{
+    uint64_t chatid;
+    uint64_t msgid;
+    uint64_t userid;
+    uint32_t keyid;
+    bool decrypted = false;
+};
+
+static size_t gProcessed = 0;
+
+// what the app's thread does for each message, with the decryption already done
+static void processMessage(Message* msg)
+{
+    promise::Promise<Message*> pms;
+    pms.then([](Message* msg)
+    {
+        msg->decrypted = true;
+        return msg;
+    })
+    .then([](Message* msg)
+    {
+        megaHandle timer = karere::setTimeout([msg]() { msg->decrypted = false; }, 10000, nullptr);
+        karere::cancelTimeout(timer, nullptr);
+        gProcessed++;
+    })
+    .fail([](const promise::Error&)
+    {
+        gProcessed++;
+    });
+    pms.resolve(msg);
+}
+
+static void runLoopUntil(size_t count)
+{
+    while (gProcessed < count)
+    {
+        std::deque<void*> messages;
+        {
+            std::unique_lock<std::mutex> lock(gMutex);
+            gCond.wait(lock, []() { return !gMessages.empty(); });
+            messages.swap(gMessages);
+        }
+        for (void* msg: messages)
+        {
+            megaProcessMessage(msg);
+        }
+        uv_run(gLoop, UV_RUN_NOWAIT);
+    }
+}
+
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void bench(std::vector<Message>& msgs)
+{
+    gProcessed = 0;
+    uint64_t allocs = gAllocCount.load();
+    auto start = std::chrono::steady_clock::now();
+    std::thread receiver([&msgs]()
+    {
+        for (auto& msg: msgs)
+        {
+            Message* pmsg = &msg;
+            uint64_t chatid = msg.chatid, msgid = msg.msgid, userid = msg.userid;
+            karere::marshallCall([pmsg, chatid, msgid, userid]()
+            {
+                assert(pmsg->chatid == chatid && pmsg->msgid == msgid && pmsg->userid == userid);
+                processMessage(pmsg);
+            }, nullptr);
+        }
+    });
+    runLoopUntil(msgs.size());
+    double ms = elapsedMs(start);
+    receiver.join();
+    allocs = gAllocCount.load() - allocs;
+    printf("%-14s %zu msgs: %8.2f ms (%6.1f ns/msg), %6.2f allocs/msg\n",
+#ifdef KARERE_DISABLE_OBJECT_POOL
+           "no pool",
+#else
+           "object pool",
+#endif
+           msgs.size(), ms, ms * 1e6 / msgs.size(), (double)allocs / msgs.size());
+}
+
+int main(int argc, char** argv)
+{
+    size_t count = (argc > 1) ? atoi(argv[1]) : 100000;
+    megaPostMessageToGui = postMessage;
+    gLoop = uv_default_loop();
+    gWheel = new karere::TimerWheel(gLoop, nullptr);
+    uv_run(gLoop, UV_RUN_NOWAIT); // the wheel learns the thread of the loop
+
+    std::vector<Message> msgs(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        msgs[i].chatid = 1;
+        msgs[i].msgid = i + 1;
+        msgs[i].userid = 2;
+        msgs[i].keyid = 3;
+    }
+    bench(msgs); // warm up the pool
+    bench(msgs);
+    return 0;
+}
@@ -12,11 +12,6 @@
 #include <sys/time.h>
 #endif
 
-namespace karere
-{
-    std::recursive_mutex timerMutex;
-}
-
 extern "C"
 {
 MEGAIO_EXPORT eventloop* services_eventloop = NULL;
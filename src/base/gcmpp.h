@@ -6,6 +6,7 @@
 #include "karereCommon.h"
 #include "gcm.h"
 #include "logger.h"
+#include "objectPool.h"
 #include <memory>
 #include <assert.h>
 
@@ -21,7 +22,8 @@ namespace karere
 template <class F>
 static inline void marshallCall(F&& func, void *appCtx)
 {
-    struct Msg: public megaMessage
+    // megaMessage must be the first base, the message is processed as a megaMessage*
+    struct Msg: public megaMessage, public PoolAllocated
     {
         F mFunc;
         Msg(F&& aFunc, megaMessageFunc cHandler)
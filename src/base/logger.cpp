@@ -8,6 +8,7 @@
 #include "logger.h"
 #include "loggerFile.h"
 #include "loggerConsole.h"
+#include "loggerAsync.h"
 #include "../stringUtils.h" //needed for parsing the KRLOG env variable
 #include "sdkApi.h"
 
@@ -92,8 +93,29 @@ void Logger::setAutoFlush(bool enable)
         mFlags |= krLogNoAutoFlush;
 }
 
+void Logger::logAsync(bool enable, size_t queueSize, unsigned asyncFlags)
+{
+    AsyncLogger* newLogger = enable ? new AsyncLogger(*this, queueSize, asyncFlags) : nullptr;
+    AsyncLogger* oldLogger = mAsyncLogger.exchange(newLogger);
+    if (!oldLogger)
+        return;
+    //wait for threads that are still pushing to the old queue
+    while (mAsyncUsers.load())
+        std::this_thread::yield();
+    delete oldLogger; //writes out the queued records
+}
+
+uint64_t Logger::droppedRecords()
+{
+    mAsyncUsers++;
+    AsyncLogger* asyncLogger = mAsyncLogger.load();
+    uint64_t ret = asyncLogger ? asyncLogger->droppedRecords() : 0;
+    mAsyncUsers--;
+    return ret;
+}
+
 Logger::Logger(unsigned aFlags, const char* timeFmt)
-    :mTimeFmt(timeFmt), mFlags(aFlags)
+    :mTimeFmt(timeFmt), mFlags(aFlags), mAsyncLogger(nullptr), mAsyncUsers(0)
 {
     setup();
     setupFromEnvVar();
@@ -175,7 +197,8 @@ void Logger::logv(const char* prefix, krLogLevel level, unsigned flags, const ch
     va_end(vaList);
     bytesLogged+=sprintfRv;
     buf[bytesLogged] = 0;
-    logString(level, buf, flags, bytesLogged);
+    if (!logStringAsync(level, buf, flags, bytesLogged))
+        logString(level, buf, flags, bytesLogged);
     if (buf != statBuf)
         delete[] buf;
 }
@@ -211,6 +234,20 @@ void Logger::logString(krLogLevel level, const char* msg, unsigned flags, size_t
     }
 }
 
+bool Logger::logStringAsync(krLogLevel level, const char* msg, unsigned flags, size_t len)
+{
+    //the counter must be incremented before loading the pointer, see logAsync()
+    mAsyncUsers++;
+    AsyncLogger* asyncLogger = mAsyncLogger.load();
+    //records logged by the writer thread itself (i.e. by a user logger) are
+    //written synchronously, it can't wait on its own queue
+    bool queued = asyncLogger && !asyncLogger->isWriterThread();
+    if (queued)
+        asyncLogger->push(level, msg, len, flags);
+    mAsyncUsers--;
+    return queued;
+}
+
  void Logger::log(const char* prefix, krLogLevel level, unsigned flags,
                 const char* fmtString, ...)
 {
@@ -224,12 +261,21 @@ std::shared_ptr<Logger::LogBuffer> Logger::loadLog()
 {
     if (!mFileLogger)
         return NULL;
+
+    //make sure records that are still queued are in the file
+    mAsyncUsers++;
+    AsyncLogger* asyncLogger = mAsyncLogger.load();
+    if (asyncLogger && !asyncLogger->isWriterThread())
+        asyncLogger->flush();
+    mAsyncUsers--;
+
     LockGuard lock(mMutex);
     return mFileLogger->loadLog();
 }
 
 Logger::~Logger()
 {
+    logAsync(false); //write out the queued records while the backends still exist
     LockGuard lock(mMutex);
     if (!mUserLoggers.empty())
     {
@@ -54,6 +54,13 @@ enum
     krLogNoTerminateMessage = 1 << 12,
     krGlobalFlagMask = krLogNoAutoFlush|krLogNoLevel|krLogNoTimestamps ///flags that override channel flags when they are globally set
 };
+/** Flags of the asynchronous logging mode, see karere::Logger::logAsync() */
+enum
+{
+    krLogAsyncDropNewest = 0, ///< a record that doesn't fit in the full queue is discarded and counted
+    krLogAsyncBlock = 1 << 0, ///< the logging thread waits until the writer thread frees a slot
+    krLogAsyncReportDrops = 1 << 1 ///< the writer thread logs a warning with the number of dropped records
+};
 typedef unsigned char krLogChannelNo;
 typedef struct _KarereLogChannel
 {
@@ -71,6 +78,8 @@ enum { krLogChannelCount = 32 };
 #include <memory>
 #include <mutex>
 #include <map>
+#include <atomic>
+#include <stdint.h>
 
 class MyMegaApi;
 #define CHATLOGS_PORT 0
@@ -79,6 +88,7 @@ namespace karere
 {
 class FileLogger;
 class ConsoleLogger;
+class AsyncLogger;
 
 class KRLOGGER_DLLIMPEXP Logger
 {
@@ -91,13 +101,19 @@ protected:
     void setupFromEnvVar();
     std::unique_ptr<FileLogger> mFileLogger;
     std::unique_ptr<ConsoleLogger> mConsoleLogger;
+    std::atomic<AsyncLogger*> mAsyncLogger;
+    std::atomic<unsigned> mAsyncUsers;
     volatile unsigned mFlags;
     size_t prependInfo(char *buf, size_t bufSize, const char* prefix, const char* severity, unsigned flags);
 
     /** This is the low-level log function that does the actual logging
      *  of an assembled single string */
     void logString(krLogLevel level, const char* msg, unsigned flags, size_t len=(size_t)-1);
+    /** Queues an assembled string to the async writer thread, if async logging is enabled.
+     * @returns \c false if the string has to be logged synchronously by the caller */
+    bool logStringAsync(krLogLevel level, const char* msg, unsigned flags, size_t len);
     std::map<std::string, ILoggerBackend*> mUserLoggers;
+    friend class AsyncLogger;
 public:
     std::recursive_mutex mMutex;
     typedef std::lock_guard<std::recursive_mutex> LockGuard;
@@ -113,6 +129,21 @@ public:
     void logToConsoleUseColors(bool useColors);
     void logToFile(const char* fileName, size_t rotateSize);
     void setAutoFlush(bool enable=true);
+
+    /** @brief Enables or disables the asynchronous logging mode.
+     * In this mode the logging thread only formats the message and puts it in a
+     * bounded lock-free queue of \c queueSize records. A background thread writes
+     * the queued records in batches to the console, file and user loggers.
+     * User loggers are therefore called from that thread.
+     * @param asyncFlags A combination of the \c krLogAsyncXXX flags, selecting
+     * what happens when the queue is full
+     * \note Disabling the mode writes out all queued records before returning
+     */
+    void logAsync(bool enable=true, size_t queueSize=4096,
+                  unsigned asyncFlags=krLogAsyncDropNewest|krLogAsyncReportDrops);
+
+    /** @brief The number of records discarded since async logging was last enabled */
+    uint64_t droppedRecords();
     Logger(unsigned flags = 0, const char* timeFmt="%m-%d %H:%M:%S");
     void logv(const char* prefix, krLogLevel level, unsigned flags, const char* fmtString, va_list aVaList);
     void log(const char* prefix, krLogLevel level, unsigned flags,
@@ -0,0 +1,270 @@
+#ifndef LOGGERASYNC_H
+#define LOGGERASYNC_H
+
+#include "logger.h"
+#include "loggerFile.h"
+#include "loggerConsole.h"
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <stdint.h>
+
+namespace karere
+{
+/** @brief Asynchronous logging pipeline of karere::Logger.
+ *
+ * Callers format their message on their own thread and put the resulting
+ * record in a bounded multi-producer/single-consumer ring buffer, without
+ * taking any lock. A background writer thread drains the ring in batches and
+ * dispatches the records to the console, file and user backends of the logger.
+ * File output of a whole batch is done with a single write (and a single flush
+ * if autoflush is enabled), and log rotation happens on the writer thread too.
+ *
+ * The ring is a bounded queue with a sequence number per slot. Producers
+ * claim a slot with a CAS on the enqueue position, and publish it by updating
+ * the slot sequence. Each slot keeps its string buffer between uses, so after
+ * warm-up no allocation is done for records shorter than the largest one seen
+ * in that slot.
+ */
+class AsyncLogger
+{
+protected:
+    struct Record
+    {
+        std::atomic<size_t> seq;
+        krLogLevel level;
+        unsigned flags;
+        std::string msg;
+    };
+    enum
+    {
+        kSlotReserve = 256,         //initial capacity of the string buffer of each slot
+        kMaxFileBatch = 64 * 1024,  //flush the file batch when it grows beyond this
+        kIdleWaitMs = 100           //max sleep of the writer if it misses a wakeup
+    };
+    Logger& mLogger;
+    unsigned mFlags;
+    std::unique_ptr<Record[]> mRing;
+    size_t mMask;
+    std::atomic<size_t> mEnqueuePos;
+    std::atomic<size_t> mDequeuePos;
+    std::atomic<uint64_t> mDropped;
+    uint64_t mDropsReported = 0;
+    std::string mFileBatch;
+    std::mutex mWakeMutex;
+    std::condition_variable mWakeCond;   //wakes up the writer thread
+    std::condition_variable mDrainCond;  //signals flush() waiters that records were consumed
+    std::atomic<bool> mWriterSleeping;
+    std::atomic<bool> mTerminate;
+    std::thread mThread;
+
+    static size_t roundToPow2(size_t n)
+    {
+        size_t ret = 2;
+        while (ret < n)
+            ret <<= 1;
+        return ret;
+    }
+    void wakeWriter()
+    {
+        //pairs with the store of mWriterSleeping and the re-check of the ring in writerLoop()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!mWriterSleeping.load(std::memory_order_relaxed) || !mWriterSleeping.exchange(false))
+            return;
+        std::lock_guard<std::mutex> lock(mWakeMutex);
+        mWakeCond.notify_one();
+    }
+    bool tryPush(krLogLevel level, const char* msg, size_t len, unsigned flags)
+    {
+        size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+        Record* rec;
+        for (;;)
+        {
+            rec = &mRing[pos & mMask];
+            size_t seq = rec->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false; //full
+            }
+            else
+            {
+                pos = mEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        rec->level = level;
+        rec->flags = flags;
+        rec->msg.assign(msg, len);
+        rec->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+    /** Dispatches all records currently in the ring. Called only by the writer thread.
+     * @returns the number of records consumed */
+    size_t processBatch()
+    {
+        size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+        Record* rec = &mRing[pos & mMask];
+        if (rec->seq.load(std::memory_order_acquire) != pos + 1)
+            return 0;
+
+        size_t count = 0;
+        Logger::LockGuard lock(mLogger.mMutex);
+        unsigned globalFlags = mLogger.mFlags;
+        bool consoleUsed = false;
+        do
+        {
+            unsigned flags = rec->flags;
+            const char* msg = rec->msg.c_str();
+            size_t len = rec->msg.size();
+            if (mLogger.mConsoleLogger && ((flags & krLogNoConsole) == 0))
+            {
+                mLogger.mConsoleLogger->logString(rec->level, msg, flags | krLogNoAutoFlush);
+                consoleUsed = true;
+            }
+            if (mLogger.mFileLogger && ((flags & krLogNoFile) == 0))
+            {
+                mFileBatch.append(msg, len);
+                if (mFileBatch.size() >= kMaxFileBatch)
+                    flushFileBatch();
+            }
+            for (auto& logger: mLogger.mUserLoggers)
+            {
+                Logger::ILoggerBackend* backend = logger.second;
+                if (rec->level <= backend->maxLogLevel)
+                    backend->log(rec->level, msg, len, flags);
+            }
+            rec->seq.store(pos + mMask + 1, std::memory_order_release);
+            pos++;
+            count++;
+            rec = &mRing[pos & mMask];
+        }
+        while (rec->seq.load(std::memory_order_acquire) == pos + 1);
+
+        mDequeuePos.store(pos, std::memory_order_release);
+        flushFileBatch();
+        if (consoleUsed && ((globalFlags & krLogNoAutoFlush) == 0))
+        {
+            fflush(stdout);
+            fflush(stderr);
+        }
+        reportDrops();
+        return count;
+    }
+    void flushFileBatch()
+    {
+        if (mFileBatch.empty())
+            return;
+        if (mLogger.mFileLogger)
+            mLogger.mFileLogger->logString(mFileBatch.c_str(), mFileBatch.size(), 0);
+        mFileBatch.clear();
+    }
+    /** Must be called with the logger locked */
+    void reportDrops()
+    {
+        if ((mFlags & krLogAsyncReportDrops) == 0)
+            return;
+        uint64_t dropped = mDropped.load(std::memory_order_relaxed);
+        if (dropped == mDropsReported)
+            return;
+        uint64_t count = dropped - mDropsReported;
+        mDropsReported = dropped;
+        //we are on the writer thread, so this is logged synchronously
+        mLogger.log("LOGGER", krLogLevelWarn, 0, "%llu log records dropped because the async log queue was full\n",
+            (unsigned long long)count);
+    }
+    void writerLoop()
+    {
+        for (;;)
+        {
+            bool hadRecords = processBatch() > 0;
+            if (hadRecords)
+            {
+                std::lock_guard<std::mutex> lock(mWakeMutex);
+                mDrainCond.notify_all();
+                continue;
+            }
+            if (mTerminate.load())
+                break;
+
+            std::unique_lock<std::mutex> lock(mWakeMutex);
+            mWriterSleeping.store(true);
+            //re-check after announcing that we sleep, so a producer that missed
+            //the flag has its record picked up by this iteration
+            size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+            if (mRing[pos & mMask].seq.load(std::memory_order_acquire) == pos + 1 || mTerminate.load())
+            {
+                mWriterSleeping.store(false);
+                continue;
+            }
+            mWakeCond.wait_for(lock, std::chrono::milliseconds(kIdleWaitMs));
+            mWriterSleeping.store(false);
+        }
+    }
+public:
+    AsyncLogger(Logger& logger, size_t queueSize, unsigned flags)
+    : mLogger(logger), mFlags(flags), mEnqueuePos(0), mDequeuePos(0), mDropped(0),
+      mWriterSleeping(false), mTerminate(false)
+    {
+        size_t size = roundToPow2(queueSize);
+        mMask = size - 1;
+        mRing.reset(new Record[size]);
+        for (size_t i = 0; i < size; i++)
+        {
+            mRing[i].seq.store(i, std::memory_order_relaxed);
+            mRing[i].msg.reserve(kSlotReserve);
+        }
+        mFileBatch.reserve(kMaxFileBatch);
+        mThread = std::thread([this]() { writerLoop(); });
+    }
+    bool isWriterThread() const { return std::this_thread::get_id() == mThread.get_id(); }
+    uint64_t droppedRecords() const { return mDropped.load(std::memory_order_relaxed); }
+
+    /** Queues a formatted record. Never blocks unless the krLogAsyncBlock policy is set */
+    void push(krLogLevel level, const char* msg, size_t len, unsigned flags)
+    {
+        while (!tryPush(level, msg, len, flags))
+        {
+            if ((mFlags & krLogAsyncBlock) == 0)
+            {
+                mDropped.fetch_add(1, std::memory_order_relaxed);
+                wakeWriter();
+                return;
+            }
+            wakeWriter();
+            std::this_thread::yield();
+        }
+        wakeWriter();
+    }
+
+    /** Waits until all records queued before the call have been dispatched to the backends.
+     * Must not be called with the logger locked, or from the writer thread */
+    void flush()
+    {
+        size_t target = mEnqueuePos.load();
+        std::unique_lock<std::mutex> lock(mWakeMutex);
+        while (mDequeuePos.load(std::memory_order_acquire) < target)
+        {
+            mWriterSleeping.store(false);
+            mWakeCond.notify_one();
+            mDrainCond.wait_for(lock, std::chrono::milliseconds(kIdleWaitMs));
+        }
+    }
+
+    ~AsyncLogger()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mWakeMutex);
+            mTerminate.store(true);
+            mWakeCond.notify_one();
+        }
+        mThread.join(); //the writer drains the ring before exiting
+    }
+};
+}
+#endif // LOGGERASYNC_H
@@ -12,6 +12,7 @@ KR_LOGGER_CONFIG_START(krLogChannel_<channel_id1>, krLogChannel_<channel_id2>,..
     KR_LOGGER_CONFIG(flags = flags | krLogNoTimestamp) //modify global flags to suit your needs
     KR_LOGGER_CONFIG(logToConsole()) //enable console logging, disabled by default
     KR_LOGGER_CONFIG(logToFile("log.txt"), <rotate_size>)) //enable file logging, disabled by default
+    KR_LOGGER_CONFIG(logAsync(true, <queue_size>, <async_flags>)) //write logs from a background thread, disabled by default
 //end optional
 KR_LOGGER_CONFIG_END()
 
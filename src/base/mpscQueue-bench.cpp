@@ -0,0 +1,179 @@
+// Stress benchmark of the queue of messages marshalled to the app's thread: many threads
+// post messages, and a single consumer thread processes them, as the karere thread does.
+// Compares the previous queue, a mutex-protected deque with a waiter notification per
+// message, against karere::MpscQueue with batch drain and coalesced notifications.
+// Also checks that no message is lost and that the messages of each thread are
+// processed in the order they were posted.
+//
+// Usage: mpscqueue-bench [thread-count] [messages-per-thread]
+// Build (from src/base):
+// g++ -std=c++11 -O2 -I. mpscQueue-bench.cpp -lpthread -o mpscqueue-bench
+// With CMake, enable optKarereBuildBenchmarks (target mpscqueue-bench).
+
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "mpscQueue.h"
+
+struct Msg
+{
+    uint32_t thread;
+    uint32_t seq;
+};
+
+// the waiter of the app's thread: a notification wakes it up once
+class Waiter
+{
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    bool mNotified = false;
+public:
+    std::atomic<uint64_t> notifyCount;
+    Waiter(): notifyCount(0) {}
+    void notify()
+    {
+        notifyCount++;
+        std::lock_guard<std::mutex> lock(mMutex);
+        mNotified = true;
+        mCond.notify_one();
+    }
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCond.wait(lock, [this]() { return mNotified; });
+        mNotified = false;
+    }
+};
+
+struct MutexQueue
+{
+    static const char* name() { return "mutex+deque"; }
+    std::mutex mutex;
+    std::deque<Msg> msgs;
+    Waiter waiter;
+    void post(const Msg& msg)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            msgs.push_back(msg);
+        }
+        waiter.notify();
+    }
+    // pops one message at a time, as EventQueue::pop() did
+    template <class F>
+    size_t drain(F&& process)
+    {
+        size_t count = 0;
+        for (;;)
+        {
+            Msg msg;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (msgs.empty())
+                    return count;
+                msg = msgs.front();
+                msgs.pop_front();
+            }
+            process(msg);
+            count++;
+        }
+    }
+};
+
+struct LockFreeQueue
+{
+    static const char* name() { return "karere::MpscQueue"; }
+    karere::MpscQueue<Msg> queue;
+    std::vector<Msg> batch;
+    std::atomic<bool> wakeupPending;
+    Waiter waiter;
+    LockFreeQueue(): wakeupPending(false) {}
+    void post(const Msg& msg)
+    {
+        queue.push(msg);
+        if (!wakeupPending.exchange(true))
+        {
+            waiter.notify();
+        }
+    }
+    template <class F>
+    size_t drain(F&& process)
+    {
+        wakeupPending.store(false);
+        batch.clear();
+        queue.popAll(batch);
+        for (auto& msg: batch)
+        {
+            process(msg);
+        }
+        return batch.size();
+    }
+};
+
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <class Q>
+static bool bench(unsigned threadCount, uint32_t msgsPerThread)
+{
+    Q queue;
+    std::vector<uint32_t> nextSeq(threadCount, 0);
+    size_t total = (size_t)threadCount * msgsPerThread;
+    size_t processed = 0;
+    size_t wakeups = 0;
+    bool ordered = true;
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers;
+    for (unsigned t = 0; t < threadCount; t++)
+    {
+        producers.emplace_back([&queue, t, msgsPerThread]()
+        {
+            for (uint32_t i = 0; i < msgsPerThread; i++)
+            {
+                queue.post(Msg{t, i});
+            }
+        });
+    }
+    while (processed < total)
+    {
+        queue.waiter.wait();
+        size_t count = queue.drain([&](const Msg& msg)
+        {
+            if (msg.seq != nextSeq[msg.thread]++)
+                ordered = false;
+        });
+        processed += count;
+        wakeups += (count != 0);
+    }
+    double ms = elapsedMs(start);
+    for (auto& thread: producers)
+    {
+        thread.join();
+    }
+
+    bool ok = ordered && processed == total;
+    printf("%-18s %u threads, %zu msgs: %8.2f ms (%6.1f ns/msg), %zu notifications, %zu wakeups, %.1f msgs/wakeup%s\n",
+           Q::name(), threadCount, total, ms, ms * 1e6 / total, (size_t)queue.waiter.notifyCount,
+           wakeups, (double)processed / (wakeups ? wakeups : 1), ok ? "" : " FAILED: lost or reordered messages");
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned threadCount = (argc > 1) ? atoi(argv[1]) : 8;
+    uint32_t msgsPerThread = (argc > 2) ? atoi(argv[2]) : 200000;
+
+    bool ok = bench<MutexQueue>(threadCount, msgsPerThread);
+    ok &= bench<LockFreeQueue>(threadCount, msgsPerThread);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,176 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+/**
+ * @file mpscQueue.h
+ * @brief Multiple-producer, single-consumer queue, with a lock-free fast path,
+ * to pass messages to the app's thread.
+ */
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <stddef.h>
+
+namespace karere
+{
+/** @brief Queue that any thread can push to, and a single thread drains in batches.
+ *
+ * Items are stored in a bounded ring of cells, each with a sequence number that
+ * tells whether it's free or holds an item (the bounded MPMC queue of D. Vyukov,
+ * restricted to one consumer). Pushing to the ring takes a CAS, and draining it
+ * doesn't take any atomic read-modify-write.
+ *
+ * A push never fails or blocks on the consumer: when the ring is full, items go to
+ * an overflow list, protected by a mutex, until the consumer empties it. While the
+ * overflow list is in use, all items go there, so that the items pushed by a thread
+ * are always delivered in the order they were pushed.
+ *
+ * \c T must be cheap to copy and default-constructible, i.e. a pointer or a small struct.
+ */
+template <class T, size_t kCapacity = 4096>
+class MpscQueue
+{
+    static_assert(kCapacity >= 2 && (kCapacity & (kCapacity - 1)) == 0, "Capacity must be a power of 2");
+
+protected:
+    enum { kCacheLine = 64, kMask = kCapacity - 1 };
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        T item;
+    };
+    // the positions are written by different threads, keep them in separate cache lines
+    std::unique_ptr<Cell[]> mCells;
+    char mPad0[kCacheLine];
+    std::atomic<size_t> mEnqueuePos;
+    char mPad1[kCacheLine - sizeof(std::atomic<size_t>)];
+    size_t mDequeuePos = 0; // only accessed by the consumer
+    char mPad2[kCacheLine - sizeof(size_t)];
+    std::atomic<bool> mOverflowing;
+    std::mutex mOverflowMutex;
+    std::deque<T> mOverflow;
+
+    bool pushToRing(const T& item)
+    {
+        size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell& cell = mCells[pos & kMask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+            if (diff == 0)
+            {
+                if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.item = item;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false; // full
+            }
+            else
+            {
+                pos = mEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    /** Pops the item at the head of the ring, if it's been published */
+    bool popFromRing(T& item)
+    {
+        Cell& cell = mCells[mDequeuePos & kMask];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        if (seq != mDequeuePos + 1)
+            return false; // empty, or the producer is still writing the item
+        item = cell.item;
+        cell.seq.store(mDequeuePos + kCapacity, std::memory_order_release);
+        mDequeuePos++;
+        return true;
+    }
+
+public:
+    MpscQueue()
+        : mCells(new Cell[kCapacity]), mEnqueuePos(0), mOverflowing(false)
+    {
+        for (size_t i = 0; i < kCapacity; i++)
+        {
+            mCells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+    static size_t capacity() { return kCapacity; }
+
+    /** Can be called from any thread */
+    void push(const T& item)
+    {
+        if (mOverflowing.load(std::memory_order_acquire))
+        {
+            std::lock_guard<std::mutex> lock(mOverflowMutex);
+            if (mOverflowing.load(std::memory_order_relaxed))
+            {
+                mOverflow.push_back(item);
+                return;
+            }
+        }
+        if (pushToRing(item))
+            return;
+
+        std::lock_guard<std::mutex> lock(mOverflowMutex);
+        mOverflowing.store(true, std::memory_order_release);
+        mOverflow.push_back(item);
+    }
+
+    /** Appends all the queued items to \c out, in order. Must be called only by
+     * the consumer thread. Returns the number of items appended. */
+    size_t popAll(std::vector<T>& out)
+    {
+        size_t count = out.size();
+        T item;
+        while (popFromRing(item))
+        {
+            out.push_back(item);
+        }
+        if (mOverflowing.load(std::memory_order_acquire))
+        {
+            std::lock_guard<std::mutex> lock(mOverflowMutex);
+            // The items in the ring were pushed before the ones in the overflow list
+            // by the same thread, so the ring has to be emptied up to the last claimed
+            // cell first, waiting for the producers that are still writing them
+            size_t end = mEnqueuePos.load(std::memory_order_acquire);
+            while (mDequeuePos != end)
+            {
+                if (popFromRing(item))
+                {
+                    out.push_back(item);
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            }
+            out.insert(out.end(), mOverflow.begin(), mOverflow.end());
+            mOverflow.clear();
+            mOverflowing.store(false, std::memory_order_release);
+        }
+        return out.size() - count;
+    }
+
+    /** The number of items in the queue. It's exact only if no producer is pushing
+     * at the same time. Must be called only by the consumer thread. */
+    size_t size()
+    {
+        size_t count = mEnqueuePos.load(std::memory_order_acquire) - mDequeuePos;
+        if (mOverflowing.load(std::memory_order_acquire))
+        {
+            std::lock_guard<std::mutex> lock(mOverflowMutex);
+            count += mOverflow.size();
+        }
+        return count;
+    }
+    bool empty() { return size() == 0; }
+};
+}
+#endif // MPSCQUEUE_H
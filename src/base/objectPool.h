@@ -0,0 +1,240 @@
+#ifndef OBJECTPOOL_H
+#define OBJECTPOOL_H
+/**
+ * @file objectPool.h
+ * @brief Size-classed pool allocator for the small, short-lived objects that are
+ * created for every marshalled call, timer and promise continuation.
+ *
+ * Define KARERE_DISABLE_OBJECT_POOL to use plain operator new/delete instead, i.e.
+ * when building with AddressSanitizer, which can't see errors inside the pool. It must
+ * be defined (or not) for all the code that is linked together.
+ */
+#include <mutex>
+#include <vector>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace karere
+{
+/** @brief Pool of fixed-size blocks, in size classes of 16 bytes up to kMaxSize.
+ *
+ * Each thread keeps its own free list per size class, so allocating and freeing
+ * normally take no lock. Objects are often freed by another thread than the one
+ * that allocated them (i.e. a marshalled call is allocated by the posting thread and
+ * freed by the app's thread), so a thread whose free list grows too long hands a
+ * batch of blocks to the central list of the size class, where threads that run out
+ * of blocks take them from. The blocks are carved from chunks that are never released
+ * to the system, the pool keeps the peak memory of the burst of objects that it had.
+ */
+class ObjectPool
+{
+public:
+    enum
+    {
+        kAlign = 16,
+        kMaxSize = 256,
+        kClassCount = kMaxSize / kAlign,
+        kBatchSize = 32,          // blocks moved at once between a thread and the central list
+        kMaxCached = kBatchSize * 2,
+        kChunkSize = 64 * 1024
+    };
+
+    static void* allocate(size_t size)
+    {
+        if (size > kMaxSize)
+            return ::operator new(size);
+        ThreadCache* cache = threadCache();
+        if (!cache)
+            return central(sizeClass(size)).allocOne();
+        FreeList& list = cache->lists[sizeClass(size)];
+        if (!list.head)
+            central(sizeClass(size)).takeBatch(list);
+        Block* block = list.head;
+        list.head = block->next;
+        list.count--;
+        return block;
+    }
+    static void deallocate(void* ptr, size_t size)
+    {
+        if (!ptr)
+            return;
+        if (size > kMaxSize)
+        {
+            ::operator delete(ptr);
+            return;
+        }
+        Block* block = static_cast<Block*>(ptr);
+        ThreadCache* cache = threadCache();
+        if (!cache)
+        {
+            central(sizeClass(size)).freeOne(block);
+            return;
+        }
+        FreeList& list = cache->lists[sizeClass(size)];
+        block->next = list.head;
+        list.head = block;
+        if (++list.count > kMaxCached)
+            central(sizeClass(size)).giveBatch(list, kBatchSize);
+    }
+
+protected:
+    struct Block
+    {
+        Block* next;
+    };
+    struct FreeList
+    {
+        Block* head = nullptr;
+        size_t count = 0;
+    };
+    class Central
+    {
+    protected:
+        std::mutex mMutex;
+        std::vector<FreeList> mBatches;
+        size_t mBlockSize;
+        char* mChunk = nullptr;   // the part of the last chunk not carved yet
+        char* mChunkEnd = nullptr;
+
+        // moves up to \c count blocks from the head of \c from to the head of \c to
+        static void moveBlocks(FreeList& from, FreeList& to, size_t count)
+        {
+            for (; count && from.head; count--)
+            {
+                Block* block = from.head;
+                from.head = block->next;
+                from.count--;
+                block->next = to.head;
+                to.head = block;
+                to.count++;
+            }
+        }
+        Block* carve()
+        {
+            if (mChunk == mChunkEnd)
+            {
+                mChunk = static_cast<char*>(::operator new(kChunkSize));
+                mChunkEnd = mChunk + (kChunkSize / mBlockSize) * mBlockSize;
+            }
+            Block* block = reinterpret_cast<Block*>(mChunk);
+            mChunk += mBlockSize;
+            return block;
+        }
+
+    public:
+        explicit Central(size_t blockSize): mBlockSize(blockSize) {}
+        /** Fills the (empty) free list of a thread */
+        void takeBatch(FreeList& list)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            while (!mBatches.empty())
+            {
+                FreeList batch = mBatches.back();
+                mBatches.pop_back();
+                if (batch.head)
+                {
+                    list = batch;
+                    return;
+                }
+            }
+            for (int i = 0; i < kBatchSize; i++)
+            {
+                Block* block = carve();
+                block->next = list.head;
+                list.head = block;
+                list.count++;
+            }
+        }
+        void giveBatch(FreeList& list, size_t count)
+        {
+            FreeList batch;
+            moveBlocks(list, batch, count);
+            std::lock_guard<std::mutex> lock(mMutex);
+            mBatches.push_back(batch);
+        }
+        // used when the thread has no cache, i.e. it's exiting
+        void* allocOne()
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            while (!mBatches.empty() && !mBatches.back().head)
+                mBatches.pop_back();
+            if (mBatches.empty())
+                return carve();
+            FreeList& batch = mBatches.back();
+            Block* block = batch.head;
+            batch.head = block->next;
+            batch.count--;
+            return block;
+        }
+        void freeOne(Block* block)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mBatches.empty() || mBatches.back().count >= kBatchSize)
+                mBatches.push_back(FreeList());
+            FreeList& batch = mBatches.back();
+            block->next = batch.head;
+            batch.head = block;
+            batch.count++;
+        }
+    };
+    struct ThreadCache
+    {
+        FreeList lists[kClassCount];
+        ~ThreadCache()
+        {
+            destroyed() = true;
+            for (int i = 0; i < kClassCount; i++)
+            {
+                while (lists[i].head)
+                    central(i).giveBatch(lists[i], kBatchSize);
+            }
+        }
+        static bool& destroyed()
+        {
+            static thread_local bool sDestroyed = false;
+            return sDestroyed;
+        }
+    };
+
+    static size_t sizeClass(size_t size) { return size ? (size - 1) / kAlign : 0; }
+    // Never destroyed, as objects may be freed by static destructors after exit()
+    static Central& central(size_t cls)
+    {
+        static Central* sCentral = createCentral();
+        return sCentral[cls];
+    }
+    static Central* createCentral()
+    {
+        Central* central = static_cast<Central*>(::operator new(sizeof(Central) * kClassCount));
+        for (size_t i = 0; i < kClassCount; i++)
+        {
+            new (central + i) Central((i + 1) * kAlign);
+        }
+        return central;
+    }
+    /** The cache of the current thread, or \c nullptr if the thread is exiting and
+     * its cache was already destroyed */
+    static ThreadCache* threadCache()
+    {
+        if (ThreadCache::destroyed())
+            return nullptr;
+        static thread_local ThreadCache sCache;
+        return &sCache;
+    }
+};
+
+/** @brief Base for classes whose instances are allocated from the ObjectPool.
+ * For classes with a virtual destructor, the objects of derived classes can be
+ * deleted via a pointer to the base, as the size passed to operator delete is the
+ * one of the actual object.
+ */
+struct PoolAllocated
+{
+#ifndef KARERE_DISABLE_OBJECT_POOL
+    static void* operator new(size_t size) { return ObjectPool::allocate(size); }
+    static void operator delete(void* ptr, size_t size) { ObjectPool::deallocate(ptr, size); }
+#endif
+};
+}
+#endif // OBJECTPOOL_H
@@ -5,6 +5,9 @@
 #include <asyncTest-framework.h>
 #define PROMISE_ON_UNHANDLED_ERROR testUnhandledError
 #include <promise.h>
+#include <atomic>
+#include <chrono>
+#include <new>
 
 TESTS_INIT();
 using namespace promise;
@@ -20,8 +23,98 @@ void testUnhandledError(const std::string& msg, int type, int code)
     gUnhandledHandler(msg, type, code);
 }
 
-int main()
+// Benchmarks, run with the 'bench' argument instead of the tests. They count
+// the calls to the global operator new, to show the heap allocations per chain.
+static std::atomic<uint64_t> gAllocCount(0);
+
+void* operator new(size_t size)
+{
+    gAllocCount.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+template <class F>
+static void bench(const char* name, size_t count, F&& func)
+{
+    func(); // warm up the object pool
+    uint64_t allocs = gAllocCount.load();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++)
+    {
+        func();
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    printf("%-44s %8.1f ns/op %6.2f allocs/op\n", name, ns / count, (double)(gAllocCount.load() - allocs) / count);
+}
+
+static int runBenchmarks(size_t count)
+{
+    int sum = 0;
+    bench("resolved value, then, then", count, [&sum]()
+    {
+        Promise<int> pms(1);
+        pms.then([](int x) { return x + 1; })
+           .then([&sum](int x) { sum += x; });
+    });
+    bench("resolved value, then returning a promise", count, [&sum]()
+    {
+        Promise<int> pms(1);
+        pms.then([](int x) { return Promise<int>(x + 1); })
+           .then([&sum](int x) { sum += x; });
+    });
+    bench("pending, then, fail, then, resolve", count, [&sum]()
+    {
+        Promise<int> pms;
+        pms.then([](int x) { return x + 1; })
+           .fail([](const Error&) { return 0; })
+           .then([&sum](int x) { sum += x; });
+        pms.resolve(1);
+    });
+    bench("rejected, then, fail", count, [&sum]()
+    {
+        Promise<int> pms(Error("test", 1, 2));
+        pms.then([](int x) { return x + 1; })
+           .fail([&sum](const Error& err) { sum += err.code(); return 0; });
+    });
+    bench("when() of 3 resolved promises", count, [&sum]()
+    {
+        Promise<int> p1(1), p2(2), p3(3);
+        when(p1, p2, p3)
+        .then([&sum]() { sum++; });
+    });
+    // a message decryption with the keys in cache: both the sender's key and the
+    // message key are already available
+    bench("decrypt with cached keys", count, [&sum]()
+    {
+        Promise<int> edKey(1);
+        Promise<int> msgKey(2);
+        auto verified = edKey.then([](int key) { return key != 0; });
+        when(verified, msgKey)
+        .then([msgKey]() { return msgKey.value() * 2; })
+        .then([&sum](int msg) { sum += msg; })
+        .fail([](const Error&) {});
+    });
+    printf("(%d)\n", sum);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+if (argc > 1 && !strcmp(argv[1], "bench"))
 {
+    return runBenchmarks((argc > 2) ? atoi(argv[2]) : 1000000);
+}
 
 TestGroup("General")
 {
@@ -564,6 +657,126 @@ TestGroup("when() tests")
         loop.schedCall([in3]() mutable { in3.reject("test fourth fail"); }, -100);
     });
 });
+TestGroup("Settled promise tests")
+{
+    asyncTest("then() on a resolved promise calls the handler before returning", {"inline", "then-final"})
+    {
+        Promise<int> pms(1);
+        bool called = false;
+        auto next = pms.then([&called](int a)
+        {
+            called = true;
+            return a + 1;
+        });
+        doneOrError(called, "inline");
+        next.then([&](int a)
+        {
+            doneOrError(a == 2, "then-final");
+        });
+    });
+    asyncTest("fail() on a resolved promise passes the value through", {"then"})
+    {
+        Promise<int> pms(1);
+        pms.fail([&](const Error& err)
+        {
+            test.error("fail() must not be called by a resolved promise");
+            return 0;
+        })
+        .then([&](int a)
+        {
+            doneOrError(a == 1, "then");
+        });
+    });
+    asyncTest("then() on a rejected promise skips the handler", {"fail"})
+    {
+        Promise<int> pms(Error("test rejected", 1, 2));
+        pms.then([&](int a)
+        {
+            test.error("then() must not be called by a rejected promise");
+            return a;
+        })
+        .fail([&](const Error& err)
+        {
+            doneOrError(err.msg() == "test rejected" && err.code() == 1 && err.type() == 2, "fail");
+            return 0;
+        });
+    });
+    asyncTest("fail() on a rejected promise calls the handler before returning", {"inline", "then-final"})
+    {
+        Promise<int> pms(Error("test rejected"));
+        bool called = false;
+        auto next = pms.fail([&called](const Error& err)
+        {
+            called = true;
+            return 5;
+        });
+        doneOrError(called, "inline");
+        next.then([&](int a)
+        {
+            doneOrError(a == 5, "then-final");
+        });
+    });
+    asyncTest("Exception in then() on a resolved promise rejects the returned promise", {"fail"})
+    {
+        Promise<int> pms(1);
+        Promise<void> next = pms.then([](int)
+        {
+            throw std::runtime_error("test exception");
+        });
+        check(next.failed());
+        next.then([&]()
+        {
+            test.error("then() must not be called after a then() with exception");
+        })
+        .fail([&](const Error& err)
+        {
+            doneOrError(err.msg() == "test exception" && err.type() == kErrException, "fail");
+        });
+    });
+    asyncTest("Exception in fail() on a rejected promise rejects the returned promise", {"fail"})
+    {
+        Promise<int> pms(Error("test rejected"));
+        pms.fail([](const Error&) -> int
+        {
+            throw std::runtime_error("test exception");
+        })
+        .fail([&](const Error& err)
+        {
+            doneOrError(err.msg() == "test exception", "fail");
+            return 0;
+        });
+    });
+    asyncTest("then() on a resolved promise returning a pending promise",
+    {{"resolve", "order", 1}, {"then-final", "order", 2}})
+    {
+        Promise<int> pms(1);
+        Promise<int> inner;
+        Promise<int> next = pms.then([inner](int) { return inner; });
+        check(!next.done());
+        next.then([&](int a)
+        {
+            doneOrError(a == 10, "then-final");
+        });
+        loop.schedCall([inner, &test]() mutable { test.done("resolve"); inner.resolve(10); }, 100);
+    });
+    asyncTest("fail() on a rejected promise returning a pending promise that fails",
+    {{"reject", "order", 1}, {"fail-final", "order", 2}})
+    {
+        Promise<int> pms(Error("test rejected"));
+        Promise<int> inner;
+        Promise<int> next = pms.fail([inner](const Error&) { return inner; });
+        check(!next.done());
+        next.then([&](int)
+        {
+            test.error("then() must not be called by a rejected promise");
+        })
+        .fail([&](const Error& err)
+        {
+            doneOrError(err.msg() == "inner rejected", "fail-final");
+        });
+        loop.schedCall([inner, &test]() mutable { test.done("reject"); inner.reject("inner rejected"); }, 100);
+    });
+});
 TestGroup("Unhandled promise fail")
 {
     asyncTest("Unhandled fail with async-rejected promise", {"unhandled"})
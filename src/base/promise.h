@@ -8,6 +8,7 @@
 #include <utility>
 #include <memory>
 #include <assert.h>
+#include "objectPool.h"
 
 /** @brief The name of the unhandled promise error handler. This handler is
  * called when a promise fails, but the user has not provided a fail() callback
@@ -60,7 +61,8 @@ struct FuncTraits <R(C::*)(Args...)> { typedef R RetType; enum {nargs = sizeof..
 template <class C, class R, class...Args>
 struct FuncTraits <R(C::*)(Args...) const> { typedef R RetType; enum {nargs = sizeof...(Args)};};
 //===
-struct IVirtDtor
+// callbacks are allocated from the pool, their size is known at compile time
+struct IVirtDtor: public karere::PoolAllocated
 {  virtual ~IVirtDtor() {}  };
 
 template <class T>
@@ -142,11 +144,14 @@ public:
     virtual ~PromiseBase(){}
 };
 
+/** Most promises have a single then() and a single fail() callback, so the first
+ * callback is stored inline, and only the next ones need the vector to be allocated */
 template <class C>
 class CallbackList
 {
 protected:
-    std::vector<C*> items;
+    C* first_ = nullptr;
+    std::vector<C*> rest;
 public:
     CallbackList(){}
 /**
@@ -158,45 +163,64 @@ public:
     template<class SP>
     inline void push(SP& cb)
     {
-        items.push_back(cb.release());
+        if (!first_)
+            first_ = cb.release();
+        else
+            rest.push_back(cb.release());
     }
 
     inline C*& operator[](int idx)
     {
-        assert((idx >= 0) && (idx < (int)items.size()));
-        return items[idx];
+        assert((idx >= 0) && (idx < count()));
+        return idx ? rest[idx-1] : first_;
     }
-    inline const C*& operator[](int idx) const
+    inline C* const& operator[](int idx) const
     {
-        assert((idx >= 0) && (idx < items.size()));
-        return items[idx];
+        assert((idx >= 0) && (idx < count()));
+        return idx ? rest[idx-1] : first_;
     }
     inline C*& first()
     {
-        assert(!items.empty());
-        return items[0];
+        assert(first_);
+        return first_;
     }
     inline int count() const
     {
-        return items.size();
+        return first_ ? (int)rest.size() + 1 : 0;
     }
     inline void addListMoveItems(CallbackList& other)
     {
-        items.insert(items.end(), other.items.begin(), other.items.end());
-        other.items.clear();
+        if (!other.first_)
+            return;
+        if (!first_)
+        {
+            first_ = other.first_;
+            rest.swap(other.rest);
+        }
+        else
+        {
+            rest.push_back(other.first_);
+            rest.insert(rest.end(), other.rest.begin(), other.rest.end());
+        }
+        other.first_ = nullptr;
+        other.rest.clear();
     }
     void clear()
     {
         static_assert(std::is_base_of<IVirtDtor, C>::value, "Callback type must be inherited from IVirtDtor");
-        for (auto it = items.begin(); it != items.end(); it++)
+        if (!first_)
+            return;
+        delete ((IVirtDtor*)first_); //static_cast wont work here because there is no info that ICallback inherits from IVirtDtor
+        first_ = nullptr;
+        for (auto it = rest.begin(); it != rest.end(); it++)
         {
-            delete ((IVirtDtor*)*it); //static_cast wont work here because there is no info that ICallback inherits from IVirtDtor
+            delete ((IVirtDtor*)*it);
         }
-        items.clear();
+        rest.clear();
     }
     ~CallbackList()
     {
-        assert(items.empty());
+        assert(!first_ && rest.empty());
     }
 };
 
@@ -261,9 +285,9 @@ protected:
         return new Callback<typename MaskVoid<P>::type, CB, TP>(std::forward<CB>(cb), next);
     }
 //===
-    struct SharedObj
+    struct SharedObj: public karere::PoolAllocated
     {
-        struct CbLists
+        struct CbLists: public karere::PoolAllocated
         {
             CallbackList<ISuccessCb> mSuccessCbs;
             CallbackList<IFailCb> mFailCbs;
@@ -522,6 +546,36 @@ protected:
         }, next);
     }
 
+/** Calls a then() or fail() handler directly, when the promise is already settled,
+ * converting exceptions to a failed promise, as createChainedCb() does. The promise
+ * returned by the handler takes the place of the chaining promise, so no callback
+ * object and no chaining promise are created.
+ */
+    template <typename In, typename Out, typename RealOut, class CB>
+    static Promise<Out> callSettledCb(CB& cb, const In& val)
+    {
+        try
+        {
+            return CallCbHandleVoids::template call<Out, RealOut, In>(cb, val);
+        }
+        catch(std::exception& e)
+        {
+            return Error(e.what(), kErrException);
+        }
+        catch(Error& e)
+        {
+            return e;
+        }
+        catch(const char* e)
+        {
+            return Error(e, kErrException);
+        }
+        catch(...)
+        {
+            return Error("(unknown exception type)", kErrException);
+        }
+    }
+
 public:
 /**
 * The Out template argument is the return type of the provided callback \c cb
@@ -539,21 +593,18 @@ public:
             return mSharedObj->mError;
 
         typedef typename RemovePromise<typename FuncTraits<F>::RetType>::Type Out;
-        Promise<Out> next;
-
-        std::unique_ptr<ISuccessCb> resolveCb(createChainedCb<typename MaskVoid<T>::type, Out,
-            typename FuncTraits<F>::RetType>(std::forward<F>(cb), next));
-
         if (mSharedObj->mResolved == kSucceeded)
         {
-            (*resolveCb)(mSharedObj->mResult);
-        }
-        else
-        {
-            assert((mSharedObj->mResolved == kNotResolved));
-            thenCbs().push(resolveCb);
+            typename std::decay<F>::type func(std::forward<F>(cb));
+            return callSettledCb<typename MaskVoid<T>::type, Out,
+                typename FuncTraits<F>::RetType>(func, mSharedObj->mResult);
         }
 
+        assert((mSharedObj->mResolved == kNotResolved));
+        Promise<Out> next;
+        std::unique_ptr<ISuccessCb> resolveCb(createChainedCb<typename MaskVoid<T>::type, Out,
+            typename FuncTraits<F>::RetType>(std::forward<F>(cb), next));
+        thenCbs().push(resolveCb);
         return next;
     }
 /** Adds a handler to be executed in case the promise is rejected
@@ -574,23 +625,21 @@ public:
             return master.fail(std::forward<F>(eb));
 
         if (mSharedObj->mResolved == kSucceeded)
-            return mSharedObj->mResult; //don't call the errorback, just return the successful resolve value
-
-        Promise<T> next;
-        std::unique_ptr<IFailCb> failCb(createChainedCb<Error, T,
-            typename FuncTraits<F>::RetType>(std::forward<F>(eb), next));
+            return *this; //don't call the errorback, the next promise has our resolve value
 
         if (mSharedObj->mResolved == kFailed)
         {
-            (*failCb)(mSharedObj->mError);
+            typename std::decay<F>::type func(std::forward<F>(eb));
+            Promise<T> ret = callSettledCb<Error, T, typename FuncTraits<F>::RetType>(func, mSharedObj->mError);
             mSharedObj->mError.setHandled();
-        }
-        else
-        {
-            assert((mSharedObj->mResolved == kNotResolved));
-            failCbs().push(failCb);
+            return ret;
         }
 
+        assert((mSharedObj->mResolved == kNotResolved));
+        Promise<T> next;
+        std::unique_ptr<IFailCb> failCb(createChainedCb<Error, T,
+            typename FuncTraits<F>::RetType>(std::forward<F>(eb), next));
+        failCbs().push(failCb);
         return next;
     }
     //val can be a by-value param, const& or &&
@@ -752,7 +801,7 @@ struct WhenStateShared
 
 struct WhenState: public std::shared_ptr<WhenStateShared>
 {
-    WhenState():std::shared_ptr<WhenStateShared>(new WhenStateShared){}
+    WhenState():std::shared_ptr<WhenStateShared>(std::make_shared<WhenStateShared>()){}
 };
 
 template <class T, class=typename std::enable_if<!std::is_same<T,void>::value, int>::type>
@@ -0,0 +1,269 @@
+// Micro-benchmark of the timer API (setTimeout/setInterval/cancelTimeout), driven by the
+// timer wheel, against the previous implementation, which created a uv timer per timer,
+// registered it in the handle store under a global mutex, and marshalled its creation
+// and cancellation.
+//
+// Usage: timer-bench [timer-count]
+// Build (from src/base, libuv required):
+// g++ -std=c++11 -O2 -I. -I.. timer-bench.cpp cservices.cpp -luv -lpthread -o timer-bench
+// With CMake, enable optKarereBuildBenchmarks (target timer-bench).
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <deque>
+#include "timers.hpp"
+
+namespace karere
+{
+bool gCatchException = false;
+}
+
+// no logging, so the logger (and the SDK it depends on) is not needed
+static KarereLogChannel gLogChannels[krLogChannelCount];
+KarereLogChannel* krLoggerChannels = gLogChannels;
+void krLoggerLog(krLogChannelNo, krLogLevel, const char*, ...) {}
+
+static uv_loop_t* gLoop;
+static karere::TimerWheel* gWheel;
+static std::deque<void*> gMessages;    // the app's message queue
+
+static void postMessage(void* msg, void*)
+{
+    gMessages.push_back(msg);
+}
+
+static void processMessages()
+{
+    while (!gMessages.empty())
+    {
+        void* msg = gMessages.front();
+        gMessages.pop_front();
+        megaProcessMessage(msg);
+    }
+}
+
+namespace karere
+{
+TimerWheel* get_timer_wheel(void*)
+{
+    return gWheel;
+}
+}
+
+// The previous implementation of timers.hpp, for comparison
+namespace legacy
+{
+using namespace karere;
+
+std::recursive_mutex timerMutex;
+
+struct TimerMsg: public megaMessage
+{
+    timerevent* timerEvent = nullptr;
+    bool canceled = false;
+    megaHandle handle;
+    TimerMsg(megaMessageFunc aFunc)
+        :megaMessage(aFunc),
+          handle(services_hstore_add_handle(MEGA_HTYPE_TIMER, this))
+    {}
+   ~TimerMsg()
+    {
+        services_hstore_remove_handle(MEGA_HTYPE_TIMER, handle);
+        if (timerEvent)
+        {
+            uv_close((uv_handle_t *)timerEvent, [](uv_handle_t* handle)
+            {
+                delete handle;
+            });
+        }
+    }
+};
+
+template <int persist, class CB>
+inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
+{
+    struct Msg: public TimerMsg
+    {
+        CB cb;
+        void *appCtx;
+        Msg(CB&& aCb, megaMessageFunc cFunc)
+        :TimerMsg(cFunc), cb(aCb)
+        {}
+        unsigned time;
+        int loop;
+    };
+    megaMessageFunc cfunc = persist
+        ? (megaMessageFunc) [](void* arg)
+          {
+              Msg* msg = static_cast<Msg*>(arg);
+              if (msg->canceled)
+                  return;
+              msg->cb();
+          }
+        : (megaMessageFunc) [](void* arg)
+          {
+              timerMutex.lock();
+              Msg* msg = static_cast<Msg*>(arg);
+              if (msg->canceled)
+              {
+                  timerMutex.unlock();
+                  return;
+              }
+              msg->cb();
+              if (msg->canceled)
+              {
+                  timerMutex.unlock();
+                  return;
+              }
+              delete msg;
+              timerMutex.unlock();
+          };
+
+    timerMutex.lock();
+    Msg* pMsg = new Msg(std::forward<CB>(callback), cfunc);
+    timerMutex.unlock();
+
+    pMsg->appCtx = ctx;
+    pMsg->time = time;
+    pMsg->loop = persist;
+    marshallCall([pMsg, ctx]()
+    {
+        pMsg->timerEvent = new uv_timer_t();
+        pMsg->timerEvent->data = pMsg;
+        uv_timer_init(gLoop, pMsg->timerEvent);
+        uv_timer_start(pMsg->timerEvent,
+                       [](uv_timer_t* handle)
+                       {
+                           megaPostMessageToGui(handle->data, ((Msg*)handle->data)->appCtx);
+                       }, pMsg->time, pMsg->loop ? pMsg->time : 0);
+    }, ctx);
+    return pMsg->handle;
+}
+
+static inline bool cancelTimeout(megaHandle handle, void *ctx)
+{
+    timerMutex.lock();
+    TimerMsg* timer = static_cast<TimerMsg*>(services_hstore_get_handle(MEGA_HTYPE_TIMER, handle));
+    if (!timer)
+    {
+        timerMutex.unlock();
+        return false;
+    }
+    timer->canceled = true;
+    timerMutex.unlock();
+    marshallCall([timer, ctx]()
+    {
+        uv_timer_stop(timer->timerEvent);
+        marshallCall([timer, ctx]()
+        {
+            delete timer;
+        }, ctx);
+    }, ctx);
+    return true;
+}
+
+template<class CB>
+static inline megaHandle setTimeout(CB&& cb, unsigned timeMs, void *ctx)
+{
+    return setTimer<0>(std::forward<CB>(cb), timeMs, ctx);
+}
+}
+
+struct Wheel
+{
+    static const char* name() { return "timer wheel"; }
+    template <class CB>
+    static megaHandle setTimeout(CB&& cb, unsigned timeMs) { return karere::setTimeout(std::forward<CB>(cb), timeMs, nullptr); }
+    static bool cancelTimeout(megaHandle handle) { return karere::cancelTimeout(handle, nullptr); }
+};
+
+struct Legacy
+{
+    static const char* name() { return "uv timer per timer"; }
+    template <class CB>
+    static megaHandle setTimeout(CB&& cb, unsigned timeMs) { return legacy::setTimeout(std::forward<CB>(cb), timeMs, nullptr); }
+    static bool cancelTimeout(megaHandle handle) { return legacy::cancelTimeout(handle, nullptr); }
+};
+
+static void runLoop()
+{
+    // the loop and the app's message queue run in the same thread, as in MEGAchat
+    do
+    {
+        processMessages();
+        uv_run(gLoop, UV_RUN_NOWAIT);
+    } while (!gMessages.empty());
+}
+
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// long timeouts that are canceled before they trigger (retries, keepalives, seen timers...)
+template <class T>
+static void benchSetAndCancel(size_t count)
+{
+    std::mt19937 rng(1234);
+    std::vector<megaHandle> handles(count);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++)
+    {
+        handles[i] = T::setTimeout([]() { abort(); }, 1000 + rng() % 3600000);
+    }
+    runLoop();
+    double setMs = elapsedMs(start);
+
+    std::shuffle(handles.begin(), handles.end(), rng);
+    start = std::chrono::steady_clock::now();
+    for (auto handle: handles)
+    {
+        T::cancelTimeout(handle);
+    }
+    runLoop();
+    double cancelMs = elapsedMs(start);
+
+    printf("%-20s set %zu timeouts: %8.2f ms (%6.0f ns/timer), cancel: %8.2f ms (%6.0f ns/timer)\n",
+           T::name(), count, setMs, setMs * 1e6 / count, cancelMs, cancelMs * 1e6 / count);
+}
+
+// short timeouts that trigger
+template <class T>
+static void benchFire(size_t count)
+{
+    std::mt19937 rng(1234);
+    size_t fired = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++)
+    {
+        T::setTimeout([&fired]() { fired++; }, rng() % 50);
+    }
+    while (true)
+    {
+        runLoop();
+        if (fired == count)
+            break;
+
+        uv_run(gLoop, UV_RUN_ONCE);
+    }
+    double ms = elapsedMs(start);
+
+    printf("%-20s fire %zu timeouts of 0-50ms: %8.2f ms\n", T::name(), count, ms);
+}
+
+int main(int argc, char** argv)
+{
+    size_t count = (argc > 1) ? atoi(argv[1]) : 100000;
+
+    megaPostMessageToGui = postMessage;
+    gLoop = uv_default_loop();
+    gWheel = new karere::TimerWheel(gLoop, nullptr);
+    uv_run(gLoop, UV_RUN_NOWAIT);   // let the wheel know the thread of the loop
+
+    benchSetAndCancel<Legacy>(count);
+    benchSetAndCancel<Wheel>(count);
+    benchFire<Legacy>(count);
+    benchFire<Wheel>(count);
+    return 0;
+}
@@ -0,0 +1,489 @@
+#ifndef _MEGA_BASE_TIMERWHEEL_INCLUDED
+#define _MEGA_BASE_TIMERWHEEL_INCLUDED
+/**
+ * @file timerWheel.h
+ * @brief Hierarchical timer wheel that drives all the timers of an event loop
+ * with a single uv timer. Used by the timer API in timers.hpp.
+ *
+ * (c) 2013-2015 by Mega Limited, Auckland, New Zealand
+ *
+ * This file is part of the MEGA SDK - Client Access Engine.
+ *
+ * Applications using the MEGA API must present a valid application key
+ * and comply with the the rules set forth in the Terms of Service.
+ *
+ * The MEGA SDK is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * @copyright Simplified (2-clause) BSD License.
+ *
+ * You should have received a copy of the license along with this
+ * program.
+ */
+#include <uv.h>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <assert.h>
+#include "gcm.h"
+#include "objectPool.h"
+
+typedef unsigned int megaHandle; //invalid handle value is 0, same as in cservices.h
+
+namespace karere
+{
+class TimerWheel;
+
+/** A timer, as seen by the wheel. When it expires, it's posted as a message to the
+ * app's message loop, so the user callback is called on the GUI thread */
+struct TimerMsg: public megaMessage, public PoolAllocated
+{
+    typedef void(*DestroyFunc)(TimerMsg*);
+
+    TimerWheel* wheel = nullptr;
+    DestroyFunc destroy;
+    TimerMsg* prev = nullptr;       // links in the slot of the wheel
+    TimerMsg* next = nullptr;
+    uint64_t expires = 0;           // in ms, in the time base of uv_now()
+    unsigned period = 0;            // 0 for one-shot timers
+    megaHandle handle = 0;
+    unsigned pendingPosts = 0;      // times posted to the message loop and not processed yet
+    uint8_t level = 0;
+    uint8_t slot = 0;
+    bool linked = false;            // true while it's in a slot of the wheel
+    bool canceled = false;
+
+    // megaMessage is a plain C struct: the type of the message is known only by its
+    // creator, so it has to provide the way to delete it
+    TimerMsg(megaMessageFunc aFunc, DestroyFunc aDestroy)
+        : megaMessage(aFunc), destroy(aDestroy)
+    {}
+};
+
+/** @brief Hierarchical timer wheel, with a resolution of 1ms.
+ *
+ * It has kLevels levels of kSlots slots each. A slot in level N spans kSlots^N ms, so
+ * the wheel covers 2^36 ms, far more than the longest timeout that can be set.
+ * A timer is placed in the level of the most significant bit in which its expiration
+ * time differs from the current time of the wheel, so it never needs more than
+ * kLevels moves to get to level 0. Slots are intrusive doubly-linked lists and the
+ * occupied slots of each level are kept in a bitmap, so scheduling, canceling and
+ * finding the next expiration are O(1).
+ *
+ * The wheel belongs to an event loop and is driven by a single uv timer, armed for
+ * the next expiration (or cascade) only, so an idle wheel never wakes up the loop.
+ * Its data is accessed only from the thread of the loop, which in MEGAchat is also
+ * the thread where the app's messages are processed. Timers can be set and canceled
+ * from any other thread: the requests are pushed to a lock-free queue, and the
+ * thread of the loop is woken up to process them.
+ */
+class TimerWheel
+{
+public:
+    enum
+    {
+        kSlotBits = 6,
+        kSlots = 1 << kSlotBits,
+        kLevels = 6
+    };
+
+    /** Must be created before the loop runs, or from the thread of the loop */
+    TimerWheel(uv_loop_t* loop, void* appCtx)
+        : mLoop(loop), mAppCtx(appCtx), mNow(uv_now(loop))
+    {
+        std::fill(&mSlots[0][0], &mSlots[0][0] + kLevels * kSlots, nullptr);
+        std::fill(mOccupied, mOccupied + kLevels, 0);
+
+        uv_timer_init(mLoop, &mTimer);
+        mTimer.data = this;
+        uv_async_init(mLoop, &mAsync, [](uv_async_t* async)
+        {
+            TimerWheel* self = static_cast<TimerWheel*>(async->data);
+            self->mLoopThread = std::this_thread::get_id();
+            self->processRequests();
+        });
+        mAsync.data = this;
+        uv_async_send(&mAsync);     // learn the thread of the loop as soon as it runs
+    }
+
+    /** Adds a timer to the wheel. Can be called from any thread
+     * @return The handle of the timer, never 0
+     */
+    megaHandle add(TimerMsg* timer, unsigned timeMs, bool repeat)
+    {
+        timer->wheel = this;
+        timer->period = repeat ? std::max(timeMs, 1u) : 0;
+        timer->handle = ++mLastHandle;
+        if (!timer->handle)     // wrapped around, 0 is the invalid handle
+        {
+            timer->handle = ++mLastHandle;
+        }
+        megaHandle handle = timer->handle;
+        if (isLoopThread())
+        {
+            insert(timer, timeMs);
+        }
+        else
+        {
+            pushRequest(new Request(timer, handle, timeMs));
+        }
+        return handle;
+    }
+
+    /** Cancels a timer. Can be called from any thread
+     * @return \c false if the handle is not valid, because the timer already
+     * triggered or was canceled. When called from a thread other than the one of the
+     * loop, the timer is canceled asynchronously and the handle can't be checked, so
+     * it returns \c true. It's still guaranteed that the callback won't be called
+     * after this function returns.
+     */
+    bool cancel(megaHandle handle)
+    {
+        if (isLoopThread())
+        {
+            processRequests();
+            return remove(handle);
+        }
+
+        pushRequest(new Request(nullptr, handle, 0));
+        return true;
+    }
+
+    /** Called by the message handler of a timer, before calling its callback
+     * @return \c false if the timer was canceled, so the callback must not be called
+     */
+    static bool beginCallback(TimerMsg* timer)
+    {
+        timer->wheel->processRequests();  // honor the cancellations from other threads
+        return !timer->canceled;
+    }
+
+    /** Called by the message handler of a timer, after calling its callback (if any) */
+    static void endCallback(TimerMsg* timer)
+    {
+        assert(timer->pendingPosts);
+        timer->pendingPosts--;
+        if (!timer->period && !timer->canceled)   // one-shot timer done, invalidate its handle
+        {
+            timer->wheel->mTimers.erase(timer->handle);
+            timer->canceled = true;
+        }
+        if (timer->canceled && !timer->pendingPosts && !timer->linked)
+        {
+            timer->destroy(timer);
+        }
+    }
+
+    /** Number of valid timers: in the wheel, or triggered and not processed yet */
+    size_t count() const { return mTimers.size(); }
+
+    /** Cancels all the timers and closes the uv handles of the wheel, which deletes
+     * itself once the loop has closed them. Must be called from the thread of the loop,
+     * after all the timers posted to the message loop have been processed, and the loop
+     * must run once more (i.e. uv_run() with UV_RUN_NOWAIT) before it's destroyed
+     */
+    void closeAndDelete()
+    {
+        assert(isLoopThread() || mLoopThread.load() == std::thread::id());
+        processRequests();
+        std::vector<megaHandle> handles;
+        handles.reserve(mTimers.size());
+        for (auto& item: mTimers)
+        {
+            handles.push_back(item.first);
+        }
+        for (megaHandle handle: handles)
+        {
+            remove(handle);
+        }
+        uv_timer_stop(&mTimer);
+
+        mPendingCloses = 2;
+        auto onClose = [](uv_handle_t* handle)
+        {
+            TimerWheel* self = static_cast<TimerWheel*>(handle->data);
+            if (--self->mPendingCloses == 0)
+            {
+                delete self;
+            }
+        };
+        uv_close(reinterpret_cast<uv_handle_t*>(&mTimer), onClose);
+        uv_close(reinterpret_cast<uv_handle_t*>(&mAsync), onClose);
+    }
+
+protected:
+    struct Request: public PoolAllocated
+    {
+        Request* next = nullptr;
+        TimerMsg* timer;    // NULL to cancel
+        megaHandle handle;
+        unsigned timeMs;
+        Request(TimerMsg* aTimer, megaHandle aHandle, unsigned aTimeMs)
+            : timer(aTimer), handle(aHandle), timeMs(aTimeMs)
+        {}
+    };
+
+    uv_loop_t* mLoop;
+    void* mAppCtx;
+    uv_timer_t mTimer;
+    uv_async_t mAsync;
+    std::atomic<std::thread::id> mLoopThread{std::thread::id()};
+    std::atomic<megaHandle> mLastHandle{0};
+    std::atomic<Request*> mRequests{nullptr};   // lock-free LIFO of requests from other threads
+
+    // --- accessed only from the thread of the loop ---
+    std::unordered_map<megaHandle, TimerMsg*> mTimers;
+    TimerMsg* mSlots[kLevels][kSlots];
+    uint64_t mOccupied[kLevels];    // bitmap of non-empty slots, per level
+    uint64_t mNow;                  // time up to which the wheel has been processed
+    uint64_t mArmedDeadline = UINT64_MAX;
+    size_t mLinkedCount = 0;
+    int mPendingCloses = 0;         // uv handles being closed by closeAndDelete()
+
+    bool isLoopThread() const
+    {
+        return mLoopThread.load(std::memory_order_relaxed) == std::this_thread::get_id();
+    }
+
+    void pushRequest(Request* req)
+    {
+        req->next = mRequests.load(std::memory_order_relaxed);
+        while (!mRequests.compare_exchange_weak(req->next, req, std::memory_order_release, std::memory_order_relaxed));
+        uv_async_send(&mAsync);
+    }
+
+    void processRequests()
+    {
+        Request* req = mRequests.exchange(nullptr, std::memory_order_acquire);
+        if (!req)
+            return;
+
+        // restore the order in which they were pushed
+        Request* ordered = nullptr;
+        while (req)
+        {
+            Request* next = req->next;
+            req->next = ordered;
+            ordered = req;
+            req = next;
+        }
+        while (ordered)
+        {
+            Request* next = ordered->next;
+            if (ordered->timer)
+            {
+                insert(ordered->timer, ordered->timeMs);
+            }
+            else
+            {
+                remove(ordered->handle);
+            }
+            delete ordered;
+            ordered = next;
+        }
+    }
+
+    void insert(TimerMsg* timer, unsigned timeMs)
+    {
+        uint64_t now = uv_now(mLoop);
+        if (!mLinkedCount)
+        {
+            mNow = now;     // nothing to cascade, start from the current time
+        }
+        timer->expires = now + timeMs;
+        mTimers[timer->handle] = timer;
+        schedule(timer);
+        rearm();
+    }
+
+    bool remove(megaHandle handle)
+    {
+        auto it = mTimers.find(handle);
+        if (it == mTimers.end())
+            return false; //not valid anymore
+
+        TimerMsg* timer = it->second;
+        mTimers.erase(it);
+        timer->canceled = true;
+        if (timer->linked)
+        {
+            unlink(timer);
+        }
+        // if it's posted to the message loop, it's deleted once it's processed
+        if (!timer->pendingPosts)
+        {
+            timer->destroy(timer);
+        }
+        return true;
+    }
+
+    static int lowestBit(uint64_t bits)
+    {
+        assert(bits);
+#if defined(__GNUC__)
+        return __builtin_ctzll(bits);
+#else
+        int n = 0;
+        while (!(bits & 1))
+        {
+            bits >>= 1;
+            n++;
+        }
+        return n;
+#endif
+    }
+
+    void schedule(TimerMsg* timer)
+    {
+        uint64_t when = std::max(timer->expires, mNow);
+        uint64_t masked = (when ^ mNow) | (kSlots - 1);
+        int level = 0;
+        while (level < kLevels - 1 && (masked >> ((level + 1) * kSlotBits)))
+        {
+            level++;
+        }
+        int slot = (when >> (level * kSlotBits)) & (kSlots - 1);
+
+        TimerMsg*& head = mSlots[level][slot];
+        timer->prev = nullptr;
+        timer->next = head;
+        if (head)
+        {
+            head->prev = timer;
+        }
+        head = timer;
+        timer->level = level;
+        timer->slot = slot;
+        timer->linked = true;
+        mOccupied[level] |= (1ULL << slot);
+        mLinkedCount++;
+    }
+
+    void unlink(TimerMsg* timer)
+    {
+        assert(timer->linked);
+        if (timer->prev)
+        {
+            timer->prev->next = timer->next;
+        }
+        else
+        {
+            mSlots[timer->level][timer->slot] = timer->next;
+            if (!timer->next)
+            {
+                mOccupied[timer->level] &= ~(1ULL << timer->slot);
+            }
+        }
+        if (timer->next)
+        {
+            timer->next->prev = timer->prev;
+        }
+        timer->prev = timer->next = nullptr;
+        timer->linked = false;
+        mLinkedCount--;
+    }
+
+    /** Time at which the next non-empty slot has to be processed, UINT64_MAX if none */
+    uint64_t nextDeadline(int& outLevel, int& outSlot) const
+    {
+        uint64_t deadline = UINT64_MAX;
+        for (int level = 0; level < kLevels; level++)
+        {
+            uint64_t bits = mOccupied[level];
+            if (!bits)
+                continue;
+
+            int shift = level * kSlotBits;
+            int nowSlot = (mNow >> shift) & (kSlots - 1);
+            uint64_t rotated = nowSlot ? ((bits >> nowSlot) | (bits << (kSlots - nowSlot))) : bits;
+            int slot = (nowSlot + lowestBit(rotated)) & (kSlots - 1);
+            uint64_t levelRange = 1ULL << (shift + kSlotBits);
+            uint64_t slotDeadline = (mNow & ~(levelRange - 1)) + ((uint64_t)slot << shift);
+            if (slot < nowSlot)
+            {
+                slotDeadline += levelRange;
+            }
+            if (slotDeadline < deadline)
+            {
+                deadline = slotDeadline;
+                outLevel = level;
+                outSlot = slot;
+            }
+        }
+        return deadline;
+    }
+
+    /** Posts the timers expired up to \c now, and moves the rest down the levels */
+    void advance(uint64_t now)
+    {
+        int level, slot;
+        uint64_t deadline;
+        while ((deadline = nextDeadline(level, slot)) <= now)
+        {
+            mNow = std::max(mNow, deadline);
+            TimerMsg* timer = mSlots[level][slot];
+            mSlots[level][slot] = nullptr;
+            mOccupied[level] &= ~(1ULL << slot);
+            while (timer)
+            {
+                TimerMsg* next = timer->next;
+                timer->prev = timer->next = nullptr;
+                timer->linked = false;
+                mLinkedCount--;
+                if (timer->expires <= mNow)
+                {
+                    fire(timer);
+                }
+                else
+                {
+                    schedule(timer);
+                }
+                timer = next;
+            }
+        }
+        mNow = std::max(mNow, now);
+    }
+
+    void fire(TimerMsg* timer)
+    {
+        timer->pendingPosts++;
+        if (timer->period)
+        {
+            timer->expires = mNow + timer->period;
+            schedule(timer);
+        }
+        megaPostMessageToGui(static_cast<megaMessage*>(timer), mAppCtx);
+    }
+
+    void rearm()
+    {
+        int level, slot;
+        uint64_t deadline = nextDeadline(level, slot);
+        if (deadline == mArmedDeadline)
+            return;
+
+        mArmedDeadline = deadline;
+        if (deadline == UINT64_MAX)
+        {
+            uv_timer_stop(&mTimer);
+            return;
+        }
+        uint64_t now = uv_now(mLoop);
+        uv_timer_start(&mTimer, [](uv_timer_t* handle)
+        {
+            TimerWheel* self = static_cast<TimerWheel*>(handle->data);
+            self->mLoopThread = std::this_thread::get_id();
+            self->mArmedDeadline = UINT64_MAX;
+            self->processRequests();
+            self->advance(uv_now(self->mLoop));
+            self->rearm();
+        }, (deadline > now) ? deadline - now : 0, 0);
+    }
+};
+
+}
+#endif
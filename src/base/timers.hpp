@@ -23,131 +23,61 @@
  */
 #include "cservices.h"
 #include "gcmpp.h"
+#include "timerWheel.h"
 #include <memory>
+#include <type_traits>
 #include <assert.h>
 
 namespace karere
 {
 
-struct TimerMsg: public megaMessage
-{
-    timerevent* timerEvent = nullptr;
-    bool canceled = false;
-    megaHandle handle;
-    TimerMsg(megaMessageFunc aFunc)
-        :megaMessage(aFunc),
-          handle(services_hstore_add_handle(MEGA_HTYPE_TIMER, this))
-    {}
-   ~TimerMsg()
-    {
-        services_hstore_remove_handle(MEGA_HTYPE_TIMER, handle);
-        if (timerEvent)
-        {            
-            uv_close((uv_handle_t *)timerEvent, [](uv_handle_t* handle)
-            {
-                delete handle;
-            });
-        }
-    }
-};
-
-void init_uv_timer(void *ctx, uv_timer_t *timer);
-
-extern std::recursive_mutex timerMutex;
+/** Returns the timer wheel of the event loop of the app context. Provided by the app */
+TimerWheel* get_timer_wheel(void *ctx);
 
 template <int persist, class CB>
 inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
 {
     struct Msg: public TimerMsg
     {
-        CB cb;
-        void *appCtx;
-        Msg(CB&& aCb, megaMessageFunc cFunc)
-        :TimerMsg(cFunc), cb(aCb)
+        typename std::decay<CB>::type cb;
+        Msg(CB&& aCb)
+        :TimerMsg(&Msg::handler, &Msg::destroy), cb(std::forward<CB>(aCb))
         {}
-        unsigned time;
-        int loop;
+        static void handler(void* arg)
+        {
+            Msg* msg = static_cast<Msg*>(static_cast<megaMessage*>(arg));
+            if (TimerWheel::beginCallback(msg))
+            {
+                msg->cb();
+            }
+            TimerWheel::endCallback(msg);
+        }
+        static void destroy(TimerMsg* timer)
+        {
+            delete static_cast<Msg*>(timer);
+        }
     };
-    megaMessageFunc cfunc = persist
-        ? (megaMessageFunc) [](void* arg)
-          {
-              Msg* msg = static_cast<Msg*>(arg);
-              if (msg->canceled)
-                  return;
-              msg->cb();
-          }
-        : (megaMessageFunc) [](void* arg)
-          {
-              timerMutex.lock();
-              Msg* msg = static_cast<Msg*>(arg);
-              if (msg->canceled)
-              {
-                  timerMutex.unlock();
-                  return;
-              }
-              msg->cb();
-              if (msg->canceled)
-              {
-                  timerMutex.unlock();
-                  return;
-              }
-              delete msg;
-              timerMutex.unlock();
-          };
-
-    timerMutex.lock();
-    Msg* pMsg = new Msg(std::forward<CB>(callback), cfunc);
-    timerMutex.unlock();
-
-    pMsg->appCtx = ctx;
-    pMsg->time = time;
-    pMsg->loop = persist;  
-    marshallCall([pMsg, ctx]()
+    TimerWheel* wheel = get_timer_wheel(ctx);
+    if (!wheel)
     {
-        pMsg->timerEvent = new uv_timer_t();
-        pMsg->timerEvent->data = pMsg;
-        init_uv_timer(ctx, pMsg->timerEvent);
-        uv_timer_start(pMsg->timerEvent,
-                       [](uv_timer_t* handle)
-                       {
-                           megaPostMessageToGui(handle->data, ((Msg*)handle->data)->appCtx);
-                       }, pMsg->time, pMsg->loop ? pMsg->time : 0);
-    }, ctx);    
-    return pMsg->handle;
+        return 0;   // the loop is being torn down, the callback would never be called
+    }
+    return wheel->add(new Msg(std::forward<CB>(callback)), time, persist != 0);
 }
 /** Cancels a previously set timeout with setTimeout()
  * @return \c false if the handle is not valid. This can happen if the timeout
- * already triggered, then the handle is invalidated. This situation is safe and
+ * already triggered, then the handle is invalidated, or if it was set during the
+ * teardown of the loop, then the handle is 0. These situations are safe and
  * considered normal
  */
 static inline bool cancelTimeout(megaHandle handle, void *ctx)
 {
-    timerMutex.lock();
-
-    assert(handle);
-    TimerMsg* timer = static_cast<TimerMsg*>(services_hstore_get_handle(MEGA_HTYPE_TIMER, handle));
-    if (!timer)
+    if (!handle)
     {
-        timerMutex.unlock();
-        return false; //not valid anymore
+        return false;
     }
-
-//we have to make sure that we delete the timer only after all possibly queued
-//timer messages in the app's message queue are processed. For this purpose,
-//we first stop the timer, and only then post a call to delete the timer.
-//That call should be processed after all timer messages
-    timer->canceled = true; //disable timer callback being called by possibly queued messages, and message freeing in one-shot timer handler
-    timerMutex.unlock();    
-    marshallCall([timer, ctx]()
-    {
-        uv_timer_stop(timer->timerEvent);
-
-        marshallCall([timer, ctx]()
-        {
-            delete timer;
-        }, ctx);
-    }, ctx);
-    return true;
+    TimerWheel* wheel = get_timer_wheel(ctx);
+    return wheel ? wheel->cancel(handle) : false;   // no wheel once the loop is torn down
 }
 /** @brief Cancels a previously set timer with setInterval.
  * @return \c false if the handle is not valid.
@@ -164,7 +94,8 @@ static inline bool cancelInterval(megaHandle handle, void *ctx)
  * @param timeMs - the time in milliseconds after which the callback
  * will be called one single time and the timer will be destroyed,
  * and the handle will be invalidated
- * @returns a handle that can be used to cancel the timeout
+ * @returns a handle that can be used to cancel the timeout, or 0 if the event loop
+ * has already been torn down, in which case the callback is never called
  */
 template<class CB>
 static inline megaHandle setTimeout(CB&& cb, unsigned timeMs, void *ctx)
@@ -177,7 +108,8 @@ static inline megaHandle setTimeout(CB&& cb, unsigned timeMs, void *ctx)
  that has \c operator()
  @param timeMs - the timer's period in milliseconds. The function will be called
  releatedly until cancelInterval() is called on the returned handle
- @returns a handle that can be used to cancel the timer
+ @returns a handle that can be used to cancel the timer, or 0 if the event loop
+ has already been torn down
 */
 template <class CB>
 static inline megaHandle setInterval(CB&& callback, unsigned timeMs, void *ctx)
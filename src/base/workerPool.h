@@ -0,0 +1,134 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+/**
+ * @file workerPool.h
+ * @brief Pool of worker threads, to run CPU-bound tasks (i.e. message decryption)
+ * off the app's thread.
+ */
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+namespace karere
+{
+/** @brief Runs tasks on a fixed set of worker threads.
+ *
+ * Tasks are posted to a queue identified by a 64-bit id (i.e. a chatid). The tasks
+ * of a queue are run one at a time, in the order they were posted, while tasks of
+ * different queues run in parallel. A task that has to pass a result back to the
+ * app's thread should do it via marshallCall(), so the results of a queue are
+ * delivered in order too.
+ *
+ * Tasks must not access any state that is used by the app's thread at the same
+ * time. In particular, promises and DeleteTrackable objects are not thread-safe,
+ * so they must not be copied or released on a worker thread.
+ */
+class WorkerPool
+{
+public:
+    typedef std::function<void()> Task;
+
+protected:
+    struct Queue
+    {
+        std::deque<Task> tasks;
+        bool scheduled = false; // in mReady, or being run by a worker
+    };
+    enum { kMaxTasksPerTurn = 16 }; // so that a busy queue doesn't starve the others
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    std::map<uint64_t, Queue> mQueues; // only queues with tasks, or being run
+    std::deque<uint64_t> mReady;       // queues with tasks, not being run by a worker
+    std::vector<std::thread> mThreads;
+    bool mTerminate = false;
+
+    void workerLoop()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        for (;;)
+        {
+            while (mReady.empty() && !mTerminate)
+            {
+                mCond.wait(lock);
+            }
+            if (mTerminate)
+                return;
+
+            uint64_t id = mReady.front();
+            mReady.pop_front();
+            // the queue is not erased by others while it's scheduled
+            auto it = mQueues.find(id);
+            Queue& queue = it->second;
+            for (int i = 0; i < kMaxTasksPerTurn && !queue.tasks.empty() && !mTerminate; i++)
+            {
+                Task task(std::move(queue.tasks.front()));
+                queue.tasks.pop_front();
+                lock.unlock();
+                task();
+                task = nullptr;
+                lock.lock();
+            }
+            if (queue.tasks.empty())
+            {
+                mQueues.erase(it);
+            }
+            else
+            {
+                mReady.push_back(id);
+                mCond.notify_one();
+            }
+        }
+    }
+
+public:
+    /** Number of threads used by default: one less than the number of cores,
+     * so that the app's thread is not competing with them, with a max of 4 */
+    static unsigned defaultThreadCount()
+    {
+        unsigned cores = std::thread::hardware_concurrency();
+        return (cores > 2) ? std::min(cores - 1, 4u) : 1;
+    }
+    explicit WorkerPool(unsigned threadCount = defaultThreadCount())
+    {
+        for (unsigned i = 0; i < std::max(threadCount, 1u); i++)
+        {
+            mThreads.emplace_back([this]() { workerLoop(); });
+        }
+    }
+    /** Waits for the tasks that are running, tasks not started yet are discarded */
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTerminate = true;
+            mCond.notify_all();
+        }
+        for (auto& thread: mThreads)
+        {
+            thread.join();
+        }
+    }
+    size_t threadCount() const { return mThreads.size(); }
+
+    /** Queues a task, to be run after the tasks already posted to queue \c queueId */
+    void post(uint64_t queueId, Task&& task)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        Queue& queue = mQueues[queueId];
+        queue.tasks.push_back(std::move(task));
+        if (!queue.scheduled)
+        {
+            queue.scheduled = true;
+            mReady.push_back(queueId);
+            mCond.notify_one();
+        }
+    }
+};
+}
+#endif // WORKERPOOL_H
@@ -23,6 +23,7 @@
 #include "sdkApi.h"
 #include <serverListProvider.h>
 #include <memory>
+#include <future>
 #include <chatd.h>
 #include <db.h>
 #include <buffer.h>
@@ -33,6 +34,7 @@
 #include <codecvt> //for nonWhitespaceStr()
 #include <locale>
 #include "strongvelope/strongvelope.h"
+#include <base/workerPool.h>
 #include "base64url.h"
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -172,72 +174,109 @@ bool Client::openDb(const std::string& sid)
         size_t cachedVersionSuffixPos = cachedVersion.find_last_of('_');
         if (cachedVersionSuffixPos != std::string::npos)
         {
+            // the cache is upgraded one version at a time, committing after each step, so
+            // caches of any older version go through all the upgrades up to the current one
             std::string cachedVersionSuffix = cachedVersion.substr(cachedVersionSuffixPos + 1);
-            if (cachedVersionSuffix == "2" && gDbSchemaVersionSuffix == "3")
+            while (cachedVersionSuffix != gDbSchemaVersionSuffix)
             {
-                KR_LOG_WARNING("Clearing history from cached chats...");
+                std::string nextVersionSuffix = std::to_string(atoi(cachedVersionSuffix.c_str()) + 1);
+                if (cachedVersionSuffix == "2")
+                {
+                    KR_LOG_WARNING("Clearing history from cached chats...");
 
-                // clients with version 2 missed the call-history msgs, need to clear cached history
-                // in order to fetch fresh history including the missing management messages
-                db.query("delete from history");
-                db.query("update chat_vars set value = 0 where name = 'have_all_history'");
-                db.query("update vars set value = ? where name = 'schema_version'", currentVersion);
-                db.commit();
+                    // clients with version 2 missed the call-history msgs, need to clear cached history
+                    // in order to fetch fresh history including the missing management messages
+                    db.query("delete from history");
+                    db.query("update chat_vars set value = 0 where name = 'have_all_history'");
 
-                KR_LOG_WARNING("Successfully cleared cached history. Database version has been updated to %s", gDbSchemaVersionSuffix);
+                    KR_LOG_WARNING("Successfully cleared cached history");
+                }
+                else if (cachedVersionSuffix == "3")
+                {
+                    // clients with version 3 need to force a full-reload of SDK's cache to retrieve
+                    // "deleted" chats from API, since it used to not return them. It should only be
+                    // done in case there's at least one chat.
 
-                ok = true;
-            }
-            else if (cachedVersionSuffix == "3" &&  gDbSchemaVersionSuffix == "4")
-            {
-                // clients with version 3 need to force a full-reload of SDK's cache to retrieve
-                // "deleted" chats from API, since it used to not return them. It should only be
-                // done in case there's at least one chat.
+                    SqliteStmt stmt(db, "select count(*) from chats");
+                    stmt.stepMustHaveData("get chats count");
+                    if (stmt.intCol(0) > 0)
+                    {
+                        KR_LOG_WARNING("Forcing a reload of SDK and MEGAchat caches...");
+                        api.sdk.invalidateCache();
+                    }
+                    else    // no chats --> only invalidate MEGAchat cache (the schema has changed)
+                    {
+                        KR_LOG_WARNING("Forcing a reload of SDK and MEGAchat cache...");
+                    }
+                    break;
+                }
+                else if (cachedVersionSuffix == "4")
+                {
+                    // clients with version 4 need to create a new table `node_history` and populate it with
+                    // node's attachments already in cache. Futhermore, the existing types for special messages
+                    // (node-attachments, contact-attachments and rich-links) will be updated to a different
+                    // range to avoid collissions with the types of upcoming management messages.
+
+                    // Update obsolete type of special messages
+                    db.query("update history set type=? where type=?", chatd::Message::Type::kMsgAttachment, 0x10);
+                    db.query("update history set type=? where type=?", chatd::Message::Type::kMsgRevokeAttachment, 0x11);
+                    db.query("update history set type=? where type=?", chatd::Message::Type::kMsgContact, 0x12);
+                    db.query("update history set type=? where type=?", chatd::Message::Type::kMsgContainsMeta, 0x13);
+
+                    // Create new table for node history
+                    db.simpleQuery("CREATE TABLE node_history(idx int not null, chatid int64 not null, msgid int64 not null,"
+                                   "    userid int64, keyid int not null, type tinyint, updated smallint, ts int,"
+                                   "    is_encrypted tinyint, data blob, backrefid int64 not null, UNIQUE(chatid,msgid), UNIQUE(chatid,idx))");
+
+                    // Populate new table with existing node-attachments
+                    db.query("insert into node_history select * from history where type=?", std::to_string(chatd::Message::Type::kMsgAttachment));
+                    int count = sqlite3_changes(db);
+
+                    KR_LOG_WARNING("%d messages added to node history", count);
+                }
+                else if (cachedVersionSuffix == "5")
+                {
+                    // clients with version 5 need to create the table `history_terms` and populate it
+                    // with the words of the messages already in cache, so they can be searched
 
-                SqliteStmt stmt(db, "select count(*) from chats");
-                stmt.stepMustHaveData("get chats count");
-                if (stmt.intCol(0) > 0)
+                    db.simpleQuery("CREATE TABLE history_terms(term text not null, chatid int64 not null, msgid int64 not null,"
+                                   "    UNIQUE(term, chatid, msgid));"
+                                   "CREATE INDEX history_terms_msg on history_terms(chatid, msgid)");
+
+                    int count = ChatdSqliteDb::indexHistory(db);
+
+                    KR_LOG_WARNING("%d messages added to the search index", count);
+                }
+                else if (cachedVersionSuffix == "6")
                 {
-                    KR_LOG_WARNING("Forcing a reload of SDK and MEGAchat caches...");
-                    api.sdk.invalidateCache();
+                    // clients with version 6 need to create the table `pairwise_keys`, which is
+                    // populated as the keys shared with other users are derived again
+                    db.simpleQuery("CREATE TABLE pairwise_keys(userid int64 primary key, pubkey blob not null,"
+                                   "    key blob not null)");
                 }
-                else    // no chats --> only invalidate MEGAchat cache (the schema has changed)
+                else if (cachedVersionSuffix == "7")
                 {
-                    KR_LOG_WARNING("Forcing a reload of SDK and MEGAchat cache...");
+                    // clients with version 7 need to create the table `dns_cache`, which is
+                    // populated as the hostnames of chatd and presenced are resolved
+                    db.simpleQuery("CREATE TABLE dns_cache(host text not null primary key, ipsv4 text, ipsv6 text,"
+                                   "    resolve_ts int64 default 0, connect_ipv4_ts int64 default 0, connect_ipv6_ts int64 default 0)");
+                }
+                else    // unknown or newer version, can't be upgraded
+                {
+                    break;
                 }
-
-                KR_LOG_WARNING("Database version has been updated to %s", gDbSchemaVersionSuffix);
-            }
-            else if (cachedVersionSuffix == "4" &&  gDbSchemaVersionSuffix == "5")
-            {
-                // clients with version 4 need to create a new table `node_history` and populate it with
-                // node's attachments already in cache. Futhermore, the existing types for special messages
-                // (node-attachments, contact-attachments and rich-links) will be updated to a different
-                // range to avoid collissions with the types of upcoming management messages.
-
-                // Update obsolete type of special messages
-                db.query("update history set type=? where type=?", chatd::Message::Type::kMsgAttachment, 0x10);
-                db.query("update history set type=? where type=?", chatd::Message::Type::kMsgRevokeAttachment, 0x11);
-                db.query("update history set type=? where type=?", chatd::Message::Type::kMsgContact, 0x12);
-                db.query("update history set type=? where type=?", chatd::Message::Type::kMsgContainsMeta, 0x13);
-
-                // Create new table for node history
-                db.simpleQuery("CREATE TABLE node_history(idx int not null, chatid int64 not null, msgid int64 not null,"
-                               "    userid int64, keyid int not null, type tinyint, updated smallint, ts int,"
-                               "    is_encrypted tinyint, data blob, backrefid int64 not null, UNIQUE(chatid,msgid), UNIQUE(chatid,idx))");
-
-                // Populate new table with existing node-attachments
-                db.query("insert into node_history select * from history where type=?", std::to_string(chatd::Message::Type::kMsgAttachment));
-                int count = sqlite3_changes(db);
 
                 // Update DB version number
-                db.query("update vars set value = ? where name = 'schema_version'", currentVersion);
+                std::string nextVersion(gDbSchemaHash);
+                nextVersion.append("_").append(nextVersionSuffix);
+                db.query("update vars set value = ? where name = 'schema_version'", nextVersion);
                 db.commit();
 
-                KR_LOG_WARNING("Database version has been updated to %s", gDbSchemaVersionSuffix);
-                KR_LOG_WARNING("%d messages added to node history", count);
-                ok = true;
+                KR_LOG_WARNING("Database version has been updated to %s", nextVersionSuffix.c_str());
+                cachedVersionSuffix = nextVersionSuffix;
             }
+
+            ok = (cachedVersionSuffix == gDbSchemaVersionSuffix);
         }
     }
 
@@ -249,6 +288,7 @@ bool Client::openDb(const std::string& sid)
     }
 
     mSid = sid;
+    websocketIO->mDnsCache.setDb(&db);
     return true;
 }
 
@@ -334,6 +374,95 @@ bool Client::isChatRoomOpened(Id chatid)
     return false;
 }
 
+bool Client::checkUnreadCounts()
+{
+    bool ok = true;
+    for (auto& item: *chats)
+    {
+        ChatRoom* room = item.second;
+        if (room->isMaterialized() && !room->chat().checkUnreadCount())
+        {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/** A search of the local history, run on a worker thread. The worker only writes
+ * the results, everything else (including the release of the job) is done on the
+ * app's thread */
+struct SearchJob
+{
+    promise::Promise<std::shared_ptr<std::vector<ChatdSearchResult>>> pms;
+    std::shared_ptr<std::vector<ChatdSearchResult>> results;
+    std::string error;
+    DeleteTrackable::Handle wptr;
+    SearchJob(DeleteTrackable::Handle aWptr)
+        : results(std::make_shared<std::vector<ChatdSearchResult>>()), wptr(aWptr) {}
+};
+
+promise::Promise<std::shared_ptr<std::vector<ChatdSearchResult>>>
+Client::searchMessages(Id chatid, const std::string& text, int limit)
+{
+    if (!mCryptoWorkers)
+    {
+        mCryptoWorkers.reset(new WorkerPool());
+    }
+
+    // the worker reads from a separate connection, so it only sees committed data.
+    // Let our own writes wait for the reader instead of failing with SQLITE_BUSY
+    db.commit();
+    sqlite3_busy_timeout(db, 2000);
+
+    auto job = std::make_shared<SearchJob>(weakHandle());
+    auto pms = job->pms;
+    std::string path = dbPath(mSid);
+    void* ctx = appCtx;
+    // all searches share a queue, so they don't delay the decryption of any chat
+    mCryptoWorkers->post(Id::null().val, [job, path, chatid, text, limit, ctx]() mutable
+    {
+        // on the worker thread
+        SqliteDb searchDb;
+        if (!searchDb.open(path.c_str()))
+        {
+            job->error = "Can't open db";
+        }
+        else
+        {
+            sqlite3_busy_timeout(searchDb, 2000);
+            try
+            {
+                ChatdSqliteDb::searchMessages(searchDb, chatid, text, limit, *job->results);
+            }
+            catch (std::exception& e)
+            {
+                job->error = e.what();
+            }
+            searchDb.close();
+        }
+
+        // hand over our reference, so the job is released on the app's thread
+        auto onDone = [job]()
+        {
+            if (job->wptr.deleted())
+            {
+                job->pms.reject("searchMessages: client deleted");
+            }
+            else if (!job->error.empty())
+            {
+                job->pms.reject("searchMessages: "+job->error);
+            }
+            else
+            {
+                job->pms.resolve(job->results);
+            }
+        };
+        job.reset();
+        marshallCall(std::move(onDone), ctx);
+    });
+    return pms;
+}
+
 bool Client::areGroupCallsEnabled()
 {
     return mGroupCallsEnabled;
@@ -396,7 +525,7 @@ promise::Promise<void> Client::pushReceived(Id chatid)
         for (auto& item: *chats)
         {
             ChatRoom *chat = item.second;
-            if (!chat->chat().isDisabled())
+            if (chat->isMaterialized() && !chat->chat().isDisabled())   // rooms loaded lazily are not joined
             {
                 mSyncCount++;
                 chat->sendSync();
@@ -529,6 +658,9 @@ void Client::initWithDbSession(const char* sid)
     try
     {
         assert(sid);
+        mInitStats = InitStats();
+        int64_t initTs = timestampMs();
+        int64_t ts = initTs;
         if (!openDb(sid))
         {
             assert(mSid.empty());
@@ -537,6 +669,38 @@ void Client::initWithDbSession(const char* sid)
         }
         assert(db);
         assert(!mSid.empty());
+        mInitStats.openDb = timestampMs() - ts;
+
+        // Read the state of all chats in bulk from a separate connection, while
+        // the rest of the session is loaded. The future blocks on destruction, so
+        // the worker never outlives this method.
+        std::future<ChatdDbPrefetchMap> prefetch;
+        if (mDbPrefetchOnInit)
+        {
+            // let our own writes wait for the reader instead of failing with SQLITE_BUSY
+            sqlite3_busy_timeout(db, 2000);
+            std::string path = dbPath(sid);
+            prefetch = std::async(std::launch::async, [path]()
+            {
+                ChatdDbPrefetchMap result;
+                SqliteDb prefetchDb;
+                if (!prefetchDb.open(path.c_str()))
+                    throw std::runtime_error("Can't open db");
+                try
+                {
+                    ChatdSqliteDb::prefetchAll(prefetchDb, result);
+                }
+                catch(...)
+                {
+                    prefetchDb.close();
+                    throw;
+                }
+                prefetchDb.close();
+                return result;
+            });
+        }
+
+        ts = timestampMs();
         mUserAttrCache.reset(new UserAttrCache(*this));        
         api.sdk.addGlobalListener(this);
 
@@ -557,10 +721,43 @@ void Client::initWithDbSession(const char* sid)
         });
 
         loadOwnKeysFromDb();
+        mInitStats.ownData = timestampMs() - ts;
+
+        ts = timestampMs();
         contactList->loadFromDb();
         mContactsLoaded = true;
+        mInitStats.contacts = timestampMs() - ts;
+
+        ts = timestampMs();
         mChatdClient.reset(new chatd::Client(this));
-        chats->loadFromDb();
+        mInitStats.chatdClient = timestampMs() - ts;
+
+        ChatdDbPrefetchMap prefetched;
+        bool hasPrefetch = false;
+        if (prefetch.valid())
+        {
+            ts = timestampMs();
+            try
+            {
+                prefetched = prefetch.get();
+                hasPrefetch = true;
+            }
+            catch(std::exception& e)
+            {
+                KR_LOG_WARNING("initWithDbSession: Error prefetching chats from db, loading them one by one: %s", e.what());
+            }
+            mInitStats.prefetchWait = timestampMs() - ts;
+        }
+
+        ts = timestampMs();
+        chats->loadFromDb(hasPrefetch ? &prefetched : nullptr);
+        mInitStats.chats = timestampMs() - ts;
+        mInitStats.total = timestampMs() - initTs;
+        KR_LOG_INFO("initWithDbSession: Session loaded from cache in %" PRId64 " ms (open db: %" PRId64
+                    ", own data: %" PRId64 ", contacts: %" PRId64 ", chatd client: %" PRId64
+                    ", prefetch wait: %" PRId64 ", chats: %" PRId64 ")",
+                    mInitStats.total, mInitStats.openDb, mInitStats.ownData, mInitStats.contacts,
+                    mInitStats.chatdClient, mInitStats.prefetchWait, mInitStats.chats);
     }
     catch(std::runtime_error& e)
     {
@@ -753,6 +950,7 @@ void Client::onRequestFinish(::mega::MegaApi* /*apiObj*/, ::mega::MegaRequest *r
 void Client::wipeDb(const std::string& sid)
 {
     assert(!sid.empty());
+    websocketIO->mDnsCache.setDb(NULL);
     db.close();
     std::string path = dbPath(sid);
     remove(path.c_str());
@@ -768,6 +966,7 @@ void Client::createDb()
     if (!db.open(path.c_str(), false))
         throw std::runtime_error("Can't access application database at "+mAppDir);
     createDbSchema(); //calls commit() at the end
+    websocketIO->mDnsCache.setDb(&db);
 }
 
 bool Client::checkSyncWithSdkDb(const std::string& scsn,
@@ -1186,6 +1385,11 @@ void Client::terminate(bool deleteDb)
         {
             KR_LOG_INFO("Doing final COMMIT to database");
             db.commit();
+            const SqliteStmtCacheStats& stats = db.stmtCacheStats();
+            KR_LOG_INFO("Prepared statement cache: %s hits, %s misses, %s uncached, %s evictions",
+                        std::to_string(stats.hits).c_str(), std::to_string(stats.misses).c_str(),
+                        std::to_string(stats.uncached).c_str(), std::to_string(stats.evictions).c_str());
+            websocketIO->mDnsCache.setDb(NULL);
             db.close();
         }
     }
@@ -1313,9 +1517,19 @@ ApiPromise ChatRoom::requestRevokeAccess(mega::MegaNode *node, mega::MegaHandle
 
 strongvelope::ProtocolHandler* Client::newStrongvelope(karere::Id chatid)
 {
+    if (!mCryptoWorkers)
+    {
+        mCryptoWorkers.reset(new WorkerPool());
+    }
+    if (!mPairwiseKeys)
+    {
+        // loads all the keys at once, before the first chat needs them
+        mPairwiseKeys.reset(new strongvelope::PairwiseKeyCache(db, StaticBuffer(mMyPrivCu25519, 32)));
+    }
     return new strongvelope::ProtocolHandler(mMyHandle,
         StaticBuffer(mMyPrivCu25519, 32), StaticBuffer(mMyPrivEd25519, 32),
-        StaticBuffer(mMyPrivRsa, mMyPrivRsaLen), *mUserAttrCache, db, chatid, appCtx);
+        StaticBuffer(mMyPrivRsa, mMyPrivRsaLen), *mUserAttrCache, db, chatid, appCtx,
+        mCryptoWorkers.get(), mPairwiseKeys.get());
 }
 
 void ChatRoom::createChatdChat(const karere::SetOfIds& initialUsers)
@@ -1325,6 +1539,75 @@ void ChatRoom::createChatdChat(const karere::SetOfIds& initialUsers)
         parent.mKarereClient.newStrongvelope(chatid()), mCreationTs, mIsGroup);
 }
 
+void ChatRoom::initWithChatdOrLazily()
+{
+    if (parent.mKarereClient.lazyChatLoading())
+    {
+        std::unique_ptr<chatd::LastTextMsgState> lastTextMsg(new chatd::LastTextMsgState);
+        if (ChatdSqliteDb::loadSummary(parent.mKarereClient.db, mChatid, parent.mKarereClient.myHandle(),
+                parent.dbPrefetch(mChatid), *lastTextMsg, mLazyLastMsgTs, mLazyUnreadCount))
+        {
+            mLazyLastTextMsg = std::move(lastTextMsg);
+            return;
+        }
+        // it has messages pending to be sent, so it can't wait
+    }
+    initWithChatd();
+}
+
+void ChatRoom::ensureChatdChat()
+{
+    if (mChat)
+        return;
+
+    KR_LOG_DEBUG("Chatroom[%s]: creating chatd chat of lazily loaded room", Id(mChatid).toString().c_str());
+    mLazyLastTextMsg.reset();
+    initWithChatd();
+}
+
+void ChatRoom::materialize()
+{
+    if (mChat)
+        return;
+
+    ensureChatdChat();
+    if (parent.mKarereClient.connState() != Client::kDisconnected)
+    {
+        connect();
+    }
+}
+
+int ChatRoom::unreadCount() const
+{
+    return mChat ? mChat->unreadMsgCount() : mLazyUnreadCount;
+}
+
+uint8_t ChatRoom::lastTextMessage(chatd::LastTextMsg*& msg)
+{
+    if (mChat)
+    {
+        return mChat->lastTextMessage(msg);
+    }
+
+    // loaded lazily: if there's none in db, it will be fetched once the chat is created
+    if (!mLazyLastTextMsg || !mLazyLastTextMsg->isValid())
+    {
+        return chatd::LastTextMsgState::kNone;
+    }
+    msg = mLazyLastTextMsg.get();
+    return chatd::LastTextMsgState::kHave;
+}
+
+uint32_t ChatRoom::lastMessageTs() const
+{
+    if (mChat)
+    {
+        return mChat->lastMessageTs();
+    }
+    // as the chat does right after being loaded from db
+    return mLazyLastMsgTs ? mLazyLastMsgTs : mCreationTs;
+}
+
 template <class T, typename F>
 void callAfterInit(T* self, F&& func, void *ctx)
 {
@@ -1350,6 +1633,7 @@ void PeerChatRoom::initWithChatd()
 
 void PeerChatRoom::connect()
 {
+    ensureChatdChat();
     mChat->connect();
 }
 
@@ -1445,13 +1729,25 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
 :ChatRoom(parent, chatid, true, aShard, aOwnPriv, ts, aIsArchived, title),
 mHasTitle(!title.empty()), mRoomGui(nullptr)
 {
-    SqliteStmt stmt(parent.mKarereClient.db, "select userid, priv from chat_peers where chatid=?");
-    stmt << mChatid;
     std::vector<promise::Promise<void> > promises;
-    while(stmt.step())
+    ChatdDbPrefetch* prefetch = parent.dbPrefetch(mChatid);
+    if (prefetch)
+    {
+        for (auto& peer: prefetch->peers)
+        {
+            promises.push_back(addMember(peer.first, peer.second, false));
+        }
+    }
+    else
     {
-        promises.push_back(addMember(stmt.uint64Col(0), (chatd::Priv)stmt.intCol(1), false));
+        SqliteStmt stmt(parent.mKarereClient.db, "select userid, priv from chat_peers where chatid=?");
+        stmt << mChatid;
+        while(stmt.step())
+        {
+            promises.push_back(addMember(stmt.uint64Col(0), (chatd::Priv)stmt.intCol(1), false));
+        }
     }
+    prefetchMemberAttrs();
 
     auto wptr = weakHandle();
     mMemberNamesResolved = promise::when(promises)
@@ -1465,7 +1761,7 @@ mHasTitle(!title.empty()), mRoomGui(nullptr)
     });
 
     notifyTitleChanged();
-    initWithChatd();
+    initWithChatdOrLazily();
     mRoomGui = addAppItem();
     mIsInitializing = false;
 }
@@ -1483,7 +1779,8 @@ void GroupChatRoom::initWithChatd()
 
 void GroupChatRoom::connect()
 {
-    if (chat().onlineState() != chatd::kChatStateOffline)
+    ensureChatdChat();
+    if (mChat->onlineState() != chatd::kChatStateOffline)
         return;
 
     mChat->connect();
@@ -1515,7 +1812,7 @@ PeerChatRoom::PeerChatRoom(ChatRoomList& parent, const uint64_t& chatid,
   mRoomGui(nullptr)
 {
     initContact(peer);
-    initWithChatd();
+    initWithChatdOrLazily();
     mRoomGui = addAppItem();
     mIsInitializing = false;
 }
@@ -1542,7 +1839,7 @@ PeerChatRoom::~PeerChatRoom()
     if (mRoomGui && !parent.mKarereClient.isTerminated())
         parent.mKarereClient.app.chatListHandler()->removePeerChatItem(*mRoomGui);
 
-    if (parent.mKarereClient.mChatdClient)
+    if (mChat && parent.mKarereClient.mChatdClient)
         parent.mKarereClient.mChatdClient->leave(mChatid);
 }
 
@@ -1615,7 +1912,6 @@ bool ChatRoom::syncArchive(bool aIsArchived)
 
     mIsArchived = aIsArchived;
     parent.mKarereClient.db.query("update chats set archived = ? where chatid = ?", mIsArchived, mChatid);
-
     return true;
 }
 
@@ -1626,6 +1922,10 @@ bool PeerChatRoom::syncPeerPriv(chatd::Priv priv)
 
     mPeerPriv = priv;
     parent.mKarereClient.db.query("update chats set peer_priv = ? where chatid = ?", mPeerPriv, mChatid);
+    if (mRoomGui)
+    {
+        mRoomGui->onMembersInfoChanged();
+    }
 
     return true;
 }
@@ -1684,6 +1984,20 @@ promise::Promise<void> GroupChatRoom::addMember(uint64_t userid, chatd::Priv pri
     return mPeers[userid]->nameResolved();
 }
 
+void GroupChatRoom::prefetchMemberAttrs()
+{
+    // the names are requested by each Member, but the public keys would be requested
+    // only after connecting to chatd, one by one as it reports each member
+    std::vector<uint64_t> users;
+    users.reserve(mPeers.size());
+    for (auto& peer: mPeers)
+    {
+        users.push_back(peer.first);
+    }
+    parent.mKarereClient.userAttrCache().prefetchAttrs(users,
+        { ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY });
+}
+
 bool GroupChatRoom::removeMember(uint64_t userid)
 {
     KR_LOG_DEBUG("GroupChatRoom[%s]: Removed member %s", Id(mChatid).toString().c_str(), Id(userid).toString().c_str());
@@ -1761,7 +2075,7 @@ void GroupChatRoom::deleteSelf()
             return;
         }
 
-        auto db = parent.mKarereClient.db;
+        auto& db = parent.mKarereClient.db;
         db.query("delete from chat_peers where chatid=?", mChatid);
         db.query("delete from chats where chatid=?", mChatid);
         delete this;
@@ -1772,25 +2086,57 @@ ChatRoomList::ChatRoomList(Client& aClient)
 :mKarereClient(aClient)
 {}
 
-void ChatRoomList::loadFromDb()
+void ChatRoomList::loadFromDb(ChatdDbPrefetchMap* prefetch)
 {
-    SqliteStmt stmt(mKarereClient.db, "select chatid, ts_created ,shard, own_priv, peer, peer_priv, title, archived from chats");
-    while(stmt.step())
+    mDbPrefetch = prefetch;
+    try
     {
-        auto chatid = stmt.uint64Col(0);
-        if (find(chatid) != end())
+        SqliteStmt stmt(mKarereClient.db, "select chatid, ts_created ,shard, own_priv, peer, peer_priv, title, archived from chats");
+        while(stmt.step())
         {
-            KR_LOG_WARNING("ChatRoomList: Attempted to load from db cache a chatid that is already in memory");
-            continue;
+            auto chatid = stmt.uint64Col(0);
+            if (find(chatid) != end())
+            {
+                KR_LOG_WARNING("ChatRoomList: Attempted to load from db cache a chatid that is already in memory");
+                continue;
+            }
+            auto peer = stmt.uint64Col(4);
+            ChatRoom* room;
+            if (peer != uint64_t(-1))
+                room = new PeerChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), peer, (chatd::Priv)stmt.intCol(5), stmt.intCol(1), stmt.intCol(7));
+            else
+                room = new GroupChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), stmt.intCol(1), stmt.intCol(7), stmt.stringCol(6));
+            emplace(chatid, room);
         }
-        auto peer = stmt.uint64Col(4);
-        ChatRoom* room;
-        if (peer != uint64_t(-1))
-            room = new PeerChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), peer, (chatd::Priv)stmt.intCol(5), stmt.intCol(1), stmt.intCol(7));
-        else
-            room = new GroupChatRoom(*this, chatid, stmt.intCol(2), (chatd::Priv)stmt.intCol(3), stmt.intCol(1), stmt.intCol(7), stmt.stringCol(6));
-        emplace(chatid, room);
     }
+    catch(...)
+    {
+        mDbPrefetch = nullptr;
+        throw;
+    }
+    mDbPrefetch = nullptr;
+}
+
+ChatdDbPrefetch* ChatRoomList::dbPrefetch(karere::Id chatid) const
+{
+    if (!mDbPrefetch)
+        return nullptr;
+    auto it = mDbPrefetch->find(chatid);
+    return (it != mDbPrefetch->end()) ? it->second.get() : nullptr;
+}
+
+std::unique_ptr<ChatdDbPrefetch> ChatRoomList::takeDbPrefetch(karere::Id chatid)
+{
+    std::unique_ptr<ChatdDbPrefetch> result;
+    if (!mDbPrefetch)
+        return result;
+    auto it = mDbPrefetch->find(chatid);
+    if (it != mDbPrefetch->end())
+    {
+        result = std::move(it->second);
+        mDbPrefetch->erase(it);
+    }
+    return result;
 }
 void ChatRoomList::addMissingRoomsFromApi(const mega::MegaTextChatList& rooms, SetOfIds& chatids)
 {
@@ -1968,6 +2314,7 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const mega::MegaTextChat& aCh
             mPeers[handle] = new Member(*this, handle, (chatd::Priv)peers->getPeerPrivilege(i)); //may try to access mContactGui, but we have set it to nullptr, so it's ok
             promises.push_back(mPeers[handle]->nameResolved());
         }
+        prefetchMemberAttrs();
 
         auto wptr = weakHandle();
         // If there is not any promise at vector promise, promise::when is resolved directly
@@ -1990,7 +2337,7 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const mega::MegaTextChat& aCh
     }
 
     //save to db
-    auto db = parent.mKarereClient.db;
+    auto& db = parent.mKarereClient.db;
     db.query("delete from chat_peers where chatid=?", mChatid);
     db.query(
         "insert or replace into chats(chatid, shard, peer, peer_priv, "
@@ -2170,7 +2517,7 @@ GroupChatRoom::~GroupChatRoom()
     if (mRoomGui && !parent.mKarereClient.isTerminated())
         parent.mKarereClient.app.chatListHandler()->removeGroupChatItem(*mRoomGui);
 
-    if (parent.mKarereClient.mChatdClient)
+    if (mChat && parent.mKarereClient.mChatdClient)
         parent.mKarereClient.mChatdClient->leave(mChatid);
 
     for (auto& m: mPeers)
@@ -2234,7 +2581,7 @@ promise::Promise<void> GroupChatRoom::invite(uint64_t userid, chatd::Priv priv)
 void ChatRoom::init(chatd::Chat& chat, chatd::DbInterface*& dbIntf)
 {
     mChat = &chat;
-    dbIntf = new ChatdSqliteDb(*mChat, parent.mKarereClient.db);
+    dbIntf = new ChatdSqliteDb(*mChat, parent.mKarereClient.db, parent.takeDbPrefetch(mChatid));
     if (mAppChatHandler)
     {
         setAppChatHandler(mAppChatHandler);
@@ -2246,12 +2593,14 @@ void ChatRoom::setAppChatHandler(IApp::IChatHandler* handler)
     if (mAppChatHandler)
         throw std::runtime_error("App chat handler is already set, remove it first");
 
+    materialize();
     mAppChatHandler = handler;
     chatd::DbInterface* dummyIntf = nullptr;
 // mAppChatHandler->init() may rely on some events, so we need to set mChatWindow as listener before
 // calling init(). This is safe, as and we will not get any async events before we
 //return to the event loop
     mChat->setListener(mAppChatHandler);
+    mChat->setOpen(true);
     mAppChatHandler->init(*mChat, dummyIntf);
 }
 
@@ -2261,6 +2610,7 @@ void ChatRoom::removeAppChatHandler()
         return;
     mAppChatHandler = nullptr;
     mChat->setListener(this);
+    mChat->setOpen(false);
 }
 
 bool ChatRoom::hasChatHandler() const
@@ -2530,7 +2880,11 @@ bool GroupChatRoom::syncWithApi(const mega::MegaTextChat& chat)
                 if (parent.mKarereClient.connected())
                 {
                     KR_LOG_DEBUG("Connecting existing room to chatd after re-join...");
-                    if (mChat->onlineState() != ::chatd::ChatState::kChatStateJoining)
+                    if (!mChat)
+                    {
+                        materialize();  // it connects the chat as well
+                    }
+                    else if (mChat->onlineState() != ::chatd::ChatState::kChatStateJoining)
                     {
                         mChat->connect();
                     }
@@ -2615,6 +2969,10 @@ GroupChatRoom::Member::Member(GroupChatRoom& aRoom, const uint64_t& user, chatd:
         {
             self->mRoom.mAppChatHandler->onMemberNameChanged(self->mHandle, self->mName);
         }
+        if (self->mRoom.mRoomGui)
+        {
+            self->mRoom.mRoomGui->onMembersInfoChanged();
+        }
 
         if (!self->mNameResolved.done())
         {
@@ -2634,6 +2992,10 @@ GroupChatRoom::Member::Member(GroupChatRoom& aRoom, const uint64_t& user, chatd:
         if (buf && !buf->empty())
         {
             self->mEmail.assign(buf->buf(), buf->dataSize());
+            if (self->mRoom.mRoomGui)
+            {
+                self->mRoom.mRoomGui->onMembersInfoChanged();
+            }
             if (self->mName.size() <= 1 && self->mRoom.memberNamesResolved().done() && !self->mRoom.mHasTitle)
             {
                 self->mRoom.makeTitleFromMemberNames();
@@ -2660,6 +3022,10 @@ void Client::connectToChatd(bool isInBackground)
     for (auto& item: *chats)
     {
         auto& chat = *item.second;
+        if (!chat.isMaterialized())
+        {
+            continue;   // loaded lazily, materialize() joins it once used
+        }
         if (!chat.chat().isDisabled())
         {
             chat.connect();
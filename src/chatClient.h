@@ -17,10 +17,12 @@
 
 namespace mega { class MegaTextChat; class MegaTextChatList; }
 
-namespace strongvelope { class ProtocolHandler; }
+namespace strongvelope { class ProtocolHandler; class PairwiseKeyCache; }
 
 struct sqlite3;
 class Buffer;
+struct ChatdDbPrefetch;
+struct ChatdSearchResult;
 
 namespace karere
 {
@@ -38,6 +40,7 @@ class ChatRoom;
 class GroupChatRoom;
 class Contact;
 class ContactList;
+class WorkerPool;
 
 typedef std::map<Id, chatd::Priv> UserPrivMap;
 class ChatRoomList;
@@ -65,8 +68,17 @@ protected:
     uint32_t mCreationTs;
     bool mIsArchived;
     std::string mTitleString;
+    // last text message, its ts and unread count while the chatd chat is not created (lazy mode)
+    std::unique_ptr<chatd::LastTextMsgState> mLazyLastTextMsg;
+    uint32_t mLazyLastMsgTs = 0;
+    int mLazyUnreadCount = 0;
     void notifyTitleChanged();
     void switchListenerToApp();
+    virtual void initWithChatd() = 0;
+    /** Creates the chatd chat right away, or defers it if rooms are loaded lazily */
+    void initWithChatdOrLazily();
+    /** Creates the chatd chat of a room loaded lazily. Unlike materialize(), it doesn't connect it */
+    void ensureChatdChat();
     void createChatdChat(const karere::SetOfIds& initialUsers); //We can't do the join in the ctor, as chatd may fire callbcks synchronously from join(), and the derived class will not be constructed at that point.
     void notifyExcludedFromChat();
     void notifyRejoinedChat();
@@ -93,11 +105,36 @@ public:
 
     virtual ~ChatRoom(){}
 
-    /** @brief returns the chatd::Chat chat object associated with the room */
-    chatd::Chat& chat() { return *mChat; }
+    /** @brief returns the chatd::Chat chat object associated with the room.
+     * If the room was loaded lazily, the chat is created by this call */
+    chatd::Chat& chat() { if (!mChat) materialize(); return *mChat; }
 
-    /** @brief returns the chatd::Chat chat object associated with the room */
-    const chatd::Chat& chat() const { return *mChat; }
+    /** @brief returns the chatd::Chat chat object associated with the room.
+     * If the room was loaded lazily, the chat is created by this call */
+    const chatd::Chat& chat() const { if (!mChat) const_cast<ChatRoom*>(this)->materialize(); return *mChat; }
+
+    /** @brief Whether the chatd::Chat of the room has been created. It's not the
+     * case for rooms loaded lazily (see \c Client::setLazyChatLoading()) that
+     * have not been used yet */
+    bool isMaterialized() const { return mChat != nullptr; }
+
+    /** @brief Creates the chatd::Chat of a room loaded lazily, and connects it
+     * if the client is connecting or connected. Does nothing if already created */
+    void materialize();
+
+    /** @brief The unread message count, as returned by \c chatd::Chat::unreadMsgCount().
+     * It doesn't create the chatd::Chat of rooms loaded lazily */
+    int unreadCount() const;
+
+    /** @brief The last text message, as returned by \c chatd::Chat::lastTextMessage().
+     * It doesn't create the chatd::Chat of rooms loaded lazily: they return the one read
+     * from db at startup, or \c LastTextMsgState::kNone if there was none */
+    uint8_t lastTextMessage(chatd::LastTextMsg*& msg);
+
+    /** @brief The timestamp of the newest known message, as returned by
+     * \c chatd::Chat::lastMessageTs(). It doesn't create the chatd::Chat of rooms loaded
+     * lazily: they return the timestamp of the last text message read from db at startup */
+    uint32_t lastMessageTs() const;
 
     /** @brief The chatid of the chatroom */
     const uint64_t& chatid() const { return mChatid; }
@@ -125,13 +162,13 @@ public:
     bool isActive() const { return mIsGroup ? (mOwnPriv != chatd::PRIV_NOTPRESENT) : true; }
 
     /** @brief The online state reported by chatd for that chatroom */
-    chatd::ChatState chatdOnlineState() const { return mChat->onlineState(); }
+    chatd::ChatState chatdOnlineState() const { return mChat ? mChat->onlineState() : chatd::kChatStateOffline; }
 
     /** @brief send a notification to the chatroom that the user is typing. */
-    virtual void sendTypingNotification() { mChat->sendTypingNotification(); }
+    virtual void sendTypingNotification() { chat().sendTypingNotification(); }
 
     /** @brief send a notification to the chatroom that the user has stopped typing. */
-    virtual void sendStopTypingNotification() { mChat->sendStopTypingNotification(); }
+    virtual void sendStopTypingNotification() { chat().sendStopTypingNotification(); }
 
     void sendSync() { mChat->sendSync(); }
 
@@ -217,7 +254,7 @@ protected:
     bool syncPeerPriv(chatd::Priv priv);
     static uint64_t getSdkRoomPeer(const ::mega::MegaTextChat& chat);
     static chatd::Priv getSdkRoomPeerPriv(const ::mega::MegaTextChat& chat);
-    void initWithChatd();
+    virtual void initWithChatd();
     virtual void connect();
     UserAttrCache::Handle mUsernameAttrCbId;
     void updateTitle(const std::string& title);
@@ -318,12 +355,13 @@ public:
     void clearTitle();
     promise::Promise<void> addMember(uint64_t userid, chatd::Priv priv, bool saveToDb);
     bool removeMember(uint64_t userid);
+    void prefetchMemberAttrs();
     virtual bool syncWithApi(const mega::MegaTextChat &chat);
     IApp::IGroupChatListItem* addAppItem();
     virtual IApp::IChatListItem* roomGui() { return mRoomGui; }
     void deleteSelf(); ///< Deletes the room from db and then immediately destroys itself (i.e. delete this)
     void makeTitleFromMemberNames();
-    void initWithChatd();
+    virtual void initWithChatd();
     void setRemoved();
     virtual void connect();
     promise::Promise<void> memberNamesResolved() const;
@@ -407,9 +445,15 @@ public:
     void addMissingRoomsFromApi(const mega::MegaTextChatList& rooms, karere::SetOfIds& chatids);
     ChatRoom* addRoom(const mega::MegaTextChat &room);
     void removeRoom(GroupChatRoom& room);
+    /** State of the chats prefetched from db, only available while loadFromDb() is running */
+    std::map<karere::Id, std::unique_ptr<ChatdDbPrefetch>>* mDbPrefetch = nullptr;
     ChatRoomList(Client& aClient);
     ~ChatRoomList();
-    void loadFromDb();
+    void loadFromDb(std::map<karere::Id, std::unique_ptr<ChatdDbPrefetch>>* prefetch = nullptr);
+    /** Returns the prefetched db state of the chat, or null if not available */
+    ChatdDbPrefetch* dbPrefetch(karere::Id chatid) const;
+    /** Returns (and forgets) the prefetched db state of the chat, or null if not available */
+    std::unique_ptr<ChatdDbPrefetch> takeDbPrefetch(karere::Id chatid);
     void onChatsUpdate(mega::MegaTextChatList& chats);
 /** @endcond PRIVATE */
 };
@@ -603,6 +647,18 @@ public:
         kHeartbeatTimeout = 10000     /// Timeout for heartbeats (ms)
     };
 
+    /** @brief Duration (in ms) of each phase of \c initWithDbSession() */
+    struct InitStats
+    {
+        int64_t openDb = 0;         ///< opening and checking the local cache
+        int64_t ownData = 0;        ///< own handle, email, identity and keys
+        int64_t contacts = 0;       ///< loading the contact list
+        int64_t chatdClient = 0;    ///< creation of the chatd client
+        int64_t prefetchWait = 0;   ///< waiting for the bulk prefetch of chats' state
+        int64_t chats = 0;          ///< creation of the chatrooms and their chatd chats
+        int64_t total = 0;
+    };
+
     /** @brief Convenience aliases for the \c force flag in \c setPresence() */
     enum: bool { kSetPresOverride = true, kSetPresDynamic = false };
 
@@ -648,6 +704,11 @@ protected:
     std::string mMyEmail;
     uint64_t mMyIdentity = 0; // seed for CLIENTID
     std::unique_ptr<UserAttrCache> mUserAttrCache;
+    /** Worker threads where messages are verified and decrypted, shared by all chats.
+     * The searches of the local history run there too */
+    std::unique_ptr<WorkerPool> mCryptoWorkers;
+    /** Symmetric keys shared with other users, persisted and shared by all chats */
+    std::unique_ptr<strongvelope::PairwiseKeyCache> mPairwiseKeys;
     UserAttrCache::Handle mOwnNameAttrHandle;
 
     std::string mSid;
@@ -655,6 +716,9 @@ protected:
     InitState mInitState = kInitCreated;
     ConnState mConnState = kDisconnected;
     bool mContactsLoaded = false;
+    bool mDbPrefetchOnInit = true;
+    bool mLazyChatLoading = false;
+    InitStats mInitStats;
 
     // resolved when fetchnodes is completed
     promise::Promise<void> mSessionReadyPromise;
@@ -696,6 +760,45 @@ public:
     ConnState connState() const { return mConnState; }
     bool connected() const { return mConnState == kConnected; }
     bool contactsLoaded() const { return mContactsLoaded; }
+    const InitStats& initStats() const { return mInitStats; }
+
+    /**
+     * @brief Enables or disables reading the state of all chats from db in bulk, from
+     * a worker thread, while the rest of the session is being loaded by \c initWithDbSession().
+     * It's enabled by default. It must be set before \c init() to have any effect.
+     */
+    void setDbPrefetchOnInit(bool enable) { mDbPrefetchOnInit = enable; }
+
+    /**
+     * @brief Enables or disables the lazy loading of chatrooms from the local cache.
+     * In lazy mode, the chatrooms loaded by \c initWithDbSession() don't create their
+     * chatd::Chat (with its history, send queue and crypto module) until it's needed:
+     * when the app opens the chatroom or uses any chatd-related feature of it.
+     * Connecting to chatd doesn't create them: they are joined, and receive messages,
+     * once created. Meanwhile, the chat list is served with the last text message
+     * and unread count read from db.
+     * It's disabled by default. It must be set before \c init() to have any effect.
+     */
+    void setLazyChatLoading(bool enable) { mLazyChatLoading = enable; }
+    bool lazyChatLoading() const { return mLazyChatLoading; }
+
+    /**
+     * @brief Checks, for every chatroom with its chatd::Chat created, that the unread
+     * counter maintained in db matches a full count of its unread messages. Intended for tests.
+     * @return false if any of them doesn't match.
+     */
+    bool checkUnreadCounts();
+
+    /**
+     * @brief Searches the local history of a chat, or of all chats, for messages containing
+     * the words of \c text, without loading the chats. Results are ranked by the number of
+     * words found, and then by recency.
+     * The query runs on a worker thread, with its own connection to the db, and the
+     * promise is resolved on the app's thread.
+     * @param chatid The chat to search in, or karere::Id::inval() for all chats
+     */
+    promise::Promise<std::shared_ptr<std::vector<ChatdSearchResult>>>
+    searchMessages(karere::Id chatid, const std::string& text, int limit);
 
     presenced::Client& presenced() { return mPresencedClient; }
 
@@ -320,6 +320,67 @@ void Client::setLastMsgTs(Id userid, ::mega::m_time_t lastMsgTs)
     mLastMsgTs[userid] = lastMsgTs;
 }
 
+void Client::setMaxRejoinsInFlight(size_t max)
+{
+    mMaxRejoinsInFlight = max;
+}
+
+void Client::setHistoryBudget(size_t perChat, size_t global)
+{
+    mHistChatBudget = perChat;
+    mHistGlobalBudget = global;
+    for (auto& chat: mChatForChatId)
+    {
+        chat.second->scheduleHistoryEviction();
+    }
+}
+
+HistCacheStats Client::historyCacheStats() const
+{
+    HistCacheStats stats;
+    for (auto& chat: mChatForChatId)
+    {
+        HistCacheStats chatStats = chat.second->historyCacheStats();
+        stats.hits += chatStats.hits;
+        stats.faults += chatStats.faults;
+        stats.evictions += chatStats.evictions;
+        stats.resident += chatStats.resident;
+    }
+    return stats;
+}
+
+void Client::enforceHistoryBudget(Chat& chat)
+{
+    if (mHistChatBudget && chat.mResidentCount > mHistChatBudget)
+    {
+        // leave some room, so we don't evict again upon every new message
+        chat.evictHistory(mHistChatBudget * 3 / 4);
+    }
+    if (!mHistGlobalBudget || mHistResident <= mHistGlobalBudget)
+        return;
+
+    // shrink the least recently used chats to a minimal window first
+    std::vector<Chat*> chats;
+    chats.reserve(mChatForChatId.size());
+    for (auto& item: mChatForChatId)
+    {
+        chats.push_back(item.second.get());
+    }
+    std::sort(chats.begin(), chats.end(), [](const Chat* a, const Chat* b)
+    {
+        return a->mLastHistUse < b->mLastHistUse;
+    });
+
+    size_t target = mHistGlobalBudget * 3 / 4;
+    for (Chat* lruChat: chats)
+    {
+        if (mHistResident <= target)
+            break;
+        lruChat->evictHistory(lruChat->initialHistoryFetchCount * 2);
+    }
+    CHATD_LOG_DEBUG("History budget: %zu messages in RAM after eviction (budget: %zu)", mHistResident, mHistGlobalBudget);
+}
+
 uint8_t Client::richLinkState() const
 {
     return mRichLinkState;
@@ -403,6 +464,8 @@ Connection::Connection(Client& chatdClient, int shardNo)
 
 void Connection::wsConnectCb()
 {
+    // the connection may have been established with the fallback IP
+    mTargetIp = wsTargetIp();
     setState(kStateConnected);
 }
 
@@ -429,7 +492,6 @@ void Connection::onSocketClose(int errcode, int errtype, const std::string& reas
 
     assert(oldState != kStateDisconnected);
 
-    usingipv6 = !usingipv6;
     mTargetIp.clear();
 
     if (oldState == kStateConnected)
@@ -530,8 +592,12 @@ void Connection::setState(State state)
     {
         mHeartbeatEnabled = false;
 
-        // if a socket is opened, close it immediately
-        if (wsIsConnected())
+        // corked commands and pending rejoins belong to the closed connection
+        mCorkBuf.clear();
+        resetRejoins();
+
+        // if a socket is opened (or being opened to the fallback IP), close it immediately
+        if (wsIsConnected() || wsIsConnecting())
         {
             wsDisconnect(true);
         }
@@ -593,7 +659,10 @@ void Connection::setState(State state)
     }
     else if (mState == kStateConnected)
     {
-        CHATDS_LOG_DEBUG("Chatd connected to %s", mTargetIp.c_str());
+        int64_t now = karere::timestampMs();
+        mLastConnectLatency = now - mConnectStartTs;
+        CHATDS_LOG_INFO("Chatd connected to %s in %lld ms (%lld ms since the socket connection started)",
+                        mTargetIp.c_str(), (long long)mLastConnectLatency, (long long)(now - mSocketConnectTs));
 
         mDNScache.connectDone(mUrl.host, mTargetIp);
         assert(!mConnectPromise.done());
@@ -640,6 +709,10 @@ Promise<void> Connection::reconnect()
     mChatdClient.mKarereClient->setCommitMode(false);
     assert(!mHeartbeatEnabled);
     assert(!mRetryCtrl);
+    if (!mReconnectStartTs)
+    {
+        mReconnectStartTs = karere::timestampMs();
+    }
     try
     {
         if (mState >= kStateResolving) //would be good to just log and return, but we have to return a promise
@@ -665,6 +738,7 @@ Promise<void> Connection::reconnect()
 
             setState(kStateDisconnected);
             mConnectPromise = Promise<void>();
+            mConnectStartTs = karere::timestampMs();
 
             string ipv4, ipv6;
             bool cachedIPs = mDNScache.get(mUrl.host, ipv4, ipv6);
@@ -741,9 +815,7 @@ Promise<void> Connection::reconnect()
                 {
                     CHATDS_LOG_DEBUG("Hostname resolved by first time. Connecting...");
 
-                    mDNScache.set(mUrl.host,
-                                  ipsv4.size() ? ipsv4.at(0) : "",
-                                  ipsv6.size() ? ipsv6.at(0) : "");
+                    mDNScache.set(mUrl.host, ipsv4, ipsv6);
                     doConnect();
                     return;
                 }
@@ -751,13 +823,14 @@ Promise<void> Connection::reconnect()
                 if (mDNScache.isMatch(mUrl.host, ipsv4, ipsv6))
                 {
                     CHATDS_LOG_DEBUG("DNS resolve matches cached IPs.");
+
+                    // keep all the resolved IPs, the cached ones are still preferred
+                    mDNScache.set(mUrl.host, ipsv4, ipsv6);
                 }
                 else
                 {
                     // update DNS cache
-                    bool ret = mDNScache.set(mUrl.host,
-                                  ipsv4.size() ? ipsv4.at(0) : "",
-                                  ipsv6.size() ? ipsv6.at(0) : "");
+                    bool ret = mDNScache.set(mUrl.host, ipsv4, ipsv6);
                     assert(ret);
 
                     CHATDS_LOG_WARNING("DNS resolve doesn't match cached IPs. Forcing reconnect...");
@@ -787,11 +860,14 @@ Promise<void> Connection::reconnect()
                     return;
 
                 assert(isOnline());
+                mConnectedTs = karere::timestampMs();
+                cork();
                 sendCommand(Command(OP_CLIENTID)+mChatdClient.mKarereClient->myIdentity());
                 mTsLastRecv = time(NULL);   // data has been received right now, since connection is established
                 mHeartbeatEnabled = true;
                 sendKeepalive(mChatdClient.mKeepaliveType);
                 rejoinExistingChats();
+                uncork();
             });
         }, wptr, mChatdClient.mKarereClient->appCtx, nullptr, 0, 0, KARERE_RECONNECT_DELAY_MAX, KARERE_RECONNECT_DELAY_INITIAL));
 
@@ -824,46 +900,26 @@ void Connection::doConnect()
     string ipv4, ipv6;
     bool cachedIPs = mDNScache.get(mUrl.host, ipv4, ipv6);
     assert(cachedIPs);
-    mTargetIp = (usingipv6 && ipv6.size()) ? ipv6 : ipv4;
+
+    // race both IP families, starting by the one that connected last time (RFC 8305)
+    bool ipv6First = ipv6.size() && (ipv4.empty() || mDNScache.isIpv6Preferred(mUrl.host));
+    mTargetIp = ipv6First ? ipv6 : ipv4;
+    const string& fallbackIp = ipv6First ? ipv4 : ipv6;
 
     setState(kStateConnecting);
-    CHATDS_LOG_DEBUG("Connecting to chatd using the IP: %s", mTargetIp.c_str());
+    mSocketConnectTs = karere::timestampMs();
+    CHATDS_LOG_DEBUG("Connecting to chatd using the IP: %s (fallback IP: %s)", mTargetIp.c_str(), fallbackIp.c_str());
 
     bool rt = wsConnect(mChatdClient.mKarereClient->websocketIO, mTargetIp.c_str(),
+              fallbackIp.c_str(),
               mUrl.host.c_str(),
               mUrl.port,
               mUrl.path.c_str(),
               mUrl.isSecure);
 
-    if (!rt)    // immediate failure --> try the other IP family (if available)
+    if (!rt)    // immediate failure with both IP families
     {
-        CHATDS_LOG_DEBUG("Connection to chatd failed using the IP: %s", mTargetIp.c_str());
-
-        string oldTargetIp = mTargetIp;
-        mTargetIp.clear();
-        if (oldTargetIp == ipv6 && ipv4.size())
-        {
-            mTargetIp = ipv4;
-        }
-        else if (oldTargetIp == ipv4 && ipv6.size())
-        {
-            mTargetIp = ipv6;
-        }
-
-        if (mTargetIp.size())
-        {
-            CHATDS_LOG_DEBUG("Retrying using the IP: %s", mTargetIp.c_str());
-            if (wsConnect(mChatdClient.mKarereClient->websocketIO, mTargetIp.c_str(),
-                                      mUrl.host.c_str(),
-                                      mUrl.port,
-                                      mUrl.path.c_str(),
-                                      mUrl.isSecure))
-            {
-                return;
-            }
-            CHATDS_LOG_DEBUG("Connection to chatd failed using the IP: %s", mTargetIp.c_str());
-        }
-
+        CHATDS_LOG_DEBUG("Connection to chatd failed using the IPs: %s %s", ipv4.c_str(), ipv6.c_str());
         onSocketClose(0, 0, "Websocket error on wsConnect (chatd)");
     }
 }
@@ -990,11 +1046,51 @@ bool Connection::sendBuf(Buffer&& buf)
     if (!isOnline())
         return false;
 
+    if (mCorkCount)
+    {
+        if (mCorkBuf.dataSize() && (mCorkBuf.dataSize() + buf.dataSize() > kMaxCorkedFrameSize))
+        {
+            flushCorked();
+        }
+        mCorkBuf.append(buf.buf(), buf.dataSize());
+        buf.free();
+        return true;
+    }
+
     bool rc = wsSendMessage(buf.buf(), buf.dataSize());
     buf.free();
     return rc;
 }
 
+void Connection::cork()
+{
+    mCorkCount++;
+}
+
+void Connection::uncork()
+{
+    assert(mCorkCount > 0);
+    if (--mCorkCount == 0)
+    {
+        flushCorked();
+    }
+}
+
+// chatd parses all the commands of a frame, so the corked commands are sent as one frame
+bool Connection::flushCorked()
+{
+    if (!mCorkBuf.dataSize())
+        return true;
+
+    bool rc = isOnline() && wsSendMessage(mCorkBuf.buf(), mCorkBuf.dataSize());
+    if (!rc)
+    {
+        CHATDS_LOG_WARNING("Failed to send %zu bytes of corked commands", mCorkBuf.dataSize());
+    }
+    mCorkBuf.clear();
+    return rc;
+}
+
 bool Connection::sendCommand(Command&& cmd)
 {
     CHATDS_LOG_DEBUG("send %s", cmd.toString().c_str());
@@ -1167,15 +1263,23 @@ string KeyCommand::toString() const
     return tmpString;
 }
 // rejoin all open chats after reconnection (this is mandatory)
+// The chats open in the app are rejoined first, then the ones with unread messages, and
+// only up to Client::mMaxRejoinsInFlight at a time, so that the first ones get online
+// without waiting for the history of all the others
 bool Connection::rejoinExistingChats()
 {
+    resetRejoins();
+    std::vector<Id> chatsByPriority[3]; // open, with unread messages, others
     for (auto& chatid: mChatIds)
     {
         try
         {
             Chat& chat = mChatdClient.chats(chatid);
-            if (!chat.isDisabled())
-                chat.login();
+            if (chat.isDisabled())
+                continue;
+
+            int priority = chat.isOpen() ? 0 : (chat.unreadMsgCount() ? 1 : 2);
+            chatsByPriority[priority].push_back(chatid);
         }
         catch(std::exception& e)
         {
@@ -1183,9 +1287,94 @@ bool Connection::rejoinExistingChats()
             return false;
         }
     }
+    for (auto& chats: chatsByPriority)
+    {
+        mRejoinQueue.insert(mRejoinQueue.end(), chats.begin(), chats.end());
+    }
+    CHATDS_LOG_DEBUG("Rejoining %zu chats (%zu open, %zu with unread messages)",
+                     mRejoinQueue.size(), chatsByPriority[0].size(), chatsByPriority[1].size());
+    sendQueuedRejoins();
     return true;
 }
 
+// sends the JOINs of the queued chats, up to the max in flight, in as few frames as possible
+void Connection::sendQueuedRejoins()
+{
+    size_t maxInFlight = mChatdClient.mMaxRejoinsInFlight;
+    cork();
+    while (!mRejoinQueue.empty() && (!maxInFlight || mRejoinsInFlight.size() < maxInFlight) && isOnline())
+    {
+        Id chatid = mRejoinQueue.front();
+        mRejoinQueue.pop_front();
+        // the chat may have been removed or disabled while queued
+        std::shared_ptr<Chat> chat = mChatdClient.chatFromId(chatid);
+        if (!chat || chat->isDisabled() || !mChatIds.count(chatid))
+            continue;
+
+        mRejoinsInFlight.insert(chatid);
+        try
+        {
+            chat->login();
+        }
+        catch(std::exception& e)
+        {
+            CHATDS_LOG_ERROR("sendQueuedRejoins: Exception: %s", e.what());
+            mRejoinsInFlight.erase(chatid);
+        }
+    }
+    uncork();
+
+    if (mRejoinStallTimer)
+    {
+        cancelTimeout(mRejoinStallTimer, mChatdClient.mKarereClient->appCtx);
+        mRejoinStallTimer = 0;
+    }
+
+    if (!mRejoinsInFlight.empty())
+    {
+        // a chat that never completes its join must not hold back the ones in the queue
+        auto wptr = weakHandle();
+        mRejoinStallTimer = setTimeout([this, wptr]()
+        {
+            if (wptr.deleted())
+                return;
+
+            mRejoinStallTimer = 0;
+            CHATDS_LOG_WARNING("%zu rejoins not completed after %d seconds, not waiting for them anymore",
+                               mRejoinsInFlight.size(), kRejoinStallTimeout);
+            mRejoinsInFlight.clear();
+            sendQueuedRejoins();
+        }, kRejoinStallTimeout * 1000, mChatdClient.mKarereClient->appCtx);
+    }
+    else if (mRejoinQueue.empty() && mReconnectStartTs && isOnline())
+    {
+        int64_t now = karere::timestampMs();
+        mLastRejoinLatency = now - mReconnectStartTs;
+        CHATDS_LOG_INFO("All chats online %lld ms after the reconnection started (%lld ms after connected)",
+                        (long long)mLastRejoinLatency, (long long)(now - mConnectedTs));
+        mReconnectStartTs = 0;
+    }
+}
+
+void Connection::onRejoinComplete(Id chatid)
+{
+    if (mRejoinsInFlight.erase(chatid))
+    {
+        sendQueuedRejoins();
+    }
+}
+
+void Connection::resetRejoins()
+{
+    mRejoinQueue.clear();
+    mRejoinsInFlight.clear();
+    if (mRejoinStallTimer)
+    {
+        cancelTimeout(mRejoinStallTimer, mChatdClient.mKarereClient->appCtx);
+        mRejoinStallTimer = 0;
+    }
+}
+
 // send JOIN
 void Chat::join()
 {
@@ -1202,11 +1391,13 @@ void Chat::onJoinRejected()
     mServerFetchState = kHistNotFetching;
     setOnlineState(kChatStateOffline);
     disable(true);
+    mConnection.onRejoinComplete(mChatId);
 }
 
 void Chat::onDisconnect()
 {
     assert(mFetchRequest.size() <= 2);  // no more than a HIST+NODEHIST in parallel are allowed
+    CALL_DB(flushHistoryQueue);
 
     while (mFetchRequest.size())
     {
@@ -1236,6 +1427,7 @@ void Chat::onDisconnect()
 
 HistSource Chat::getHistory(unsigned count)
 {
+    touchHistory();
     if (isNotifyingOldHistFromServer())
     {
         return kHistSourceServer;
@@ -1379,34 +1571,220 @@ void Chat::requestNodeHistoryFromServer(Id oldestMsgid, uint32_t count)
     }, mChatdClient.mKarereClient->appCtx);
 }
 
-Message *Chat::oldest() const
+Message *Chat::oldest()
+{
+    return empty() ? NULL : findOrNull(lownum());
+}
+
+Message *Chat::newest()
+{
+    return empty() ? NULL : findOrNull(highnum());
+}
+
+void Chat::push_forward(Message* msg)
 {
-    if (!mBackwardList.empty())
+    mHistory.pushHigh(msg);
+    mResidentCount++;
+    mChatdClient.mHistResident++;
+    scheduleHistoryEviction();
+}
+
+void Chat::push_back(Message* msg)
+{
+    mHistory.pushLow(msg);
+    mResidentCount++;
+    mChatdClient.mHistResident++;
+    scheduleHistoryEviction();
+}
+
+void Chat::clear()
+{
+    if (mDbInterface)
+    {
+        // the queued messages are the ones in RAM
+        CALL_DB(flushHistoryQueue);
+    }
+    mHistory.reset(mForwardStart);
+    mChatdClient.mHistResident -= mResidentCount;
+    mResidentCount = 0;
+}
+
+void Chat::touchHistory()
+{
+    mLastHistUse = ++mChatdClient.mHistClock;
+}
+
+HistCacheStats Chat::historyCacheStats() const
+{
+    HistCacheStats stats = mHistStats;
+    stats.resident = mResidentCount;
+    return stats;
+}
+
+Idx Chat::residentMsgIndexFromId(karere::Id msgid) const
+{
+    const Idx* idx = mIdToIndexMap.find(msgid);
+    return idx ? *idx : CHATD_IDX_INVALID;
+}
+
+Idx Chat::msgIndexFromId(karere::Id msgid)
+{
+    Idx idx = residentMsgIndexFromId(msgid);
+    if (idx != CHATD_IDX_INVALID || mResidentCount == (size_t)size())
+        return idx; // found in RAM, or nothing has been evicted
+
+    // the message may have been evicted from RAM, but still be in the range of the history buffer
+    idx = mDbInterface->getIdxOfMsgidFromHistory(msgid);
+    return (idx != CHATD_IDX_INVALID && hasNum(idx)) ? idx : CHATD_IDX_INVALID;
+}
+
+void Chat::throwOutOfRange(Idx num) const
+{
+    throw std::runtime_error("Chat::operator[idx]: idx = "+
+        std::to_string(num)+" is outside of ["+std::to_string(lownum())+":"+
+        std::to_string(highnum())+"] range or could not be reloaded from db");
+}
+
+Message* Chat::faultInMsg(Idx num)
+{
+    // load a chunk of messages around the requested one, since accesses to history are
+    // usually sequential (i.e. getHistory(), or notifying a range of messages)
+    Idx high = num + (Idx)initialHistoryFetchCount / 2;
+    if (high > highnum())
+        high = highnum();
+
+    std::vector<Message*> messages;
+    CALL_DB(fetchDbHistory, high, initialHistoryFetchCount, messages);
+
+    Message* ret = nullptr;
+    size_t faulted = 0;
+    Idx idx = high;
+    for (Message* msg: messages)
+    {
+        std::unique_ptr<Message>* slot = slotOrNull(idx);
+        if (!slot || *slot)
+        {
+            delete msg; // already in RAM
+        }
+        else
+        {
+            slot->reset(msg);
+            mIdToIndexMap[msg->id()] = idx;
+            if (msg->backRefId)
+            {
+                mRefidToIdxMap.emplace(msg->backRefId, idx);
+            }
+            faulted++;
+            if (idx == num)
+            {
+                ret = msg;
+            }
+        }
+        idx--;
+    }
+
+    if (!ret)
     {
-        return mBackwardList.back().get();
+        CHATID_LOG_ERROR("faultInMsg: Message with idx %d was evicted from RAM, but can't be loaded from db", num);
     }
+    mHistStats.faults++;
+    mResidentCount += faulted;
+    mChatdClient.mHistResident += faulted;
+    touchHistory();
+    scheduleHistoryEviction();
+    return ret;
+}
 
-    if (!mForwardList.empty())
+void Chat::scheduleHistoryEviction()
+{
+    if (mEvictionScheduled)
+        return;
+
+    if ((!mChatdClient.mHistChatBudget || mResidentCount <= mChatdClient.mHistChatBudget)
+        && (!mChatdClient.mHistGlobalBudget || mChatdClient.mHistResident <= mChatdClient.mHistGlobalBudget))
     {
-        return mForwardList.front().get();
+        return;
     }
 
-    return NULL;
+    // Evict asynchronously, since callers up in the stack may be holding references to messages
+    mEvictionScheduled = true;
+    auto wptr = weakHandle();
+    marshallCall([wptr, this]()
+    {
+        if (wptr.deleted())
+            return;
+
+        mEvictionScheduled = false;
+        mChatdClient.enforceHistoryBudget(*this);
+    }, mChatdClient.mKarereClient->appCtx);
 }
 
-Message *Chat::newest() const
+void Chat::evictHistory(size_t maxResident)
 {
-    if (!mForwardList.empty())
+    if (mResidentCount <= maxResident)
+        return;
+
+    if (isServerFetchDecrypting() || mDecryptOldHaltedAt != CHATD_IDX_INVALID
+        || mDecryptNewHaltedAt != CHATD_IDX_INVALID)
     {
-        return mForwardList.back().get();
+        CHATID_LOG_DEBUG("evictHistory: decryption in progress, will evict later");
+        return;
     }
+    CALL_DB(flushHistoryQueue);    // the queued messages are the ones in RAM
 
-    if (!mBackwardList.empty())
+    // Keep the newest messages, and the ones around the oldest message sent to the app by getHistory(),
+    // which is where the app is browsing the history. Messages below it haven't been sent to the app yet.
+    Idx band = (Idx)(maxResident / 2);
+    Idx start = lownum();
+    if (mNextHistFetchIdx != CHATD_IDX_INVALID && mNextHistFetchIdx + band + 1 > start)
     {
-        return mBackwardList.front().get();
+        start = mNextHistFetchIdx + band + 1;
     }
+    Idx end = highnum() - band;
 
-    return NULL;
+    // messages still referenced by id by pending edits and rich-link requests
+    std::set<karere::Id> pinned(mMsgsToUpdateWithRichLink);
+    for (auto& edit: mPendingEdits)
+    {
+        pinned.insert(edit.first);
+    }
+    for (auto& item: mSending)
+    {
+        if (item.isEdit())
+        {
+            pinned.insert(item.msg->id());
+        }
+    }
+
+    size_t evicted = 0;
+    for (Idx i = start; (i < end) && (mResidentCount > maxResident); i++)
+    {
+        if (i == mLastSeenIdx || i == mLastReceivedIdx
+            || i == mLastIdxReceivedFromServer || i == mLastTextMsg.idx())
+        {
+            continue;
+        }
+
+        std::unique_ptr<Message>& slot = *slotOrNull(i);
+        if (!slot || slot->isPendingToDecrypt() || pinned.count(slot->id()))
+        {
+            continue;
+        }
+
+        mIdToIndexMap.erase(slot->id());
+        const Idx* refIdx = mRefidToIdxMap.find(slot->backRefId);
+        if (refIdx && *refIdx == i)
+        {
+            mRefidToIdxMap.erase(slot->backRefId);
+        }
+        slot.reset();
+        mResidentCount--;
+        mChatdClient.mHistResident--;
+        evicted++;
+    }
+
+    mHistStats.evictions += evicted;
+    CHATID_LOG_DEBUG("evictHistory: evicted %zu messages from RAM, %zu left", evicted, mResidentCount);
 }
 
 Chat::Chat(Connection& conn, Id chatid, Listener* listener,
@@ -1446,6 +1824,7 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
         //no history in db
         mHasMoreHistoryInDb = false;
         mForwardStart = CHATD_IDX_RANGE_MIDDLE;
+        mHistory.reset(mForwardStart);
         CHATID_LOG_DEBUG("Db has no local history for chat");
         loadAndProcessUnsent();
     }
@@ -1454,6 +1833,7 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
         assert(info.newestDbIdx != CHATD_IDX_INVALID);
         mHasMoreHistoryInDb = true;
         mForwardStart = info.newestDbIdx + 1;
+        mHistory.reset(mForwardStart);
         CHATID_LOG_DEBUG("Db has local history: %s - %s (middle point: %u)",
             ID_CSTR(info.oldestDbId), ID_CSTR(info.newestDbId), mForwardStart);
         loadAndProcessUnsent();
@@ -1513,10 +1893,31 @@ Idx Chat::getHistoryFromDb(unsigned count)
 #define READ_8(varname, offset)\
     assert(offset==pos-base); uint8_t varname(buf.read<uint8_t>(pos)); pos+=1
 
+void Connection::wsSendQueueDrainedCb()
+{
+    CHATDS_LOG_DEBUG("Send queue drained, resuming output of chats");
+    for (auto& chatid: mChatIds)
+    {
+        Chat& chat = mChatdClient.chats(chatid);
+        if (chat.onlineState() == kChatStateOnline)
+        {
+            chat.flushOutputQueue();
+        }
+    }
+}
+
 void Connection::wsHandleMsgCb(char *data, size_t len)
 {
     mTsLastRecv = time(NULL);
+    // the frame is parsed in place, straight from the memory of the network layer.
+    // The commands sent in response to it (i.e. RECEIVED, SEEN, or the JOINs queued
+    // after a rejoin completes) go together in a single frame
+    auto wptr = weakHandle();
+    cork();
     execCommand(StaticBuffer(data, len));
+    if (wptr.deleted())
+        return;
+    uncork();
 }
 
 // inbound command processing
@@ -1596,9 +1997,17 @@ void Connection::execCommand(const StaticBuffer& buf)
                     ID_CSTR(chatid), Command::opcodeToStr(opcode), ID_CSTR(msgid),
                     ID_CSTR(userid), keyid, ts, updated);
 
+                Chat& chat = mChatdClient.chats(chatid);
+                if (opcode == OP_NEWMSG && chat.msgIndexFromId(msgid) != CHATD_IDX_INVALID)
+                {
+                    // don't copy the message out of the frame, it would be discarded
+                    CHATDS_LOG_WARNING("%s: Ignoring duplicated NEWMSG: msgid %s", ID_CSTR(chatid), ID_CSTR(msgid));
+                    break;
+                }
+
+                // the message outlives the frame: it's decrypted asynchronously and kept in history
                 std::unique_ptr<Message> msg(new Message(msgid, userid, ts, updated, msgdata, msglen, false, keyid));
                 msg->setEncrypted(Message::kEncryptedPending);
-                Chat& chat = mChatdClient.chats(chatid);
                 if (opcode == OP_MSGUPD)
                 {
                     chat.onMsgUpdated(msg.release());
@@ -1952,6 +2361,8 @@ void Chat::onHistDone()
     mFetchRequest.pop();
     if (fetchType == FetchType::kFetchMessages)
     {
+        CALL_DB(flushHistoryQueue);
+
         // We may be fetching from memory and db because of a resetHistFetch()
         // while fetching from server. In that case, we don't notify about
         // fetched messages and onHistDone()
@@ -2236,8 +2647,7 @@ void Chat::onEndCall(karere::Id userid, uint32_t clientid)
 
 void Chat::initChat()
 {
-    mBackwardList.clear();
-    mForwardList.clear();
+    clear();
     mIdToIndexMap.clear();
     if (mAttachmentNodes)
     {
@@ -2245,6 +2655,7 @@ void Chat::initChat()
     }
 
     mForwardStart = CHATD_IDX_RANGE_MIDDLE;
+    mHistory.reset(mForwardStart);
 
     mOldestKnownMsgId = 0;
     mLastSeenIdx = CHATD_IDX_INVALID;
@@ -2259,6 +2670,7 @@ void Chat::initChat()
     mEncryptionHalted = false;
     mDecryptNewHaltedAt = CHATD_IDX_INVALID;
     mDecryptOldHaltedAt = CHATD_IDX_INVALID;
+    mDecryptsAhead.clear();
     mRefidToIdxMap.clear();
 
     mHasMoreHistoryInDb = false;
@@ -2823,26 +3235,25 @@ void Chat::onLastReceived(Id msgid)
 {
     mLastReceivedId = msgid;
     CALL_DB(setLastReceived, msgid);
-    auto it = mIdToIndexMap.find(msgid);
-    if (it == mIdToIndexMap.end())
+    Idx idx = msgIndexFromId(msgid);
+    if (idx == CHATD_IDX_INVALID)
     { // we don't have that message in the buffer yet, so we don't know its index
-        Idx idx = mDbInterface->getIdxOfMsgidFromHistory(msgid);
-        if (idx != CHATD_IDX_INVALID)
+        Idx dbIdx = mDbInterface->getIdxOfMsgidFromHistory(msgid);
+        if (dbIdx != CHATD_IDX_INVALID)
         {
-            if ((mLastReceivedIdx != CHATD_IDX_INVALID) && (idx < mLastReceivedIdx))
+            if ((mLastReceivedIdx != CHATD_IDX_INVALID) && (dbIdx < mLastReceivedIdx))
             {
                 CHATID_LOG_ERROR("onLastReceived: Tried to set the index to an older message, ignoring");
-                CHATID_LOG_DEBUG("highnum() = %zu, mLastReceivedIdx = %zu, idx = %zu", highnum(), mLastReceivedIdx, idx);
+                CHATID_LOG_DEBUG("highnum() = %zu, mLastReceivedIdx = %zu, idx = %zu", highnum(), mLastReceivedIdx, dbIdx);
             }
             else
             {
-                mLastReceivedIdx = idx;
+                mLastReceivedIdx = dbIdx;
             }
         }
         return; //last-received is behind history in memory, so nothing to notify about
     }
 
-    auto idx = it->second;
     if (idx == mLastReceivedIdx)
         return; //probably set from db
     if (at(idx).userid != mChatdClient.myHandle())
@@ -2886,17 +3297,13 @@ void Chat::onLastReceived(Id msgid)
 
 void Chat::onLastSeen(Id msgid)
 {
-    Idx idx = CHATD_IDX_INVALID;
-
-    auto it = mIdToIndexMap.find(msgid);
-    if (it == mIdToIndexMap.end())  // msgid not loaded in RAM
+    Idx idx = msgIndexFromId(msgid);
+    if (idx == CHATD_IDX_INVALID)  // msgid not loaded in RAM
     {
         idx = mDbInterface->getIdxOfMsgidFromHistory(msgid);   // return CHATD_IDX_INVALID if not found in DB
     }
     else    // msgid is in RAM
     {
-        idx = it->second;
-
         if (at(idx).userid == mChatdClient.mMyHandle)
         {
             CHATID_LOG_WARNING("Last-seen points to a message by us, possibly the pointer was not set properly");
@@ -3022,45 +3429,26 @@ bool Chat::setMessageSeen(Idx idx)
 
 bool Chat::setMessageSeen(Id msgid)
 {
-    auto it = mIdToIndexMap.find(msgid);
-    if (it == mIdToIndexMap.end())
+    Idx idx = msgIndexFromId(msgid);
+    if (idx == CHATD_IDX_INVALID)
     {
         CHATID_LOG_WARNING("setMessageSeen: unknown msgid '%s'", ID_CSTR(msgid));
         return false;
     }
-    return setMessageSeen(it->second);
+    return setMessageSeen(idx);
 }
 
 int Chat::unreadMsgCount() const
 {
-    if (mLastSeenIdx == CHATD_IDX_INVALID)
-    {
-        if (mHaveAllHistory)
-        {
-            return mDbInterface->getUnreadMsgCountAfterIdx(mLastSeenIdx);
-        }
-        else
-        {
-            return -mDbInterface->getUnreadMsgCountAfterIdx(CHATD_IDX_INVALID);
-        }
-    }
-    else if (mLastSeenIdx < lownum())
-    {
-        return mDbInterface->getUnreadMsgCountAfterIdx(mLastSeenIdx);
-    }
+    // the db keeps a counter of unread messages after the last-seen one, so there's
+    // no need to iterate over the history in RAM
+    int count = mDbInterface->getUnreadMsgCountAfterIdx(mLastSeenIdx);
+    return (mLastSeenIdx == CHATD_IDX_INVALID && !mHaveAllHistory) ? -count : count;
+}
 
-    Idx first = mLastSeenIdx+1;
-    unsigned count = 0;
-    auto last = highnum();
-    for (Idx i=first; i<=last; i++)
-    {
-        auto& msg = at(i);
-        if (msg.isValidUnread(mChatdClient.myHandle()))
-        {
-            count++;
-        }
-    }
-    return count;
+bool Chat::checkUnreadCount()
+{
+    return mDbInterface->checkUnreadCount();
 }
 
 void Chat::flushOutputQueue(bool fromStart)
@@ -3070,6 +3458,13 @@ void Chat::flushOutputQueue(bool fromStart)
 
     while (mNextUnsent != mSending.end())
     {
+        if (mConnection.wsIsSendQueueFull())
+        {
+            // resumed by Connection::wsSendQueueDrainedCb()
+            CHATID_LOG_DEBUG("Send queue is congested, postponing output");
+            return;
+        }
+
         //kickstart encryption
         //return true if we encrypted at least one message
         if (!msgEncryptAndSend(mNextUnsent++))
@@ -3497,12 +3892,10 @@ void Chat::onMsgUpdated(Message* cipherMsg)
                 msg->type = msg->buf()[1] + Message::Type::kMsgOffset;
         }
 
-        //update in memory, if loaded
-        auto msgit = mIdToIndexMap.find(msg->id());
-        Idx idx;
-        if (msgit != mIdToIndexMap.end())   // message is loaded in RAM
+        //update in memory, if loaded (or evicted from RAM, but in the range of the history buffer)
+        Idx idx = msgIndexFromId(msg->id());
+        if (idx != CHATD_IDX_INVALID)   // message is loaded in RAM
         {
-            idx = msgit->second;
             auto& histmsg = at(idx);
             unsigned char histType = histmsg.type;
 
@@ -3726,17 +4119,25 @@ Id Chat::makeRandomId()
 
 void Chat::deleteMessagesBefore(Idx idx)
 {
-    //delete everything before idx, but not including idx
-    if (idx > mForwardStart)
+    CALL_DB(flushHistoryQueue);    // the queued messages are the ones in RAM
+    size_t deleted = 0;
+    for (Idx i = lownum(); i < idx; i++)
     {
-        mBackwardList.clear();
-        auto delCount = idx-mForwardStart;
-        mForwardList.erase(mForwardList.begin(), mForwardList.begin()+delCount);
-        mForwardStart += delCount;
+        std::unique_ptr<Message>* slot = slotOrNull(i);
+        if (slot && *slot)
+        {
+            deleted++;
+        }
     }
-    else
+    mResidentCount -= deleted;
+    mChatdClient.mHistResident -= deleted;
+
+    //delete everything before idx, but not including idx
+    mDecryptsAhead.erase(mDecryptsAhead.begin(), mDecryptsAhead.lower_bound(idx));
+    mHistory.eraseBelow(idx);
+    if (idx > mForwardStart)
     {
-        mBackwardList.erase(mBackwardList.begin()+mForwardStart-idx, mBackwardList.end());
+        mForwardStart = idx;
     }
 }
 
@@ -3790,11 +4191,15 @@ Idx Chat::msgIncoming(bool isNew, Message* message, bool isLocal)
 
     if (isNew)
     {
-        auto it = mIdToIndexMap.find(message->id());
-        if (it != mIdToIndexMap.end())  // message already received
+        // duplicated NEWMSGs are the newest messages, which are never evicted from RAM,
+        // so there's no need to look them up in db
+        const Idx* dupIdx = mIdToIndexMap.find(message->id());
+        if (dupIdx)  // message already received
         {
-            CHATID_LOG_WARNING("Ignoring duplicated NEWMSG: msgid %s, idx %d", ID_CSTR(it->first), it->second);
-            return it->second;
+            Idx ret = *dupIdx;
+            CHATID_LOG_WARNING("Ignoring duplicated NEWMSG: msgid %s, idx %d", ID_CSTR(message->id()), ret);
+            delete message;
+            return ret;
         }
 
         push_forward(message);
@@ -3887,10 +4292,16 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         }
         return true;    // decrypt was not done immediately, but none checks the returned value in this codepath
     }
-    else
+
+    auto ahead = mDecryptsAhead.find(idx);
+    if (ahead != mDecryptsAhead.end())
     {
-        assert(msg.isPendingToDecrypt()); //no decrypt attempt was made
+        // decryption was started while it was halted, now it's the turn of its result
+        auto pms = ahead->second;
+        mDecryptsAhead.erase(ahead);
+        return msgIncomingDecrypting(pms, isNew, isLocal, msg, idx);
     }
+    assert(msg.isPendingToDecrypt()); //no decrypt attempt was made
 
     try
     {
@@ -3916,6 +4327,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         if (mDecryptNewHaltedAt != CHATD_IDX_INVALID)
         {
             CHATID_LOG_DEBUG("Decryption of new messages is halted, message queued for decryption");
+            decryptAhead(msg, idx);
             return false;
         }
     }
@@ -3924,11 +4336,29 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         if (mDecryptOldHaltedAt != CHATD_IDX_INVALID)
         {
             CHATID_LOG_DEBUG("Decryption of old messages is halted, message queued for decryption");
+            decryptAhead(msg, idx);
             return false;
         }
     }
     CHATD_LOG_CRYPTO_CALL("Calling ICrypto::decrypt()");
     auto pms = mCrypto->msgDecrypt(&msg);
+    return msgIncomingDecrypting(pms, isNew, isLocal, msg, idx);
+}
+
+void Chat::decryptAhead(Message& msg, Idx idx)
+{
+    if ((mDecryptsAhead.size() >= kMaxDecryptsAhead) || !msg.isPendingToDecrypt()
+        || mDecryptsAhead.count(idx))
+    {
+        return;
+    }
+    CHATD_LOG_CRYPTO_CALL("Calling ICrypto::decrypt() ahead of order");
+    mDecryptsAhead.emplace(idx, mCrypto->msgDecrypt(&msg));
+}
+
+// Handles the result of a decryption, which may be delayed
+bool Chat::msgIncomingDecrypting(promise::Promise<Message*>& pms, bool isNew, bool isLocal, Message& msg, Idx idx)
+{
     if (pms.succeeded())
     {
         assert(!msg.isEncrypted());
@@ -3942,6 +4372,22 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
     else
         mDecryptOldHaltedAt = idx;
 
+    // meanwhile, start the decryption of the messages queued after this one
+    if (isNew)
+    {
+        for (Idx i = idx + 1; (i <= highnum()) && (mDecryptsAhead.size() < kMaxDecryptsAhead); i++)
+        {
+            decryptAhead(at(i), i);
+        }
+    }
+    else
+    {
+        for (Idx i = idx - 1; (i >= lownum()) && (mDecryptsAhead.size() < kMaxDecryptsAhead); i--)
+        {
+            decryptAhead(at(i), i);
+        }
+    }
+
     auto message = &msg;
     pms.fail([this, message](const ::promise::Error& err) -> ::promise::Promise<Message*>
     {
@@ -4082,7 +4528,15 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
         }
 
         verifyMsgOrder(msg, idx);
-        CALL_DB(addMsgToHistory, msg, idx);
+        if (isFetchingFromServer() && !isServerFetchDecrypting())
+        {
+            // history burst (JOINRANGEHIST/HIST): written in batches, flushed upon HISTDONE
+            CALL_DB(queueMsgToHistory, msg, idx, isNew);
+        }
+        else
+        {
+            CALL_DB(addMsgToHistory, msg, idx);
+        }
 
         if (mChatdClient.isMessageReceivedConfirmationActive() && !isGroup() &&
                 (msg.userid != mChatdClient.mMyHandle) && // message is not ours
@@ -4243,10 +4697,10 @@ void Chat::verifyMsgOrder(const Message& msg, Idx idx)
 {
     for (auto refid: msg.backRefs)
     {
-        auto it = mRefidToIdxMap.find(refid);
-        if (it == mRefidToIdxMap.end())
+        const Idx* refIdx = mRefidToIdxMap.find(refid);
+        if (!refIdx)
             continue;
-        Idx targetIdx = it->second;
+        Idx targetIdx = *refIdx;
         if (targetIdx >= idx)
         {
             CALL_LISTENER(onMsgOrderVerificationFail, msg, idx, "Message order verification failed, possible history tampering");
@@ -4350,6 +4804,7 @@ void Chat::onJoinComplete()
     mEncryptionHalted = false;
     setOnlineState(kChatStateOnline);
     flushOutputQueue(true); //flush encrypted messages
+    mConnection.onRejoinComplete(mChatId);
 
     if (mIsFirstJoin)
     {
@@ -4792,6 +5247,92 @@ bool Message::isValidEmail(const string &buf)
     return regex_match(buf, regularExpresion);
 }
 
+std::string Message::searchableText() const
+{
+    if (empty())
+        return std::string();
+
+    switch (type)
+    {
+        case kMsgNormal:
+            return std::string(buf(), dataSize());
+
+        case kMsgContainsMeta:
+        {
+            std::string json = containsMetaJson();
+            rapidjson::Document document;
+            document.Parse(json.c_str());
+            if (document.HasParseError() || !document.IsObject())
+                return std::string();
+
+            auto it = document.FindMember("textMessage");
+            return (it != document.MemberEnd() && it->value.IsString()) ? it->value.GetString() : std::string();
+        }
+
+        case kMsgAttachment:
+        case kMsgVoiceClip:
+        case kMsgContact:
+        {
+            // skip the 2-byte binary prefix
+            if (dataSize() <= 2)
+                return std::string();
+            std::string json(buf() + 2, dataSize() - 2);
+            rapidjson::Document document;
+            document.Parse(json.c_str());
+            if (document.HasParseError() || !document.IsArray())
+                return std::string();
+
+            std::string text;
+            for (rapidjson::SizeType i = 0; i < document.Size(); i++)
+            {
+                const rapidjson::Value& item = document[i];
+                if (!item.IsObject())
+                    continue;
+                for (const char* field: {"name", "email"})
+                {
+                    auto it = item.FindMember(field);
+                    if (it != item.MemberEnd() && it->value.IsString())
+                    {
+                        text.append(it->value.GetString()).push_back(' ');
+                    }
+                }
+            }
+            return text;
+        }
+
+        default:
+            return std::string();
+    }
+}
+
+void Message::splitSearchTerms(const std::string& text, std::set<std::string>& terms)
+{
+    std::string term;
+    for (size_t i = 0; i <= text.size(); i++)
+    {
+        unsigned char c = (i < text.size()) ? text[i] : 0;
+        if (isalnum(c) || c >= 0x80)   // non-ASCII chars are kept as part of the word
+        {
+            term.push_back((c < 0x80) ? tolower(c) : c);
+            continue;
+        }
+
+        if (term.size() >= kSearchTermMinLen)
+        {
+            if (term.size() > kSearchTermMaxLen)
+            {
+                // don't cut a multi-byte char in the middle
+                size_t len = kSearchTermMaxLen;
+                while (len && (term[len] & 0xC0) == 0x80)
+                    len--;
+                term.resize(len);
+            }
+            terms.insert(term);
+        }
+        term.clear();
+    }
+}
+
 FilteredHistory::FilteredHistory(DbInterface &db, Chat &chat)
     : mDb(&db), mChat(&chat), mListener(NULL)
 {
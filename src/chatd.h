@@ -12,6 +12,7 @@
 #include <base/timers.hpp>
 #include <base/trackDelete.h>
 #include <chatdMsg.h>
+#include <msgIndex.h>
 #include <url.h>
 #include <net/websocketsIO.h>
 #include <userAttrCache.h>
@@ -75,6 +76,18 @@ enum
 
 enum { kMaxMsgSize = 120000 };  // (in bytes)
 
+/** @brief Counters of the RAM history buffer of a chat, or of all chats of a client.
+ * Messages evicted from RAM to stay within the history budget are reloaded from
+ * the db when they are accessed again, which is counted as a fault.
+ */
+struct HistCacheStats
+{
+    uint64_t hits = 0;          ///< lookups of messages that were in RAM
+    uint64_t faults = 0;        ///< lookups of evicted messages, reloaded from db
+    uint64_t evictions = 0;     ///< messages evicted from RAM
+    size_t resident = 0;        ///< messages currently in RAM
+};
+
 class DbInterface;
 struct LastTextMsg;
 
@@ -394,7 +407,9 @@ public:
     {
         kIdleTimeout = 64,      // (in seconds) chatd closes connection after 48-64s of not receiving a response
         kEchoTimeout = 1,       // (in seconds) echo to check connection is alive when back to foreground
-        kConnectTimeout = 30    // (in seconds) timeout reconnection to succeeed
+        kConnectTimeout = 30,   // (in seconds) timeout reconnection to succeeed
+        kRejoinStallTimeout = 10,   // (in seconds) rejoins in flight with no progress are given up, to send the queued ones
+        kMaxCorkedFrameSize = 32768 // corked commands are flushed when they reach this size
     };
 
 protected:
@@ -426,9 +441,6 @@ protected:
     /** Target IP address being used for the reconnection in-flight */
     std::string mTargetIp;
 
-    /** ip version to try first (both are tried) */
-    bool usingipv6 = false;
-
     /** RetryController that manages the reconnection's attempts */
     std::unique_ptr<karere::rh::IRetryController> mRetryCtrl;
 
@@ -445,11 +457,35 @@ protected:
 
     /** Handler of the timeout for the connection establishment */
     megaHandle mConnectTimer = 0;
+
+    /** While corked (see cork()), outgoing commands are appended here instead of being sent */
+    Buffer mCorkBuf;
+    int mCorkCount = 0;
+
+    /** Chats waiting to be rejoined after a reconnection, in priority order, and the ones
+     * whose JOIN/JOINRANGEHIST was sent but haven't completed it yet */
+    std::deque<karere::Id> mRejoinQueue;
+    std::set<karere::Id> mRejoinsInFlight;
+    megaHandle mRejoinStallTimer = 0;
+
+    /** Timestamps (ms) of the start of the ongoing reconnection and of its connection
+     * establishment, to measure the time until all the chats are online again */
+    int64_t mReconnectStartTs = 0;
+    int64_t mConnectedTs = 0;
+    int64_t mLastRejoinLatency = -1;
+
+    /** Timestamps (ms) of the start of the current connection attempt (including DNS
+     * resolution), and of its socket connection, to measure the time until the websocket
+     * is established */
+    int64_t mConnectStartTs = 0;
+    int64_t mSocketConnectTs = 0;
+    int64_t mLastConnectLatency = -1;
     
     // ---- callbacks called from libwebsocketsIO ----
     virtual void wsConnectCb();
     virtual void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
     virtual void wsHandleMsgCb(char *data, size_t len);
+    virtual void wsSendQueueDrainedCb();
 
     void onSocketClose(int ercode, int errtype, const std::string& reason);
     promise::Promise<void> reconnect();
@@ -458,7 +494,11 @@ protected:
     void doConnect();
 // Destroys the buffer content
     bool sendBuf(Buffer&& buf);
+    bool flushCorked();
     bool rejoinExistingChats();
+    void sendQueuedRejoins();
+    void onRejoinComplete(karere::Id chatid);
+    void resetRejoins();
     void resendPending();
     void join(karere::Id chatid);
     void hist(karere::Id chatid, long count);
@@ -483,6 +523,21 @@ public:
 
     int shardNo() const;
     promise::Promise<void> sendSync();
+
+    /** @brief Holds the outgoing commands until uncork() is called, to send them
+     * together in as few websocket frames as possible. Calls can be nested, the
+     * commands are sent when the outermost uncork() is called. */
+    void cork();
+    void uncork();
+
+    /** Time (ms) from the start of the last reconnection until all its chats were
+     * online again, or -1 if no reconnection completed yet */
+    int64_t lastRejoinLatency() const { return mLastRejoinLatency; }
+
+    /** Time (ms) from the start of the last successful connection attempt, including
+     * the DNS resolution, until its websocket was established (before the login to
+     * chatd), or -1 if never connected */
+    int64_t lastConnectLatency() const { return mLastConnectLatency; }
 };
 
 enum ServerHistFetchState
@@ -664,8 +719,13 @@ struct ChatDbInfo;
 
 /** @brief Represents a single chatroom together with the message history.
  * Message sending is done by calling methods on this class.
- * The history buffer can grow in two directions and is always contiguous, i.e.
- * there are no "holes".
+ * The history buffer can grow in two directions and its range of indexes is always
+ * contiguous, i.e. there are no "holes". However, in order to stay within the
+ * history budget of the client, messages that are not needed may be evicted from
+ * RAM, leaving an empty slot. They are reloaded from db by \c findOrNull(), \c at()
+ * and \c msgIndexFromId(), which are therefore non-const: there are no const accessors
+ * of messages by index, so that no caller can miss an evicted message unknowingly.
+ * Eviction is disabled unless a history budget is set via \c Client::setHistoryBudget().
  */
 class Chat: public karere::DeleteTrackable
 {
@@ -725,14 +785,17 @@ public:
 protected:
     Connection& mConnection;
     karere::Id mChatId;
-    Idx mForwardStart;
-    std::vector<std::unique_ptr<Message>> mForwardList;
-    std::vector<std::unique_ptr<Message>> mBackwardList;
+    /** The index of the first message received after the initial load from db.
+     * Older messages are loaded below it, and newer are added above it */
+    Idx mForwardStart = CHATD_IDX_RANGE_MIDDLE;
+    /** The history buffer, indexed by message idx */
+    SlotRing<Message, Idx> mHistory;
     std::unique_ptr<FilteredHistory> mAttachmentNodes;
     OutputQueue mSending;
     OutputQueue::iterator mNextUnsent;
     bool mIsFirstJoin = true;
-    std::map<karere::Id, Idx> mIdToIndexMap;
+    bool mIsOpen = false;
+    IdIndex<Idx> mIdToIndexMap;
     karere::Id mLastReceivedId;
     Idx mLastReceivedIdx = CHATD_IDX_INVALID;
     karere::Id mLastSeenId;
@@ -800,6 +863,13 @@ protected:
      * of new messages may work synchronously and not be delayed.
      */
     Idx mDecryptOldHaltedAt = CHATD_IDX_INVALID;
+
+    /** Decryptions of queued messages, started while decryption is halted, so that
+     * they proceed in parallel with the one that halted it (i.e. on the crypto
+     * worker threads). Their results are taken in order of index when processing
+     * of the queued messages resumes */
+    std::map<Idx, promise::Promise<Message*>> mDecryptsAhead;
+    enum { kMaxDecryptsAhead = 128 };
     uint32_t mLastMsgTs;
     bool mIsGroup;
     std::set<karere::Id> mMsgsToUpdateWithRichLink;
@@ -815,23 +885,42 @@ protected:
     /** True when node-attachments are pending to decrypt and history is truncated --> discard message being decrypted */
     bool mTruncateAttachment = false;
     // ====
-    std::map<karere::Id, Message*> mPendingEdits;
-    std::map<BackRefId, Idx> mRefidToIdxMap;
+    IdIndex<Message*> mPendingEdits;
+    IdIndex<Idx> mRefidToIdxMap;
+    /** Number of messages of the history buffer that are in RAM, i.e. not evicted */
+    size_t mResidentCount = 0;
+    /** Tick of the client's history clock of the last time the history of this chat
+     * was used. Chats that have not been used for longer are evicted first */
+    uint64_t mLastHistUse = 0;
+    bool mEvictionScheduled = false;
+    mutable HistCacheStats mHistStats;
     Chat(Connection& conn, karere::Id chatid, Listener* listener,
     const karere::SetOfIds& users, uint32_t chatCreationTs, ICrypto* crypto, bool isGroup);
-    void push_forward(Message* msg) { mForwardList.emplace_back(msg); }
-    void push_back(Message* msg) { mBackwardList.emplace_back(msg); }
-    void clear()
+    void push_forward(Message* msg);
+    void push_back(Message* msg);
+    void clear();
+    /** Returns the slot of the specified index in the history buffer, or \c nullptr
+     * if the index is out of range. The slot is empty if the message was evicted */
+    std::unique_ptr<Message>* slotOrNull(Idx num) const
     {
-        mBackwardList.clear();
-        mForwardList.clear();
+        return const_cast<std::unique_ptr<Message>*>(mHistory.slot(num));
     }
+    /** Reloads from db a chunk of evicted messages around the specified index */
+    Message* faultInMsg(Idx num);
+    [[noreturn]] void throwOutOfRange(Idx num) const;
+    /** Evicts messages from RAM, until no more than \c maxResident are left,
+     * or there are no more messages that can be evicted */
+    void evictHistory(size_t maxResident);
+    void scheduleHistoryEviction();
+    void touchHistory();
     // msgid can be 0 in case of rejections
     Idx msgConfirm(karere::Id msgxid, karere::Id msgid);
     bool msgAlreadySent(karere::Id msgxid, karere::Id msgid);
     Message* msgRemoveFromSending(karere::Id msgxid, karere::Id msgid);
     Idx msgIncoming(bool isNew, Message* msg, bool isLocal=false);
     bool msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx);
+    bool msgIncomingDecrypting(promise::Promise<Message*>& pms, bool isNew, bool isLocal, Message& msg, Idx idx);
+    void decryptAhead(Message& msg, Idx idx);
     void msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx idx);
     bool msgNodeHistIncoming(Message* msg);
     void onUserJoin(karere::Id userid, Priv priv);
@@ -886,19 +975,22 @@ public:
     Client& client() const { return mChatdClient; }
     Connection& connection() const { return mConnection; }
     /** @brief The lowest index of a message in the RAM history buffer */
-    Idx lownum() const { return mForwardStart - (Idx)mBackwardList.size(); }
+    Idx lownum() const { return mHistory.low(); }
     /** @brief The highest index of a message in the RAM history buffer */
-    Idx highnum() const { return mForwardStart + (Idx)mForwardList.size()-1;}
+    Idx highnum() const { return mHistory.high(); }
     /** @brief Needed only for debugging purposes */
     Idx forwardStart() const { return mForwardStart; }
     /** The number of messages currently in the history buffer (in RAM).
      * @note Note that there may be more messages in history db, but not loaded
      * into memory*/
-    Idx size() const { return mForwardList.size() + mBackwardList.size(); }
+    Idx size() const { return (Idx)mHistory.size(); }
     /** @brief Whether we have any messages in the history buffer */
-    bool empty() const { return mForwardList.empty() && mBackwardList.empty();}
+    bool empty() const { return mHistory.empty(); }
     bool isDisabled() const { return mIsDisabled; }
     bool isFirstJoin() const { return mIsFirstJoin; }
+    /** Whether the app has the chat open. Open chats are rejoined first after a reconnection */
+    bool isOpen() const { return mIsOpen; }
+    void setOpen(bool open) { mIsOpen = open; }
     void disable(bool state) { mIsDisabled = state; }
     /** The index of the oldest decrypted message in the RAM history buffer.
      * This will be greater than lownum() if there are not-yet-decrypted messages
@@ -942,7 +1034,7 @@ public:
       *  This can be used by the app to replace the text of messages who have
       * been edited before they have been sent/confirmed. Normally the app needs
       * to display the edited text in the unsent message.*/
-    const std::map<karere::Id, Message*>& pendingEdits() const { return mPendingEdits; }
+    const IdIndex<Message*>& pendingEdits() const { return mPendingEdits; }
 
     /** @brief Whether the listener will be notified upon receiving
      * old history messages from the server.
@@ -987,39 +1079,32 @@ public:
 
     /** @brief
      * Get the message with the specified index, or \c NULL if that
-     * index is out of range
+     * index is out of range. If the message was evicted from RAM, it's
+     * reloaded from db.
      */
-    inline Message* findOrNull(Idx num) const
+    inline Message* findOrNull(Idx num)
     {
-        if (num < mForwardStart) //look in mBackwardList
+        std::unique_ptr<Message>* slot = slotOrNull(num);
+        if (!slot)
+            return nullptr;
+        if (*slot)
         {
-            Idx idx = mForwardStart - num - 1; //always >= 0
-            if (static_cast<size_t>(idx) >= mBackwardList.size())
-                return nullptr;
-            return mBackwardList[idx].get();
-        }
-        else
-        {
-            Idx idx = num - mForwardStart;
-            if (static_cast<size_t>(idx) >= mForwardList.size())
-                return nullptr;
-            return mForwardList[idx].get();
+            mHistStats.hits++;
+            return slot->get();
         }
+        return faultInMsg(num);
     }
 
     /**
-     * @brief Returns the message at the specified index in the RAM history buffer.
+     * @brief Returns the message at the specified index in the RAM history buffer,
+     * reloading it from db if it was evicted from RAM.
      * Throws if index is out of range
      */
-    Message& at(Idx num) const
+    Message& at(Idx num)
     {
         Message* msg = findOrNull(num);
         if (!msg)
-        {
-            throw std::runtime_error("Chat::operator[idx]: idx = "+
-                std::to_string(num)+" is outside of ["+std::to_string(lownum())+":"+
-                std::to_string(highnum())+"] range");
-        }
+            throwOutOfRange(num);
         return *msg;
     }
 
@@ -1027,31 +1112,31 @@ public:
      * @brief Returns the message at the specified index in the RAM history buffer.
      * Throws if index is out of range
      */
-    Message& operator[](Idx num) const { return at(num); }
+    Message& operator[](Idx num) { return at(num); }
 
     /** @brief Returns whether the specified RAM history buffer index is valid or out
      * of range
      */
-    bool hasNum(Idx num) const
-    {
-        if (num < mForwardStart)
-            return (static_cast<size_t>(mForwardStart - num) <= mBackwardList.size());
-        else
-            return (num < mForwardStart + static_cast<int>(mForwardList.size()));
-    }
+    bool hasNum(Idx num) const { return mHistory.has(num); }
 
     /**
      * @brief Returns the index of the message with the specified msgid.
      * @param msgid The message id whose index to find
      * @returns The index of the message inside the RAM history buffer.
      *  If no such message exists in the RAM history buffer, CHATD_IDX_INVALID
-     * is returned
+     * is returned. Messages evicted from RAM are looked up in db.
      */
-    Idx msgIndexFromId(karere::Id msgid) const
-    {
-        auto it = mIdToIndexMap.find(msgid);
-        return (it == mIdToIndexMap.end()) ? CHATD_IDX_INVALID : it->second;
-    }
+    Idx msgIndexFromId(karere::Id msgid);
+
+    /**
+     * @brief Same as \c msgIndexFromId(), but it never accesses the db:
+     * CHATD_IDX_INVALID is returned also for the messages evicted from RAM.
+     * Only for callers that can't reach evicted messages, or handle them.
+     */
+    Idx residentMsgIndexFromId(karere::Id msgid) const;
+
+    /** @brief The counters of the RAM history buffer of this chat */
+    HistCacheStats historyCacheStats() const;
 
     /**
      * @brief Returns the message with specific msgid that it's stored at node history
@@ -1175,6 +1260,10 @@ public:
       */
     int unreadMsgCount() const;
 
+    /** @brief Checks the unread counter maintained by the db against a full count of
+     * the unread messages in history, for testing purposes. */
+    bool checkUnreadCount();
+
     /** @brief Returns the text of the most-recent message in the chat that can
      * be displayed as text in the chat list. If it is not found in RAM,
      * the database will be queried. If not found there as well, server is queried,
@@ -1265,10 +1354,10 @@ public:
     void requestNodeHistoryFromServer(karere::Id oldestMsgid, uint32_t count);
 
     /** Returns oldest message in  the history buffer*/
-    Message* oldest() const;
+    Message* oldest();
 
     /** Returns newest message in  the history buffer*/
-    Message* newest() const;
+    Message* newest();
 
     /** Returns true when fetch in-flight is a NODEHIST */
     bool isFetchingNodeHistory() const;
@@ -1312,6 +1401,8 @@ public:
 
 class Client
 {
+public:
+    enum: size_t { kDefaultHistChatBudget = 0, kDefaultHistGlobalBudget = 0, kDefaultMaxRejoinsInFlight = 100 };
 protected:
     karere::Id mMyHandle;
 
@@ -1321,6 +1412,16 @@ protected:
     // maps a chatid to the handling Shard connection
     std::map<karere::Id, Connection*> mConnectionForChatId;
 
+    // max number of history messages kept in RAM per chat and for all chats (0 = unlimited)
+    size_t mHistChatBudget = kDefaultHistChatBudget;
+    size_t mHistGlobalBudget = kDefaultHistGlobalBudget;
+    // total number of history messages in RAM
+    size_t mHistResident = 0;
+    // max number of chats of a shard rejoining at the same time after a reconnection (0 = unlimited)
+    size_t mMaxRejoinsInFlight = kDefaultMaxRejoinsInFlight;
+    // incremented every time the history of a chat is used, to find the least recently used
+    uint64_t mHistClock = 0;
+
     // maps chatids to the Chat object
     std::map<karere::Id, std::shared_ptr<Chat>> mChatForChatId;
 
@@ -1338,6 +1439,9 @@ protected:
     // to track changes in the richPreview's user-attribute
     karere::UserAttrCache::Handle mRichPrevAttrCbHandle;
 
+    /** Evicts history messages of \c chat, and of other chats if the global budget is exceeded */
+    void enforceHistoryBudget(Chat& chat);
+
     bool onMsgAlreadySent(karere::Id msgxid, karere::Id msgid);
     void msgConfirm(karere::Id msgxid, karere::Id msgid);
     void sendKeepalive();
@@ -1403,6 +1507,21 @@ public:
     // True if clients send confirmation to chatd when they receive a new message
     bool isMessageReceivedConfirmationActive() const;
 
+    /** @brief Sets the max number of history messages kept in RAM for each chat and
+     * for all chats together. Messages beyond the budget that are not needed are
+     * evicted, and reloaded from db on demand. Zero means unlimited.
+     */
+    void setHistoryBudget(size_t perChat, size_t global);
+
+    /** @brief Sets the max number of chats of a shard that are rejoined at the same
+     * time after a reconnection. The rest are rejoined as the previous ones complete
+     * their join, the open chats and the ones with unread messages first. Zero means unlimited.
+     */
+    void setMaxRejoinsInFlight(size_t max);
+
+    /** @brief The counters of the RAM history buffers of all chats */
+    HistCacheStats historyCacheStats() const;
+
     // The timestamps of the most recent message from userid
     mega::m_time_t getLastMsgTs(karere::Id userid) const;
     void setLastMsgTs(karere::Id userid, mega::m_time_t lastMsgTs);
@@ -1456,6 +1575,21 @@ public:
     /// adds a message to the history buffer at the specified \c idx
     virtual void addMsgToHistory(const Message& msg, Idx idx) = 0;
 
+    /**
+     * @brief Queues a message to be added to the history buffer at the specified \c idx.
+     * Queued messages are written in a single batch by \c flushHistoryQueue(), or earlier
+     * if the queue grows too big or too old. Any other access to the history flushes the
+     * queue first, so the queued messages are always visible to the rest of methods.
+     * The message is not copied: it must stay in the RAM history buffer, unchanged, until
+     * the queue is flushed. The chat flushes it before releasing any message from RAM.
+     * @param isNew Whether the message extends the history forwards (NEWMSG) or
+     * backwards (OLDMSG). Messages of each direction must be queued in order of idx.
+     */
+    virtual void queueMsgToHistory(const Message& msg, Idx idx, bool isNew) = 0;
+
+    /// writes to the history buffer all the messages queued by \c queueMsgToHistory()
+    virtual void flushHistoryQueue() = 0;
+
     /// update a message in the history buffer with the specified \c msgid
     virtual void updateMsgInHistory(karere::Id msgid, const Message& msg) = 0;
 
@@ -1519,6 +1653,9 @@ public:
     virtual Idx getOldestIdx() = 0;
     virtual Idx getIdxOfMsgidFromHistory(karere::Id msgid) = 0;
     virtual Idx getUnreadMsgCountAfterIdx(Idx idx) = 0;
+    /** @brief Checks the incrementally maintained unread counter against a full count
+     * of the history, for testing purposes. Returns false if they don't match. */
+    virtual bool checkUnreadCount() = 0;
     virtual void getLastTextMessage(Idx from, chatd::LastTextMsgState& msg) = 0;
     virtual void getMessageDelta(karere::Id msgid, uint16_t *updated) = 0;
 
@@ -5,18 +5,376 @@
 #include "chatd.h"
 //extern sqlite3* db;
 
+/** @brief State of a chat in the db, read in bulk for all chats at startup by
+ * \c ChatdSqliteDb::prefetchAll(), so that the initialization of every chat does not
+ * need to query the db. Each piece of info is used at most once, and all of it is
+ * discarded as soon as the chat writes to its history or pointers.
+ */
+struct ChatdDbPrefetch
+{
+    chatd::ChatDbInfo historyInfo;
+    karere::Id lastSeenId;
+    karere::Id lastRecvId;
+    chatd::Idx lastSeenIdx = CHATD_IDX_INVALID;
+    chatd::Idx lastRecvIdx = CHATD_IDX_INVALID;
+    bool haveAllHistory = false;
+    bool hasSendingItems = false;
+    bool hasManualSendItems = false;
+    bool hasLastTextMsg = false;
+    int unreadCount = -1;   // persisted unread counter, -1 if not available
+    uint8_t lastTextMsgType = chatd::Message::kMsgInvalid;
+    chatd::Idx lastTextMsgIdx = CHATD_IDX_INVALID;
+    uint32_t lastTextMsgTs = 0;
+    karere::Id lastTextMsgId;
+    karere::Id lastTextMsgUserid;
+    Buffer lastTextMsgData;
+    std::vector<std::pair<karere::Id, chatd::Priv>> peers;
+    ChatdDbPrefetch() { memset(&historyInfo, 0, sizeof(historyInfo)); }
+};
+typedef std::map<karere::Id, std::unique_ptr<ChatdDbPrefetch>> ChatdDbPrefetchMap;
+
+/** @brief A message found by \c ChatdSqliteDb::searchMessages() */
+struct ChatdSearchResult
+{
+    karere::Id chatid;
+    karere::Id msgid;
+    int score;      // number of words of the query found in the message
+    uint32_t ts;
+};
+
 class ChatdSqliteDb: public chatd::DbInterface
 {
+public:
+    // the queued messages are owned by the RAM history buffer of the chat, which flushes
+    // the queue before releasing any of them
+    typedef std::vector<std::pair<chatd::Idx, const chatd::Message*>> HistoryQueue;
+    enum
+    {
+        kHistQueueMaxSize = 512,    // max number of messages queued before flushing them to db
+        kHistQueueMaxAge = 2,       // max time (in seconds) a message is queued before flushing to db
+        kMaxVarsPerStmt = 999,      // SQLITE_MAX_VARIABLE_NUMBER of older sqlite versions
+        kHistInsertChunkRows = kMaxVarsPerStmt / 11,   // rows of the multi-row inserts to history
+        kTermInsertChunkRows = kMaxVarsPerStmt / 3,    // rows of the multi-row inserts to the search index
+        kMaxSearchTerms = 8         // max number of words of a search query, the rest are ignored
+    };
+
 protected:
     SqliteDb& mDb;
     chatd::Chat& mChat;
     std::string mSendingTblName;
     std::string mHistTblName;
+    HistoryQueue mOldHistQueue;     // old history, in descending order of idx
+    HistoryQueue mNewHistQueue;     // new history, in ascending order of idx
+    time_t mHistQueueTs = 0;        // when the oldest message of the queues was queued
+    enum: uint8_t
+    {
+        kPrefetchHistoryInfo = 0x01,
+        kPrefetchHaveAllHistory = 0x02,
+        kPrefetchSending = 0x04,
+        kPrefetchManualSending = 0x08,
+        kPrefetchLastTextMsg = 0x10,
+        kPrefetchAll = 0x1f
+    };
+    std::unique_ptr<ChatdDbPrefetch> mPrefetch;
+    uint8_t mPrefetchUnused = 0;  // bitmask of kPrefetchXXX items not used yet
+    bool usePrefetch(uint8_t item)
+    {
+        if (!mPrefetch || !(mPrefetchUnused & item))
+            return false;
+        mPrefetchUnused &= ~item;
+        return true;
+    }
+    void dropPrefetch() { mPrefetch.reset(); }
+
+    // Unread counter, kept up to date on every write to history, so reading it
+    // doesn't need to scan the history. It's persisted in chat_vars as 'unread_count'
+    int mUnreadCount = -1;                          // -1: not loaded from db yet
+    chatd::Idx mUnreadAfterIdx = CHATD_IDX_INVALID; // idx of the last-seen msg, only msgs after it are counted
+    karere::Id mUnreadLastSeenId;
+    void loadUnreadAfterIdx()
+    {
+        SqliteStmt stmt(mDb, "select c.last_seen, "
+            "(select idx from history where chatid = c.chatid and msgid = c.last_seen) "
+            "from chats c where c.chatid = ?");
+        stmt << mChat.chatId();
+        stmt.stepMustHaveData("loadUnreadAfterIdx");
+        mUnreadLastSeenId = stmt.uint64Col(0);
+        mUnreadAfterIdx = (sqlite3_column_type(stmt, 1) != SQLITE_NULL) ? stmt.intCol(1) : CHATD_IDX_INVALID;
+    }
+    /** Loads the unread counter, if not loaded yet. It must be called before writing
+     * to history, so the counter is updated from the state previous to the change */
+    void loadUnreadCount()
+    {
+        if (mUnreadCount >= 0)
+            return;
+
+        loadUnreadAfterIdx();
+        SqliteStmt stmt(mDb, "select value from chat_vars where chatid = ? and name = 'unread_count'");
+        stmt << mChat.chatId();
+        if (stmt.step() && sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+        {
+            mUnreadCount = stmt.intCol(0);
+        }
+        else    // not persisted yet (i.e. db created by an older version)
+        {
+            recountUnread();
+        }
+    }
+    void recountUnread()
+    {
+        mUnreadCount = countUnreadMsgsAfterIdx(mDb, mChat.chatId(), mChat.client().myHandle(), mUnreadAfterIdx);
+        saveUnreadCount();
+    }
+    void saveUnreadCount()
+    {
+        mDb.query("insert or replace into chat_vars(chatid, name, value) values(?, 'unread_count', ?)",
+                  mChat.chatId(), mUnreadCount);
+    }
+    /** Makes the unread counter count the msgs after \c idx. It's adjusted by the msgs
+     * between the previous last-seen msg and the new one, so moving the last-seen pointer
+     * doesn't count all the unread msgs again. The counter must be loaded. */
+    void setUnreadAfterIdx(chatd::Idx idx)
+    {
+        assert(mUnreadCount >= 0);
+        chatd::Idx oldIdx = mUnreadAfterIdx;
+        mUnreadAfterIdx = idx;
+        if (idx == oldIdx)
+            return;
+
+        if (idx == CHATD_IDX_INVALID)
+        {
+            // the last-seen msg is not in history, all msgs are unread
+            recountUnread();
+            return;
+        }
+
+        karere::Id myHandle = mChat.client().myHandle();
+        if (oldIdx == CHATD_IDX_INVALID || idx > oldIdx)
+        {
+            mUnreadCount -= countUnreadMsgsAfterIdx(mDb, mChat.chatId(), myHandle, oldIdx, idx);
+        }
+        else
+        {
+            mUnreadCount += countUnreadMsgsAfterIdx(mDb, mChat.chatId(), myHandle, idx, oldIdx);
+        }
+
+        if (mUnreadCount < 0)
+        {
+            CHATD_LOG_ERROR("chatid %s: setUnreadAfterIdx: unread counter is negative, counting the unread messages again",
+                mChat.chatId().toString().c_str());
+            recountUnread();
+            return;
+        }
+        saveUnreadCount();
+    }
+    bool isAfterUnreadIdx(chatd::Idx idx) const
+    {
+        return (mUnreadAfterIdx == CHATD_IDX_INVALID) || (idx > mUnreadAfterIdx);
+    }
 public:
     ChatdSqliteDb(chatd::Chat& chat, SqliteDb& db, const std::string& sendingTblName="sending", const std::string& histTblName="history")
         :mDb(db), mChat(chat), mSendingTblName(sendingTblName), mHistTblName(histTblName){}
+    ChatdSqliteDb(chatd::Chat& chat, SqliteDb& db, std::unique_ptr<ChatdDbPrefetch>&& prefetch)
+        :ChatdSqliteDb(chat, db)
+    {
+        mPrefetch = std::move(prefetch);
+        mPrefetchUnused = mPrefetch ? kPrefetchAll : 0;
+        if (mPrefetch && mPrefetch->unreadCount >= 0)
+        {
+            mUnreadCount = mPrefetch->unreadCount;
+            mUnreadAfterIdx = mPrefetch->lastSeenIdx;
+            mUnreadLastSeenId = mPrefetch->lastSeenId;
+        }
+    }
+    /**
+     * @brief Reads from \c db the state of all chats needed by their initialization,
+     * using a few queries for all chats instead of several queries per chat.
+     * @note It doesn't depend on any chat, so it can be run from a worker thread on
+     * its own connection to the db.
+     */
+    static void prefetchAll(SqliteDb& db, ChatdDbPrefetchMap& result)
+    {
+        SqliteStmt chats(db, "select c.chatid, c.last_seen, c.last_recv, "
+            "(select idx from history where chatid = c.chatid and msgid = c.last_seen), "
+            "(select idx from history where chatid = c.chatid and msgid = c.last_recv) from chats c");
+        while (chats.step())
+        {
+            std::unique_ptr<ChatdDbPrefetch> item(new ChatdDbPrefetch);
+            item->lastSeenId = chats.uint64Col(1);
+            item->lastRecvId = chats.uint64Col(2);
+            if (sqlite3_column_type(chats, 3) != SQLITE_NULL)
+                item->lastSeenIdx = chats.intCol(3);
+            if (sqlite3_column_type(chats, 4) != SQLITE_NULL)
+                item->lastRecvIdx = chats.intCol(4);
+            result[chats.uint64Col(0)] = std::move(item);
+        }
+
+        SqliteStmt range(db, "select r.chatid, r.hi, lo.msgid, hi.msgid from "
+            "(select chatid, min(idx) as lo, max(idx) as hi from history group by chatid) r "
+            "join history lo on lo.chatid = r.chatid and lo.idx = r.lo "
+            "join history hi on hi.chatid = r.chatid and hi.idx = r.hi");
+        while (range.step())
+        {
+            auto it = result.find(range.uint64Col(0));
+            if (it == result.end())
+                continue;
+            // same as getHistoryInfo(), info stays zeroed if there's no history
+            ChatdDbPrefetch& item = *it->second;
+            chatd::ChatDbInfo& info = item.historyInfo;
+            info.newestDbIdx = range.intCol(1);
+            info.oldestDbId = range.uint64Col(2);
+            info.newestDbId = range.uint64Col(3);
+            if (!info.newestDbId)
+            {
+                CHATD_LOG_WARNING("Db: Newest msgid in db is null, telling chatd we don't have local history");
+                info.oldestDbId = 0;
+            }
+            info.lastSeenId = item.lastSeenId;
+            info.lastRecvId = item.lastRecvId;
+        }
+
+        SqliteStmt vars(db, "select chatid from chat_vars where name='have_all_history' and value='1'");
+        while (vars.step())
+        {
+            auto it = result.find(vars.uint64Col(0));
+            if (it != result.end())
+                it->second->haveAllHistory = true;
+        }
+
+        SqliteStmt unread(db, "select chatid, value from chat_vars where name='unread_count'");
+        while (unread.step())
+        {
+            auto it = result.find(unread.uint64Col(0));
+            if (it != result.end() && sqlite3_column_type(unread, 1) != SQLITE_NULL)
+                it->second->unreadCount = unread.intCol(1);
+        }
+
+        SqliteStmt sending(db, "select distinct chatid from sending");
+        while (sending.step())
+        {
+            auto it = result.find(sending.uint64Col(0));
+            if (it != result.end())
+                it->second->hasSendingItems = true;
+        }
+
+        SqliteStmt manual(db, "select distinct chatid from manual_sending");
+        while (manual.step())
+        {
+            auto it = result.find(manual.uint64Col(0));
+            if (it != result.end())
+                it->second->hasManualSendItems = true;
+        }
+
+        SqliteStmt peers(db, "select chatid, userid, priv from chat_peers");
+        while (peers.step())
+        {
+            auto it = result.find(peers.uint64Col(0));
+            if (it != result.end())
+                it->second->peers.emplace_back(peers.uint64Col(1), (chatd::Priv)peers.intCol(2));
+        }
+
+        // same conditions as getLastTextMessage()
+        SqliteStmt last(db, "select h.chatid, h.type, h.idx, h.data, h.msgid, h.userid, h.ts from history h join "
+            "(select chatid, max(idx) as mx from history where "
+            "(length(data) > 0 OR type = ?1) and type != ?2 and type != ?3 group by chatid) l "
+            "on h.chatid = l.chatid and h.idx = l.mx");
+        last << chatd::Message::kMsgTruncate
+             << chatd::Message::kMsgRevokeAttachment
+             << chatd::Message::kMsgInvalid;
+        while (last.step())
+        {
+            auto it = result.find(last.uint64Col(0));
+            if (it == result.end())
+                continue;
+            ChatdDbPrefetch& item = *it->second;
+            item.hasLastTextMsg = true;
+            item.lastTextMsgType = last.intCol(1);
+            item.lastTextMsgIdx = last.intCol(2);
+            last.blobCol(3, item.lastTextMsgData);
+            item.lastTextMsgId = last.uint64Col(4);
+            item.lastTextMsgUserid = last.uint64Col(5);
+            item.lastTextMsgTs = last.uintCol(6);
+        }
+    }
+    /**
+     * @brief Reads the last text message, the timestamp of the last message and the unread
+     * count that a chat would report right after being loaded from db, without creating
+     * its chatd::Chat. The timestamp is the one of the last text message, or 0 if there is none.
+     * @param prefetch Optional, bulk-prefetched state of the chat. It saves some queries.
+     * @return false if the chat has messages pending to be sent. In that case, the
+     * last text message may be one of them, and the chatd::Chat should be created instead.
+     */
+    static bool loadSummary(SqliteDb& db, karere::Id chatid, karere::Id myHandle, const ChatdDbPrefetch* prefetch,
+                            chatd::LastTextMsgState& lastTextMsg, uint32_t& lastMsgTs, int& unreadCount)
+    {
+        chatd::Idx lastSeenIdx;
+        bool haveAllHistory;
+        int count = -1;
+        lastMsgTs = 0;
+        if (prefetch)
+        {
+            if (prefetch->hasSendingItems || prefetch->hasManualSendItems)
+                return false;
+
+            lastSeenIdx = prefetch->lastSeenIdx;
+            haveAllHistory = prefetch->haveAllHistory;
+            count = prefetch->unreadCount;
+            if (prefetch->hasLastTextMsg)
+            {
+                lastTextMsg.assign(prefetch->lastTextMsgData, prefetch->lastTextMsgType, prefetch->lastTextMsgId,
+                                   prefetch->lastTextMsgIdx, prefetch->lastTextMsgUserid);
+                lastMsgTs = prefetch->lastTextMsgTs;
+            }
+            else
+            {
+                lastTextMsg.clear();
+            }
+        }
+        else
+        {
+            SqliteStmt stmt(db, "select "
+                "exists(select 1 from sending where chatid = c.chatid) or exists(select 1 from manual_sending where chatid = c.chatid), "
+                "(select idx from history where chatid = c.chatid and msgid = c.last_seen), "
+                "exists(select 1 from chat_vars where chatid = c.chatid and name='have_all_history' and value='1'), "
+                "(select value from chat_vars where chatid = c.chatid and name='unread_count') "
+                "from chats c where c.chatid = ?");
+            stmt << chatid;
+            stmt.stepMustHaveData("loadSummary");
+            if (stmt.intCol(0))
+                return false;
+
+            lastSeenIdx = (sqlite3_column_type(stmt, 1) != SQLITE_NULL) ? stmt.intCol(1) : CHATD_IDX_INVALID;
+            haveAllHistory = stmt.intCol(2);
+            if (sqlite3_column_type(stmt, 3) != SQLITE_NULL)
+                count = stmt.intCol(3);
+            loadLastTextMessage(db, chatid, CHATD_IDX_INVALID, lastTextMsg, &lastMsgTs);
+        }
+
+        // same as chatd::Chat::unreadMsgCount()
+        unreadCount = (count >= 0) ? count : countUnreadMsgsAfterIdx(db, chatid, myHandle, lastSeenIdx);
+        if (lastSeenIdx == CHATD_IDX_INVALID && !haveAllHistory)
+            unreadCount = -unreadCount;
+        return true;
+    }
+    virtual ~ChatdSqliteDb()
+    {
+        try
+        {
+            flushHistoryQueue();
+        }
+        catch(std::exception& e)
+        {
+            CHATD_LOG_ERROR("chatid %s: Error writing queued history to db: %s", mChat.chatId().toString().c_str(), e.what());
+        }
+    }
     virtual void getHistoryInfo(chatd::ChatDbInfo& info)
     {
+        flushHistoryQueue();
+        if (usePrefetch(kPrefetchHistoryInfo))
+        {
+            info = mPrefetch->historyInfo;
+            return;
+        }
         SqliteStmt stmt(mDb, "select min(idx), max(idx) from history where chatid=?1");
         stmt.bind(mChat.chatId()).step(); //will always return a row, even if table empty
         auto minIdx = stmt.intCol(0); //WARNING: the chatd implementation uses uint32_t values for idx.
@@ -87,6 +445,7 @@ public:
 
     void addSendingItem(chatd::Chat::SendingItem& item)
     {
+        dropPrefetch();
         assert(item.msg);
         uint8_t opcode = item.opcode();
         assert((opcode == chatd::OP_NEWMSG)
@@ -147,10 +506,190 @@ public:
     }
     virtual void addMsgToHistory(const chatd::Message& msg, chatd::Idx idx)
     {
+        dropPrefetch();
+        flushHistoryQueue();
+        loadUnreadCount();
         addMessage(msg, idx, "history");
+        indexMessage(mDb, mChat.chatId(), msg.id(), msg);
+        if (isAfterUnreadIdx(idx) && msg.isValidUnread(mChat.client().myHandle()))
+        {
+            mUnreadCount++;
+            saveUnreadCount();
+        }
+        if (msg.id() == mUnreadLastSeenId)
+        {
+            // the last-seen msg is now known, only msgs after it are unread
+            setUnreadAfterIdx(idx);
+        }
+    }
+    virtual void queueMsgToHistory(const chatd::Message& msg, chatd::Idx idx, bool isNew)
+    {
+        dropPrefetch();
+        if (mOldHistQueue.empty() && mNewHistQueue.empty())
+        {
+            mHistQueueTs = time(NULL);
+        }
+
+        // NEWMSGs received during a burst of old history grow the history at the other end,
+        // so each direction has its own queue to keep the batches contiguous
+        HistoryQueue& queue = isNew ? mNewHistQueue : mOldHistQueue;
+        if (!queue.empty() && idx != queue.back().first + (isNew ? 1 : -1))
+        {
+            CHATD_LOG_WARNING("chatid %s: queueMsgToHistory: idx %d doesn't follow the queued messages, flushing them",
+                mChat.chatId().toString().c_str(), idx);
+            flushHistoryQueue();
+        }
+        queue.emplace_back(idx, &msg);
+        if (queue.size() >= (size_t)kHistQueueMaxSize || time(NULL) - mHistQueueTs >= kHistQueueMaxAge)
+        {
+            flushHistoryQueue();
+        }
+    }
+    virtual void flushHistoryQueue()
+    {
+        // clear the queues even if the write fails, to not retry (and fail) on every access to history
+        HistoryQueue oldQueue;
+        HistoryQueue newQueue;
+        oldQueue.swap(mOldHistQueue);
+        newQueue.swap(mNewHistQueue);
+        addMsgsToHistory(oldQueue);
+        addMsgsToHistory(newQueue);
+    }
+    static std::string historyInsertSql(size_t rows)
+    {
+        static const char* kRowParams = "(?,?,?,?,?,?,?,?,?,?,?)";
+        std::string sql("insert into history (idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) values");
+        sql.reserve(sql.size() + rows * (strlen(kRowParams) + 1));
+        for (size_t i = 0; i < rows; i++)
+        {
+            if (i)
+                sql += ',';
+            sql.append(kRowParams);
+        }
+        return sql;
+    }
+    void bindHistoryRow(SqliteStmt& stmt, chatd::Idx idx, const chatd::Message& msg)
+    {
+        stmt << idx << mChat.chatId() << msg.id() << msg.keyid
+             << msg.type << msg.userid << msg.ts << msg.updated << msg
+             << msg.backRefId << msg.isEncrypted();
+    }
+    /**
+     * @brief Adds a batch of messages to the history, using multi-row inserts inside
+     * a single transaction. The messages must be contiguous, either in ascending or descending
+     * order of idx (new or old history), and adjacent to the existing history.
+     */
+    void addMsgsToHistory(const HistoryQueue& msgs)
+    {
+        if (msgs.empty())
+            return;
+
+#ifndef NDEBUG
+        chatd::Idx lowIdx = std::min(msgs.front().first, msgs.back().first);
+        chatd::Idx highIdx = std::max(msgs.front().first, msgs.back().first);
+        if ((size_t)(highIdx - lowIdx + 1) != msgs.size())
+        {
+            CHATD_LOG_ERROR("chatid %s: addMsgsToHistory: batch is not contiguous: %d messages in range [%d, %d]",
+                mChat.chatId().toString().c_str(), (int)msgs.size(), lowIdx, highIdx);
+            assert(false);
+        }
+        SqliteStmt check(mDb, "select min(idx), max(idx), count(*) from history where chatid = ?");
+        check << mChat.chatId();
+        check.step();
+        if (check.intCol(2) > 0 && highIdx != check.intCol(0) - 1 && lowIdx != check.intCol(1) + 1)
+        {
+            CHATD_LOG_ERROR("chatid %s: addMsgsToHistory: history discontinuity detected: "
+                "batch [%d, %d] is not adjacent to neither end of db history [%d, %d]",
+                mChat.chatId().toString().c_str(), lowIdx, highIdx, check.intCol(0), check.intCol(1));
+            assert(false);
+        }
+#endif
+        loadUnreadCount();
+        SqliteBatch batch(mDb);
+        const size_t chunkRows = kHistInsertChunkRows;
+        size_t pos = 0;
+        if (msgs.size() >= chunkRows)
+        {
+            // always the same number of rows, so the statement is prepared only once
+            static const std::string chunkSql = historyInsertSql(chunkRows);
+            SqliteStmt stmt(mDb, chunkSql);
+            for (; msgs.size() - pos >= chunkRows; pos += chunkRows)
+            {
+                for (size_t i = pos; i < pos + chunkRows; i++)
+                {
+                    bindHistoryRow(stmt, msgs[i].first, *msgs[i].second);
+                }
+                stmt.step();
+                assertAffectedRowCount((int)chunkRows, "addMsgsToHistory");
+                stmt.reset().clearBind();
+            }
+        }
+        if (pos < msgs.size())
+        {
+            // the rest, one row at a time
+            static const std::string rowSql = historyInsertSql(1);
+            SqliteStmt stmt(mDb, rowSql);
+            for (; pos < msgs.size(); pos++)
+            {
+                bindHistoryRow(stmt, msgs[pos].first, *msgs[pos].second);
+                stmt.step();
+                assertAffectedRowCount(1, "addMsgsToHistory");
+                stmt.reset().clearBind();
+            }
+        }
+
+        SearchTerms terms;
+        for (auto& item: msgs)
+        {
+            collectSearchTerms(mChat.chatId(), item.second->id(), *item.second, terms);
+        }
+        insertSearchTerms(mDb, terms);
+
+        chatd::Idx lastSeenIdx = CHATD_IDX_INVALID;
+        int unread = 0;
+        karere::Id myHandle = mChat.client().myHandle();
+        for (auto& item: msgs)
+        {
+            const chatd::Message& msg = *item.second;
+            if (msg.id() == mUnreadLastSeenId)
+            {
+                lastSeenIdx = item.first;
+            }
+            if (msg.isValidUnread(myHandle))
+            {
+                unread++;
+            }
+        }
+        if (unread && isAfterUnreadIdx(msgs.front().first))
+        {
+            // the batch is contiguous and the last-seen msg is not before it, so either all
+            // of it is after the last-seen msg or none
+            mUnreadCount += unread;
+            saveUnreadCount();
+        }
+        if (lastSeenIdx != CHATD_IDX_INVALID)
+        {
+            // the last-seen msg is now known, only msgs after it are unread
+            setUnreadAfterIdx(lastSeenIdx);
+        }
+        batch.commit();
     }
     virtual void updateMsgInHistory(karere::Id msgid, const chatd::Message& msg)
     {
+        dropPrefetch();
+        flushHistoryQueue();
+        loadUnreadCount();
+
+        // check if the msg was counted as unread before the update
+        std::string query = std::string("select idx, ") + unreadMsgCond() + " from history where chatid = ?1 and msgid = ?11";
+        SqliteStmt stmt(mDb, query);
+        stmt << mChat.chatId();
+        bindUnreadMsgCond(stmt, mChat.client().myHandle());
+        stmt << msgid;
+        stmt.stepMustHaveData("updateMsgInHistory");
+        chatd::Idx idx = stmt.intCol(0);
+        bool wasUnread = stmt.intCol(1);
+
         if (msg.type == chatd::Message::kMsgTruncate)
         {
             mDb.query("update history set type = ?, data = ?, ts = ?, userid = ? where chatid = ? and msgid = ?",
@@ -162,10 +701,20 @@ public:
                 msg.type, msg, msg.updated, msg.userid, msg.isEncrypted(), mChat.chatId(), msgid);
         }
         assertAffectedRowCount(1, "updateMsgInHistory");
+
+        reindexMessage(mDb, mChat.chatId(), msgid, msg);
+
+        bool isUnread = msg.isValidUnread(mChat.client().myHandle());
+        if (isUnread != wasUnread && isAfterUnreadIdx(idx))
+        {
+            mUnreadCount += isUnread ? 1 : -1;
+            saveUnreadCount();
+        }
     }
 
     virtual void getMessageDelta(karere::Id msgid, uint16_t *updated)
     {
+        flushHistoryQueue();
         SqliteStmt stmt3(mDb, "select updated from history where chatid = ? and msgid = ?");
         stmt3 << mChat.chatId() << msgid;
         stmt3.stepMustHaveData();
@@ -174,6 +723,12 @@ public:
 
     virtual void loadSendQueue(chatd::Chat::OutputQueue& queue)
     {
+        if (usePrefetch(kPrefetchSending) && !mPrefetch->hasSendingItems)
+        {
+            queue.clear();
+            return;
+        }
+
         SqliteStmt stmt(mDb, "select rowid, opcode, msgid, keyid, msg, type, "
             "ts, updated, backrefid, backrefs, recipients, msg_cmd, key_cmd "
             "from sending where chatid=? order by rowid asc");
@@ -244,11 +799,20 @@ public:
     }
     virtual void fetchDbHistory(chatd::Idx idx, unsigned count, std::vector<chatd::Message*>& messages)
     {
+        flushHistoryQueue();
         loadMessages(count, idx, messages, "history");
     }
 
     virtual chatd::Idx getIdxOfMsgid(karere::Id msgid, const std::string &table)
     {
+        flushHistoryQueue();
+        if (mPrefetch && table == "history")
+        {
+            if (msgid == mPrefetch->lastSeenId)
+                return mPrefetch->lastSeenIdx;
+            if (msgid == mPrefetch->lastRecvId)
+                return mPrefetch->lastRecvIdx;
+        }
         std::string query = "select idx from " + table + " where chatid = ? and msgid = ?";
         SqliteStmt stmt(mDb, query.c_str());
         stmt << mChat.chatId() << msgid;
@@ -261,17 +825,38 @@ public:
     }
     virtual chatd::Idx getUnreadMsgCountAfterIdx(chatd::Idx idx)
     {
-        // get the unread messages count --> conditions should match the ones in Message::isValidUnread()
-        std::string sql = "select count(*) from history where (chatid = ?1)"
-                "and (userid != ?2)"
-                "and not (updated != 0 and length(data) = 0)"
-                "and (is_encrypted = ?3 or is_encrypted = ?4 or is_encrypted = ?5)"
-                "and (type = ?6 or type = ?7 or type = ?8 or type = ?9 or type = ?10)";
-        if (idx != CHATD_IDX_INVALID)
-            sql+=" and (idx > ?)";
+        flushHistoryQueue();
+        loadUnreadCount();
+        if (idx == mUnreadAfterIdx)
+            return mUnreadCount;
+
+        // the counter is relative to a different msg, i.e. the last-seen pointer was just changed
+        return countUnreadMsgsAfterIdx(mDb, mChat.chatId(), mChat.client().myHandle(), idx);
+    }
+    virtual bool checkUnreadCount()
+    {
+        flushHistoryQueue();
+        loadUnreadCount();
+        int count = countUnreadMsgsAfterIdx(mDb, mChat.chatId(), mChat.client().myHandle(), mUnreadAfterIdx);
+        if (count == mUnreadCount)
+            return true;
 
-        SqliteStmt stmt(mDb, sql);
-        stmt << mChat.chatId() << mChat.client().myHandle()   // skip own messages
+        CHATD_LOG_ERROR("chatid %s: checkUnreadCount: unread counter is %d, but there are %d unread messages after idx %d",
+            mChat.chatId().toString().c_str(), mUnreadCount, count, mUnreadAfterIdx);
+        return false;
+    }
+    /** Conditions for a message in history to be unread --> they should match the ones
+     * in Message::isValidUnread(). Params ?2 to ?10 are bound by bindUnreadMsgCond() */
+    static const char* unreadMsgCond()
+    {
+        return "(userid != ?2)"
+               " and not (updated != 0 and length(data) = 0)"
+               " and (is_encrypted = ?3 or is_encrypted = ?4 or is_encrypted = ?5)"
+               " and (type = ?6 or type = ?7 or type = ?8 or type = ?9 or type = ?10)";
+    }
+    static void bindUnreadMsgCond(SqliteStmt& stmt, karere::Id myHandle)
+    {
+        stmt << myHandle                                    // skip own messages
              << chatd::Message::kNotEncrypted               // include decrypted messages
              << chatd::Message::kEncryptedMalformed         // include encrypted messages due to malformed payload
              << chatd::Message::kEncryptedSignature         // include encrypted messages due to invalid signature
@@ -280,13 +865,31 @@ public:
              << chatd::Message::kMsgContact
              << chatd::Message::kMsgContainsMeta
              << chatd::Message::kMsgVoiceClip;
+    }
+    /** Counts the unread msgs after \c idx (all if invalid) and, if \c lastIdx is valid,
+     * up to \c lastIdx, included */
+    static int countUnreadMsgsAfterIdx(SqliteDb& db, karere::Id chatid, karere::Id myHandle, chatd::Idx idx,
+                                       chatd::Idx lastIdx = CHATD_IDX_INVALID)
+    {
+        std::string sql = std::string("select count(*) from history where (chatid = ?1) and ") + unreadMsgCond();
+        if (idx != CHATD_IDX_INVALID)
+            sql+=" and (idx > ?)";
+        if (lastIdx != CHATD_IDX_INVALID)
+            sql+=" and (idx <= ?)";
+
+        SqliteStmt stmt(db, sql);
+        stmt << chatid;
+        bindUnreadMsgCond(stmt, myHandle);
         if (idx != CHATD_IDX_INVALID)
             stmt << idx;
+        if (lastIdx != CHATD_IDX_INVALID)
+            stmt << lastIdx;
         stmt.stepMustHaveData("get peer msg count");
         return stmt.intCol(0);
     }
     virtual void saveItemToManualSending(const chatd::Chat::SendingItem& item, int reason)
     {
+        dropPrefetch();
         auto& msg = *item.msg;
         mDb.query("insert into manual_sending(chatid, rowid, msgid, type, "
             "ts, updated, msg, opcode, reason) values(?,?,?,?,?,?,?,?,?)",
@@ -295,6 +898,9 @@ public:
     }
     virtual void loadManualSendItems(std::vector<chatd::Chat::ManualSendItem>& items)
     {
+        if (usePrefetch(kPrefetchManualSending) && !mPrefetch->hasManualSendItems)
+            return;
+
         SqliteStmt stmt(mDb, "select rowid, msgid, type, ts, updated, msg, opcode, "
             "reason from manual_sending where chatid=? order by rowid asc");
         stmt << mChat.chatId();
@@ -332,11 +938,19 @@ public:
     }
     virtual void truncateHistory(const chatd::Message& msg)
     {
+        dropPrefetch();
+        flushHistoryQueue();
         auto idx = getIdxOfMsgidFromHistory(msg.id());
         if (idx == CHATD_IDX_INVALID)
             throw std::runtime_error("dbInterface::truncateHistory: msgid "+msg.id().toString()+" does not exist in db");
+        mDb.query("delete from history_terms where chatid = ?1 and msgid in "
+                  "(select msgid from history where chatid = ?1 and idx < ?2)", mChat.chatId(), idx);
         mDb.query("delete from history where chatid = ? and idx < ?", mChat.chatId(), idx);
 
+        // the last-seen msg may have been deleted
+        loadUnreadAfterIdx();
+        recountUnread();
+
 #ifndef NDEBUG
         SqliteStmt stmt(mDb, "select type from history where chatid=? and msgid=?");
         stmt << mChat.chatId() << msg.id();
@@ -347,6 +961,7 @@ public:
     }
     virtual chatd::Idx getOldestIdx()
     {
+        flushHistoryQueue();
         SqliteStmt stmt(mDb, "select min(idx) from history where chatid = ?");
         stmt << mChat.chatId();
         stmt.stepMustHaveData(__FUNCTION__);
@@ -354,16 +969,28 @@ public:
     }
     virtual void setLastSeen(karere::Id msgid)
     {
+        dropPrefetch();
+        flushHistoryQueue();
+        loadUnreadCount();  // relative to the previous last-seen msg
         mDb.query("update chats set last_seen=? where chatid=?", msgid, mChat.chatId());
         assertAffectedRowCount(1, "setLastSeen");
+
+        // only the msgs after the new last-seen one are counted
+        mUnreadLastSeenId = msgid;
+        SqliteStmt stmt(mDb, "select idx from history where chatid = ? and msgid = ?");
+        stmt << mChat.chatId() << msgid;
+        setUnreadAfterIdx(stmt.step() ? stmt.intCol(0) : CHATD_IDX_INVALID);
     }
     virtual void setLastReceived(karere::Id msgid)
     {
+        dropPrefetch();
         mDb.query("update chats set last_recv=? where chatid=?", msgid, mChat.chatId());
         assertAffectedRowCount(1);
     }
     virtual void setHaveAllHistory(bool haveAllHistory)
     {
+        dropPrefetch();
+        flushHistoryQueue();
         mDb.query(
             "insert or replace into chat_vars(chatid, name, value) "
             "values(?, 'have_all_history', ?)", mChat.chatId(), haveAllHistory ? 1 : 0);
@@ -371,6 +998,9 @@ public:
     }
     virtual bool haveAllHistory()
     {
+        if (usePrefetch(kPrefetchHaveAllHistory))
+            return mPrefetch->haveAllHistory;
+
         SqliteStmt stmt(mDb,
             "select value from chat_vars where chatid=? and name='have_all_history' and value='1'");
         stmt << mChat.chatId();
@@ -378,11 +1008,32 @@ public:
     }
     virtual void getLastTextMessage(chatd::Idx from, chatd::LastTextMsgState& msg)
     {
-        SqliteStmt stmt(mDb,
-            "select type, idx, data, msgid, userid from history where chatid=?1 and "
+        flushHistoryQueue();
+        if (usePrefetch(kPrefetchLastTextMsg))
+        {
+            if (!mPrefetch->hasLastTextMsg)
+            {
+                msg.clear();
+                return;
+            }
+            if (mPrefetch->lastTextMsgIdx <= from)
+            {
+                msg.assign(mPrefetch->lastTextMsgData, mPrefetch->lastTextMsgType, mPrefetch->lastTextMsgId,
+                           mPrefetch->lastTextMsgIdx, mPrefetch->lastTextMsgUserid);
+                return;
+            }
+            // the prefetched one is newer than 'from', so it's not the one requested
+        }
+        loadLastTextMessage(mDb, mChat.chatId(), from, msg);
+    }
+    static void loadLastTextMessage(SqliteDb& db, karere::Id chatid, chatd::Idx from, chatd::LastTextMsgState& msg,
+                                    uint32_t* ts = nullptr)
+    {
+        SqliteStmt stmt(db,
+            "select type, idx, data, msgid, userid, ts from history where chatid=?1 and "
             "(length(data) > 0 OR type = ?2) and type != ?3  and type != ?4 and (idx <= ?5)"
             "order by idx desc limit 1");
-        stmt << mChat.chatId()
+        stmt << chatid
              << chatd::Message::kMsgTruncate
              << chatd::Message::kMsgRevokeAttachment
              << chatd::Message::kMsgInvalid     // exclude (still) encrypted messages (theorically, they should not be stored in DB)
@@ -395,11 +1046,182 @@ public:
         Buffer buf(128);
         stmt.blobCol(2, buf);
         msg.assign(buf, stmt.intCol(0), stmt.uint64Col(3), stmt.intCol(1), stmt.uint64Col(4));
+        if (ts)
+            *ts = stmt.uintCol(5);
+    }
+
+    /** A row of the search index: a word of a message */
+    struct SearchTerm
+    {
+        karere::Id chatid;
+        karere::Id msgid;
+        std::string term;
+    };
+    typedef std::vector<SearchTerm> SearchTerms;
+
+    /** Appends to \c terms the words of the message, if it has any text */
+    static void collectSearchTerms(karere::Id chatid, karere::Id msgid, const chatd::Message& msg, SearchTerms& terms)
+    {
+        if (msg.isEncrypted() || msg.isDeleted())
+            return;
+
+        std::set<std::string> words;
+        chatd::Message::splitSearchTerms(msg.searchableText(), words);
+        for (auto& word: words)
+        {
+            terms.push_back({chatid, msgid, word});
+        }
+    }
+    static std::string termInsertSql(size_t rows)
+    {
+        std::string sql("insert or ignore into history_terms(term, chatid, msgid) values");
+        for (size_t i = 0; i < rows; i++)
+        {
+            sql.append(i ? ",(?,?,?)" : "(?,?,?)");
+        }
+        return sql;
+    }
+    /** Adds \c terms to the search index, using multi-row inserts, as addMsgsToHistory() does */
+    static void insertSearchTerms(SqliteDb& db, const SearchTerms& terms)
+    {
+        const size_t chunkRows = kTermInsertChunkRows;
+        size_t pos = 0;
+        if (terms.size() >= chunkRows)
+        {
+            static const std::string chunkSql = termInsertSql(chunkRows);
+            SqliteStmt stmt(db, chunkSql);
+            for (; terms.size() - pos >= chunkRows; pos += chunkRows)
+            {
+                for (size_t i = pos; i < pos + chunkRows; i++)
+                {
+                    stmt << terms[i].term << terms[i].chatid << terms[i].msgid;
+                }
+                stmt.step();
+                stmt.reset().clearBind();
+            }
+        }
+        if (pos < terms.size())
+        {
+            static const std::string rowSql = termInsertSql(1);
+            SqliteStmt stmt(db, rowSql);
+            for (; pos < terms.size(); pos++)
+            {
+                stmt << terms[pos].term << terms[pos].chatid << terms[pos].msgid;
+                stmt.step();
+                stmt.reset().clearBind();
+            }
+        }
+    }
+    /** Adds the words of the message to the search index, if it has any text */
+    static void indexMessage(SqliteDb& db, karere::Id chatid, karere::Id msgid, const chatd::Message& msg)
+    {
+        SearchTerms terms;
+        collectSearchTerms(chatid, msgid, msg, terms);
+        insertSearchTerms(db, terms);
+    }
+    /** Replaces the words of an edited or deleted message in the search index */
+    static void reindexMessage(SqliteDb& db, karere::Id chatid, karere::Id msgid, const chatd::Message& msg)
+    {
+        db.query("delete from history_terms where chatid = ? and msgid = ?", chatid, msgid);
+        indexMessage(db, chatid, msgid, msg);
+    }
+    /**
+     * @brief Builds the search index of all the history in db, i.e. after upgrading
+     * from a db version without it.
+     * @return The number of messages indexed
+     */
+    static int indexHistory(SqliteDb& db)
+    {
+        SqliteStmt stmt(db, "select chatid, msgid, userid, ts, updated, data, type from history "
+            "where is_encrypted = ?1 and type in (?2, ?3, ?4, ?5, ?6)");
+        stmt << chatd::Message::kNotEncrypted
+             << chatd::Message::kMsgNormal
+             << chatd::Message::kMsgAttachment
+             << chatd::Message::kMsgContact
+             << chatd::Message::kMsgContainsMeta
+             << chatd::Message::kMsgVoiceClip;
+        int count = 0;
+        SearchTerms terms;
+        while (stmt.step())
+        {
+            Buffer buf;
+            stmt.blobCol(5, buf);
+            chatd::Message msg(stmt.uint64Col(1), stmt.uint64Col(2), stmt.intCol(3), stmt.intCol(4),
+                               std::move(buf), false, CHATD_KEYID_INVALID, (unsigned char)stmt.intCol(6));
+            collectSearchTerms(stmt.uint64Col(0), msg.id(), msg, terms);
+            if (terms.size() >= (size_t)kTermInsertChunkRows * 16)
+            {
+                insertSearchTerms(db, terms);
+                terms.clear();
+            }
+            count++;
+        }
+        insertSearchTerms(db, terms);
+        return count;
+    }
+    /**
+     * @brief Searches the history in db for messages containing the words of \c text,
+     * or words that start with them, so results can be found while typing.
+     * Messages are ranked by the number of words found, and then by recency.
+     * @param chatid The chat to search in, or karere::Id::inval() to search in all chats
+     */
+    static void searchMessages(SqliteDb& db, karere::Id chatid, const std::string& text, int limit,
+                               std::vector<ChatdSearchResult>& results)
+    {
+        std::set<std::string> terms;
+        chatd::Message::splitSearchTerms(text, terms);
+        if (terms.empty() || limit <= 0)
+            return;
+
+        // every word is a prefix, which matches the range [word, word + 0xff), since 0xff never appears in UTF-8
+        std::vector<std::string> bounds;
+        for (auto& term: terms)
+        {
+            if (bounds.size() >= kMaxSearchTerms * 2)
+                break;
+            bounds.push_back(term);
+            bounds.push_back(term + '\xff');
+        }
+
+        std::string match;
+        std::string score;
+        for (size_t i = 1; i < bounds.size(); i += 2)
+        {
+            std::string cond = "(t.term >= ?" + std::to_string(i) + " and t.term < ?" + std::to_string(i + 1) + ")";
+            match.append(match.empty() ? "" : " or ").append(cond);
+            score.append(score.empty() ? "" : " + ").append("max").append(cond);
+        }
+
+        std::string sql = "select t.chatid, t.msgid, " + score + " as score, h.ts from history_terms t "
+            "join history h on h.chatid = t.chatid and h.msgid = t.msgid where (" + match + ")";
+        if (chatid.isValid())
+            sql.append(" and t.chatid = ?");
+        sql.append(" group by t.chatid, t.msgid order by score desc, h.ts desc limit ?");
+
+        SqliteStmt stmt(db, sql);
+        for (auto& bound: bounds)
+        {
+            stmt << bound;
+        }
+        if (chatid.isValid())
+            stmt << chatid;
+        stmt << limit;
+
+        while (stmt.step())
+        {
+            results.push_back({stmt.uint64Col(0), stmt.uint64Col(1), stmt.intCol(2), (uint32_t)stmt.int64Col(3)});
+        }
     }
 
     virtual void clearHistory()
     {
+        dropPrefetch();
+        flushHistoryQueue();
+        mDb.query("delete from history_terms where chatid = ?", mChat.chatId());
         mDb.query("delete from history where chatid = ?", mChat.chatId());
+        loadUnreadAfterIdx();
+        mUnreadCount = 0;
+        saveUnreadCount();
         setHaveAllHistory(false);
     }
 
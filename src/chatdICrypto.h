@@ -20,6 +20,7 @@ enum
 class Chat;
 class ICrypto
 {
+protected:
     void *appCtx;
     
 public:
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <set>
 #include <buffer.h>
 #include "karereId.h"
 
@@ -692,6 +693,15 @@ public:
     static void removeUnnecessaryFirstCharacters(std::string& buf);
     static bool isValidEmail(const std::string &buf);
 
+    /** @brief Returns the text to be indexed for search: the text of normal messages and
+     * of messages with meta, and the names of attached nodes and contacts. Empty for other types */
+    std::string searchableText() const;
+
+    /** @brief Splits \c text into the words used to index and search messages. Only ASCII
+     * letters are lowercased, other chars (i.e. UTF-8 sequences) are kept as they are */
+    static void splitSearchTerms(const std::string& text, std::set<std::string>& terms);
+    enum { kSearchTermMinLen = 2, kSearchTermMaxLen = 32 };   // in bytes
+
 protected:
     static const char* statusNames[];
     friend class Chat;
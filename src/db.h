@@ -2,6 +2,8 @@
 #define _KARERE_DB_H
 
 #include <sqlite3.h>
+#include <list>
+#include <unordered_map>
 
 struct SqliteString
 {
@@ -16,16 +18,140 @@ struct SqliteString
 };
 class SqliteStmt;
 
+/** @brief Counters of the prepared-statement cache of \c SqliteDb */
+struct SqliteStmtCacheStats
+{
+    uint64_t hits = 0;          ///< statement was reused from the cache
+    uint64_t misses = 0;        ///< statement had to be prepared (and was cached)
+    uint64_t uncached = 0;      ///< statement was prepared without caching (cache disabled or already in use)
+    uint64_t evictions = 0;     ///< cached statement was finalized to make room for a new one
+};
+
 class SqliteDb
 {
 protected:
     friend class SqliteStmt;
+    friend class SqliteBatch;
+    struct CachedStmt
+    {
+        sqlite3_stmt* stmt;
+        std::list<std::string>::iterator lruPos;
+        bool inUse;
+    };
     sqlite3* mDb = nullptr;
     bool mCommitEach = true;
     bool mHasOpenTransaction = false;
     uint16_t mCommitInterval = 20;
     time_t mLastCommitTs = 0;
+    /** Number of nested \c SqliteBatch objects alive. No timed commits are done meanwhile */
+    int mBatchDepth = 0;
+    /** Prepared statements, keyed by their sql. The most recently used is at the
+     * front of \c mStmtLru */
+    std::unordered_map<std::string, CachedStmt> mStmtCache;
+    std::list<std::string> mStmtLru;
+    size_t mStmtCacheMaxSize = 128;
+    /** Number of statements, cached or not, currently held by \c SqliteStmt objects */
+    size_t mStmtsInUse = 0;
+    SqliteStmtCacheStats mStmtCacheStats;
     inline int step(SqliteStmt& stmt);
+    /** Returns a prepared statement for \c sql, reusing a cached one if available.
+     * @param[out] cached Set to true if the statement is owned by the cache, and
+     * must be returned via \c releaseStmt() instead of being finalized */
+    sqlite3_stmt* acquireStmt(const char* sql, bool& cached)
+    {
+        cached = false;
+        if (!mStmtCacheMaxSize)
+        {
+            mStmtCacheStats.uncached++;
+            return prepareUsedStmt(sql);
+        }
+        std::string key(sql);
+        auto it = mStmtCache.find(key);
+        if (it != mStmtCache.end())
+        {
+            if (it->second.inUse) // same query is already running (i.e. nested), don't share it
+            {
+                mStmtCacheStats.uncached++;
+                return prepareUsedStmt(sql);
+            }
+            mStmtCacheStats.hits++;
+            mStmtLru.splice(mStmtLru.begin(), mStmtLru, it->second.lruPos);
+            it->second.inUse = true;
+            mStmtsInUse++;
+            cached = true;
+            return it->second.stmt;
+        }
+        sqlite3_stmt* stmt = prepareUsedStmt(sql);
+        mStmtCacheStats.misses++;
+        evictStmts(mStmtCacheMaxSize - 1);
+        mStmtLru.push_front(key);
+        mStmtCache.emplace(std::move(key), CachedStmt{stmt, mStmtLru.begin(), true});
+        cached = true;
+        return stmt;
+    }
+    sqlite3_stmt* prepareUsedStmt(const char* sql)
+    {
+        sqlite3_stmt* stmt = prepareStmt(sql);
+        mStmtsInUse++;
+        return stmt;
+    }
+    /** Finalizes a statement obtained via \c acquireStmt() that is not owned by the cache */
+    void finalizeStmt(sqlite3_stmt* stmt)
+    {
+        assert(mStmtsInUse);
+        mStmtsInUse--;
+        sqlite3_finalize(stmt);
+    }
+    /** Returns a statement obtained via \c acquireStmt() to the cache, resetting it
+     * and clearing its bindings. If it is no longer in the cache, it's finalized */
+    void releaseStmt(sqlite3_stmt* stmt)
+    {
+        assert(mStmtsInUse);
+        mStmtsInUse--;
+        auto it = mStmtCache.find(sqlite3_sql(stmt));
+        if (it == mStmtCache.end() || it->second.stmt != stmt)
+        {
+            sqlite3_finalize(stmt);
+            return;
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        it->second.inUse = false;
+    }
+    sqlite3_stmt* prepareStmt(const char* sql)
+    {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(mDb, sql, -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            const char* errMsg = sqlite3_errmsg(mDb);
+            if (!errMsg)
+                errMsg = "(Unknown error)";
+            throw std::runtime_error(std::string(
+                "Error creating sqlite statement with sql:\n'")+sql+"'\n"+errMsg);
+        }
+        assert(stmt);
+        return stmt;
+    }
+    /** Finalizes the least recently used idle statements until the cache has
+     * at most \c maxSize entries. Statements in use are detached from the cache
+     * only when \c maxSize is zero, and finalized by \c releaseStmt() */
+    void evictStmts(size_t maxSize)
+    {
+        auto lruIt = mStmtLru.end();
+        while (mStmtCache.size() > maxSize && lruIt != mStmtLru.begin())
+        {
+            --lruIt;
+            auto it = mStmtCache.find(*lruIt);
+            assert(it != mStmtCache.end());
+            if (it->second.inUse && maxSize)
+                continue;
+            if (!it->second.inUse)
+                sqlite3_finalize(it->second.stmt);
+            mStmtCache.erase(it);
+            lruIt = mStmtLru.erase(lruIt);
+            mStmtCacheStats.evictions++;
+        }
+    }
     void beginTransaction()
     {
         assert(!mHasOpenTransaction);
@@ -45,6 +171,9 @@ public:
     SqliteDb(sqlite3* db=nullptr, uint16_t commitInterval=20)
     : mDb(db), mCommitInterval(commitInterval)
     {}
+    // copies would share, and could finalize, the cached statements
+    SqliteDb(const SqliteDb&) = delete;
+    SqliteDb& operator=(const SqliteDb&) = delete;
     bool open(const char* fname, bool commitEach=true)
     {
         assert(!mDb);
@@ -71,7 +200,23 @@ public:
             return;
         if (!mCommitEach)
             commitTransaction();
-        sqlite3_close(mDb);
+        // All statements must be finalized before closing, otherwise sqlite3_close()
+        // fails with SQLITE_BUSY and leaks the connection
+        assert(!mStmtsInUse);
+        evictStmts(0);
+        if (mStmtsInUse)
+        {
+            // Statements still held by SqliteStmt objects are finalized when these are
+            // destroyed. Meanwhile the connection is kept as a zombie and freed with the
+            // last of them
+            sqlite3_close_v2(mDb);
+        }
+        else
+        {
+            int ret = sqlite3_close(mDb);
+            assert(ret == SQLITE_OK);
+            (void)ret;
+        }
         mDb = nullptr;
         mLastCommitTs = 0;
     }
@@ -87,6 +232,15 @@ public:
         }
     }
     void setCommitInterval(uint16_t sec) { mCommitInterval = sec; }
+    /** @brief Sets the max number of prepared statements kept for reuse. Zero
+     * disables the cache */
+    void setStmtCacheSize(size_t maxSize)
+    {
+        mStmtCacheMaxSize = maxSize;
+        evictStmts(maxSize);
+    }
+    size_t stmtCacheSize() const { return mStmtCache.size(); }
+    const SqliteStmtCacheStats& stmtCacheStats() const { return mStmtCacheStats; }
     bool hasOpenTransaction() const { return !mHasOpenTransaction; }
     operator sqlite3*() { return mDb; }
     operator const sqlite3*() const { return mDb; }
@@ -145,6 +299,7 @@ protected:
     sqlite3_stmt* mStmt;
     SqliteDb& mDb;
     int mLastBindCol = 0;
+    bool mIsCached = false;
     void retCheck(int code, const char* opname)
     {
         if (code != SQLITE_OK)
@@ -171,22 +326,20 @@ protected:
 public:
     SqliteStmt(SqliteDb& db, const char* sql):mDb(db)
     {
-        if (sqlite3_prepare_v2(db, sql, -1, &mStmt, nullptr) != SQLITE_OK)
-        {
-            const char* errMsg = sqlite3_errmsg(mDb);
-            if (!errMsg)
-                errMsg = "(Unknown error)";
-            throw std::runtime_error(std::string(
-                "Error creating sqlite statement with sql:\n'")+sql+"'\n"+errMsg);
-        }
-        assert(mStmt);
+        mStmt = db.acquireStmt(sql, mIsCached);
     }
     SqliteStmt(SqliteDb& db, const std::string& sql)
         :SqliteStmt(db, sql.c_str()){}
+    SqliteStmt(const SqliteStmt&) = delete;
+    SqliteStmt& operator=(const SqliteStmt&) = delete;
     ~SqliteStmt()
     {
-        if (mStmt)
-            sqlite3_finalize(mStmt);
+        if (!mStmt)
+            return;
+        if (mIsCached)
+            mDb.releaseStmt(mStmt);
+        else
+            mDb.finalizeStmt(mStmt);
     }
     operator sqlite3_stmt*() { return mStmt; }
     operator const sqlite3_stmt*() const {return mStmt; }
@@ -294,13 +447,45 @@ inline bool SqliteDb::query(const char* sql, Args&&... args)
 inline int SqliteDb::step(SqliteStmt& stmt)
 {
     auto ret = sqlite3_step(stmt);
-    if (ret == SQLITE_DONE)
+    if (ret == SQLITE_DONE && !mBatchDepth)
     {
         timedCommit();
     }
     return ret;
 }
 
+/** @brief Groups the statements executed during its lifetime, so they are applied atomically.
+ * It's based on a savepoint, so it works both in commit-each mode (where it becomes a
+ * transaction on its own) and nested in the transaction kept open in deferred-commit mode.
+ * If it's destroyed without calling \c commit(), the statements are rolled back.
+ */
+class SqliteBatch
+{
+protected:
+    SqliteDb* mDb;
+public:
+    SqliteBatch(SqliteDb& db): mDb(&db)
+    {
+        mDb->simpleQuery("SAVEPOINT batch");
+        mDb->mBatchDepth++;
+    }
+    void commit()
+    {
+        assert(mDb);
+        mDb->mBatchDepth--;
+        mDb->simpleQuery("RELEASE SAVEPOINT batch");
+        mDb = nullptr;
+    }
+    ~SqliteBatch()
+    {
+        if (!mDb)
+            return;
+        mDb->mBatchDepth--;
+        // errors are ignored, as in SqliteDb::rollback()
+        sqlite3_exec(*mDb, "ROLLBACK TO SAVEPOINT batch; RELEASE SAVEPOINT batch", nullptr, nullptr, nullptr);
+    }
+};
+
 class SqliteTransaction
 {
 protected:
@@ -34,7 +34,17 @@ CREATE TABLE history(idx int not null, chatid int64 not null, msgid int64 not nu
 CREATE TABLE sendkeys(chatid int64 not null, userid int64 not null, keyid int64 not null, key blob not null,
     ts int not null, UNIQUE(chatid, userid, keyid));
 
+CREATE TABLE pairwise_keys(userid int64 primary key, pubkey blob not null,
+    key blob not null);
+
 CREATE TABLE node_history(idx int not null, chatid int64 not null, msgid int64 not null,
     userid int64, keyid int not null, type tinyint, updated smallint, ts int,
     is_encrypted tinyint, data blob, backrefid int64 not null, UNIQUE(chatid,msgid), UNIQUE(chatid,idx));
 
+CREATE TABLE history_terms(term text not null, chatid int64 not null, msgid int64 not null,
+    UNIQUE(term, chatid, msgid));
+
+CREATE INDEX history_terms_msg on history_terms(chatid, msgid);
+
+CREATE TABLE dns_cache(host text not null primary key, ipsv4 text, ipsv6 text,
+    resolve_ts int64 default 0, connect_ipv4_ts int64 default 0, connect_ipv6_ts int64 default 0);
@@ -14,10 +14,13 @@ namespace rtcModule {void globalCleanup(); }
 
 namespace karere
 {
-const char* gDbSchemaVersionSuffix = "5";
+const char* gDbSchemaVersionSuffix = "8";
 // 2 --> +3: invalidate cached chats to reload history (so call-history msgs are fetched)
 // 3 --> +4: invalidate both caches, SDK + MEGAchat, if there's at least one chat (so deleted chats are re-fetched from API)
 // 4 --> +5: modify attachment, revoke, contact and containsMeta and create a new table node_history
+// 5 --> +6: create a new table history_terms and index the cached messages (full-text search)
+// 6 --> +7: create a new table pairwise_keys (symmetric keys shared with other users)
+// 7 --> +8: create a new table dns_cache (IPs of chatd and presenced, and the last connection to each family)
 
 bool gCatchException = true;
 
@@ -38,8 +41,8 @@ void globalCleanup()
     services_shutdown();
 }
 
-void init_uv_timer(void *ctx, uv_timer_t *timer)
+TimerWheel *get_timer_wheel(void *ctx)
 {
-    uv_timer_init(((::mega::LibuvWaiter *)(((megachat::MegaChatApiImpl *)ctx)->waiter))->eventloop, timer);
+    return ((megachat::MegaChatApiImpl *)ctx)->timerWheel;
 }
 }
@@ -362,6 +362,11 @@ void MegaChatApi::requestLastGreen(MegaChatHandle userid, MegaChatRequestListene
     pImpl->requestLastGreen(userid, listener);
 }
 
+void MegaChatApi::setPresenceNotificationsInterval(int intervalMs)
+{
+    pImpl->setPresenceNotificationsInterval(intervalMs);
+}
+
 void MegaChatApi::signalPresenceActivity(MegaChatRequestListener *listener)
 {
     pImpl->signalPresenceActivity(listener);
@@ -577,6 +582,11 @@ bool MegaChatApi::isFullHistoryLoaded(MegaChatHandle chatid)
     return pImpl->isFullHistoryLoaded(chatid);
 }
 
+void MegaChatApi::setHistoryBudget(unsigned int perChat, unsigned int global)
+{
+    pImpl->setHistoryBudget(perChat, global);
+}
+
 MegaChatMessage *MegaChatApi::getMessage(MegaChatHandle chatid, MegaChatHandle msgid)
 {
     return pImpl->getMessage(chatid, msgid);
@@ -592,6 +602,11 @@ MegaChatMessage *MegaChatApi::getManualSendingMessage(MegaChatHandle chatid, Meg
     return pImpl->getManualSendingMessage(chatid, rowid);
 }
 
+void MegaChatApi::searchMessages(MegaChatHandle chatid, const char *text, int limit, MegaChatRequestListener *listener)
+{
+    pImpl->searchMessages(chatid, text, limit, listener);
+}
+
 MegaChatMessage *MegaChatApi::sendMessage(MegaChatHandle chatid, const char *msg)
 {
     return pImpl->sendMessage(chatid, msg, msg ? strlen(msg) : 0);
@@ -1290,6 +1305,22 @@ void MegaChatListener::onChatPresenceLastGreen(MegaChatApi * /*api*/, MegaChatHa
 
 }
 
+void MegaChatListener::onChatOnlineStatusUpdateBatch(MegaChatApi *api, MegaChatOnlineStatusList *list)
+{
+    for (unsigned int i = 0; i < list->size(); i++)
+    {
+        onChatOnlineStatusUpdate(api, list->getUserHandle(i), list->getStatus(i), false);
+    }
+}
+
+void MegaChatListener::onChatPresenceLastGreenBatch(MegaChatApi *api, MegaChatLastGreenList *list)
+{
+    for (unsigned int i = 0; i < list->size(); i++)
+    {
+        onChatPresenceLastGreen(api, list->getUserHandle(i), list->getLastGreen(i));
+    }
+}
+
 MegaChatListItem *MegaChatListItem::copy() const
 {
     return NULL;
@@ -1621,6 +1652,46 @@ unsigned int MegaChatListItemList::size() const
     return 0;
 }
 
+MegaChatOnlineStatusList *MegaChatOnlineStatusList::copy() const
+{
+    return NULL;
+}
+
+MegaChatHandle MegaChatOnlineStatusList::getUserHandle(unsigned int /*i*/) const
+{
+    return MEGACHAT_INVALID_HANDLE;
+}
+
+int MegaChatOnlineStatusList::getStatus(unsigned int /*i*/) const
+{
+    return MegaChatApi::STATUS_INVALID;
+}
+
+unsigned int MegaChatOnlineStatusList::size() const
+{
+    return 0;
+}
+
+MegaChatLastGreenList *MegaChatLastGreenList::copy() const
+{
+    return NULL;
+}
+
+MegaChatHandle MegaChatLastGreenList::getUserHandle(unsigned int /*i*/) const
+{
+    return MEGACHAT_INVALID_HANDLE;
+}
+
+int MegaChatLastGreenList::getLastGreen(unsigned int /*i*/) const
+{
+    return -1;
+}
+
+unsigned int MegaChatLastGreenList::size() const
+{
+    return 0;
+}
+
 MegaChatPresenceConfig *MegaChatPresenceConfig::copy() const
 {
     return NULL;
@@ -57,6 +57,8 @@ class MegaChatVideoListener;
 class MegaChatListener;
 class MegaChatNotificationListener;
 class MegaChatListItem;
+class MegaChatOnlineStatusList;
+class MegaChatLastGreenList;
 class MegaChatNodeHistoryListener;
 
 /**
@@ -803,6 +805,90 @@ public:
 
 };
 
+/**
+ * @brief List of changes of the online status of users
+ *
+ * It's received in MegaChatListener::onChatOnlineStatusUpdateBatch. Every user is
+ * included only once, with the latest status.
+ *
+ * Objects of this class are immutable.
+ */
+class MegaChatOnlineStatusList
+{
+public:
+    virtual ~MegaChatOnlineStatusList() {}
+
+    virtual MegaChatOnlineStatusList *copy() const;
+
+    /**
+     * @brief Returns the handle of the user at the position i in the list
+     *
+     * If the index is >= the size of the list, this function returns MEGACHAT_INVALID_HANDLE.
+     *
+     * @param i Position of the user in the list
+     * @return MegaChatHandle of the user at the position i in the list
+     */
+    virtual MegaChatHandle getUserHandle(unsigned int i) const;
+
+    /**
+     * @brief Returns the online status of the user at the position i in the list
+     *
+     * If the index is >= the size of the list, this function returns MegaChatApi::STATUS_INVALID.
+     *
+     * @param i Position of the user in the list
+     * @return Online status of the user at the position i in the list
+     */
+    virtual int getStatus(unsigned int i) const;
+
+    /**
+     * @brief Returns the number of users in the list
+     * @return Number of users in the list
+     */
+    virtual unsigned int size() const;
+};
+
+/**
+ * @brief List of last-green times of users
+ *
+ * It's received in MegaChatListener::onChatPresenceLastGreenBatch. Every user is
+ * included only once, with the latest value.
+ *
+ * Objects of this class are immutable.
+ */
+class MegaChatLastGreenList
+{
+public:
+    virtual ~MegaChatLastGreenList() {}
+
+    virtual MegaChatLastGreenList *copy() const;
+
+    /**
+     * @brief Returns the handle of the user at the position i in the list
+     *
+     * If the index is >= the size of the list, this function returns MEGACHAT_INVALID_HANDLE.
+     *
+     * @param i Position of the user in the list
+     * @return MegaChatHandle of the user at the position i in the list
+     */
+    virtual MegaChatHandle getUserHandle(unsigned int i) const;
+
+    /**
+     * @brief Returns the time elapsed (minutes) since the user at the position i was green
+     *
+     * If the index is >= the size of the list, this function returns -1.
+     *
+     * @param i Position of the user in the list
+     * @return Minutes since the last time the user at the position i in the list was green
+     */
+    virtual int getLastGreen(unsigned int i) const;
+
+    /**
+     * @brief Returns the number of users in the list
+     * @return Number of users in the list
+     */
+    virtual unsigned int size() const;
+};
+
 /**
  * @brief This class store rich preview data
  *
@@ -1506,6 +1592,7 @@ public:
         TYPE_SET_PRESENCE_PERSIST, TYPE_SET_PRESENCE_AUTOAWAY,
         TYPE_LOAD_AUDIO_VIDEO_DEVICES, TYPE_ARCHIVE_CHATROOM,
         TYPE_PUSH_RECEIVED, TYPE_SET_LAST_GREEN_VISIBLE, TYPE_LAST_GREEN,
+        TYPE_SEARCH_MESSAGES,
         TOTAL_OF_REQUEST_TYPES
     };
 
@@ -1659,6 +1746,8 @@ public:
      * This value is valid for these requests:
      * - MegaChatApi::pushReceived - Returns the list of ids for unread messages in the chatid
      *   (you can get the list of chatids from \c getMegaHandleList)
+     * - MegaChatApi::searchMessages - Returns the list of ids of the messages found in the chatid,
+     *   ranked from best to worst match
      *
      * @param chatid MegaChatHandle that identifies the chat room
      * @return mega::MegaHandleList of handles for a given chatid
@@ -1673,6 +1762,8 @@ public:
      *
      * This value is valid for these requests:
      * - MegaChatApi::pushReceived - Returns the list of chatids with unread messages
+     * - MegaChatApi::searchMessages - Returns the list of chatids with messages found,
+     *   ranked by their best match
      *
      * @return mega::MegaHandleList of handles for a given chatid
      */
@@ -2431,6 +2522,29 @@ public:
      */
     void requestLastGreen(MegaChatHandle userid, MegaChatRequestListener *listener = NULL);
 
+    /**
+     * @brief Enable/disable the coalescing of the notifications of presence
+     *
+     * By default, every change in the online status of a user is notified right away by
+     * MegaChatListener::onChatOnlineStatusUpdate, and every last-green received is notified
+     * by MegaChatListener::onChatPresenceLastGreen. Right after login, presenced sends the status
+     * of every contact, so apps with many contacts receive a burst of notifications.
+     *
+     * When enabled, the changes are accumulated and notified at most once per \c intervalMs,
+     * in a single call to MegaChatListener::onChatOnlineStatusUpdateBatch and another one to
+     * MegaChatListener::onChatPresenceLastGreenBatch. If the status of a user changes several
+     * times during the interval, only the latest one is notified. The changes of the own
+     * status that are in progress are still notified right away.
+     *
+     * @note The default implementation of the batch callbacks calls the individual callbacks
+     * for every user in the list, so apps that don't override them still get one notification
+     * per user, but no more than one per interval.
+     *
+     * @param intervalMs Minimum time between two notifications, in milliseconds. 0 to
+     * disable the coalescing (default).
+     */
+    void setPresenceNotificationsInterval(int intervalMs);
+
     /**
      * @brief Signal there is some user activity
      *
@@ -3177,6 +3291,22 @@ public:
      */
     bool isFullHistoryLoaded(MegaChatHandle chatid);
 
+    /**
+     * @brief Limits the number of messages of the history kept in memory
+     *
+     * By default, all the messages loaded, received and sent are kept in memory while
+     * the session is alive. When a budget is set, the messages beyond it that are not
+     * needed anymore (i.e. far from the newest ones and from the ones recently loaded by
+     * MegaChatApi::loadMessages) are released from memory. They are reloaded from the
+     * local cache on demand, i.e. by MegaChatApi::getMessage.
+     *
+     * The budget is kept across sessions of this MegaChatApi instance.
+     *
+     * @param perChat Max number of messages kept in memory for every chat, 0 for unlimited (default)
+     * @param global Max number of messages kept in memory for all chats together, 0 for unlimited (default)
+     */
+    void setHistoryBudget(unsigned int perChat, unsigned int global);
+
     /**
      * @brief Returns the MegaChatMessage specified from the chat room.
      *
@@ -3221,6 +3351,43 @@ public:
      */
     MegaChatMessage *getManualSendingMessage(MegaChatHandle chatid, MegaChatHandle rowid);
 
+    /**
+     * @brief Searches the local history for messages containing some words
+     *
+     * It searches the history cached locally, without loading the chatrooms, in the text of
+     * the messages, including messages with meta (ie. rich-links), and in the names of the
+     * attached files and contacts. Every word of \c text matches any word that starts with it.
+     * The matching ignores the case of ASCII letters only: other letters (i.e. accented or
+     * non-latin ones) must match exactly, including their case. The messages are ranked by
+     * the number of words found, and then from newest to oldest.
+     *
+     * The search runs in the background, so it doesn't block other requests. Messages
+     * received in the last few seconds may not be found yet.
+     *
+     * The associated request type with this request is MegaChatRequest::TYPE_SEARCH_MESSAGES
+     * Valid data in the MegaChatRequest object received on callbacks:
+     * - MegaChatRequest::getChatHandle - Returns the chat identifier
+     * - MegaChatRequest::getText - Returns the text to search
+     * - MegaChatRequest::getNumber - Returns the maximum number of messages to return
+     *
+     * Valid data in the MegaChatRequest object received in onRequestFinish when the error code
+     * is MegaError::ERROR_OK:
+     * - MegaChatRequest::getMegaHandleList - Returns the list of chatids with messages found,
+     * ranked by their best match
+     * - MegaChatRequest::getMegaHandleListByChat - Returns the list of msgids found in each chat,
+     * ranked from best to worst match
+     *
+     * On the onRequestFinish error, the error code associated to the MegaChatError can be:
+     * - MegaChatError::ERROR_ARGS - If the text is empty or the limit is not positive
+     * - MegaChatError::ERROR_NOENT - If the chatroom does not exist.
+     *
+     * @param chatid MegaChatHandle that identifies the chat room, or MEGACHAT_INVALID_HANDLE for all chats
+     * @param text Words to search
+     * @param limit Maximum number of messages to return
+     * @param listener MegaChatRequestListener to track this request
+     */
+    void searchMessages(MegaChatHandle chatid, const char *text, int limit, MegaChatRequestListener *listener = NULL);
+
     /**
      * @brief Sends a new message to the specified chatroom
      *
@@ -4896,6 +5063,38 @@ public:
      * @param lastGreen Time elapsed (minutes) since the last time user was green
      */
     virtual void onChatPresenceLastGreen(MegaChatApi* api, MegaChatHandle userhandle, int lastGreen);
+
+    /**
+     * @brief This function is called with the changes of the online status of several users
+     *
+     * It is called instead of MegaChatListener::onChatOnlineStatusUpdate only if the coalescing of
+     * presence notifications has been enabled by MegaChatApi::setPresenceNotificationsInterval.
+     * The default implementation calls MegaChatListener::onChatOnlineStatusUpdate for every user
+     * in the list.
+     *
+     * The MegaChatOnlineStatusList object will be valid until this function returns. If you
+     * want to save the list, use MegaChatOnlineStatusList::copy
+     *
+     * @param api MegaChatApi connected to the account
+     * @param list List of users and their new online status
+     */
+    virtual void onChatOnlineStatusUpdateBatch(MegaChatApi* api, MegaChatOnlineStatusList *list);
+
+    /**
+     * @brief This function is called with the last-green's time of several users
+     *
+     * It is called instead of MegaChatListener::onChatPresenceLastGreen only if the coalescing of
+     * presence notifications has been enabled by MegaChatApi::setPresenceNotificationsInterval.
+     * The default implementation calls MegaChatListener::onChatPresenceLastGreen for every user
+     * in the list.
+     *
+     * The MegaChatLastGreenList object will be valid until this function returns. If you
+     * want to save the list, use MegaChatLastGreenList::copy
+     *
+     * @param api MegaChatApi connected to the account
+     * @param list List of users and the minutes since they were green by last time
+     */
+    virtual void onChatPresenceLastGreenBatch(MegaChatApi* api, MegaChatLastGreenList *list);
 };
 
 /**
@@ -40,7 +40,10 @@
 #include <base/logger.h>
 #include <IGui.h>
 #include <chatClient.h>
+#include <chatdDb.h>
 #include <mega/base64.h>
+#include <algorithm>
+#include <chrono>
 
 #ifndef _WIN32
 #include <signal.h>
@@ -58,6 +61,9 @@ using namespace chatd;
 
 LoggerHandler *MegaChatApiImpl::loggerHandler = NULL;
 
+// the instance whose karere thread is the current thread, if any
+static thread_local MegaChatApiImpl *tKarereThreadOwner = NULL;
+
 MegaChatApiImpl::MegaChatApiImpl(MegaChatApi *chatApi, MegaApi *megaApi)
 : sdkMutex(true), videoMutex(true)
 {
@@ -90,6 +96,7 @@ MegaChatApiImpl::~MegaChatApiImpl()
     }
 
     // TODO: destruction of waiter hangs forever or may cause crashes
+    // (the timer wheel, bound to the loop of the waiter, was closed and deleted by the thread)
     //delete waiter;
 
     // TODO: destruction of network layer may cause hangs on MegaApi's network layer.
@@ -109,7 +116,9 @@ void MegaChatApiImpl::init(MegaChatApi *chatApi, MegaApi *megaApi)
 
     this->mClient = NULL;
     this->terminating = false;
+    this->mWakeupPending = false;
     this->waiter = new MegaChatWaiter();
+    this->timerWheel = new karere::TimerWheel(((MegaChatWaiter *)waiter)->eventloop, this);
     this->websocketsIO = new MegaWebsocketsIO(&sdkMutex, waiter, megaApi, this);
 
     //Start blocking thread
@@ -134,6 +143,7 @@ void *MegaChatApiImpl::threadEntryPoint(void *param)
 
 void MegaChatApiImpl::loop()
 {
+    tKarereThreadOwner = this;
     sdkMutex.lock();
     while (true)
     {
@@ -145,6 +155,8 @@ void MegaChatApiImpl::loop()
 
         sdkMutex.lock();
 
+        // messages posted from now on need a new wakeup
+        mWakeupPending.store(false);
         sendPendingEvents();
         sendPendingRequests();
 
@@ -152,12 +164,22 @@ void MegaChatApiImpl::loop()
         {
             // There must be only one pending events, at maximum: the logout marshall call to delete the client
             assert(eventQueue.isEmpty() || (eventQueue.size() == 1));
-            sendPendingEvents();
+            while (eventQueue.processAll(megaProcessMessage))
+            {
+            }
+            clearSnapshot();
+
+            // no timer is needed anymore. The wheel is deleted once the loop closes its handles
+            timerWheel->closeAndDelete();
+            timerWheel = NULL;
+            uv_run(((MegaChatWaiter *)waiter)->eventloop, UV_RUN_NOWAIT);
 
             sdkMutex.unlock();
             break;
         }
     }
+    API_LOG_INFO("sdkMutex contention: %s", sdkMutex.contentionReport().c_str());
+    API_LOG_INFO("Event queue: %s", eventQueue.statsReport().c_str());
 
 #ifndef KARERE_DISABLE_WEBRTC
     rtcModule::globalCleanup();
@@ -184,7 +206,10 @@ void MegaChatApiImpl::megaApiPostMessage(void* msg, void* ctx)
 void MegaChatApiImpl::postMessage(void *msg)
 {
     eventQueue.push(msg);
-    waiter->notify();
+    if (!mWakeupPending.exchange(true))
+    {
+        waiter->notify();
+    }
 }
 
 void MegaChatApiImpl::sendPendingRequests()
@@ -341,6 +366,10 @@ void MegaChatApiImpl::sendPendingRequests()
         {
             bool deleteDb = request->getFlag();
             terminating = true;
+            clearSnapshot();
+            cancelPresenceNotifications();
+            API_LOG_INFO("sdkMutex contention: %s", sdkMutex.contentionReport().c_str());
+            API_LOG_INFO("Event queue: %s", eventQueue.statsReport().c_str());
             mClient->terminate(deleteDb);
 
             API_LOG_INFO("Chat engine is logged out!");
@@ -374,6 +403,7 @@ void MegaChatApiImpl::sendPendingRequests()
         }
         case MegaChatRequest::TYPE_DELETE:
         {
+            cancelPresenceNotifications();
             if (mClient && !terminating)
             {
                 mClient->terminate();
@@ -1008,7 +1038,7 @@ void MegaChatApiImpl::sendPendingRequests()
                         MegaHandleList *msgids = MegaHandleList::createInstance();
 
                         MegaChatHandle chatid = it->first;
-                        const Chat &chat = it->second->chat();
+                        Chat &chat = it->second->chat();
                         Idx lastSeenIdx = chat.lastSeenIdx();
 
                         // first msg to consider: last-seen if loaded in memory. Otherwise, the oldest loaded msg
@@ -1055,6 +1085,58 @@ void MegaChatApiImpl::sendPendingRequests()
             });
             break;
         }
+        case MegaChatRequest::TYPE_SEARCH_MESSAGES:
+        {
+            MegaChatHandle chatid = request->getChatHandle();
+            const char *text = request->getText();
+            int limit = (int)request->getNumber();
+            if (!text || !*text || limit <= 0)
+            {
+                errorCode = MegaChatError::ERROR_ARGS;
+                break;
+            }
+            if (chatid != MEGACHAT_INVALID_HANDLE && !findChatRoom(chatid))
+            {
+                errorCode = MegaChatError::ERROR_NOENT;
+                break;
+            }
+
+            // the query runs off the karere thread, the results are received back on it
+            mClient->searchMessages(chatid, text, limit)
+            .then([this, request](const std::shared_ptr<std::vector<ChatdSearchResult>>& results)
+            {
+                // group the results by chat, keeping the chats in order of their best match
+                MegaHandleList *chatids = MegaHandleList::createInstance();
+                std::map<MegaChatHandle, MegaHandleList*> msgidsByChat;
+                for (auto& result: *results)
+                {
+                    MegaHandleList *&msgids = msgidsByChat[result.chatid];
+                    if (!msgids)
+                    {
+                        msgids = MegaHandleList::createInstance();
+                        chatids->addMegaHandle(result.chatid);
+                    }
+                    msgids->addMegaHandle(result.msgid);
+                }
+                for (auto& item: msgidsByChat)
+                {
+                    request->setMegaHandleListByChat(item.first, item.second);
+                    delete item.second;
+                }
+                request->setMegaHandleList(chatids);    // always a valid list, even if empty
+                delete chatids;
+
+                MegaChatErrorPrivate *megaChatError = new MegaChatErrorPrivate(MegaChatError::ERROR_OK);
+                fireOnChatRequestFinish(request, megaChatError);
+            })
+            .fail([this, request](const ::promise::Error& err)
+            {
+                API_LOG_ERROR("Error searching messages: %s", err.what());
+                MegaChatErrorPrivate *megaChatError = new MegaChatErrorPrivate(err.msg(), err.code(), err.type());
+                fireOnChatRequestFinish(request, megaChatError);
+            });
+            break;
+        }
 #ifndef KARERE_DISABLE_WEBRTC
         case MegaChatRequest::TYPE_START_CHAT_CALL:
         {
@@ -1377,13 +1459,236 @@ void MegaChatApiImpl::sendPendingRequests()
     }
 }
 
-void MegaChatApiImpl::sendPendingEvents()
+std::shared_ptr<const ChatSnapshot> MegaChatApiImpl::readSnapshot() const
 {
-    void *msg;
-    while ((msg = eventQueue.pop()))
+    if (tKarereThreadOwner == this)
     {
-        megaProcessMessage(msg);
+        return NULL;    // the karere thread reads the current state directly
+    }
+    return std::atomic_load(&mSnapshot);
+}
+
+std::shared_ptr<ChatSnapshot::Room> MegaChatApiImpl::makeSnapshotRoom(ChatRoom &chatroom)
+{
+    std::shared_ptr<ChatSnapshot::Room> room = std::make_shared<ChatSnapshot::Room>();
+    room->room.reset(new MegaChatRoomPrivate(chatroom));
+    room->item.reset(new MegaChatListItemPrivate(chatroom));
+    if (!chatroom.isGroup())
+    {
+        MegaChatHandle peer = ((PeerChatRoom &)chatroom).peer();
+        ContactList::iterator it = mClient->contactList->find(peer);
+        if (it != mClient->contactList->end() && it->second->chatRoom() == &chatroom)
+        {
+            room->contact = peer;
+        }
+    }
+    return room;
+}
+
+void MegaChatApiImpl::publishSnapshot(ChatSnapshot *snapshot)
+{
+    snapshot->version = ++mSnapshotVersion;
+    std::atomic_store(&mSnapshot, std::shared_ptr<const ChatSnapshot>(snapshot));
+}
+
+void MegaChatApiImpl::buildSnapshot()
+{
+    if (!mClient || terminating || !mClient->chats)
+    {
+        clearSnapshot();
+        return;
+    }
+
+    ChatSnapshot *snapshot = new ChatSnapshot;
+    snapshot->myHandle = mClient->myHandle();
+    std::array<std::shared_ptr<ChatSnapshot::RoomList>, ChatSnapshot::kBucketCount> rooms;
+    for (ChatRoomList::iterator it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+    {
+        // the list is sorted by chatid too
+        std::shared_ptr<ChatSnapshot::RoomList> &bucket = rooms[ChatSnapshot::bucketOf(it->first)];
+        if (!bucket)
+        {
+            bucket = std::make_shared<ChatSnapshot::RoomList>();
+        }
+        bucket->emplace_back(it->first, makeSnapshotRoom(*it->second));
+    }
+    std::copy(rooms.begin(), rooms.end(), snapshot->rooms.begin());
+
+    std::array<std::shared_ptr<ChatSnapshot::PresenceMap>, ChatSnapshot::kBucketCount> presence;
+    for (auto &peer: mClient->presenced().peersPresence())
+    {
+        std::shared_ptr<ChatSnapshot::PresenceMap> &bucket = presence[ChatSnapshot::bucketOf(peer.first)];
+        if (!bucket)
+        {
+            bucket = std::make_shared<ChatSnapshot::PresenceMap>();
+        }
+        (*bucket)[peer.first] = peer.second.status();
+    }
+    std::copy(presence.begin(), presence.end(), snapshot->presence.begin());
+    publishSnapshot(snapshot);
+}
+
+void MegaChatApiImpl::updateSnapshotRoom(MegaChatHandle chatid)
+{
+    ChatRoom *chatroom = findChatRoom(chatid);
+    if (chatroom)   // otherwise, it's being created or deleted (see add/removeXXXChatItem())
+    {
+        mStaleSnapshotRooms.erase(chatid);
+        updateSnapshotRoom(chatid, chatroom);
+    }
+}
+
+void MegaChatApiImpl::updateSnapshotRoom(MegaChatHandle chatid, ChatRoom *chatroom)
+{
+    std::shared_ptr<const ChatSnapshot> current = std::atomic_load(&mSnapshot);
+    if (!current)
+    {
+        return; // not published yet, readers use the current state
+    }
+    if (!mClient || terminating)
+    {
+        clearSnapshot();
+        return;
+    }
+
+    // copies the bucket of the chat, the other buckets and the rooms are shared
+    ChatSnapshot *snapshot = new ChatSnapshot(*current);
+    std::shared_ptr<const ChatSnapshot::RoomList> &bucket = snapshot->rooms[ChatSnapshot::bucketOf(chatid)];
+    ChatSnapshot::RoomList *rooms = bucket ? new ChatSnapshot::RoomList(*bucket) : new ChatSnapshot::RoomList;
+    ChatSnapshot::RoomList::iterator it = std::lower_bound(rooms->begin(), rooms->end(), chatid,
+        [](const ChatSnapshot::RoomList::value_type &entry, MegaChatHandle id) { return entry.first < id; });
+    bool found = (it != rooms->end() && it->first == chatid);
+
+    if (chatroom)
+    {
+        if (found)
+        {
+            it->second = makeSnapshotRoom(*chatroom);
+        }
+        else
+        {
+            rooms->emplace(it, chatid, makeSnapshotRoom(*chatroom));
+        }
+    }
+    else if (found)
+    {
+        rooms->erase(it);
+    }
+
+    if (rooms->empty())
+    {
+        delete rooms;
+        bucket.reset();
+    }
+    else
+    {
+        bucket.reset(rooms);
+    }
+    publishSnapshot(snapshot);
+}
+
+void MegaChatApiImpl::scheduleSnapshotRoomUpdate(MegaChatHandle chatid)
+{
+    if (!std::atomic_load(&mSnapshot))
+    {
+        return;
+    }
+
+    mStaleSnapshotRooms.insert(chatid);
+    if (!mStaleSnapshotTimer)
+    {
+        // after the current burst of events (i.e. names of all the members being fetched)
+        mStaleSnapshotTimer = karere::setTimeout([this]()
+        {
+            mStaleSnapshotTimer = 0;
+            refreshStaleSnapshotRooms();
+        }, 0, this);
+    }
+}
+
+void MegaChatApiImpl::refreshStaleSnapshotRooms()
+{
+    std::set<MegaChatHandle> chatids;
+    chatids.swap(mStaleSnapshotRooms);
+    std::shared_ptr<const ChatSnapshot> current = std::atomic_load(&mSnapshot);
+    if (!current || !mClient || terminating)
+    {
+        return;
+    }
+
+    // the chatids are sorted, so the chats of the same bucket are consecutive
+    ChatSnapshot *snapshot = new ChatSnapshot(*current);
+    ChatSnapshot::RoomList *rooms = NULL;
+    for (MegaChatHandle chatid: chatids)
+    {
+        ChatRoom *chatroom = findChatRoom(chatid);
+        std::shared_ptr<const ChatSnapshot::RoomList> &bucket = snapshot->rooms[ChatSnapshot::bucketOf(chatid)];
+        if (!chatroom || !bucket)
+        {
+            continue;   // removed meanwhile
+        }
+        ChatSnapshot::RoomList::const_iterator it = std::lower_bound(bucket->begin(), bucket->end(), chatid,
+            [](const ChatSnapshot::RoomList::value_type &entry, MegaChatHandle id) { return entry.first < id; });
+        if (it == bucket->end() || it->first != chatid)
+        {
+            continue;
+        }
+        size_t pos = it - bucket->begin();
+        if (bucket.get() != rooms)  // first chat of this bucket
+        {
+            rooms = new ChatSnapshot::RoomList(*bucket);
+            bucket.reset(rooms);
+        }
+        (*rooms)[pos].second = makeSnapshotRoom(*chatroom);
+    }
+
+    if (!rooms)
+    {
+        delete snapshot;
+        return;
+    }
+    publishSnapshot(snapshot);
+}
+
+void MegaChatApiImpl::updateSnapshotPresence(const std::map<MegaChatHandle, int> &changes)
+{
+    std::shared_ptr<const ChatSnapshot> current = std::atomic_load(&mSnapshot);
+    if (!current || changes.empty())
+    {
+        return;
     }
+
+    // copies only the buckets of the users that changed, once per batch. The changes are
+    // sorted, so the users of the same bucket are consecutive
+    ChatSnapshot *snapshot = new ChatSnapshot(*current);
+    ChatSnapshot::PresenceMap *presence = NULL;
+    for (auto &change: changes)
+    {
+        std::shared_ptr<const ChatSnapshot::PresenceMap> &bucket = snapshot->presence[ChatSnapshot::bucketOf(change.first)];
+        if (!bucket || bucket.get() != presence)
+        {
+            presence = bucket ? new ChatSnapshot::PresenceMap(*bucket) : new ChatSnapshot::PresenceMap;
+            bucket.reset(presence);
+        }
+        (*presence)[change.first] = change.second;
+    }
+    publishSnapshot(snapshot);
+}
+
+void MegaChatApiImpl::clearSnapshot()
+{
+    std::atomic_store(&mSnapshot, std::shared_ptr<const ChatSnapshot>());
+    mStaleSnapshotRooms.clear();
+    if (mStaleSnapshotTimer)
+    {
+        karere::cancelTimeout(mStaleSnapshotTimer, this);
+        mStaleSnapshotTimer = 0;
+    }
+}
+
+void MegaChatApiImpl::sendPendingEvents()
+{
+    eventQueue.processAll(megaProcessMessage);
 }
 
 void MegaChatApiImpl::setLogLevel(int logLevel)
@@ -1863,6 +2168,9 @@ void MegaChatApiImpl::fireOnChatVideoData(MegaChatHandle chatid, MegaChatHandle
 
 void MegaChatApiImpl::fireOnChatListItemUpdate(MegaChatListItem *item)
 {
+    // so that the app sees the changes if it reads the item from another thread
+    updateSnapshotRoom(item->getChatId());
+
     for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
     {
         (*it)->onChatListItemUpdate(chatApi, item);
@@ -1905,6 +2213,22 @@ void MegaChatApiImpl::fireOnChatPresenceLastGreenUpdated(MegaChatHandle userhand
     }
 }
 
+void MegaChatApiImpl::fireOnChatOnlineStatusUpdateBatch(MegaChatOnlineStatusList *list)
+{
+    for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
+    {
+        (*it)->onChatOnlineStatusUpdateBatch(chatApi, list);
+    }
+}
+
+void MegaChatApiImpl::fireOnChatPresenceLastGreenBatch(MegaChatLastGreenList *list)
+{
+    for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
+    {
+        (*it)->onChatPresenceLastGreenBatch(chatApi, list);
+    }
+}
+
 void MegaChatApiImpl::fireOnChatConnectionStateUpdate(MegaChatHandle chatid, int newState)
 {
     bool allConnected = (newState == MegaChatApi::CHAT_CONNECTION_ONLINE) ? mClient->mChatdClient->areAllChatsLoggedIn() : false;
@@ -2052,6 +2376,14 @@ void MegaChatApiImpl::setLastGreenVisible(bool enable, MegaChatRequestListener *
     waiter->notify();
 }
 
+void MegaChatApiImpl::setPresenceNotificationsInterval(int intervalMs)
+{
+    sdkMutex.lock();
+    // if disabled, the changes already pending are still notified in a batch
+    mPresenceNotifInterval = (intervalMs > 0) ? intervalMs : 0;
+    sdkMutex.unlock();
+}
+
 void MegaChatApiImpl::requestLastGreen(MegaChatHandle userid, MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_LAST_GREEN, listener);
@@ -2093,6 +2425,12 @@ bool MegaChatApiImpl::isSignalActivityRequired()
 
 int MegaChatApiImpl::getOnlineStatus()
 {
+    std::shared_ptr<const ChatSnapshot> snapshot = readSnapshot();
+    if (snapshot)
+    {
+        return snapshot->userOnlineStatus(snapshot->myHandle);
+    }
+
     sdkMutex.lock();
 
     int status = mClient ? getUserOnlineStatus(mClient->myHandle()) : (int)MegaChatApi::STATUS_INVALID;
@@ -2115,6 +2453,12 @@ bool MegaChatApiImpl::isOnlineStatusPending()
 
 int MegaChatApiImpl::getUserOnlineStatus(MegaChatHandle userhandle)
 {
+    std::shared_ptr<const ChatSnapshot> snapshot = readSnapshot();
+    if (snapshot)
+    {
+        return snapshot->userOnlineStatus(userhandle);
+    }
+
     int status = MegaChatApi::STATUS_INVALID;
 
     sdkMutex.lock();
@@ -2278,6 +2622,16 @@ MegaChatRoomList *MegaChatApiImpl::getChatRooms()
 {
     MegaChatRoomListPrivate *chats = new MegaChatRoomListPrivate();
 
+    std::shared_ptr<const ChatSnapshot> snapshot = readSnapshot();
+    if (snapshot)
+    {
+        snapshot->forEachRoom([chats](const ChatSnapshot::Room &room)
+        {
+            chats->addChatRoom(room.room->copy());
+        });
+        return chats;
+    }
+
     sdkMutex.lock();
 
     if (mClient && !terminating)
@@ -2296,6 +2650,13 @@ MegaChatRoomList *MegaChatApiImpl::getChatRooms()
 
 MegaChatRoom *MegaChatApiImpl::getChatRoom(MegaChatHandle chatid)
 {
+    std::shared_ptr<const ChatSnapshot> snapshot = readSnapshot();
+    if (snapshot)
+    {
+        const ChatSnapshot::Room *room = snapshot->findRoom(chatid);
+        return room ? room->room->copy() : NULL;
+    }
+
     MegaChatRoomPrivate *chat = NULL;
 
     sdkMutex.lock();
@@ -2313,6 +2674,13 @@ MegaChatRoom *MegaChatApiImpl::getChatRoom(MegaChatHandle chatid)
 
 MegaChatRoom *MegaChatApiImpl::getChatRoomByUser(MegaChatHandle userhandle)
 {
+    std::shared_ptr<const ChatSnapshot> snapshot = readSnapshot();
+    if (snapshot)
+    {
+        const ChatSnapshot::Room *room = snapshot->findRoomByContact(userhandle);
+        return room ? room->room->copy() : NULL;
+    }
+
     MegaChatRoomPrivate *chat = NULL;
 
     sdkMutex.lock();
@@ -2332,6 +2700,19 @@ MegaChatListItemList *MegaChatApiImpl::getChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
+    std::shared_ptr<const ChatSnapshot> snapshot = readSnapshot();
+    if (snapshot)
+    {
+        snapshot->forEachRoom([items](const ChatSnapshot::Room &room)
+        {
+            if (!room.item->isArchived())
+            {
+                items->addChatListItem(room.item->copy());
+            }
+        });
+        return items;
+    }
+
     sdkMutex.lock();
 
     if (mClient && !terminating)
@@ -2355,6 +2736,46 @@ MegaChatListItemList *MegaChatApiImpl::getChatListItemsByPeers(MegaChatPeerList
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
+    std::shared_ptr<const ChatSnapshot> snapshot = readSnapshot();
+    if (snapshot)
+    {
+        snapshot->forEachRoom([items, peers](const ChatSnapshot::Room &entry)
+        {
+            const MegaChatRoomPrivate &room = *entry.room;
+            if (room.isGroup())
+            {
+                if ((int)room.getPeerCount() != peers->size())
+                {
+                    return;
+                }
+
+                std::set<MegaChatHandle> members;
+                for (unsigned int i = 0; i < room.getPeerCount(); i++)
+                {
+                    members.insert(room.getPeerHandle(i));
+                }
+                bool sameParticipants = true;
+                for (int i = 0; i < peers->size(); i++)
+                {
+                    if (members.find(peers->getPeerHandle(i)) == members.end())
+                    {
+                        sameParticipants = false;
+                        break;
+                    }
+                }
+                if (sameParticipants)
+                {
+                    items->addChatListItem(entry.item->copy());
+                }
+            }
+            else if (peers->size() == 1 && room.getPeerHandle(0) == peers->getPeerHandle(0))
+            {
+                items->addChatListItem(entry.item->copy());
+            }
+        });
+        return items;
+    }
+
     sdkMutex.lock();
 
     if (mClient && !terminating)
@@ -2410,6 +2831,13 @@ MegaChatListItemList *MegaChatApiImpl::getChatListItemsByPeers(MegaChatPeerList
 
 MegaChatListItem *MegaChatApiImpl::getChatListItem(MegaChatHandle chatid)
 {
+    std::shared_ptr<const ChatSnapshot> snapshot = readSnapshot();
+    if (snapshot)
+    {
+        const ChatSnapshot::Room *room = snapshot->findRoom(chatid);
+        return room ? room->item->copy() : NULL;
+    }
+
     MegaChatListItemPrivate *item = NULL;
 
     sdkMutex.lock();
@@ -2429,6 +2857,19 @@ int MegaChatApiImpl::getUnreadChats()
 {
     int count = 0;
 
+    std::shared_ptr<const ChatSnapshot> snapshot = readSnapshot();
+    if (snapshot)
+    {
+        snapshot->forEachRoom([&count](const ChatSnapshot::Room &room)
+        {
+            if (!room.item->isArchived() && room.item->getUnreadCount())
+            {
+                count++;
+            }
+        });
+        return count;
+    }
+
     sdkMutex.lock();
 
     if (mClient && !terminating)
@@ -2437,7 +2878,7 @@ int MegaChatApiImpl::getUnreadChats()
         for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
         {
             ChatRoom *room = it->second;
-            if (!room->isArchived() && room->chat().unreadMsgCount())
+            if (!room->isArchived() && room->unreadCount())
             {
                 count++;
             }
@@ -2453,6 +2894,19 @@ MegaChatListItemList *MegaChatApiImpl::getActiveChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
+    std::shared_ptr<const ChatSnapshot> snapshot = readSnapshot();
+    if (snapshot)
+    {
+        snapshot->forEachRoom([items](const ChatSnapshot::Room &room)
+        {
+            if (!room.item->isArchived() && room.item->isActive())
+            {
+                items->addChatListItem(room.item->copy());
+            }
+        });
+        return items;
+    }
+
     sdkMutex.lock();
 
     if (mClient && !terminating)
@@ -2476,6 +2930,19 @@ MegaChatListItemList *MegaChatApiImpl::getInactiveChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
+    std::shared_ptr<const ChatSnapshot> snapshot = readSnapshot();
+    if (snapshot)
+    {
+        snapshot->forEachRoom([items](const ChatSnapshot::Room &room)
+        {
+            if (!room.item->isArchived() && !room.item->isActive())
+            {
+                items->addChatListItem(room.item->copy());
+            }
+        });
+        return items;
+    }
+
     sdkMutex.lock();
 
     if (mClient && !terminating)
@@ -2499,6 +2966,19 @@ MegaChatListItemList *MegaChatApiImpl::getArchivedChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
+    std::shared_ptr<const ChatSnapshot> snapshot = readSnapshot();
+    if (snapshot)
+    {
+        snapshot->forEachRoom([items](const ChatSnapshot::Room &room)
+        {
+            if (room.item->isArchived())
+            {
+                items->addChatListItem(room.item->copy());
+            }
+        });
+        return items;
+    }
+
     sdkMutex.lock();
 
     if (mClient && !terminating)
@@ -2522,6 +3002,19 @@ MegaChatListItemList *MegaChatApiImpl::getUnreadChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
+    std::shared_ptr<const ChatSnapshot> snapshot = readSnapshot();
+    if (snapshot)
+    {
+        snapshot->forEachRoom([items](const ChatSnapshot::Room &room)
+        {
+            if (!room.item->isArchived() && room.item->getUnreadCount())
+            {
+                items->addChatListItem(room.item->copy());
+            }
+        });
+        return items;
+    }
+
     sdkMutex.lock();
 
     if (mClient && !terminating)
@@ -2530,7 +3023,7 @@ MegaChatListItemList *MegaChatApiImpl::getUnreadChatListItems()
         for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
         {
             ChatRoom *room = it->second;
-            if (!room->isArchived() && room->chat().unreadMsgCount())
+            if (!room->isArchived() && room->unreadCount())
             {
                 items->addChatListItem(new MegaChatListItemPrivate(*it->second));
             }
@@ -2544,6 +3037,13 @@ MegaChatListItemList *MegaChatApiImpl::getUnreadChatListItems()
 
 MegaChatHandle MegaChatApiImpl::getChatHandleByUser(MegaChatHandle userhandle)
 {
+    std::shared_ptr<const ChatSnapshot> snapshot = readSnapshot();
+    if (snapshot)
+    {
+        const ChatSnapshot::Room *room = snapshot->findRoomByContact(userhandle);
+        return room ? room->room->getChatId() : MEGACHAT_INVALID_HANDLE;
+    }
+
     MegaChatHandle chatid = MEGACHAT_INVALID_HANDLE;
 
     sdkMutex.lock();
@@ -2707,6 +3207,23 @@ bool MegaChatApiImpl::isFullHistoryLoaded(MegaChatHandle chatid)
     return ret;
 }
 
+void MegaChatApiImpl::setHistoryBudget(unsigned int perChat, unsigned int global)
+{
+    sdkMutex.lock();
+    mHistChatBudget = perChat;
+    mHistGlobalBudget = global;
+    applyHistoryBudget();
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::applyHistoryBudget()
+{
+    if (mClient && mClient->mChatdClient)
+    {
+        mClient->mChatdClient->setHistoryBudget(mHistChatBudget, mHistGlobalBudget);
+    }
+}
+
 MegaChatMessage *MegaChatApiImpl::getMessage(MegaChatHandle chatid, MegaChatHandle msgid)
 {
     MegaChatMessagePrivate *megaMsg = NULL;
@@ -3216,6 +3733,16 @@ void MegaChatApiImpl::pushReceived(bool beep, MegaChatHandle chatid, int type, M
     waiter->notify();
 }
 
+void MegaChatApiImpl::searchMessages(MegaChatHandle chatid, const char *text, int limit, MegaChatRequestListener *listener)
+{
+    MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SEARCH_MESSAGES, listener);
+    request->setChatHandle(chatid);
+    request->setText(text);
+    request->setNumber(limit);
+    requestQueue.push(request);
+    waiter->notify();
+}
+
 #ifndef KARERE_DISABLE_WEBRTC
 
 MegaStringList *MegaChatApiImpl::getChatAudioInDevices()
@@ -3839,6 +4366,13 @@ void MegaChatApiImpl::onInitStateChange(int newState)
 
     int state = MegaChatApiImpl::convertInitState(newState);
 
+    if (state == MegaChatApi::INIT_OFFLINE_SESSION || state == MegaChatApi::INIT_ONLINE_SESSION)
+    {
+        // the chats are loaded (from cache or from API), publish them for the read APIs
+        buildSnapshot();
+        applyHistoryBudget();
+    }
+
     // only notify meaningful state to the app
     if (state == MegaChatApi::INIT_ERROR ||
             state == MegaChatApi::INIT_WAITING_NEW_SESSION ||
@@ -3911,6 +4445,9 @@ IApp::IGroupChatListItem *MegaChatApiImpl::addGroupChatItem(GroupChatRoom &chat)
     MegaChatGroupListItemHandler *itemHandler = new MegaChatGroupListItemHandler(*this, chat);
     chatGroupListItemHandler.insert(itemHandler);
 
+    // not in the list of chats yet, so the notification can't add it to the snapshot
+    updateSnapshotRoom(chat.chatid(), &chat);
+
     // notify the app about the new chatroom
     MegaChatListItemPrivate *item = new MegaChatListItemPrivate(chat);
     fireOnChatListItemUpdate(item);
@@ -3923,6 +4460,9 @@ IApp::IPeerChatListItem *MegaChatApiImpl::addPeerChatItem(PeerChatRoom &chat)
     MegaChatPeerListItemHandler *itemHandler = new MegaChatPeerListItemHandler(*this, chat);
     chatPeerListItemHandler.insert(itemHandler);
 
+    // not in the list of chats yet, so the notification can't add it to the snapshot
+    updateSnapshotRoom(chat.chatid(), &chat);
+
     // notify the app about the new chatroom
     MegaChatListItemPrivate *item = new MegaChatListItemPrivate(chat);
     fireOnChatListItemUpdate(item);
@@ -3938,6 +4478,7 @@ void MegaChatApiImpl::removeGroupChatItem(IGroupChatListItem &item)
         IGroupChatListItem *itemHandler = (*it);
         if (itemHandler == &item)
         {
+            updateSnapshotRoom((*it)->getChatRoom().chatid(), NULL);
             delete (itemHandler);
             chatGroupListItemHandler.erase(it);
             return;
@@ -3955,6 +4496,7 @@ void MegaChatApiImpl::removePeerChatItem(IPeerChatListItem &item)
         IPeerChatListItem *itemHandler = (*it);
         if (itemHandler == &item)
         {
+            updateSnapshotRoom((*it)->getChatRoom().chatid(), NULL);
             delete (itemHandler);
             chatPeerListItemHandler.erase(it);
             return;
@@ -3974,6 +4516,23 @@ void MegaChatApiImpl::onPresenceChanged(Id userid, Presence pres, bool inProgres
     {
         API_LOG_INFO("Presence of user %s has been changed to %s", userid.toString().c_str(), pres.toString());
     }
+    if (mPresenceNotifInterval)
+    {
+        if (!inProgress)
+        {
+            // the snapshot is updated with the batch
+            mPendingOnlineStatus[userid.val] = pres.status();
+            schedulePresenceNotifications();
+            return;
+        }
+
+        // the own status in progress is notified right away, the previous one is outdated
+        mPendingOnlineStatus.erase(userid.val);
+    }
+    else if (!inProgress)
+    {
+        updateSnapshotPresence({{userid.val, pres.status()}});
+    }
     fireOnChatOnlineStatusUpdate(userid.val, pres.status(), inProgress);
 }
 
@@ -3985,9 +4544,64 @@ void MegaChatApiImpl::onPresenceConfigChanged(const presenced::Config &state, bo
 
 void MegaChatApiImpl::onPresenceLastGreenUpdated(Id userid, uint16_t lastGreen)
 {
+    if (mPresenceNotifInterval)
+    {
+        mPendingLastGreen[userid.val] = lastGreen;
+        schedulePresenceNotifications();
+        return;
+    }
     fireOnChatPresenceLastGreenUpdated(userid, lastGreen);
 }
 
+void MegaChatApiImpl::schedulePresenceNotifications()
+{
+    if (mPresenceNotifTimer)
+    {
+        return;     // the pending changes will be included in the next batch
+    }
+
+    // notify right away (after the current burst of events) if the last batch is old enough
+    int64_t delay = mPresenceNotifTs + mPresenceNotifInterval - (int64_t)karere::timestampMs();
+    mPresenceNotifTimer = karere::setTimeout([this]()
+    {
+        mPresenceNotifTimer = 0;
+        flushPresenceNotifications();
+    }, (delay > 0) ? (unsigned)delay : 0, this);
+}
+
+void MegaChatApiImpl::flushPresenceNotifications()
+{
+    mPresenceNotifTs = karere::timestampMs();
+
+    // the pending changes are cleared before the callbacks, which may cause new changes
+    if (!mPendingOnlineStatus.empty())
+    {
+        updateSnapshotPresence(mPendingOnlineStatus);
+        MegaChatOnlineStatusListPrivate list(mPendingOnlineStatus);
+        mPendingOnlineStatus.clear();
+        API_LOG_DEBUG("Notifying changes of online status of %u users", list.size());
+        fireOnChatOnlineStatusUpdateBatch(&list);
+    }
+
+    if (!mPendingLastGreen.empty())
+    {
+        MegaChatLastGreenListPrivate list(mPendingLastGreen);
+        mPendingLastGreen.clear();
+        fireOnChatPresenceLastGreenBatch(&list);
+    }
+}
+
+void MegaChatApiImpl::cancelPresenceNotifications()
+{
+    if (mPresenceNotifTimer)
+    {
+        karere::cancelTimeout(mPresenceNotifTimer, this);
+        mPresenceNotifTimer = 0;
+    }
+    mPendingOnlineStatus.clear();
+    mPendingLastGreen.clear();
+}
+
 ChatRequestQueue::ChatRequestQueue()
 {
     mutex.init(false);
@@ -4037,59 +4651,161 @@ void ChatRequestQueue::removeListener(MegaChatRequestListener *listener)
     mutex.unlock();
 }
 
-EventQueue::EventQueue()
+// index of the bucket of a logarithmic histogram of kBucketCount buckets, where
+// the first one holds values < firstLimit, and the last one the values that are out of range
+static int histogramBucket(int64_t value, int64_t firstLimit, int64_t factor)
 {
-    mutex.init(false);
+    int bucket = 0;
+    for (int64_t limit = firstLimit; bucket < EventQueue::kBucketCount - 1 && value >= limit; limit *= factor)
+    {
+        bucket++;
+    }
+    return bucket;
 }
 
-void EventQueue::push(void *transfer)
+static std::string histogramReport(const std::atomic<uint64_t> *counts, const char **bucketNames)
 {
-    mutex.lock();
-    events.push_back(transfer);
-    mutex.unlock();
+    std::string report;
+    for (int i = 0; i < EventQueue::kBucketCount; i++)
+    {
+        if (i)
+        {
+            report.append(", ");
+        }
+        report.append(bucketNames[i]).append(": ").append(std::to_string(counts[i].load(std::memory_order_relaxed)));
+    }
+    return report;
 }
 
-void EventQueue::push_front(void *event)
+static int64_t steadyTimestampUs()
 {
-    mutex.lock();
-    events.push_front(event);
-    mutex.unlock();
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-void* EventQueue::pop()
+EventQueue::EventQueue()
 {
-    mutex.lock();
-    if(events.empty())
+    for (int i = 0; i < kBucketCount; i++)
     {
-        mutex.unlock();
-        return NULL;
+        mBatchSizes[i] = 0;
+        mLatencies[i] = 0;
     }
-    void* event = events.front();
-    events.pop_front();
-    mutex.unlock();
-    return event;
 }
 
-bool EventQueue::isEmpty()
+void EventQueue::push(void *event)
 {
-    bool ret;
+    Event ev;
+    ev.msg = event;
+    ev.pushTs = steadyTimestampUs();
+    events.push(ev);
+}
 
-    mutex.lock();
-    ret = events.empty();
-    mutex.unlock();
+size_t EventQueue::processAll(void (*process)(void *))
+{
+    // messages posted while processing the batch are left for the next call,
+    // so a message that keeps posting itself doesn't starve the requests
+    batch.clear();
+    size_t count = events.popAll(batch);
+    if (!count)
+    {
+        return 0;
+    }
+    mBatchSizes[histogramBucket(count, 4, 4)].fetch_add(1, std::memory_order_relaxed);
 
-    return ret;
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        int64_t latency = steadyTimestampUs() - batch[i].pushTs;
+        mLatencies[histogramBucket(latency, 1, 10)].fetch_add(1, std::memory_order_relaxed);
+        process(batch[i].msg);
+    }
+    return count;
+}
+
+bool EventQueue::isEmpty()
+{
+    return events.empty();
 }
 
 size_t EventQueue::size()
 {
-    size_t ret;
+    return events.size();
+}
 
-    mutex.lock();
-    ret = events.size();
-    mutex.unlock();
+std::string EventQueue::statsReport() const
+{
+    static const char *batchNames[kBucketCount] = { "<4", "<16", "<64", "<256", "<1024", "<4096", "<16384", ">=16384" };
+    static const char *latencyNames[kBucketCount] = { "<1us", "<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s" };
+    return "events per wakeup: " + histogramReport(mBatchSizes, batchNames)
+            + "; latency: " + histogramReport(mLatencies, latencyNames);
+}
 
-    return ret;
+MegaChatMutex::MegaChatMutex(bool recursive)
+    : MegaMutex(recursive)
+{
+    for (int i = 0; i < kBucketCount; i++)
+    {
+        mWaits[i] = 0;
+    }
+}
+
+void MegaChatMutex::lock()
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    MegaMutex::lock();
+    int64_t waitUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    mWaits[histogramBucket(waitUs, 1, 10)].fetch_add(1, std::memory_order_relaxed);
+}
+
+std::string MegaChatMutex::contentionReport() const
+{
+    static const char *bucketNames[kBucketCount] = { "<1us", "<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s" };
+    return histogramReport(mWaits, bucketNames);
+}
+
+const ChatSnapshot::Room *ChatSnapshot::findRoom(MegaChatHandle chatid) const
+{
+    const std::shared_ptr<const RoomList> &bucket = rooms[bucketOf(chatid)];
+    if (!bucket)
+    {
+        return NULL;
+    }
+    RoomList::const_iterator it = std::lower_bound(bucket->begin(), bucket->end(), chatid,
+        [](const RoomList::value_type &entry, MegaChatHandle id) { return entry.first < id; });
+    return (it != bucket->end() && it->first == chatid) ? it->second.get() : NULL;
+}
+
+const ChatSnapshot::Room *ChatSnapshot::findRoomByContact(MegaChatHandle userhandle) const
+{
+    for (auto &bucket: rooms)
+    {
+        if (!bucket)
+        {
+            continue;
+        }
+        for (RoomList::const_iterator it = bucket->begin(); it != bucket->end(); it++)
+        {
+            if (it->second->contact == userhandle)
+            {
+                return it->second.get();
+            }
+        }
+    }
+    return NULL;
+}
+
+int ChatSnapshot::userOnlineStatus(MegaChatHandle userhandle) const
+{
+    const std::shared_ptr<const PresenceMap> &bucket = presence[bucketOf(userhandle)];
+    if (bucket)
+    {
+        PresenceMap::const_iterator it = bucket->find(userhandle);
+        if (it != bucket->end())
+        {
+            return it->second;
+        }
+    }
+    return Presence(Presence::kInvalid).status();
 }
 
 MegaChatRequestPrivate::MegaChatRequestPrivate(int type, MegaChatRequestListener *listener)
@@ -4199,6 +4915,7 @@ const char *MegaChatRequestPrivate::getRequestString() const
         case TYPE_PUSH_RECEIVED: return "PUSH_RECEIVED";
         case TYPE_SET_LAST_GREEN_VISIBLE: return "SET_LAST_GREEN_VISIBLE";
         case TYPE_LAST_GREEN: return "TYPE_LAST_GREEN";
+        case TYPE_SEARCH_MESSAGES: return "SEARCH_MESSAGES";
     }
     return "UNKNOWN";
 }
@@ -5134,6 +5851,8 @@ void MegaChatRoomHandler::removeChatRoomListener(MegaChatRoomListener *listener)
 
 void MegaChatRoomHandler::fireOnChatRoomUpdate(MegaChatRoom *chat)
 {
+    chatApiImpl->updateSnapshotRoom(chatid);
+
     for(set<MegaChatRoomListener *>::iterator it = roomListeners.begin(); it != roomListeners.end() ; it++)
     {
         (*it)->onChatRoomUpdate(chatApi, chat);
@@ -5233,14 +5952,13 @@ bool MegaChatRoomHandler::isRevoked(MegaChatHandle h)
     return false;
 }
 
-void MegaChatRoomHandler::handleHistoryMessage(MegaChatMessage *message)
+void MegaChatRoomHandler::handleHistoryMessage(MegaChatMessagePrivate *message)
 {
     if (message->getType() == MegaChatMessage::TYPE_NODE_ATTACHMENT)
     {
-        MegaNodeList *nodeList = message->getMegaNodeList();
-        for (int i = 0; i < nodeList->size(); i++)
+        std::vector<MegaChatHandle> handles = message->getAttachedNodeHandles();
+        for (MegaChatHandle h : handles)
         {
-            MegaChatHandle h = nodeList->get(i)->getHandle();
             auto itAccess = attachmentsAccess.find(h);
             if (itAccess == attachmentsAccess.end())
             {
@@ -5260,17 +5978,16 @@ void MegaChatRoomHandler::handleHistoryMessage(MegaChatMessage *message)
     }
 }
 
-std::set<MegaChatHandle> *MegaChatRoomHandler::handleNewMessage(MegaChatMessage *message)
+std::set<MegaChatHandle> *MegaChatRoomHandler::handleNewMessage(MegaChatMessagePrivate *message)
 {
     set <MegaChatHandle> *msgToUpdate = NULL;
 
     // new messages overwrite any current access to nodes
     if (message->getType() == MegaChatMessage::TYPE_NODE_ATTACHMENT)
     {
-        MegaNodeList *nodeList = message->getMegaNodeList();
-        for (int i = 0; i < nodeList->size(); i++)
+        std::vector<MegaChatHandle> handles = message->getAttachedNodeHandles();
+        for (MegaChatHandle h : handles)
         {
-            MegaChatHandle h = nodeList->get(i)->getHandle();
             auto itAccess = attachmentsAccess.find(h);
             if (itAccess != attachmentsAccess.end() && !itAccess->second)
             {
@@ -5359,6 +6076,15 @@ void MegaChatRoomHandler::onRecvNewMessage(Idx idx, Message &msg, Message::Statu
     MegaChatMessagePrivate *message = new MegaChatMessagePrivate(msg, status, idx);
     set <MegaChatHandle> *msgToUpdate = handleNewMessage(message);
 
+    // check if notification is required
+    MegaChatMessage *notification = NULL;
+    if ( (msg.type == chatd::Message::kMsgTruncate)   // truncate received from a peer or from myself in another client
+         || (msg.userid != chatApi->getMyUserHandle() && status == chatd::Message::kNotSeen) )  // new (unseen) message received from a peer
+    {
+        // cheaper than building it again from the chatd message, the payload is not parsed
+        notification = message->copy();
+    }
+
     fireOnMessageReceived(message);
 
     if (msgToUpdate)
@@ -5375,13 +6101,9 @@ void MegaChatRoomHandler::onRecvNewMessage(Idx idx, Message &msg, Message::Statu
         delete msgToUpdate;
     }
 
-    // check if notification is required
-    if ( (msg.type == chatd::Message::kMsgTruncate)   // truncate received from a peer or from myself in another client
-         || (msg.userid != chatApi->getMyUserHandle() && status == chatd::Message::kNotSeen) )  // new (unseen) message received from a peer
+    if (notification)
     {
-
-        MegaChatMessagePrivate *message = new MegaChatMessagePrivate(msg, status, idx);
-        chatApiImpl->fireOnChatNotification(chatid, message);
+        chatApiImpl->fireOnChatNotification(chatid, notification);
     }
 }
 
@@ -5726,7 +6448,7 @@ MegaChatRoomPrivate::MegaChatRoomPrivate(const ChatRoom &chat)
     this->group = chat.isGroup();
     this->title = chat.titleString();
     this->mHasCustomTitle = chat.isGroup() ? ((GroupChatRoom*)&chat)->hasTitle() : false;
-    this->unreadCount = chat.chat().unreadMsgCount();
+    this->unreadCount = chat.unreadCount();
     this->active = chat.isActive();
     this->archived = chat.isArchived();
     this->uh = MEGACHAT_INVALID_HANDLE;
@@ -6169,7 +6891,7 @@ MegaChatListItemPrivate::MegaChatListItemPrivate(ChatRoom &chatroom)
 {
     this->chatid = chatroom.chatid();
     this->title = chatroom.titleString();
-    this->unreadCount = chatroom.chat().unreadMsgCount();
+    this->unreadCount = chatroom.unreadCount();
     this->group = chatroom.isGroup();
     this->active = chatroom.isActive();
     this->ownPriv = chatroom.ownPriv();
@@ -6183,7 +6905,7 @@ MegaChatListItemPrivate::MegaChatListItemPrivate(ChatRoom &chatroom)
     LastTextMsg tmp;
     LastTextMsg *message = &tmp;
     LastTextMsg *&msg = message;
-    uint8_t lastMsgStatus = chatroom.chat().lastTextMessage(msg);
+    uint8_t lastMsgStatus = chatroom.lastTextMessage(msg);
     if (lastMsgStatus == LastTextMsgState::kHave)
     {        
         this->lastMsgSender = msg->sender();
@@ -6248,7 +6970,7 @@ MegaChatListItemPrivate::MegaChatListItemPrivate(ChatRoom &chatroom)
         this->mLastMsgId = MEGACHAT_INVALID_HANDLE;
     }
 
-    this->lastTs = chatroom.chat().lastMessageTs();
+    this->lastTs = chatroom.lastMessageTs();
 }
 
 MegaChatListItemPrivate::MegaChatListItemPrivate(const MegaChatListItem *item)
@@ -6492,6 +7214,12 @@ void MegaChatListItemHandler::onChatArchived(bool archived)
     chatApi.fireOnChatListItemUpdate(item);
 }
 
+void MegaChatListItemHandler::onMembersInfoChanged()
+{
+    // not notified to the app, but returned by getChatRoom()
+    chatApi.scheduleSnapshotRoomUpdate(mRoom.chatid());
+}
+
 MegaChatPeerListItemHandler::MegaChatPeerListItemHandler(MegaChatApiImpl &chatApi, ChatRoom &room)
     : MegaChatListItemHandler(chatApi, room)
 {
@@ -6536,12 +7264,47 @@ MegaChatMessagePrivate::MegaChatMessagePrivate(const MegaChatMessage *msg)
     }
 }
 
+MegaChatMessagePrivate::MegaChatMessagePrivate(const MegaChatMessagePrivate *msg)
+{
+    this->msg = MegaApi::strdup(msg->msg);
+    this->uh = msg->uh;
+    this->hAction = msg->hAction;
+    this->msgId = msg->msgId;
+    this->tempId = msg->tempId;
+    this->index = msg->index;
+    this->status = msg->status;
+    this->ts = msg->ts;
+    this->type = msg->type;
+    this->changed = msg->changed;
+    this->edited = msg->edited;
+    this->deleted = msg->deleted;
+    this->priv = msg->priv;
+    this->code = msg->code;
+    this->rowId = msg->rowId;
+    this->megaHandleList = msg->megaHandleList ? msg->megaHandleList->copy() : NULL;
+
+    std::lock_guard<std::mutex> lock(msg->mPayloadMutex);
+    if (!msg->mPayloadParsed)   // copy the payload, not the result of parsing it
+    {
+        this->mPayload = msg->mPayload;
+        this->mContainsMetaType = msg->mContainsMetaType;
+        this->mPayloadParsed = false;
+        return;
+    }
+
+    this->megaNodeList = msg->megaNodeList ? msg->megaNodeList->copy() : NULL;
+    this->megaChatUsers = msg->megaChatUsers ? new std::vector<MegaChatAttachedUser>(*msg->megaChatUsers) : NULL;
+    this->mContainsMeta = msg->mContainsMeta ? msg->mContainsMeta->copy() : NULL;
+}
+
 MegaChatMessagePrivate::MegaChatMessagePrivate(const Message &msg, Message::Status status, Idx index)
 {
-    if (msg.type == TYPE_NORMAL || msg.type == TYPE_CHAT_TITLE)
+    if ((msg.type == TYPE_NORMAL || msg.type == TYPE_CHAT_TITLE) && msg.size())
     {
-        string tmp(msg.buf(), msg.size());
-        this->msg = msg.size() ? MegaApi::strdup(tmp.c_str()) : NULL;
+        char *content = new char[msg.size() + 1];
+        memcpy(content, msg.buf(), msg.size());
+        content[msg.size()] = '\0';
+        this->msg = content;
     }
     else    // for other types, content is irrelevant
     {
@@ -6575,8 +7338,10 @@ MegaChatMessagePrivate::MegaChatMessagePrivate(const Message &msg, Message::Stat
         }
         case MegaChatMessage::TYPE_NODE_ATTACHMENT:
         case MegaChatMessage::TYPE_VOICE_CLIP:
+        case MegaChatMessage::TYPE_CONTACT_ATTACHMENT:
         {
-            megaNodeList = JSonUtils::parseAttachNodeJSon(msg.toText().c_str());
+            mPayload = msg.toText();
+            mPayloadParsed = false;
             break;
         }
         case MegaChatMessage::TYPE_REVOKE_NODE_ATTACHMENT:
@@ -6584,16 +7349,11 @@ MegaChatMessagePrivate::MegaChatMessagePrivate(const Message &msg, Message::Stat
             this->hAction = MegaApi::base64ToHandle(msg.toText().c_str());
             break;
         }
-        case MegaChatMessage::TYPE_CONTACT_ATTACHMENT:
-        {
-            megaChatUsers = JSonUtils::parseAttachContactJSon(msg.toText().c_str());
-            break;
-        }
         case MegaChatMessage::TYPE_CONTAINS_META:
         {
-            uint8_t containsMetaType = msg.containMetaSubtype();
-            string containsMetaJson = msg.containsMetaJson();
-            mContainsMeta = JSonUtils::parseContainsMeta(containsMetaJson.c_str(), containsMetaType);
+            mContainsMetaType = msg.containMetaSubtype();
+            mPayload = msg.containsMetaJson();
+            mPayloadParsed = false;
             break;
         }
         case MegaChatMessage::TYPE_CALL_ENDED:
@@ -6642,6 +7402,12 @@ MegaChatMessagePrivate::MegaChatMessagePrivate(const Message &msg, Message::Stat
     case Message::kNotEncrypted:
         break;
     }
+
+    if (encryptionState != Message::kNotEncrypted && !mPayloadParsed)
+    {
+        mPayload.clear();   // not decrypted, nothing to parse
+        mPayloadParsed = true;
+    }
 }
 
 MegaChatMessagePrivate::~MegaChatMessagePrivate()
@@ -6653,6 +7419,54 @@ MegaChatMessagePrivate::~MegaChatMessagePrivate()
     delete megaHandleList;
 }
 
+void MegaChatMessagePrivate::parsePayload() const
+{
+    std::lock_guard<std::mutex> lock(mPayloadMutex);
+    if (mPayloadParsed)
+    {
+        return;
+    }
+
+    mPayloadParsed = true;
+    switch (type)
+    {
+        case MegaChatMessage::TYPE_NODE_ATTACHMENT:
+        case MegaChatMessage::TYPE_VOICE_CLIP:
+            megaNodeList = JSonUtils::parseAttachNodeJSon(mPayload.c_str());
+            break;
+
+        case MegaChatMessage::TYPE_CONTACT_ATTACHMENT:
+            megaChatUsers = JSonUtils::parseAttachContactJSon(mPayload.c_str());
+            break;
+
+        case MegaChatMessage::TYPE_CONTAINS_META:
+            mContainsMeta = JSonUtils::parseContainsMeta(mPayload.c_str(), mContainsMetaType);
+            break;
+
+        default:    // i.e. undecryptable messages, whose type was changed
+            break;
+    }
+}
+
+std::vector<MegaChatHandle> MegaChatMessagePrivate::getAttachedNodeHandles() const
+{
+    std::vector<MegaChatHandle> handles;
+    std::lock_guard<std::mutex> lock(mPayloadMutex);
+    if (!mPayloadParsed)
+    {
+        JSonUtils::parseAttachNodeHandles(mPayload.c_str(), handles);
+    }
+    else if (megaNodeList)
+    {
+        for (int i = 0; i < megaNodeList->size(); i++)
+        {
+            handles.push_back(megaNodeList->get(i)->getHandle());
+        }
+    }
+
+    return handles;
+}
+
 MegaChatMessage *MegaChatMessagePrivate::copy() const
 {
     return new MegaChatMessagePrivate(this);
@@ -6818,6 +7632,7 @@ int MegaChatMessagePrivate::convertEndCallTermCodeToUI(const Message::CallEndedI
 
 unsigned int MegaChatMessagePrivate::getUsersCount() const
 {
+    parsePayload();
     unsigned int size = 0;
     if (megaChatUsers != NULL)
     {
@@ -6829,6 +7644,7 @@ unsigned int MegaChatMessagePrivate::getUsersCount() const
 
 MegaChatHandle MegaChatMessagePrivate::getUserHandle(unsigned int index) const
 {
+    parsePayload();
     if (!megaChatUsers || index >= megaChatUsers->size())
     {
         return MEGACHAT_INVALID_HANDLE;
@@ -6839,6 +7655,7 @@ MegaChatHandle MegaChatMessagePrivate::getUserHandle(unsigned int index) const
 
 const char *MegaChatMessagePrivate::getUserName(unsigned int index) const
 {
+    parsePayload();
     if (!megaChatUsers || index >= megaChatUsers->size())
     {
         return NULL;
@@ -6849,6 +7666,7 @@ const char *MegaChatMessagePrivate::getUserName(unsigned int index) const
 
 const char *MegaChatMessagePrivate::getUserEmail(unsigned int index) const
 {
+    parsePayload();
     if (!megaChatUsers || index >= megaChatUsers->size())
     {
         return NULL;
@@ -6859,11 +7677,13 @@ const char *MegaChatMessagePrivate::getUserEmail(unsigned int index) const
 
 MegaNodeList *MegaChatMessagePrivate::getMegaNodeList() const
 {
+    parsePayload();
     return megaNodeList;
 }
 
 const MegaChatContainsMeta *MegaChatMessagePrivate::getContainsMeta() const
 {
+    parsePayload();
     return mContainsMeta;
 }
 
@@ -7465,6 +8285,56 @@ void MegaChatListItemListPrivate::addChatListItem(MegaChatListItem *item)
     list.push_back(item);
 }
 
+MegaChatOnlineStatusListPrivate::MegaChatOnlineStatusListPrivate(const std::map<MegaChatHandle, int> &statuses)
+    : list(statuses.begin(), statuses.end())
+{
+}
+
+MegaChatOnlineStatusList *MegaChatOnlineStatusListPrivate::copy() const
+{
+    return new MegaChatOnlineStatusListPrivate(*this);
+}
+
+MegaChatHandle MegaChatOnlineStatusListPrivate::getUserHandle(unsigned int i) const
+{
+    return (i < list.size()) ? list[i].first : MEGACHAT_INVALID_HANDLE;
+}
+
+int MegaChatOnlineStatusListPrivate::getStatus(unsigned int i) const
+{
+    return (i < list.size()) ? list[i].second : (int)MegaChatApi::STATUS_INVALID;
+}
+
+unsigned int MegaChatOnlineStatusListPrivate::size() const
+{
+    return list.size();
+}
+
+MegaChatLastGreenListPrivate::MegaChatLastGreenListPrivate(const std::map<MegaChatHandle, int> &lastGreens)
+    : list(lastGreens.begin(), lastGreens.end())
+{
+}
+
+MegaChatLastGreenList *MegaChatLastGreenListPrivate::copy() const
+{
+    return new MegaChatLastGreenListPrivate(*this);
+}
+
+MegaChatHandle MegaChatLastGreenListPrivate::getUserHandle(unsigned int i) const
+{
+    return (i < list.size()) ? list[i].first : MEGACHAT_INVALID_HANDLE;
+}
+
+int MegaChatLastGreenListPrivate::getLastGreen(unsigned int i) const
+{
+    return (i < list.size()) ? list[i].second : -1;
+}
+
+unsigned int MegaChatLastGreenListPrivate::size() const
+{
+    return list.size();
+}
+
 MegaChatPresenceConfigPrivate::MegaChatPresenceConfigPrivate(const MegaChatPresenceConfigPrivate &config)
 {
     this->status = config.getOnlineStatus();
@@ -7872,6 +8742,47 @@ std::string JSonUtils::generateAttachNodeJSon(MegaNodeList *nodes, uint8_t type)
     return ret;
 }
 
+bool JSonUtils::parseAttachNodeHandles(const char *json, std::vector<MegaChatHandle> &handles)
+{
+    if (!json || strcmp(json, "") == 0)
+    {
+        API_LOG_ERROR("Invalid attachment JSON");
+        return false;
+    }
+
+    rapidjson::StringStream stringStream(json);
+    rapidjson::Document document;
+    document.ParseStream(stringStream);
+
+    if (document.GetParseError() != rapidjson::ParseErrorCode::kParseErrorNone || !document.IsArray())
+    {
+        API_LOG_ERROR("parseAttachNodeHandles: Parser json error");
+        return false;
+    }
+
+    for (unsigned int i = 0; i < document.Size(); ++i)
+    {
+        const rapidjson::Value& file = document[i];
+        if (!file.IsObject())
+        {
+            API_LOG_ERROR("parseAttachNodeHandles: Invalid attachment JSON");
+            handles.clear();
+            return false;
+        }
+
+        rapidjson::Value::ConstMemberIterator iteratorHandle = file.FindMember("h");
+        if (iteratorHandle == file.MemberEnd() || !iteratorHandle->value.IsString())
+        {
+            API_LOG_ERROR("parseAttachNodeHandles: Invalid nodehandle in attachment JSON");
+            handles.clear();
+            return false;
+        }
+        handles.push_back(MegaApi::base64ToHandle(iteratorHandle->value.GetString()));
+    }
+
+    return true;
+}
+
 MegaNodeList *JSonUtils::parseAttachNodeJSon(const char *json)
 {
     if (!json || strcmp(json, "") == 0)
@@ -43,8 +43,12 @@
 #include <logger.h>
 #include <rapidjson/document.h>
 #include <stdint.h>
+#include <array>
+#include <atomic>
+#include <mutex>
 #include "net/libwebsocketsIO.h"
 #include "waiter/libuvWaiter.h"
+#include <base/mpscQueue.h>
 
 typedef LibwebsocketsIO MegaWebsocketsIO;
 typedef ::mega::LibuvWaiter MegaChatWaiter;
@@ -390,6 +394,7 @@ public:
     virtual void onLastTsUpdated(uint32_t ts);
     virtual void onChatOnlineState(const chatd::ChatState state);
     virtual void onChatArchived(bool archived);
+    virtual void onMembersInfoChanged();
 
     virtual const karere::ChatRoom& getChatRoom() const;
 
@@ -418,6 +423,8 @@ public:
     MegaChatPeerListItemHandler(MegaChatApiImpl &, karere::ChatRoom&);
 };
 
+class MegaChatMessagePrivate;
+
 class MegaChatRoomHandler :public karere::IApp::IChatHandler
 {
 public:
@@ -476,9 +483,9 @@ public:
 
     bool isRevoked(MegaChatHandle h);
     // update access to attachments
-    void handleHistoryMessage(MegaChatMessage *message);
+    void handleHistoryMessage(MegaChatMessagePrivate *message);
     // update access to attachments, returns messages requiring updates (you take ownership)
-    std::set<MegaChatHandle> *handleNewMessage(MegaChatMessage *msg);
+    std::set<MegaChatHandle> *handleNewMessage(MegaChatMessagePrivate *msg);
 
 protected:
 
@@ -663,6 +670,34 @@ private:
     std::vector<MegaChatListItem*> list;
 };
 
+class MegaChatOnlineStatusListPrivate : public MegaChatOnlineStatusList
+{
+public:
+    MegaChatOnlineStatusListPrivate(const std::map<MegaChatHandle, int> &statuses);
+    virtual MegaChatOnlineStatusList *copy() const;
+
+    virtual MegaChatHandle getUserHandle(unsigned int i) const;
+    virtual int getStatus(unsigned int i) const;
+    virtual unsigned int size() const;
+
+private:
+    std::vector<std::pair<MegaChatHandle, int>> list;
+};
+
+class MegaChatLastGreenListPrivate : public MegaChatLastGreenList
+{
+public:
+    MegaChatLastGreenListPrivate(const std::map<MegaChatHandle, int> &lastGreens);
+    virtual MegaChatLastGreenList *copy() const;
+
+    virtual MegaChatHandle getUserHandle(unsigned int i) const;
+    virtual int getLastGreen(unsigned int i) const;
+    virtual unsigned int size() const;
+
+private:
+    std::vector<std::pair<MegaChatHandle, int>> list;
+};
+
 class MegaChatRoomPrivate : public MegaChatRoom
 {
 public:
@@ -754,10 +789,18 @@ class MegaChatAttachedUser;
 class MegaChatRichPreviewPrivate;
 class MegaChatContainsMetaPrivate;
 
+/** @brief Message exposed to the app.
+ *
+ * The JSON payload of attachments, contacts and messages with meta is kept as received
+ * and parsed only when one of the getters that need it is first called, since apps
+ * usually load many messages and show only some of them. The parsing is serialized by
+ * mPayloadMutex, so those getters can be called concurrently for the same object.
+ */
 class MegaChatMessagePrivate : public MegaChatMessage
 {
 public:
     MegaChatMessagePrivate(const MegaChatMessage *msg);
+    MegaChatMessagePrivate(const MegaChatMessagePrivate *msg);
     MegaChatMessagePrivate(const chatd::Message &msg, chatd::Message::Status status, chatd::Idx index);
 
     virtual ~MegaChatMessagePrivate();
@@ -801,6 +844,9 @@ public:
     void setCode(int code);
     void setAccess();
 
+    // handles of the attached nodes, without parsing the whole attachment if not parsed yet
+    std::vector<MegaChatHandle> getAttachedNodeHandles() const;
+
     static int convertEndCallTermCodeToUI(const chatd::Message::CallEndedInfo &callEndInfo);
 
 private:
@@ -820,10 +866,17 @@ private:
     bool deleted;
     int priv;               // certain messages need additional info, like priv changes
     int code;               // generic field for additional information (ie. the reason of manual sending)
-    std::vector<MegaChatAttachedUser> *megaChatUsers = NULL;
-    mega::MegaNodeList *megaNodeList = NULL;
+    mutable std::vector<MegaChatAttachedUser> *megaChatUsers = NULL;
+    mutable mega::MegaNodeList *megaNodeList = NULL;
     mega::MegaHandleList *megaHandleList = NULL;
-    const MegaChatContainsMeta *mContainsMeta = NULL;
+    mutable const MegaChatContainsMeta *mContainsMeta = NULL;
+
+    std::string mPayload;           // JSON of the attachment/contact/meta, until parsed
+    uint8_t mContainsMetaType = 0;
+    mutable bool mPayloadParsed = true;
+    mutable std::mutex mPayloadMutex;   // guards the lazy parsing of mPayload
+
+    void parsePayload() const;
 };
 
 //Thread safe request queue
@@ -841,20 +894,105 @@ class ChatRequestQueue
         void removeListener(MegaChatRequestListener *listener);
 };
 
-//Thread safe transfer queue
+/** @brief Queue of the messages marshalled to the karere thread. Any thread can push,
+ * and the karere thread drains all the queued messages at once, when woken up.
+ * Keeps histograms of the number of messages per drain, and of the time from push
+ * to processing.
+ */
 class EventQueue
 {
-protected:
-    std::deque<void *> events;
-    mega::MegaMutex mutex;
-
 public:
+    enum { kBucketCount = 8 };
     EventQueue();
     void push(void* event);
-    void push_front(void *event);
-    void* pop();
+    /** Pops all the queued messages and processes them. Called by the karere thread */
+    size_t processAll(void (*process)(void *));
     bool isEmpty();
     size_t size();
+    std::string statsReport() const;
+
+protected:
+    struct Event
+    {
+        void *msg;
+        int64_t pushTs; // microseconds, steady clock
+    };
+    karere::MpscQueue<Event> events;
+    std::vector<Event> batch; // reused by processAll()
+    std::atomic<uint64_t> mBatchSizes[kBucketCount];  // <4, <16, <64, ... <16384, >=16384
+    std::atomic<uint64_t> mLatencies[kBucketCount];   // <1us, <10us, ... <1s, >=1s
+};
+
+/** @brief Recursive mutex that keeps a histogram of the time that callers wait to
+ * acquire it. Used for \c sdkMutex, to measure how much the app's threads are
+ * blocked by the karere thread and vice versa.
+ */
+class MegaChatMutex : public mega::MegaMutex
+{
+public:
+    enum { kBucketCount = 8 }; // waits of <1us, <10us, <100us, ... <1s, >=1s
+    MegaChatMutex(bool recursive);
+    virtual void lock();
+    std::string contentionReport() const;
+
+protected:
+    std::atomic<uint64_t> mWaits[kBucketCount];
+};
+
+/** @brief Immutable view of the chat list and of the presence of users, published
+ * by the karere thread so that the read APIs, when called from other threads, don't
+ * have to wait for the karere thread to release \c sdkMutex.
+ *
+ * The whole view is built when the session is ready (offline or online). Then, the
+ * entry of a chat is updated before the app is notified of changes in its list item
+ * or chatroom, added when the chat is created and removed when it's deleted. Changes
+ * that the app is not notified of (i.e. names of the members of a chatroom that is not
+ * open) are applied shortly after, in a single update for all the chats changed meanwhile.
+ * The presence of users is updated before each notification of online status, so in
+ * batches if the notifications are coalesced.
+ *
+ * Chats and users are split in buckets by the top bits of their handles, which are
+ * random, and the buckets are shared between versions, so an update copies only the
+ * bucket it changes. Since the buckets are ordered, iterating them in order visits
+ * the chats sorted by chatid.
+ */
+struct ChatSnapshot
+{
+    struct Room
+    {
+        std::unique_ptr<MegaChatRoomPrivate> room;
+        std::unique_ptr<MegaChatListItemPrivate> item;
+        MegaChatHandle contact = MEGACHAT_INVALID_HANDLE; // the peer, if a 1on1 with a contact
+    };
+    typedef std::vector<std::pair<MegaChatHandle, std::shared_ptr<const Room>>> RoomList; // sorted by chatid
+    typedef std::map<MegaChatHandle, int> PresenceMap;
+
+    static const int kBucketBits = 6;
+    static const size_t kBucketCount = (size_t)1 << kBucketBits;
+    static size_t bucketOf(MegaChatHandle handle) { return (size_t)(handle >> (64 - kBucketBits)); }
+
+    uint64_t version = 0;
+    MegaChatHandle myHandle = MEGACHAT_INVALID_HANDLE;
+    std::array<std::shared_ptr<const RoomList>, kBucketCount> rooms;       // NULL if empty
+    std::array<std::shared_ptr<const PresenceMap>, kBucketCount> presence; // NULL if empty
+
+    template <class F>
+    void forEachRoom(F&& func) const
+    {
+        for (auto &bucket: rooms)
+        {
+            if (bucket)
+            {
+                for (auto &entry: *bucket)
+                {
+                    func(*entry.second);
+                }
+            }
+        }
+    }
+    const Room *findRoom(MegaChatHandle chatid) const;
+    const Room *findRoomByContact(MegaChatHandle userhandle) const;
+    int userOnlineStatus(MegaChatHandle userhandle) const;
 };
 
 class MegaChatApiImpl :
@@ -866,9 +1004,10 @@ public:
     MegaChatApiImpl(MegaChatApi *chatApi, mega::MegaApi *megaApi);
     virtual ~MegaChatApiImpl();
 
-    mega::MegaMutex sdkMutex;
+    MegaChatMutex sdkMutex;
     mega::MegaMutex videoMutex;
     mega::Waiter *waiter;
+    karere::TimerWheel *timerWheel;
 private:
     MegaChatApi *chatApi;
     mega::MegaApi *megaApi;
@@ -887,6 +1026,9 @@ private:
 
     ChatRequestQueue requestQueue;
     EventQueue eventQueue;
+    // set by the first message posted since the last wakeup, so that a burst
+    // of messages notifies the waiter only once
+    std::atomic<bool> mWakeupPending;
 
     std::set<MegaChatListener *> listeners;
     std::set<MegaChatNotificationListener *> notificationListeners;
@@ -910,6 +1052,37 @@ private:
 
     static int convertInitState(int state);
 
+    // published view for the read APIs, accessed with std::atomic_load/store
+    std::shared_ptr<const ChatSnapshot> mSnapshot;
+    uint64_t mSnapshotVersion = 0;
+    std::shared_ptr<const ChatSnapshot> readSnapshot() const;
+    std::shared_ptr<ChatSnapshot::Room> makeSnapshotRoom(karere::ChatRoom &chatroom);
+    void publishSnapshot(ChatSnapshot *snapshot);
+    void buildSnapshot();
+    // updates the entry of the chat, or removes it if `chatroom` is NULL
+    void updateSnapshotRoom(MegaChatHandle chatid, karere::ChatRoom *chatroom);
+    void updateSnapshotPresence(const std::map<MegaChatHandle, int> &changes);
+    void clearSnapshot();
+    // chats with changes that the app is not notified of, updated in the snapshot by a timer
+    std::set<MegaChatHandle> mStaleSnapshotRooms;
+    megaHandle mStaleSnapshotTimer = 0;
+    void refreshStaleSnapshotRooms();
+
+    // max number of history messages in RAM, applied to the chatd client of every session (0 = unlimited)
+    unsigned int mHistChatBudget = 0;
+    unsigned int mHistGlobalBudget = 0;
+    void applyHistoryBudget();
+
+    // coalescing of the presence notifications (karere thread, the interval is set under sdkMutex)
+    int mPresenceNotifInterval = 0; // ms, 0 if disabled
+    megaHandle mPresenceNotifTimer = 0;
+    int64_t mPresenceNotifTs = 0;   // time of the last batch
+    std::map<MegaChatHandle, int> mPendingOnlineStatus;
+    std::map<MegaChatHandle, int> mPendingLastGreen;
+    void schedulePresenceNotifications();
+    void flushPresenceNotifications();
+    void cancelPresenceNotifications();
+
 public:
     static void megaApiPostMessage(void* msg, void* ctx);
     void postMessage(void *msg);
@@ -925,6 +1098,11 @@ public:
     int init(const char *sid);
     int getInitState();
 
+    // updates the entry of the chat in the view of the read APIs (karere thread only)
+    void updateSnapshotRoom(MegaChatHandle chatid);
+    // same, but shortly after, for changes that the app is not notified of
+    void scheduleSnapshotRoomUpdate(MegaChatHandle chatid);
+
     MegaChatRoomHandler* getChatRoomHandler(MegaChatHandle chatid);
     void removeChatRoomHandler(MegaChatHandle chatid);
 
@@ -984,6 +1162,8 @@ public:
     void fireOnChatOnlineStatusUpdate(MegaChatHandle userhandle, int status, bool inProgress);
     void fireOnChatPresenceConfigUpdate(MegaChatPresenceConfig *config);
     void fireOnChatPresenceLastGreenUpdated(MegaChatHandle userhandle, int lastGreen);
+    void fireOnChatOnlineStatusUpdateBatch(MegaChatOnlineStatusList *list);
+    void fireOnChatPresenceLastGreenBatch(MegaChatLastGreenList *list);
     void fireOnChatConnectionStateUpdate(MegaChatHandle chatid, int newState);
 
     // MegaChatNotificationListener callbacks
@@ -1012,6 +1192,7 @@ public:
     void signalPresenceActivity(MegaChatRequestListener *listener = NULL);
     void setLastGreenVisible(bool enable, MegaChatRequestListener *listener = NULL);
     void requestLastGreen(MegaChatHandle userid, MegaChatRequestListener *listener = NULL);
+    void setPresenceNotificationsInterval(int intervalMs);
     MegaChatPresenceConfig *getPresenceConfig();
     bool isSignalActivityRequired();
 
@@ -1057,9 +1238,11 @@ public:
 
     int loadMessages(MegaChatHandle chatid, int count);
     bool isFullHistoryLoaded(MegaChatHandle chatid);
+    void setHistoryBudget(unsigned int perChat, unsigned int global);
     MegaChatMessage *getMessage(MegaChatHandle chatid, MegaChatHandle msgid);
     MegaChatMessage *getMessageFromNodeHistory(MegaChatHandle chatid, MegaChatHandle msgid);
     MegaChatMessage *getManualSendingMessage(MegaChatHandle chatid, MegaChatHandle rowid);
+    void searchMessages(MegaChatHandle chatid, const char *text, int limit, MegaChatRequestListener *listener = NULL);
     MegaChatMessage *sendMessage(MegaChatHandle chatid, const char* msg, size_t msgLen, int type = MegaChatMessage::TYPE_NORMAL);
     MegaChatMessage *attachContacts(MegaChatHandle chatid, mega::MegaHandleList* contacts);
     MegaChatMessage *forwardContact(MegaChatHandle sourceChatid, MegaChatHandle msgid, MegaChatHandle targetChatId);
@@ -1272,6 +1455,9 @@ public:
     // you take the ownership of returned value. NULL if error
     static mega::MegaNodeList *parseAttachNodeJSon(const char* json);
 
+    // only the handles of the attached nodes. False if error
+    static bool parseAttachNodeHandles(const char* json, std::vector<MegaChatHandle> &handles);
+
     // you take the ownership of returned value. NULL if error
     static std::vector<MegaChatAttachedUser> *parseAttachContactJSon(const char* json);
 
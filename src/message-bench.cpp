@@ -0,0 +1,109 @@
+// Benchmark of the work done by the karere thread for each message that loadMessages()
+// delivers to the app (see MegaChatRoomHandler::onRecvHistoryMessage): the message is
+// converted to a MegaChatMessagePrivate, the access to its attachments is tracked and the
+// app shows some of them. Compares the eager parsing of the attachment JSON that was done
+// by the constructor against the lazy parsing on the first call to the getters.
+//
+// Usage: message-bench [message-count] [one-shown-every]
+// Build (from src, with the MEGA SDK, and karere built as a static library):
+// g++ -std=c++11 -O2 -I. -Ibase -I<sdk>/include -I<rapidjson>/include message-bench.cpp
+//     -L<build> -lkarere -lservices -lmega <SDK dependencies> -o message-bench
+// With CMake, enable optKarereBuildBenchmarks (target message-bench).
+
+#include <chrono>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include "megachatapi_impl.h"
+
+using namespace megachat;
+
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// attachment of two nodes, as generated by JSonUtils::generateAttachNodeJSon()
+static std::string attachmentJson(uint64_t i)
+{
+    std::string json = "[";
+    for (int j = 0; j < 2; j++)
+    {
+        char node[512];
+        snprintf(node, sizeof(node),
+                 "%s{\"h\":\"%08llu\",\"k\":[1019912233,-1361423401,1741012843,-1008745325,"
+                 "-2094421312,1240187421,-1873423122,984372012],\"t\":0,\"name\":\"IMG_%llu_%d.jpg\","
+                 "\"s\":%llu,\"hash\":\"WmxjFAyDi5C8Fe2IuoXKSgTLu4ZYD\",\"fa\":\"924:0*4uN3bW1Vbn0/925:1*QqbYqe0R3Lk\","
+                 "\"ts\":1550000000}",
+                 j ? "," : "", (unsigned long long)(i * 2 + j) % 100000000, (unsigned long long)i, j,
+                 (unsigned long long)(100000 + i));
+        json.append(node);
+    }
+    json.append("]");
+    return json;
+}
+
+static bool bench(const std::vector<chatd::Message*>& msgs, unsigned shownEvery, bool eager)
+{
+    size_t handleCount = 0;
+    size_t nodeCount = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < msgs.size(); i++)
+    {
+        MegaChatMessagePrivate *message = new MegaChatMessagePrivate(*msgs[i], chatd::Message::kServerReceived, (chatd::Idx)i);
+        if (eager)
+        {
+            message->getMegaNodeList();    // what the constructor did before
+        }
+
+        // what MegaChatRoomHandler::handleHistoryMessage() does
+        handleCount += message->getAttachedNodeHandles().size();
+
+        // the app shows only some of the loaded messages
+        if (i % shownEvery == 0)
+        {
+            mega::MegaNodeList *nodes = message->getMegaNodeList();
+            nodeCount += nodes ? nodes->size() : 0;
+        }
+        delete message;
+    }
+    double ms = elapsedMs(start);
+
+    size_t shown = (msgs.size() + shownEvery - 1) / shownEvery;
+    bool ok = (handleCount == msgs.size() * 2) && (nodeCount == shown * 2);
+    printf("%-6s %zu msgs, 1 shown every %u: %8.2f ms (%6.2f us/msg)%s\n",
+           eager ? "eager" : "lazy", msgs.size(), shownEvery, ms, ms * 1000 / msgs.size(),
+           ok ? "" : " FAILED: wrong number of nodes");
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    size_t count = (argc > 1) ? atoi(argv[1]) : 10000;
+    unsigned shownEvery = (argc > 2) ? atoi(argv[2]) : 20;
+    if (!shownEvery)
+    {
+        shownEvery = 1;
+    }
+
+    std::vector<chatd::Message*> msgs;
+    for (size_t i = 0; i < count; i++)
+    {
+        // special messages have a 2-byte binary prefix
+        std::string content("\0\0", 2);
+        content[1] = (char)chatd::Message::kMsgAttachment;
+        content.append(attachmentJson(i));
+        msgs.push_back(new chatd::Message(i + 1, 1, 1550000000 + i, 0, content.data(), content.size(),
+                                          false, CHATD_KEYID_INVALID, chatd::Message::kMsgAttachment));
+    }
+
+    bool ok = bench(msgs, shownEvery, true);
+    ok &= bench(msgs, shownEvery, false);
+
+    for (auto msg: msgs)
+    {
+        delete msg;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,257 @@
+// Tests of the lazy parsing of the payload of MegaChatMessagePrivate (attachments, contacts
+// and messages with meta), and of JSonUtils::parseAttachNodeHandles(), which extracts
+// only the node handles of an attachment without parsing the rest of it.
+//
+// Usage: message-test
+// Built with the karere library when optKarereBuildTests is enabled.
+
+#include <asyncTest-framework.h>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <string>
+#include <string.h>
+#include "megachatapi_impl.h"
+
+TESTS_INIT();
+using namespace megachat;
+
+static std::string nodeJson(mega::MegaHandle h, const char *name)
+{
+    char *b64 = mega::MegaApi::handleToBase64(h);
+    std::string json = std::string("{\"h\":\"") + b64 + "\",\"k\":[1019912233,-1361423401,1741012843,"
+            "-1008745325,-2094421312,1240187421,-1873423122,984372012],\"t\":0,\"name\":\""
+            + name + "\",\"s\":1024,\"hash\":\"WmxjFAyDi5C8Fe2IuoXKSgTLu4ZYD\",\"ts\":1550000000}";
+    delete [] b64;
+    return json;
+}
+
+static std::string contactJson(MegaChatHandle uh, const char *email, const char *name)
+{
+    char *b64 = mega::MegaApi::userHandleToBase64(uh);
+    std::string json = std::string("{\"u\":\"") + b64 + "\",\"email\":\"" + email
+            + "\",\"name\":\"" + name + "\"}";
+    delete [] b64;
+    return json;
+}
+
+// special messages have a 2-byte binary prefix, with the type relative to kMsgOffset
+static chatd::Message *specialMessage(unsigned char type, const std::string& json)
+{
+    std::string content("\0\0", 2);
+    content[1] = (char)(type - chatd::Message::kMsgOffset);
+    content.append(json);
+    return new chatd::Message(1, 1, 1550000000, 0, content.data(), content.size(),
+                              false, CHATD_KEYID_INVALID, type);
+}
+
+static const mega::MegaHandle kNode1 = 0x112233445566;
+static const mega::MegaHandle kNode2 = 0x0a0b0c0d0e0f;
+static const MegaChatHandle kUser1 = 0x1122334455667788;
+static const MegaChatHandle kUser2 = 0x0102030405060708;
+
+int main(int argc, char** argv)
+{
+std::string twoNodes = "[" + nodeJson(kNode1, "one.jpg") + "," + nodeJson(kNode2, "two.pdf") + "]";
+std::string twoContacts = "[" + contactJson(kUser1, "one@mega.nz", "One") + ","
+        + contactJson(kUser2, "two@mega.nz", "Two") + "]";
+
+TestGroup("parseAttachNodeHandles")
+{
+    syncTest("Returns the handles of all attached nodes, in order")
+    {
+        std::vector<MegaChatHandle> handles;
+        check(JSonUtils::parseAttachNodeHandles(twoNodes.c_str(), handles));
+        check(handles.size() == 2);
+        check(handles[0] == kNode1);
+        check(handles[1] == kNode2);
+    });
+    syncTest("Returns the same handles as the full parsing")
+    {
+        std::vector<MegaChatHandle> handles;
+        check(JSonUtils::parseAttachNodeHandles(twoNodes.c_str(), handles));
+        std::unique_ptr<mega::MegaNodeList> nodes(JSonUtils::parseAttachNodeJSon(twoNodes.c_str()));
+        check(nodes && nodes->size() == (int)handles.size());
+        for (int i = 0; i < nodes->size(); i++)
+        {
+            check(nodes->get(i)->getHandle() == handles[i]);
+        }
+    });
+    syncTest("Accepts an attachment without nodes")
+    {
+        std::vector<MegaChatHandle> handles;
+        check(JSonUtils::parseAttachNodeHandles("[]", handles));
+        check(handles.empty());
+    });
+    syncTest("Fails on empty or malformed JSON")
+    {
+        std::vector<MegaChatHandle> handles;
+        check(!JSonUtils::parseAttachNodeHandles(nullptr, handles));
+        check(!JSonUtils::parseAttachNodeHandles("", handles));
+        check(!JSonUtils::parseAttachNodeHandles("[{\"h\":", handles));
+        check(!JSonUtils::parseAttachNodeHandles("{\"h\":\"AAAAAAAA\"}", handles));   // not an array
+        check(handles.empty());
+    });
+    syncTest("Fails and returns no handles if any node is invalid")
+    {
+        std::vector<MegaChatHandle> handles;
+        std::string noHandle = "[" + nodeJson(kNode1, "one.jpg") + ",{\"name\":\"two.pdf\"}]";
+        check(!JSonUtils::parseAttachNodeHandles(noHandle.c_str(), handles));
+        check(handles.empty());
+
+        std::string numericHandle = "[" + nodeJson(kNode1, "one.jpg") + ",{\"h\":1234}]";
+        check(!JSonUtils::parseAttachNodeHandles(numericHandle.c_str(), handles));
+        check(handles.empty());
+
+        std::string notObject = "[" + nodeJson(kNode1, "one.jpg") + ",\"AAAAAAAA\"]";
+        check(!JSonUtils::parseAttachNodeHandles(notObject.c_str(), handles));
+        check(handles.empty());
+    });
+});
+
+TestGroup("Lazy payload of MegaChatMessagePrivate")
+{
+    syncTest("Node handles are the same before and after parsing the attachment")
+    {
+        std::unique_ptr<chatd::Message> msg(specialMessage(chatd::Message::kMsgAttachment, twoNodes));
+        MegaChatMessagePrivate message(*msg, chatd::Message::kServerReceived, 0);
+        std::vector<MegaChatHandle> before = message.getAttachedNodeHandles();
+        mega::MegaNodeList *nodes = message.getMegaNodeList();
+        check(nodes && nodes->size() == 2);
+        check(nodes->get(0)->getHandle() == kNode1);
+        check(!strcmp(nodes->get(0)->getName(), "one.jpg"));
+        check(nodes->get(1)->getHandle() == kNode2);
+        check(!strcmp(nodes->get(1)->getName(), "two.pdf"));
+        check(message.getMegaNodeList() == nodes);   // parsed only once
+        check(before == message.getAttachedNodeHandles());
+        check(before.size() == 2 && before[0] == kNode1 && before[1] == kNode2);
+    });
+    syncTest("Copies made before and after parsing have the same nodes")
+    {
+        std::unique_ptr<chatd::Message> msg(specialMessage(chatd::Message::kMsgAttachment, twoNodes));
+        MegaChatMessagePrivate message(*msg, chatd::Message::kServerReceived, 0);
+        std::unique_ptr<MegaChatMessage> unparsedCopy(message.copy());
+        mega::MegaNodeList *nodes = message.getMegaNodeList();
+        std::unique_ptr<MegaChatMessage> parsedCopy(message.copy());
+        for (MegaChatMessage *copy: {unparsedCopy.get(), parsedCopy.get()})
+        {
+            mega::MegaNodeList *copyNodes = copy->getMegaNodeList();
+            check(copyNodes && copyNodes != nodes);
+            check(copyNodes->size() == nodes->size());
+            for (int i = 0; i < nodes->size(); i++)
+            {
+                check(copyNodes->get(i)->getHandle() == nodes->get(i)->getHandle());
+                check(!strcmp(copyNodes->get(i)->getName(), nodes->get(i)->getName()));
+            }
+        }
+    });
+    syncTest("Voice clips are parsed as node attachments")
+    {
+        std::string oneNode = "[" + nodeJson(kNode2, "voice.mp4") + "]";
+        std::unique_ptr<chatd::Message> msg(specialMessage(chatd::Message::kMsgVoiceClip, oneNode));
+        MegaChatMessagePrivate message(*msg, chatd::Message::kServerReceived, 0);
+        check(message.getType() == MegaChatMessage::TYPE_VOICE_CLIP);
+        check(message.getAttachedNodeHandles() == std::vector<MegaChatHandle>{kNode2});
+        mega::MegaNodeList *nodes = message.getMegaNodeList();
+        check(nodes && nodes->size() == 1 && nodes->get(0)->getHandle() == kNode2);
+    });
+    syncTest("Malformed attachment has no nodes")
+    {
+        std::unique_ptr<chatd::Message> msg(specialMessage(chatd::Message::kMsgAttachment, "[{\"h\":"));
+        MegaChatMessagePrivate message(*msg, chatd::Message::kServerReceived, 0);
+        check(message.getAttachedNodeHandles().empty());
+        check(!message.getMegaNodeList());
+        check(message.getAttachedNodeHandles().empty());
+        std::unique_ptr<MegaChatMessage> copy(message.copy());
+        check(!copy->getMegaNodeList());
+    });
+    syncTest("Attachment that could not be decrypted is not parsed")
+    {
+        std::unique_ptr<chatd::Message> msg(specialMessage(chatd::Message::kMsgAttachment, twoNodes));
+        msg->setEncrypted(chatd::Message::kEncryptedNoKey);
+        MegaChatMessagePrivate message(*msg, chatd::Message::kServerReceived, 0);
+        check(message.getType() == MegaChatMessage::TYPE_UNKNOWN);
+        check(message.getAttachedNodeHandles().empty());
+        check(!message.getMegaNodeList());
+    });
+    syncTest("Contact getters parse the attached users")
+    {
+        std::unique_ptr<chatd::Message> msg(specialMessage(chatd::Message::kMsgContact, twoContacts));
+        MegaChatMessagePrivate message(*msg, chatd::Message::kServerReceived, 0);
+        std::unique_ptr<MegaChatMessage> unparsedCopy(message.copy());
+        for (const MegaChatMessage *m: {(const MegaChatMessage *)&message, (const MegaChatMessage *)unparsedCopy.get()})
+        {
+            check(m->getUsersCount() == 2);
+            check(m->getUserHandle(0) == kUser1);
+            check(!strcmp(m->getUserEmail(0), "one@mega.nz"));
+            check(!strcmp(m->getUserName(0), "One"));
+            check(m->getUserHandle(1) == kUser2);
+            check(!strcmp(m->getUserEmail(1), "two@mega.nz"));
+            check(!strcmp(m->getUserName(1), "Two"));
+            check(m->getUserHandle(2) == MEGACHAT_INVALID_HANDLE);
+            check(!m->getUserEmail(2));
+            check(!m->getUserName(2));
+            check(!m->getMegaNodeList());
+        }
+    });
+    syncTest("Malformed contact attachment has no users")
+    {
+        std::unique_ptr<chatd::Message> msg(specialMessage(chatd::Message::kMsgContact, "[{\"u\":\"AAAAAAAAAAA\"}]"));
+        MegaChatMessagePrivate message(*msg, chatd::Message::kServerReceived, 0);
+        check(message.getUsersCount() == 0);
+        check(message.getUserHandle(0) == MEGACHAT_INVALID_HANDLE);
+    });
+    syncTest("Contains-meta getter parses the geolocation")
+    {
+        std::string content = JSonUtils::generateGeolocationJSon(2.5f, 41.25f, nullptr);
+        chatd::Message msg(1, 1, 1550000000, 0, content.data(), content.size(),
+                           false, CHATD_KEYID_INVALID, chatd::Message::kMsgContainsMeta);
+        MegaChatMessagePrivate message(msg, chatd::Message::kServerReceived, 0);
+        std::unique_ptr<MegaChatMessage> unparsedCopy(message.copy());
+        for (const MegaChatMessage *m: {(const MegaChatMessage *)&message, (const MegaChatMessage *)unparsedCopy.get()})
+        {
+            const MegaChatContainsMeta *meta = m->getContainsMeta();
+            check(meta && meta->getType() == MegaChatContainsMeta::CONTAINS_META_GEOLOCATION);
+            check(m->getContainsMeta() == meta);   // parsed only once
+            const MegaChatGeolocation *geolocation = meta->getGeolocation();
+            check(geolocation);
+            check(geolocation->getLongitude() == 2.5f);
+            check(geolocation->getLatitude() == 41.25f);
+            check(m->getUsersCount() == 0);
+        }
+    });
+    syncTest("Concurrent getters parse the payload once")
+    {
+        std::unique_ptr<chatd::Message> msg(specialMessage(chatd::Message::kMsgAttachment, twoNodes));
+        MegaChatMessagePrivate message(*msg, chatd::Message::kServerReceived, 0);
+        const int threadCount = 8;
+        std::vector<mega::MegaNodeList *> seen(threadCount, nullptr);
+        std::vector<size_t> handleCounts(threadCount, 0);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < threadCount; i++)
+        {
+            threads.emplace_back([&message, &seen, &handleCounts, i]()
+            {
+                handleCounts[i] = message.getAttachedNodeHandles().size();
+                seen[i] = message.getMegaNodeList();
+                std::unique_ptr<MegaChatMessage> copy(message.copy());
+                if (!copy->getMegaNodeList() || copy->getMegaNodeList()->size() != 2)
+                {
+                    seen[i] = nullptr;
+                }
+            });
+        }
+        for (auto& thread: threads)
+        {
+            thread.join();
+        }
+        for (int i = 0; i < threadCount; i++)
+        {
+            check(seen[i] && seen[i] == seen[0]);
+            check(handleCounts[i] == 2);
+        }
+    });
+});
+
+return test::gNumFailed;
+}
@@ -0,0 +1,177 @@
+// Micro-benchmark of the containers of the history buffer of a chat (see msgIndex.h),
+// against the previous ones: std::map for the msgid and backrefid indexes, and a pair of
+// vectors (forward and backward list) for the messages, addressed by idx.
+//
+// Usage: msgindex-bench [message-count]
+// Build (from src):
+// g++ -std=c++11 -O2 -I. msgIndex-bench.cpp -o msgindex-bench
+// With CMake, enable optKarereBuildBenchmarks (target msgindex-bench).
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include "msgIndex.h"
+
+typedef int32_t Idx;
+struct Msg
+{
+    uint64_t id;
+    Msg(uint64_t aId): id(aId) {}
+};
+
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct MapIndex
+{
+    static const char* name() { return "std::map"; }
+    std::map<uint64_t, Idx> map;
+    void insert(uint64_t id, Idx idx) { map.emplace(id, idx); }
+    Idx find(uint64_t id) { auto it = map.find(id); return (it == map.end()) ? -1 : it->second; }
+    void erase(uint64_t id) { map.erase(id); }
+};
+
+struct HashIndex
+{
+    static const char* name() { return "chatd::IdIndex"; }
+    chatd::IdIndex<Idx> map;
+    void insert(uint64_t id, Idx idx) { map.emplace(id, idx); }
+    Idx find(uint64_t id) { const Idx* idx = map.find(id); return idx ? *idx : -1; }
+    void erase(uint64_t id) { map.erase(id); }
+};
+
+// msgids are random 64-bit values
+template <class T>
+static void benchIndex(size_t count)
+{
+    std::mt19937_64 rng(1234);
+    std::vector<uint64_t> ids(count);
+    std::vector<uint64_t> missing(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        ids[i] = rng() | 1;
+        missing[i] = rng() | 1;
+    }
+
+    T index;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++)
+    {
+        index.insert(ids[i], (Idx)i);
+    }
+    double insertMs = elapsedMs(start);
+
+    std::vector<uint64_t> lookups(ids);
+    std::shuffle(lookups.begin(), lookups.end(), rng);
+    int64_t sum = 0;
+    start = std::chrono::steady_clock::now();
+    for (auto id: lookups)
+    {
+        sum += index.find(id);
+    }
+    double hitMs = elapsedMs(start);
+
+    start = std::chrono::steady_clock::now();
+    for (auto id: missing)
+    {
+        sum += index.find(id);
+    }
+    double missMs = elapsedMs(start);
+
+    start = std::chrono::steady_clock::now();
+    for (auto id: lookups)
+    {
+        index.erase(id);
+    }
+    double eraseMs = elapsedMs(start);
+
+    printf("%-16s %zu ids: insert %6.1f, hit %6.1f, miss %6.1f, erase %6.1f ns/op (%lld)\n",
+           T::name(), count, insertMs * 1e6 / count, hitMs * 1e6 / count, missMs * 1e6 / count,
+           eraseMs * 1e6 / count, (long long)sum);
+}
+
+struct ListBuffer
+{
+    static const char* name() { return "forward/backward"; }
+    Idx forwardStart = 0;
+    std::vector<std::unique_ptr<Msg>> forwardList;
+    std::vector<std::unique_ptr<Msg>> backwardList;
+    void pushHigh(Msg* msg) { forwardList.emplace_back(msg); }
+    void pushLow(Msg* msg) { backwardList.emplace_back(msg); }
+    Msg* at(Idx num)
+    {
+        if (num < forwardStart)
+        {
+            size_t idx = forwardStart - num - 1;
+            return (idx < backwardList.size()) ? backwardList[idx].get() : nullptr;
+        }
+        size_t idx = num - forwardStart;
+        return (idx < forwardList.size()) ? forwardList[idx].get() : nullptr;
+    }
+};
+
+struct RingBuffer
+{
+    static const char* name() { return "chatd::SlotRing"; }
+    chatd::SlotRing<Msg, Idx> ring;
+    void pushHigh(Msg* msg) { ring.pushHigh(msg); }
+    void pushLow(Msg* msg) { ring.pushLow(msg); }
+    Msg* at(Idx num) { auto slot = ring.slot(num); return slot ? slot->get() : nullptr; }
+};
+
+// half of the history loaded backwards (from db/server), half received as new messages
+template <class T>
+static void benchBuffer(size_t count)
+{
+    T buffer;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count / 2; i++)
+    {
+        buffer.pushLow(new Msg(i));
+        buffer.pushHigh(new Msg(i));
+    }
+    double pushMs = elapsedMs(start);
+
+    std::mt19937 rng(1234);
+    Idx low = -(Idx)(count / 2);
+    std::vector<Idx> nums(count);
+    for (auto& num: nums)
+    {
+        num = low + (Idx)(rng() % count);
+    }
+    uint64_t sum = 0;
+    start = std::chrono::steady_clock::now();
+    for (auto num: nums)
+    {
+        sum += buffer.at(num)->id;
+    }
+    double randomMs = elapsedMs(start);
+
+    start = std::chrono::steady_clock::now();
+    for (Idx num = low; num < low + (Idx)count; num++)
+    {
+        sum += buffer.at(num)->id;
+    }
+    double seqMs = elapsedMs(start);
+
+    printf("%-16s %zu msgs: push %6.1f, random access %6.1f, sequential access %6.1f ns/op (%llu)\n",
+           T::name(), count, pushMs * 1e6 / count, randomMs * 1e6 / count, seqMs * 1e6 / count,
+           (unsigned long long)sum);
+}
+
+int main(int argc, char** argv)
+{
+    size_t count = (argc > 1) ? atoi(argv[1]) : 100000;
+
+    benchIndex<MapIndex>(count);
+    benchIndex<HashIndex>(count);
+    benchBuffer<ListBuffer>(count);
+    benchBuffer<RingBuffer>(count);
+    return 0;
+}
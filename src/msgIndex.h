@@ -0,0 +1,262 @@
+#ifndef MSGINDEX_H
+#define MSGINDEX_H
+/**
+ * @file msgIndex.h
+ * @brief Compact containers for the history buffer of a chat: an open-addressing
+ * hash index keyed on 64-bit ids (msgids, backrefids), and a ring of message slots
+ * addressed by the history index, that can grow in both directions.
+ */
+
+#include <stdint.h>
+#include <assert.h>
+#include <memory>
+#include <vector>
+#include <utility>
+
+namespace chatd
+{
+/** @brief Hash map from a 64-bit id to a small value, with open addressing and
+ * linear probing, stored in a single array. The id 0 is reserved as the marker of
+ * empty entries, and can't be inserted (msgids and backrefids are never 0).
+ * Removal shifts back the following entries of the probe sequence, so there are
+ * no tombstones and lookups never degrade.
+ * \note Pointers to values are invalidated by insertions.
+ */
+template <class V>
+class IdIndex
+{
+public:
+    struct Entry
+    {
+        uint64_t first = 0; // the id, 0 if empty
+        V second = V();
+    };
+
+    template <class E>
+    class Iter
+    {
+    protected:
+        E* mPos;
+        E* mEnd;
+        void skipEmpty() { while (mPos != mEnd && !mPos->first) mPos++; }
+    public:
+        Iter(E* pos, E* end): mPos(pos), mEnd(end) { skipEmpty(); }
+        E& operator*() const { return *mPos; }
+        E* operator->() const { return mPos; }
+        Iter& operator++() { mPos++; skipEmpty(); return *this; }
+        bool operator!=(const Iter& other) const { return mPos != other.mPos; }
+        bool operator==(const Iter& other) const { return mPos == other.mPos; }
+    };
+    typedef Iter<Entry> iterator;
+    typedef Iter<const Entry> const_iterator;
+
+protected:
+    enum { kMinCapacity = 16 };
+    std::unique_ptr<Entry[]> mEntries;
+    size_t mMask = 0;
+    size_t mSize = 0;
+
+    // ids are random-ish, but not necessarily in the low bits, so mix them (murmur3 finalizer)
+    static size_t hash(uint64_t key)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return (size_t)key;
+    }
+    Entry* lookup(uint64_t key) const
+    {
+        if (!key || !mSize)
+            return nullptr;
+        for (size_t i = hash(key) & mMask;; i = (i + 1) & mMask)
+        {
+            Entry& entry = mEntries[i];
+            if (entry.first == key)
+                return &entry;
+            if (!entry.first)
+                return nullptr;
+        }
+    }
+    void rehash(size_t capacity)
+    {
+        size_t oldCapacity = mEntries ? mMask + 1 : 0;
+        std::unique_ptr<Entry[]> old(std::move(mEntries));
+        mEntries.reset(new Entry[capacity]);
+        mMask = capacity - 1;
+        for (size_t i = 0; i < oldCapacity; i++)
+        {
+            Entry& entry = old[i];
+            if (!entry.first)
+                continue;
+            size_t pos = hash(entry.first) & mMask;
+            while (mEntries[pos].first)
+                pos = (pos + 1) & mMask;
+            mEntries[pos] = std::move(entry);
+        }
+    }
+
+public:
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+    iterator begin() { return iterator(mEntries.get(), mEntries.get() + (mEntries ? mMask + 1 : 0)); }
+    iterator end() { Entry* last = mEntries.get() + (mEntries ? mMask + 1 : 0); return iterator(last, last); }
+    const_iterator begin() const { return const_iterator(mEntries.get(), mEntries.get() + (mEntries ? mMask + 1 : 0)); }
+    const_iterator end() const { const Entry* last = mEntries.get() + (mEntries ? mMask + 1 : 0); return const_iterator(last, last); }
+
+    /** Returns a pointer to the value of \c key, or \c nullptr if not found */
+    V* find(uint64_t key) { Entry* entry = lookup(key); return entry ? &entry->second : nullptr; }
+    const V* find(uint64_t key) const { Entry* entry = lookup(key); return entry ? &entry->second : nullptr; }
+    bool has(uint64_t key) const { return lookup(key) != nullptr; }
+
+    /** Inserts the value if \c key is not present. Returns a pointer to the value
+     * of \c key, and whether it was inserted (as std::map::emplace() does) */
+    std::pair<V*, bool> emplace(uint64_t key, const V& value)
+    {
+        assert(key);
+        // keep the load factor below 3/4
+        if (!mEntries || (mSize + 1) * 4 > (mMask + 1) * 3)
+            rehash(mEntries ? (mMask + 1) * 2 : (size_t)kMinCapacity);
+
+        size_t pos = hash(key) & mMask;
+        for (;; pos = (pos + 1) & mMask)
+        {
+            Entry& entry = mEntries[pos];
+            if (entry.first == key)
+                return std::make_pair(&entry.second, false);
+            if (!entry.first)
+                break;
+        }
+        Entry& entry = mEntries[pos];
+        entry.first = key;
+        entry.second = value;
+        mSize++;
+        return std::make_pair(&entry.second, true);
+    }
+    V& operator[](uint64_t key) { return *emplace(key, V()).first; }
+
+    /** Removes \c key, returns whether it was present */
+    bool erase(uint64_t key)
+    {
+        Entry* entry = lookup(key);
+        if (!entry)
+            return false;
+
+        size_t hole = entry - mEntries.get();
+        for (size_t i = (hole + 1) & mMask; mEntries[i].first; i = (i + 1) & mMask)
+        {
+            // move back the entry if its home position is not in the (cyclic) range (hole, i]
+            size_t home = hash(mEntries[i].first) & mMask;
+            bool inRange = (hole <= i)
+                ? (home > hole && home <= i)
+                : (home > hole || home <= i);
+            if (!inRange)
+            {
+                mEntries[hole] = std::move(mEntries[i]);
+                hole = i;
+            }
+        }
+        mEntries[hole].first = 0;
+        mEntries[hole].second = V();
+        mSize--;
+        return true;
+    }
+    void clear()
+    {
+        mEntries.reset();
+        mMask = 0;
+        mSize = 0;
+    }
+};
+
+/** @brief Ring of slots addressed by a signed index, that can grow at both ends.
+ * It holds the messages of the history buffer in a single contiguous array, the
+ * message with index \c low() being at the head of the ring. A slot may be empty,
+ * i.e. if its message was evicted from RAM. The objects themselves are allocated
+ * separately, so that references to them remain valid while the ring grows.
+ */
+template <class T, class I = int32_t>
+class SlotRing
+{
+protected:
+    std::vector<std::unique_ptr<T>> mSlots; // size is a power of 2, or zero
+    size_t mHead = 0;   // position of the slot with index mLow
+    size_t mCount = 0;
+    I mLow = 0;
+
+    size_t mask() const { return mSlots.size() - 1; }
+    void grow()
+    {
+        std::vector<std::unique_ptr<T>> slots(mSlots.empty() ? 64 : mSlots.size() * 2);
+        for (size_t i = 0; i < mCount; i++)
+        {
+            slots[i] = std::move(mSlots[(mHead + i) & mask()]);
+        }
+        mSlots.swap(slots);
+        mHead = 0;
+    }
+
+public:
+    /** @param low The index the ring starts from when empty: the first item added
+     * at the high end will have that index, and the first item added at the low
+     * end will have index low-1 */
+    explicit SlotRing(I low = 0): mLow(low) {}
+    I low() const { return mLow; }
+    I high() const { return mLow + (I)mCount - 1; }
+    size_t size() const { return mCount; }
+    bool empty() const { return mCount == 0; }
+    bool has(I idx) const { return idx >= mLow && (size_t)(idx - mLow) < mCount; }
+
+    /** Returns the slot of index \c idx, or \c nullptr if out of range */
+    std::unique_ptr<T>* slot(I idx)
+    {
+        if (!has(idx))
+            return nullptr;
+        return &mSlots[(mHead + (size_t)(idx - mLow)) & mask()];
+    }
+    const std::unique_ptr<T>* slot(I idx) const
+    {
+        return const_cast<SlotRing*>(this)->slot(idx);
+    }
+
+    /** Adds an item after the one with the highest index */
+    void pushHigh(T* item)
+    {
+        if (mCount == mSlots.size())
+            grow();
+        mSlots[(mHead + mCount) & mask()].reset(item);
+        mCount++;
+    }
+    /** Adds an item before the one with the lowest index */
+    void pushLow(T* item)
+    {
+        if (mCount == mSlots.size())
+            grow();
+        mHead = (mHead - 1) & mask();
+        mSlots[mHead].reset(item);
+        mLow--;
+        mCount++;
+    }
+    /** Deletes the items with index lower than \c idx */
+    void eraseBelow(I idx)
+    {
+        while (mCount && mLow < idx)
+        {
+            mSlots[mHead].reset();
+            mHead = (mHead + 1) & mask();
+            mLow++;
+            mCount--;
+        }
+    }
+    /** Deletes all items, and sets the index the ring starts from */
+    void reset(I low)
+    {
+        mSlots.clear();
+        mHead = 0;
+        mCount = 0;
+        mLow = low;
+    }
+};
+}
+#endif // MSGINDEX_H
@@ -0,0 +1,93 @@
+// Tests of the reassembly of fragmented websocket messages in buffers of a BufferPool,
+// as done by LibwebsocketsClient for LWS_CALLBACK_CLIENT_RECEIVE.
+//
+// Usage: bufferpool-test
+// Build (from src/net): g++ -std=c++11 -I.. bufferPool-test.cpp -lpthread -o bufferpool-test
+// With CMake, enable optKarereBuildTests (target bufferpool-test).
+
+#include <asyncTest-framework.h>
+#include <algorithm>
+#include <string>
+#include "bufferPool.h"
+
+TESTS_INIT();
+
+// receives a message in fragments of up to fragSize bytes, as libwebsockets delivers it
+static void receive(FragmentedMessage& msg, const std::string& data, size_t fragSize)
+{
+    for (size_t pos = 0; pos < data.size(); pos += fragSize)
+    {
+        size_t len = std::min(fragSize, data.size() - pos);
+        msg.append(data.data() + pos, len, data.size() - pos - len);
+    }
+}
+
+int main(int argc, char** argv)
+{
+TestGroup("Fragmented messages")
+{
+    syncTest("Message over the pooled buffer size is followed by a small one")
+    {
+        BufferPool pool;
+        FragmentedMessage msg(pool);
+        std::string big(BufferPool::kMaxFreeBufferSize + 512 * 1024, 'a');
+        big.back() = 'z';
+        receive(msg, big, 64 * 1024);
+        check(!msg.empty());
+        check(msg.size() == big.size());
+        check(std::string(msg.data(), msg.size()) == big);
+        msg.reset();
+        check(msg.empty());
+        check(pool.freeCount() == 0);   // too big to be kept
+
+        std::string small("small message");
+        receive(msg, small, 5);
+        check(msg.size() == small.size());
+        check(std::string(msg.data(), msg.size()) == small);
+        msg.reset();
+        check(msg.empty());
+        check(pool.freeCount() == 1);
+    });
+    syncTest("Message is reset when the pool has enough idle buffers")
+    {
+        BufferPool pool;
+        for (int i = 0; i < BufferPool::kMaxFreeBuffers; i++)
+        {
+            pool.put(BufferPool::BufferPtr(new std::string));
+        }
+        FragmentedMessage msg(pool);
+        msg.append("first", 5, 0);  // takes one of the idle buffers
+        pool.put(BufferPool::BufferPtr(new std::string));
+        check(pool.freeCount() == BufferPool::kMaxFreeBuffers);
+        msg.reset();
+        check(msg.empty());
+        check(pool.freeCount() == BufferPool::kMaxFreeBuffers);
+
+        receive(msg, "second", 2);
+        check(std::string(msg.data(), msg.size()) == "second");
+    });
+    syncTest("Buffers are reused between messages")
+    {
+        BufferPool pool;
+        FragmentedMessage msg(pool);
+        receive(msg, std::string(1000, 'x'), 100);
+        const char *first = msg.data();
+        msg.reset();
+        check(pool.freeCount() == 1);
+        receive(msg, "yy", 1);
+        check(msg.data() == first);
+        check(std::string(msg.data(), msg.size()) == "yy");
+        check(pool.freeCount() == 0);
+    });
+    syncTest("put() releases the buffer even if it is not kept")
+    {
+        BufferPool pool;
+        BufferPool::BufferPtr buf = pool.get(BufferPool::kMaxFreeBufferSize + 1);
+        pool.put(std::move(buf));
+        check(!buf);
+        check(pool.freeCount() == 0);
+    });
+});
+
+return test::gNumFailed;
+}
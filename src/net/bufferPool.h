@@ -0,0 +1,114 @@
+#ifndef bufferPool_h
+#define bufferPool_h
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+/**
+ * @brief Pool of the buffers used by the websockets layer to reassemble messages
+ * received in fragments and to queue outgoing data. A pool is shared by all the
+ * connections, and a connection only holds buffers while it has data in transit,
+ * so bursts don't leave big buffers allocated in every connection, and buffers are
+ * reused instead of allocated per message.
+ * Messages received in a single fragment don't need any buffer: they are handled
+ * straight from the memory of the network layer.
+ */
+class BufferPool
+{
+public:
+    enum
+    {
+        kMaxFreeBuffers = 4,                // max number of idle buffers kept for reuse
+        kMaxFreeBufferSize = 1024 * 1024    // bigger buffers are released instead of kept
+    };
+    typedef std::unique_ptr<std::string> BufferPtr;
+
+    /** @brief Returns an empty buffer with capacity for at least \c size bytes */
+    BufferPtr get(size_t size)
+    {
+        BufferPtr buf;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (!mFree.empty())
+            {
+                buf = std::move(mFree.back());
+                mFree.pop_back();
+            }
+        }
+        if (!buf)
+        {
+            buf.reset(new std::string);
+        }
+        buf->reserve(size);
+        return buf;
+    }
+
+    /** @brief Returns a buffer obtained via \c get() to the pool. The buffer is taken
+     * by value, so the caller's pointer is always released, even if the pool doesn't keep
+     * the buffer because it is too big or there are enough idle buffers already.
+     */
+    void put(BufferPtr buf)
+    {
+        if (!buf || buf->capacity() > kMaxFreeBufferSize)
+            return;
+
+        buf->clear();
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mFree.size() < kMaxFreeBuffers)
+        {
+            mFree.push_back(std::move(buf));
+        }
+    }
+
+    size_t freeCount()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mFree.size();
+    }
+
+protected:
+    std::mutex mMutex;
+    std::vector<BufferPtr> mFree;
+};
+
+/**
+ * @brief A message received in fragments, reassembled in a buffer of a \c BufferPool
+ * that is held only until the message has been handled.
+ */
+class FragmentedMessage
+{
+public:
+    explicit FragmentedMessage(BufferPool& pool): mPool(pool) {}
+    ~FragmentedMessage() { reset(); }
+
+    /** @brief Appends a fragment. \c remaining is the size of the rest of the message,
+     * if known, to reserve room for it. */
+    void append(const char *data, size_t len, size_t remaining)
+    {
+        if (!mBuf)
+        {
+            mBuf = mPool.get(len + remaining);
+        }
+        mBuf->append(data, len);
+    }
+    bool empty() const { return !mBuf || mBuf->empty(); }
+    const char *data() const { return mBuf->data(); }
+    size_t size() const { return mBuf->size(); }
+
+    /** @brief Returns the buffer to the pool, so the next fragment starts a new message */
+    void reset()
+    {
+        if (mBuf)
+        {
+            mPool.put(std::move(mBuf));
+        }
+    }
+
+protected:
+    BufferPool& mPool;
+    BufferPool::BufferPtr mBuf;
+};
+
+#endif /* bufferPool_h */
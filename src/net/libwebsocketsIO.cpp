@@ -17,6 +17,9 @@ static struct lws_protocols protocols[] =
     { NULL, NULL, 0, 0 } /* terminator */
 };
 
+static BufferPool gRecvBufferPool;
+static BufferPool gSendBufferPool;
+
 LibwebsocketsIO::LibwebsocketsIO(::mega::Mutex *mutex, ::mega::Waiter* waiter, ::mega::MegaApi *api, void *ctx) : WebsocketsIO(mutex, api, ctx)
 {
     struct lws_context_creation_info info;
@@ -138,7 +141,8 @@ WebsocketsClientImpl *LibwebsocketsIO::wsConnect(const char *ip, const char *hos
     return libwebsocketsClient;
 }
 
-LibwebsocketsClient::LibwebsocketsClient(::mega::Mutex *mutex, WebsocketsClient *client) : WebsocketsClientImpl(mutex, client)
+LibwebsocketsClient::LibwebsocketsClient(::mega::Mutex *mutex, WebsocketsClient *client)
+    : WebsocketsClientImpl(mutex, client), recmessage(gRecvBufferPool)
 {
     wsi = NULL;
 }
@@ -146,35 +150,33 @@ LibwebsocketsClient::LibwebsocketsClient(::mega::Mutex *mutex, WebsocketsClient
 LibwebsocketsClient::~LibwebsocketsClient()
 {
     wsDisconnect(true);
+    resetOutputQueue();
+    resetMessage();
 }
 
 void LibwebsocketsClient::appendMessageFragment(char *data, size_t len, size_t remaining)
 {
-    if (!recbuffer.size() && remaining)
-    {
-        recbuffer.reserve(len + remaining);
-    }
-    recbuffer.append(data, len);
+    recmessage.append(data, len, remaining);
 }
 
 bool LibwebsocketsClient::hasFragments()
 {
-    return recbuffer.size();
+    return !recmessage.empty();
 }
 
 const char *LibwebsocketsClient::getMessage()
 {
-    return recbuffer.data();
+    return recmessage.data();
 }
 
 size_t LibwebsocketsClient::getMessageLength()
 {
-    return recbuffer.size();
+    return recmessage.size();
 }
 
 void LibwebsocketsClient::resetMessage()
 {
-    recbuffer.clear();
+    recmessage.reset();
 }
 
 bool LibwebsocketsClient::wsSendMessage(char *msg, size_t len)
@@ -187,13 +189,35 @@ bool LibwebsocketsClient::wsSendMessage(char *msg, size_t len)
         assert(false);
         return false;
     }
+
+    // a message bigger than the queue is accepted if the queue is empty, otherwise it
+    // would be rejected forever. Rejections are transient: the queue will be drained
+    if (sendstats.bytesInFlight && sendstats.bytesInFlight + len > kSendQueueMaxSize)
+    {
+        WEBSOCKETS_LOG_ERROR("Send queue is full (%zu bytes). Discarding message of %zu bytes", sendstats.bytesInFlight, len);
+        return false;
+    }
     
-    if (!sendbuffer.size())
+    if (sendqueue.empty() || sendqueue.back()->size() - LWS_PRE + len > kSendChunkSize)
+    {
+        BufferPool::BufferPtr chunk = gSendBufferPool.get(LWS_PRE + std::max<size_t>(len, kSendChunkSize));
+        chunk->resize(LWS_PRE);
+        sendqueue.push_back(std::move(chunk));
+    }
+    sendqueue.back()->append(msg, len);
+
+    sendstats.queueDepth = sendqueue.size();
+    sendstats.bytesInFlight += len;
+    if (sendstats.bytesInFlight > sendstats.peakBytesInFlight)
+    {
+        sendstats.peakBytesInFlight = sendstats.bytesInFlight;
+    }
+    if (!sendqueuefull && sendstats.bytesInFlight >= kSendQueueHighWatermark)
     {
-        sendbuffer.reserve(LWS_PRE + len);
-        sendbuffer.resize(LWS_PRE);
+        sendqueuefull = true;
+        sendstats.congestionCount++;
+        WEBSOCKETS_LOG_WARNING("Send queue is congested: %zu bytes in %zu chunks", sendstats.bytesInFlight, sendstats.queueDepth);
     }
-    sendbuffer.append(msg, len);
 
     if (lws_callback_on_writable(wsi) <= 0)
     {
@@ -249,19 +273,48 @@ bool LibwebsocketsClient::wsIsConnected()
     return wsi != NULL;
 }
 
-const char *LibwebsocketsClient::getOutputBuffer()
+bool LibwebsocketsClient::wsIsSendQueueFull()
 {
-    return sendbuffer.size() ? sendbuffer.data() + LWS_PRE : NULL;
+    return sendqueuefull;
 }
 
-size_t LibwebsocketsClient::getOutputBufferLength()
+WebsocketsSendStats LibwebsocketsClient::wsSendStats()
 {
-    return sendbuffer.size() ? sendbuffer.size() - LWS_PRE : 0;
+    return sendstats;
 }
 
-void LibwebsocketsClient::resetOutputBuffer()
+bool LibwebsocketsClient::writeOutputChunk()
 {
-    sendbuffer.clear();
+    BufferPool::BufferPtr &chunk = sendqueue.front();
+    size_t len = chunk->size() - LWS_PRE;
+
+    // if the socket doesn't accept the whole chunk, libwebsockets keeps the remainder
+    // and doesn't report the connection as writable again until it has been sent
+    int written = lws_write(wsi, (unsigned char *)&(*chunk)[LWS_PRE], len, LWS_WRITE_BINARY);
+    if (written < (int)len)
+    {
+        WEBSOCKETS_LOG_ERROR("lws_write() failed: %d of %zu bytes written", written, len);
+        return false;
+    }
+
+    gSendBufferPool.put(std::move(chunk));
+    sendqueue.pop_front();
+    sendstats.queueDepth = sendqueue.size();
+    sendstats.bytesInFlight -= len;
+    sendstats.bytesSent += len;
+    return true;
+}
+
+void LibwebsocketsClient::resetOutputQueue()
+{
+    for (auto &chunk: sendqueue)
+    {
+        gSendBufferPool.put(std::move(chunk));
+    }
+    sendqueue.clear();
+    sendqueuefull = false;
+    sendstats.queueDepth = 0;
+    sendstats.bytesInFlight = 0;
 }
 
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L) || defined (LIBRESSL_VERSION_NUMBER) || defined (OPENSSL_IS_BORINGSSL)
@@ -436,12 +489,24 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
                 return -1;
             }
             
-            data = (void *)client->getOutputBuffer();
-            len = client->getOutputBufferLength();
-            if (len && data)
+            // a single write per callback: pending chunks are written in next callbacks
+            if (!client->sendqueue.empty())
+            {
+                if (!client->writeOutputChunk())
+                {
+                    return -1;
+                }
+
+                if (!client->sendqueue.empty())
+                {
+                    lws_callback_on_writable(wsi);
+                }
+            }
+
+            if (client->sendqueuefull && client->sendstats.bytesInFlight <= kSendQueueLowWatermark)
             {
-                lws_write(wsi, (unsigned char *)data, len, LWS_WRITE_BINARY);
-                client->resetOutputBuffer();
+                client->sendqueuefull = false;
+                client->wsSendQueueDrainedCb();
             }
             break;
         }
@@ -5,8 +5,10 @@
 #include <openssl/ssl.h>
 #include <iostream>
 #include <functional>
+#include <deque>
 
 #include "net/websocketsIO.h"
+#include "net/bufferPool.h"
 
 // Websockets network layer implementation based on libwebsocket
 class LibwebsocketsIO : public WebsocketsIO
@@ -30,25 +32,40 @@ protected:
 class LibwebsocketsClient : public WebsocketsClientImpl
 {
 public:
+    enum
+    {
+        kSendChunkSize = 64 * 1024,             // messages are coalesced in chunks up to this size
+        kSendQueueHighWatermark = 512 * 1024,   // producers are asked to stop above this size...
+        kSendQueueLowWatermark = 128 * 1024,    // ...and to resume below this one
+        kSendQueueMaxSize = 16 * 1024 * 1024    // messages are rejected above this size, unless the queue is empty
+    };
+
     LibwebsocketsClient(::mega::Mutex *mutex, WebsocketsClient *client);
     virtual ~LibwebsocketsClient();
     
 protected:
-    std::string recbuffer;
-    std::string sendbuffer;
+    FragmentedMessage recmessage;       // holds a buffer only while receiving a fragmented message
+
+    // Outbound queue: each chunk is written as a single websocket message, made of one or
+    // more whole messages from the client. Chunks are reserved with LWS_PRE bytes of
+    // headroom, so they are written without copying.
+    std::deque<BufferPool::BufferPtr> sendqueue;
+    bool sendqueuefull = false;
+    WebsocketsSendStats sendstats;
 
     void appendMessageFragment(char *data, size_t len, size_t remaining);
     bool hasFragments();
     const char *getMessage();
     size_t getMessageLength();
     void resetMessage();
-    const char *getOutputBuffer();
-    size_t getOutputBufferLength();
-    void resetOutputBuffer();
+    bool writeOutputChunk();
+    void resetOutputQueue();
     
     virtual bool wsSendMessage(char *msg, size_t len);
     virtual void wsDisconnect(bool immediate);
     virtual bool wsIsConnected();
+    virtual bool wsIsSendQueueFull();
+    virtual WebsocketsSendStats wsSendStats();
     
 public:
     struct lws *wsi;
@@ -1,4 +1,7 @@
 #include "net/websocketsIO.h"
+#include "db.h"
+#include <sstream>
+#include <algorithm>
 
 WebsocketsIO::WebsocketsIO(::mega::Mutex *mutex, ::mega::MegaApi *megaApi, void *ctx)
     : mApi(*megaApi, ctx, false)
@@ -49,7 +52,7 @@ void WebsocketsClientImpl::wsConnectCb()
 {
     ScopedLock lock(this->mutex);
     WEBSOCKETS_LOG_DEBUG("Connection established");
-    client->wsConnectCb();
+    client->wsConnectCbPrivate(this);
 }
 
 void WebsocketsClientImpl::wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len)
@@ -65,16 +68,23 @@ void WebsocketsClientImpl::wsCloseCb(int errcode, int errtype, const char *preas
         WEBSOCKETS_LOG_DEBUG("Connection closed by server");
     }
 
-    client->wsCloseCbPrivate(errcode, errtype, preason, reason_len);
+    client->wsCloseCbPrivate(this, errcode, errtype, preason, reason_len);
 }
 
 void WebsocketsClientImpl::wsHandleMsgCb(char *data, size_t len)
 {
     ScopedLock lock(this->mutex);
-    WEBSOCKETS_LOG_DEBUG("Received %d bytes", len);
+    WEBSOCKETS_LOG_DEBUG("Received %zu bytes", len);
     client->wsHandleMsgCb(data, len);
 }
 
+void WebsocketsClientImpl::wsSendQueueDrainedCb()
+{
+    ScopedLock lock(this->mutex);
+    WEBSOCKETS_LOG_DEBUG("Send queue drained");
+    client->wsSendQueueDrainedCb();
+}
+
 WebsocketsClient::WebsocketsClient()
 {
     ctx = NULL;
@@ -85,6 +95,7 @@ WebsocketsClient::WebsocketsClient()
 
 WebsocketsClient::~WebsocketsClient()
 {
+    cancelFallback();
     delete ctx;
     ctx = NULL;
 }
@@ -111,6 +122,8 @@ bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const char *ip, cons
         delete ctx;
     }
 
+    cancelFallback();
+    mTargetIp = ip;
     ctx = websocketIO->wsConnect(ip, host, port, path, ssl, this);
     if (!ctx)
     {
@@ -119,6 +132,66 @@ bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const char *ip, cons
     return ctx != NULL;
 }
 
+bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const char *ip, const char *fallbackIp,
+                                 const char *host, int port, const char *path, bool ssl)
+{
+    bool connecting = wsConnect(websocketIO, ip, host, port, path, ssl);
+    if (!fallbackIp || !fallbackIp[0])
+    {
+        return connecting;
+    }
+
+    mWebsocketIO = websocketIO;
+    mFallbackIp = fallbackIp;
+    mHost = host;
+    mPort = port;
+    mPath = path;
+    mSsl = ssl;
+
+    if (!connecting)    // immediate failure --> try the fallback IP right away
+    {
+        return startFallback();
+    }
+
+    // if the first attempt fails before the timer expires, the fallback is started right away
+    mFallbackTimer = karere::setTimeout([this]()
+    {
+        mFallbackTimer = 0;
+        startFallback();
+    }, kFallbackDelay, websocketIO->appCtx);
+    return true;
+}
+
+bool WebsocketsClient::startFallback()
+{
+    if (mFallbackTimer)
+    {
+        karere::cancelTimeout(mFallbackTimer, mWebsocketIO->appCtx);
+        mFallbackTimer = 0;
+    }
+
+    WEBSOCKETS_LOG_DEBUG("Connecting to %s (%s) as fallback", mHost.c_str(), mFallbackIp.c_str());
+    mFallbackCtx = mWebsocketIO->wsConnect(mFallbackIp.c_str(), mHost.c_str(), mPort, mPath.c_str(), mSsl, this);
+    if (!mFallbackCtx)
+    {
+        WEBSOCKETS_LOG_WARNING("Immediate error in wsConnect to the fallback IP");
+        mFallbackIp.clear();
+    }
+    return mFallbackCtx != NULL;
+}
+
+void WebsocketsClient::cancelFallback()
+{
+    if (mFallbackTimer)
+    {
+        karere::cancelTimeout(mFallbackTimer, mWebsocketIO->appCtx);
+        mFallbackTimer = 0;
+    }
+    delete mFallbackCtx;
+    mFallbackCtx = NULL;
+    mFallbackIp.clear();
+}
+
 bool WebsocketsClient::wsSendMessage(char *msg, size_t len)
 {
     assert (ctx);
@@ -136,7 +209,7 @@ bool WebsocketsClient::wsSendMessage(char *msg, size_t len)
 #endif
     
     
-    WEBSOCKETS_LOG_DEBUG("Sending %d bytes", len);
+    WEBSOCKETS_LOG_DEBUG("Sending %zu bytes", len);
     bool result = ctx->wsSendMessage(msg, len);
     if (!result)
     {
@@ -148,7 +221,8 @@ bool WebsocketsClient::wsSendMessage(char *msg, size_t len)
 void WebsocketsClient::wsDisconnect(bool immediate)
 {
     WEBSOCKETS_LOG_DEBUG("Disconnecting. Immediate: %d", immediate);
-    
+
+    cancelFallback();
     if (!ctx)
     {
         return;
@@ -184,41 +258,236 @@ bool WebsocketsClient::wsIsConnected()
     return ctx->wsIsConnected();
 }
 
-void WebsocketsClient::wsCloseCbPrivate(int errcode, int errtype, const char *preason, size_t reason_len)
+bool WebsocketsClient::wsIsConnecting()
+{
+    return mFallbackTimer || mFallbackCtx;
+}
+
+bool WebsocketsClient::wsIsSendQueueFull()
+{
+    if (!ctx)
+    {
+        return false;
+    }
+
+    return ctx->wsIsSendQueueFull();
+}
+
+WebsocketsSendStats WebsocketsClient::wsSendStats()
 {
-    if (!ctx)   // immediate disconnect ocurred before the marshall is executed (only applies to libws)
+    if (!ctx)
+    {
+        return WebsocketsSendStats();
+    }
+
+    return ctx->wsSendStats();
+}
+
+void WebsocketsClient::wsConnectCbPrivate(WebsocketsClientImpl *impl)
+{
+    if (mFallbackCtx && impl == mFallbackCtx)
+    {
+        WEBSOCKETS_LOG_DEBUG("Connected using the fallback IP %s", mFallbackIp.c_str());
+        delete ctx;
+        ctx = mFallbackCtx;
+        mFallbackCtx = NULL;
+        mTargetIp = mFallbackIp;
+    }
+    else if (impl != ctx)
     {
         return;
     }
 
-    delete ctx;
-    ctx = NULL;
+    // the race is over, close the other connection attempt (if any)
+    cancelFallback();
+    wsConnectCb();
+}
+
+void WebsocketsClient::wsCloseCbPrivate(WebsocketsClientImpl *impl, int errcode, int errtype, const char *preason, size_t reason_len)
+{
+    if (mFallbackCtx && impl == mFallbackCtx)   // the attempt to the fallback IP failed
+    {
+        WEBSOCKETS_LOG_DEBUG("Connection to the fallback IP %s failed", mFallbackIp.c_str());
+        delete mFallbackCtx;
+        mFallbackCtx = NULL;
+        mFallbackIp.clear();
+        if (ctx)
+        {
+            return; // wait for the first attempt
+        }
+        // both failed, notify the last error
+    }
+    else if (!ctx || impl != ctx)   // immediate disconnect ocurred before the marshall is executed (only applies to libws)
+    {
+        return;
+    }
+    else
+    {
+        delete ctx;
+        ctx = NULL;
+
+        if (mFallbackTimer || mFallbackCtx)   // the first attempt failed, but the race is not over
+        {
+            WEBSOCKETS_LOG_DEBUG("Connection to %s failed, waiting for the fallback IP", mTargetIp.c_str());
+            if (mFallbackCtx || startFallback())
+            {
+                return;
+            }
+        }
+    }
 
     WEBSOCKETS_LOG_DEBUG("Socket was closed gracefully or by server");
 
     wsCloseCb(errcode, errtype, preason, reason_len);
 }
 
-bool DNScache::set(const std::string &url, const std::string &ipv4, const std::string &ipv6)
+static std::string joinIps(const std::vector<std::string> &ips)
+{
+    std::string result;
+    for (auto &ip: ips)
+    {
+        if (!result.empty())
+        {
+            result.append(",");
+        }
+        result.append(ip);
+    }
+    return result;
+}
+
+static std::vector<std::string> splitIps(const std::string &str)
 {
-    if (!isMatch(url, ipv4, ipv6))
+    std::vector<std::string> result;
+    std::istringstream stream(str);
+    std::string ip;
+    while (std::getline(stream, ip, ','))
     {
-        DNSrecord record;
-        record.ipv4 = ipv4;
-        record.ipv6 = ipv6;
-        record.resolveTs = time(NULL);
+        if (!ip.empty())
+        {
+            result.push_back(ip);
+        }
+    }
+    return result;
+}
 
-        mRecords[url] = record;
+void DNScache::setDb(SqliteDb *db)
+{
+    mDb = db;
+    if (!mDb)
+    {
+        return;
+    }
 
-        return true;
+    // records resolved by this instance are more recent than the saved ones
+    try
+    {
+        SqliteStmt stmt(*mDb, "select host, ipsv4, ipsv6, resolve_ts, connect_ipv4_ts, connect_ipv6_ts from dns_cache");
+        while (stmt.step())
+        {
+            std::string url = stmt.stringCol(0);
+            if (mRecords.find(url) != mRecords.end())
+            {
+                continue;
+            }
+
+            DNSrecord &record = mRecords[url];
+            record.ipsv4 = splitIps(stmt.stringCol(1));
+            record.ipsv6 = splitIps(stmt.stringCol(2));
+            record.resolveTs = stmt.int64Col(3);
+            record.connectIpv4Ts = stmt.int64Col(4);
+            record.connectIpv6Ts = stmt.int64Col(5);
+        }
+    }
+    catch (std::exception& e)
+    {
+        WEBSOCKETS_LOG_ERROR("Failed to load the DNS cache: %s", e.what());
+    }
+
+    for (auto &it: mRecords)
+    {
+        saveRecord(it.first, it.second);
+    }
+    WEBSOCKETS_LOG_DEBUG("DNS cache loaded: %d hosts", (int)mRecords.size());
+}
+
+void DNScache::saveRecord(const std::string &url, const DNSrecord &record)
+{
+    if (!mDb)
+    {
+        return;
+    }
+
+    // called while connecting: a db error must not abort the connection, the cache is just not updated
+    try
+    {
+        mDb->query("insert or replace into dns_cache(host, ipsv4, ipsv6, resolve_ts, connect_ipv4_ts, connect_ipv6_ts) "
+                   "values(?,?,?,?,?,?)", url, joinIps(record.ipsv4), joinIps(record.ipsv6),
+                   (int64_t)record.resolveTs, (int64_t)record.connectIpv4Ts, (int64_t)record.connectIpv6Ts);
+    }
+    catch (std::exception& e)
+    {
+        WEBSOCKETS_LOG_ERROR("Failed to save the DNS cache record of %s: %s", url.c_str(), e.what());
+    }
+}
+
+bool DNScache::set(const std::string &url, const std::vector<std::string> &ipsv4, const std::vector<std::string> &ipsv6)
+{
+    auto it = mRecords.find(url);
+    if (it != mRecords.end() && it->second.ipsv4 == ipsv4 && it->second.ipsv6 == ipsv6)
+    {
+        return false;
     }
 
-    return false;
+    // keep the history of connections, and the IPs that connected first if they are still valid
+    DNSrecord &record = mRecords[url];
+    std::string ipv4 = record.ipsv4.empty() ? "" : record.ipsv4.front();
+    std::string ipv6 = record.ipsv6.empty() ? "" : record.ipsv6.front();
+    record.ipsv4 = ipsv4;
+    record.ipsv6 = ipsv6;
+    record.resolveTs = time(NULL);
+    auto pos = std::find(record.ipsv4.begin(), record.ipsv4.end(), ipv4);
+    if (pos != record.ipsv4.end())
+    {
+        std::rotate(record.ipsv4.begin(), pos, pos + 1);
+    }
+    pos = std::find(record.ipsv6.begin(), record.ipsv6.end(), ipv6);
+    if (pos != record.ipsv6.end())
+    {
+        std::rotate(record.ipsv6.begin(), pos, pos + 1);
+    }
+
+    saveRecord(url, record);
+    return true;
+}
+
+bool DNScache::set(const std::string &url, const std::string &ipv4, const std::string &ipv6)
+{
+    std::vector<std::string> ipsv4, ipsv6;
+    if (!ipv4.empty())
+    {
+        ipsv4.push_back(ipv4);
+    }
+    if (!ipv6.empty())
+    {
+        ipsv6.push_back(ipv6);
+    }
+    return set(url, ipsv4, ipsv6);
 }
 
 void DNScache::clear(const std::string &url)
 {
     mRecords.erase(url);
+    if (mDb)
+    {
+        try
+        {
+            mDb->query("delete from dns_cache where host = ?", url);
+        }
+        catch (std::exception& e)
+        {
+            WEBSOCKETS_LOG_ERROR("Failed to remove the DNS cache record of %s: %s", url.c_str(), e.what());
+        }
+    }
 }
 
 bool DNScache::get(const std::string &url, std::string &ipv4, std::string &ipv6)
@@ -229,8 +498,8 @@ bool DNScache::get(const std::string &url, std::string &ipv4, std::string &ipv6)
         return false;
     }
 
-    ipv4 = it->second.ipv4;
-    ipv6 = it->second.ipv6;
+    ipv4 = it->second.ipsv4.empty() ? "" : it->second.ipsv4.front();
+    ipv6 = it->second.ipsv6.empty() ? "" : it->second.ipsv6.front();
 
     return true;
 }
@@ -240,17 +509,37 @@ void DNScache::connectDone(const std::string &url, const std::string &ip)
     auto it = mRecords.find(url);
     if (it != mRecords.end())
     {
-        if (ip == it->second.ipv4)
+        DNSrecord &record = it->second;
+        auto pos = std::find(record.ipsv4.begin(), record.ipsv4.end(), ip);
+        if (pos != record.ipsv4.end())
+        {
+            std::rotate(record.ipsv4.begin(), pos, pos + 1);
+            record.connectIpv4Ts = time(NULL);
+        }
+        else if ((pos = std::find(record.ipsv6.begin(), record.ipsv6.end(), ip)) != record.ipsv6.end())
         {
-            it->second.connectIpv4Ts = time(NULL);
+            std::rotate(record.ipsv6.begin(), pos, pos + 1);
+            record.connectIpv6Ts = time(NULL);
         }
-        else if (ip == it->second.ipv6)
+        else
         {
-            it->second.connectIpv6Ts = time(NULL);
+            return;
         }
+        saveRecord(url, record);
     }
 }
 
+bool DNScache::isIpv6Preferred(const std::string &url)
+{
+    auto it = mRecords.find(url);
+    if (it == mRecords.end())
+    {
+        return true;
+    }
+
+    return it->second.connectIpv6Ts >= it->second.connectIpv4Ts;
+}
+
 time_t DNScache::age(const std::string &url)
 {
     auto it = mRecords.find(url);
@@ -269,8 +558,8 @@ bool DNScache::isMatch(const std::string &url, const std::vector<std::string> &i
     auto it = mRecords.find(url);
     if (it != mRecords.end())
     {
-        std::string ipv4 = it->second.ipv4;
-        std::string ipv6 = it->second.ipv6;
+        std::string ipv4 = it->second.ipsv4.empty() ? "" : it->second.ipsv4.front();
+        std::string ipv6 = it->second.ipsv6.empty() ? "" : it->second.ipsv6.front();
 
         match = ( ((ipv4.empty() && ipsv4.empty()) // don't have IPv4, but it wasn't received either
                    || (std::find(ipsv4.begin(), ipsv4.end(), ipv4) != ipsv4.end())) // IPv4 is contained in `ipsv4`
@@ -288,7 +577,8 @@ bool DNScache::isMatch(const std::string &url, const std::string &ipv4, const st
     auto it = mRecords.find(url);
     if (it != mRecords.end())
     {
-        match = (it->second.ipv4 == ipv4) && (it->second.ipv6 == ipv6);
+        match = (it->second.ipsv4.empty() ? ipv4.empty() : it->second.ipsv4.front() == ipv4)
+                && (it->second.ipsv6.empty() ? ipv6.empty() : it->second.ipsv6.front() == ipv6);
     }
 
     return match;
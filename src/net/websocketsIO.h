@@ -7,6 +7,7 @@
 #include <mega/waiter.h>
 #include <mega/thread.h>
 #include "base/logger.h"
+#include "base/timers.hpp"
 #include "sdkApi.h"
 
 #define WEBSOCKETS_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_websockets, fmtString, ##__VA_ARGS__)
@@ -16,31 +17,51 @@
 
 class WebsocketsClient;
 class WebsocketsClientImpl;
+class SqliteDb;
+
+// Metrics of the outbound queue of a websocket connection
+struct WebsocketsSendStats
+{
+    size_t queueDepth = 0;          // websocket messages queued to be written to the socket
+    size_t bytesInFlight = 0;       // bytes accepted but not written to the socket yet
+    size_t peakBytesInFlight = 0;   // max value of bytesInFlight since the connection was established
+    size_t congestionCount = 0;     // times the queue reached its high watermark
+    uint64_t bytesSent = 0;         // bytes written to the socket
+};
 
 class DNScache
 {
 public:
     DNScache() {}
-    // returns false if ipv4 and ipv6 for the given url already match the ones in cache, true if not (so they are updated)
+    // loads the records saved in the db and keeps it updated from now on. NULL to stop using the db
+    void setDb(SqliteDb *db);
+    // returns false if the resolved IPs for the given url match the ones in cache, true if not (so they are updated)
+    bool set(const std::string &url, const std::vector<std::string> &ipsv4, const std::vector<std::string> &ipsv6);
     bool set(const std::string &url, const std::string &ipv4, const std::string &ipv6);
     void clear(const std::string &url);
     // returns true if hit in cache, false if there's no record for the given url
+    // (the IPs returned are the last ones that connected successfully, if any)
     bool get(const std::string &url, std::string &ipv4, std::string &ipv6);
     void connectDone(const std::string &url, const std::string &ip);
+    // returns true if IPv6 should be tried first: the last successful connection used it, or none did
+    bool isIpv6Preferred(const std::string &url);
     time_t age(const std::string &url);
     bool isMatch(const std::string &url, const std::vector<std::string> &ipsv4, const std::vector<std::string> &ipsv6);
     bool isMatch(const std::string &url, const std::string &ipv4, const std::string &ipv6);
 private:
     struct DNSrecord
     {
-        std::string ipv4;
-        std::string ipv6;
+        std::vector<std::string> ipsv4;   // all the resolved IPs, the preferred one first
+        std::vector<std::string> ipsv6;
         time_t resolveTs = 0;       // can be used to invalidate IP addresses by age
-        time_t connectIpv4Ts = 0;   // can be used for heuristics based on last successful connection
-        time_t connectIpv6Ts = 0;   // can be used for heuristics based on last successful connection
+        time_t connectIpv4Ts = 0;   // used to prefer the IP family of the last successful connection
+        time_t connectIpv6Ts = 0;
     };
 
     std::map<std::string, DNSrecord> mRecords;
+    SqliteDb *mDb = NULL;
+
+    void saveRecord(const std::string &url, const DNSrecord &record);
 };
 
 // Generic websockets network layer
@@ -72,6 +93,10 @@ protected:
 
 class WebsocketsClient
 {
+public:
+    // delay before starting the connection attempt to the fallback IP (RFC 8305's Connection Attempt Delay)
+    enum { kFallbackDelay = 250 };
+
 private:
     WebsocketsClientImpl *ctx;
 #if defined(_WIN32) && defined(_MSC_VER)
@@ -80,20 +105,50 @@ private:
     pthread_t thread_id;
 #endif
 
+    // connection attempt to the fallback IP, racing with the one in `ctx` until one of them connects
+    WebsocketsClientImpl *mFallbackCtx = NULL;
+    megaHandle mFallbackTimer = 0;
+    WebsocketsIO *mWebsocketIO = NULL;
+    std::string mTargetIp;      // IP of `ctx`
+    std::string mFallbackIp;    // IP of `mFallbackCtx`, or to be used when the timer expires
+    std::string mHost;
+    std::string mPath;
+    int mPort = 0;
+    bool mSsl = false;
+
+    bool startFallback();
+    void cancelFallback();
+
 public:
     WebsocketsClient();
     virtual ~WebsocketsClient();
     bool wsResolveDNS(WebsocketsIO *websocketIO, const char *hostname, std::function<void(int, std::vector<std::string>&, std::vector<std::string>&)> f);
     bool wsConnect(WebsocketsIO *websocketIO, const char *ip,
                    const char *host, int port, const char *path, bool ssl);
+    // connects to `ip`, and also to `fallbackIp` (if not empty) if the first one fails or doesn't
+    // connect within kFallbackDelay. The first connection established is kept, and the other one closed
+    bool wsConnect(WebsocketsIO *websocketIO, const char *ip, const char *fallbackIp,
+                   const char *host, int port, const char *path, bool ssl);
+    // IP of the established connection, or of the first connection attempt in progress
+    const std::string &wsTargetIp() const { return mTargetIp; }
     bool wsSendMessage(char *msg, size_t len);  // returns true on success, false if error
     void wsDisconnect(bool immediate);
     bool wsIsConnected();
-    void wsCloseCbPrivate(int errcode, int errtype, const char *preason, size_t reason_len);
+    // true while the connection attempt to the fallback IP is scheduled or in progress,
+    // even if the first attempt already failed (then, wsIsConnected() returns false)
+    bool wsIsConnecting();
+    void wsConnectCbPrivate(WebsocketsClientImpl *impl);
+    void wsCloseCbPrivate(WebsocketsClientImpl *impl, int errcode, int errtype, const char *preason, size_t reason_len);
+
+    // returns true while the outbound queue is above its high watermark: producers
+    // should stop sending until wsSendQueueDrainedCb() is called
+    bool wsIsSendQueueFull();
+    WebsocketsSendStats wsSendStats();
 
     virtual void wsConnectCb() = 0;
     virtual void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len) = 0;
     virtual void wsHandleMsgCb(char *data, size_t len) = 0;
+    virtual void wsSendQueueDrainedCb() {}
 };
 
 
@@ -110,10 +165,13 @@ public:
     void wsConnectCb();
     void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
     void wsHandleMsgCb(char *data, size_t len);
+    void wsSendQueueDrainedCb();
     
     virtual bool wsSendMessage(char *msg, size_t len) = 0;
     virtual void wsDisconnect(bool immediate) = 0;
     virtual bool wsIsConnected() = 0;
+    virtual bool wsIsSendQueueFull() = 0;
+    virtual WebsocketsSendStats wsSendStats() = 0;
 };
 
 #endif /* websocketsIO_h */
@@ -75,13 +75,17 @@ void Client::pushPeers()
         return;
     }
 
+    // the full list supersedes any pending change
+    cancelFlushPeers();
+    mPeersDelta.clear();
+
     size_t numPeers = mCurrentPeers.size();
     size_t totalSize = sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint64_t) * numPeers;
 
     Command cmd(OP_SNSETPEERS, totalSize);
     cmd.append<uint64_t>(mLastScsn.val);
     cmd.append<uint32_t>(numPeers);
-    for (auto it = mCurrentPeers.begin(); it != mCurrentPeers.end(); it++)
+    for (auto it = mCurrentPeers.begin(); it != mCurrentPeers.end(); ++it)
     {
         cmd.append<uint64_t>(it->first);
     }
@@ -89,8 +93,110 @@ void Client::pushPeers()
     sendCommand(std::move(cmd));
 }
 
+void Client::addPeerToDelta(karere::Id peer, int change)
+{
+    // an addition and a removal of the same peer cancel each other
+    int* pending = mPeersDelta.find(peer.val);
+    if (pending)
+    {
+        assert(*pending == -change);
+        mPeersDelta.erase(peer.val);
+    }
+    else
+    {
+        mPeersDelta.emplace(peer.val, change);
+    }
+
+    if (!mFlushPeersTimer)
+    {
+        // send the changes once the current burst of actionpackets has been processed
+        auto wptr = weakHandle();
+        mFlushPeersTimer = setTimeout([this, wptr]()
+        {
+            if (wptr.deleted())
+                return;
+
+            mFlushPeersTimer = 0;
+            flushPeers();
+
+        }, 0, mKarereClient->appCtx);
+    }
+}
+
+void Client::cancelFlushPeers()
+{
+    if (mFlushPeersTimer)
+    {
+        cancelTimeout(mFlushPeersTimer, mKarereClient->appCtx);
+        mFlushPeersTimer = 0;
+    }
+}
+
+void Client::flushPeers()
+{
+    cancelFlushPeers();
+    if (mPeersDelta.empty())
+    {
+        return;
+    }
+
+    if (!isOnline())
+    {
+        // the full list of peers will be sent upon login
+        mPeersDelta.clear();
+        return;
+    }
+
+    // if the changes are more than the peers, sending the full list is shorter
+    if (mPeersDelta.size() > mCurrentPeers.size())
+    {
+        PRESENCED_LOG_DEBUG("flushPeers: %zu changes in a list of %zu peers, sending the full list",
+                            mPeersDelta.size(), mCurrentPeers.size());
+        pushPeers();
+        return;
+    }
+
+    size_t numAdded = 0;
+    for (auto it = mPeersDelta.begin(); it != mPeersDelta.end(); ++it)
+    {
+        if (it->second > 0)
+            numAdded++;
+    }
+    size_t numRemoved = mPeersDelta.size() - numAdded;
+
+    if (numAdded)
+    {
+        Command cmd(OP_SNADDPEERS, sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint64_t) * numAdded);
+        cmd.append<uint64_t>(mLastScsn.val);
+        cmd.append<uint32_t>(numAdded);
+        for (auto it = mPeersDelta.begin(); it != mPeersDelta.end(); ++it)
+        {
+            if (it->second > 0)
+                cmd.append<uint64_t>(it->first);
+        }
+        sendCommand(std::move(cmd));
+    }
+
+    if (numRemoved)
+    {
+        Command cmd(OP_SNDELPEERS, sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint64_t) * numRemoved);
+        cmd.append<uint64_t>(mLastScsn.val);
+        cmd.append<uint32_t>(numRemoved);
+        for (auto it = mPeersDelta.begin(); it != mPeersDelta.end(); ++it)
+        {
+            if (it->second < 0)
+                cmd.append<uint64_t>(it->first);
+        }
+        sendCommand(std::move(cmd));
+    }
+
+    mPeersDelta.clear();
+}
+
 void Client::wsConnectCb()
 {
+    // the connection may have been established with the fallback IP
+    mTargetIp = wsTargetIp();
     setConnState(kConnected);
 }
 
@@ -114,7 +220,6 @@ void Client::onSocketClose(int errcode, int errtype, const std::string& reason)
 
     assert(oldState != kDisconnected);
 
-    usingipv6 = !usingipv6;
     mTargetIp.clear();
 
     if (oldState >= kConnected)
@@ -310,6 +415,7 @@ Client::reconnect()
 
             setConnState(kDisconnected);
             mConnectPromise = Promise<void>();
+            mConnectStartTs = karere::timestampMs();
 
             string ipv4, ipv6;
             bool cachedIPs = mDNScache.get(mUrl.host, ipv4, ipv6);
@@ -379,9 +485,7 @@ Client::reconnect()
                 {
                     PRESENCED_LOG_DEBUG("Hostname resolved by first time. Connecting...");
 
-                    mDNScache.set(mUrl.host,
-                                  ipsv4.size() ? ipsv4.at(0) : "",
-                                  ipsv6.size() ? ipsv6.at(0) : "");
+                    mDNScache.set(mUrl.host, ipsv4, ipsv6);
                     doConnect();
                     return;
                 }
@@ -389,14 +493,15 @@ Client::reconnect()
                 if (mDNScache.isMatch(mUrl.host, ipsv4, ipsv6))
                 {
                     PRESENCED_LOG_DEBUG("DNS resolve matches cached IPs.");
+
+                    // keep all the resolved IPs, the cached ones are still preferred
+                    mDNScache.set(mUrl.host, ipsv4, ipsv6);
                 }
                 else
                 {
                     // update DNS cache
-                    bool ret = mDNScache.set(mUrl.host,
-                                             ipsv4.size() ? ipsv4.at(0) : "",
-                                             ipsv6.size() ? ipsv6.at(0) : "");
-                    assert(!ret);
+                    bool ret = mDNScache.set(mUrl.host, ipsv4, ipsv6);
+                    assert(ret);
 
                     PRESENCED_LOG_WARNING("DNS resolve doesn't match cached IPs. Forcing reconnect...");
                     onSocketClose(0, 0, "DNS resolve doesn't match cached IPs (presenced)");
@@ -493,24 +598,25 @@ void Client::onChatsUpdate(::mega::MegaApi *api, ::mega::MegaTextChatList *rooms
             uint64_t chatid = room->getHandle();
             const ::mega::MegaTextChatPeerList *peerList = room->getPeerList();
 
-            auto it = mChatMembers.find(chatid);
-            if (it == mChatMembers.end())  // new room
+            SetOfIds* members = mChatMembers.find(chatid);
+            if (!members)  // new room
             {
                 if (!peerList)
                 {
                     continue;   // no peers in this chatroom
                 }
 
+                members = &mChatMembers[chatid];
                 for (int j = 0; j < peerList->size(); j++)
                 {
                     uint64_t userid = peerList->getPeerHandle(j);
-                    mChatMembers[chatid].insert(userid);
+                    members->insert(userid);
                     addPeer(userid);
                 }
             }
             else    // existing room
             {
-                SetOfIds oldPeerList = mChatMembers[chatid];
+                SetOfIds oldPeerList = *members;
                 SetOfIds newPeerList;
                 if (peerList)
                 {
@@ -526,7 +632,7 @@ void Client::onChatsUpdate(::mega::MegaApi *api, ::mega::MegaTextChatList *rooms
                     uint64_t userid = *oldIt;
                     if (!newPeerList.has(userid))
                     {
-                        mChatMembers[chatid].erase(userid);
+                        members->erase(userid);
                         removePeer(userid);
                     }
                 }
@@ -537,7 +643,7 @@ void Client::onChatsUpdate(::mega::MegaApi *api, ::mega::MegaTextChatList *rooms
                     uint64_t userid = *newIt;
                     if (!oldPeerList.has(userid))
                     {
-                        mChatMembers[chatid].insert(userid);
+                        members->insert(userid);
                         addPeer(userid);
                     }
                 }
@@ -614,7 +720,7 @@ void Client::onUsersUpdate(::mega::MegaApi *api, ::mega::MegaUserList *usersUpda
 
                     // update mCurrentPeers's counter in order to consider groupchats. Otherwise, the count=1 will be zeroed if
                     // the user (now contact again) is removed from any groupchat, resulting in an incorrect DELPEERS
-                    for (auto it = mChatMembers.begin(); it != mChatMembers.end(); it++)
+                    for (auto it = mChatMembers.begin(); it != mChatMembers.end(); ++it)
                     {
                         if (it->second.has(userid))
                         {
@@ -662,6 +768,8 @@ void Client::onEvent(::mega::MegaApi *api, ::mega::MegaEvent *event)
             mCurrentPeers.clear();
             mContacts.clear();
             mChatMembers.clear();
+            cancelFlushPeers();
+            mPeersDelta.clear();
 
             // initialize the list of contacts
             for (int i = 0; i < contacts->size(); i++)
@@ -764,46 +872,26 @@ void Client::doConnect()
     string ipv4, ipv6;
     bool cachedIPs = mDNScache.get(mUrl.host, ipv4, ipv6);
     assert(cachedIPs);
-    mTargetIp = (usingipv6 && ipv6.size()) ? ipv6 : ipv4;
+
+    // race both IP families, starting by the one that connected last time (RFC 8305)
+    bool ipv6First = ipv6.size() && (ipv4.empty() || mDNScache.isIpv6Preferred(mUrl.host));
+    mTargetIp = ipv6First ? ipv6 : ipv4;
+    const string& fallbackIp = ipv6First ? ipv4 : ipv6;
 
     setConnState(kConnecting);
-    PRESENCED_LOG_DEBUG("Connecting to presenced using the IP: %s", mTargetIp.c_str());
+    mSocketConnectTs = karere::timestampMs();
+    PRESENCED_LOG_DEBUG("Connecting to presenced using the IP: %s (fallback IP: %s)", mTargetIp.c_str(), fallbackIp.c_str());
 
     bool rt = wsConnect(mKarereClient->websocketIO, mTargetIp.c_str(),
+          fallbackIp.c_str(),
           mUrl.host.c_str(),
           mUrl.port,
           mUrl.path.c_str(),
           mUrl.isSecure);
 
-    if (!rt)    // immediate failure --> try the other IP family (if available)
+    if (!rt)    // immediate failure with both IP families
     {
-        PRESENCED_LOG_DEBUG("Connection to presenced failed using the IP: %s", mTargetIp.c_str());
-
-        string oldTargetIp = mTargetIp;
-        mTargetIp.clear();
-        if (oldTargetIp == ipv6 && ipv4.size())
-        {
-            mTargetIp = ipv4;
-        }
-        else if (oldTargetIp == ipv4 && ipv6.size())
-        {
-            mTargetIp = ipv6;
-        }
-
-        if (mTargetIp.size())
-        {
-            PRESENCED_LOG_DEBUG("Retrying using the IP: %s", mTargetIp.c_str());
-            if (wsConnect(mKarereClient->websocketIO, mTargetIp.c_str(),
-                          mUrl.host.c_str(),
-                          mUrl.port,
-                          mUrl.path.c_str(),
-                          mUrl.isSecure))
-            {
-                return;
-            }
-            PRESENCED_LOG_DEBUG("Connection to presenced failed using the IP: %s", mTargetIp.c_str());
-        }
-
+        PRESENCED_LOG_DEBUG("Connection to presenced failed using the IPs: %s %s", ipv4.c_str(), ipv6.c_str());
         onSocketClose(0, 0, "Websocket error on wsConnect (presenced)");
     }
 }
@@ -1110,6 +1198,7 @@ Client::~Client()
 {
     mApi->sdk.removeGlobalListener(this);
 
+    cancelFlushPeers();
     disconnect();
     CALL_LISTENER(onDestroy); //we don't delete because it may have its own idea of its lifetime (i.e. it could be a GUI class)
 }
@@ -1258,8 +1347,8 @@ void Client::setConnState(ConnState newState)
     {
         mHeartbeatEnabled = false;
 
-        // if a socket is opened, close it immediately
-        if (wsIsConnected())
+        // if a socket is opened (or being opened to the fallback IP), close it immediately
+        if (wsIsConnected() || wsIsConnecting())
         {
             wsDisconnect(true);
         }
@@ -1291,7 +1380,7 @@ void Client::setConnState(ConnState newState)
         }
 
         // if disconnected, we don't really know the presence status anymore
-        for (auto it = mCurrentPeers.begin(); it != mCurrentPeers.end(); it++)
+        for (auto it = mCurrentPeers.begin(); it != mCurrentPeers.end(); ++it)
         {
             updatePeerPresence(it->first, Presence::kInvalid);
         }
@@ -1299,7 +1388,9 @@ void Client::setConnState(ConnState newState)
     }
     else if (mConnState == kConnected)
     {
-        PRESENCED_LOG_DEBUG("Presenced connected to %s", mTargetIp.c_str());
+        int64_t now = karere::timestampMs();
+        PRESENCED_LOG_INFO("Presenced connected to %s in %lld ms (%lld ms since the socket connection started)",
+                           mTargetIp.c_str(), (long long)(now - mConnectStartTs), (long long)(now - mSocketConnectTs));
 
         mDNScache.connectDone(mUrl.host, mTargetIp);
         assert(!mConnectPromise.done());
@@ -1326,14 +1417,7 @@ void Client::addPeer(karere::Id peer)
     int result = mCurrentPeers.insert(peer);
     if (result == 1) //refcount = 1, wasnt there before
     {
-        size_t totalSize = sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint64_t);
-
-        Command cmd(OP_SNADDPEERS, totalSize);
-        cmd.append<uint64_t>(mLastScsn.val);
-        cmd.append<uint32_t>(1);
-        cmd.append<uint64_t>(peer.val);
-
-        sendCommand(std::move(cmd));
+        addPeerToDelta(peer, 1);
     }
 }
 
@@ -1341,13 +1425,13 @@ void Client::removePeer(karere::Id peer, bool force)
 {
     assert(mLastScsn.isValid());
 
-    auto it = mCurrentPeers.find(peer);
-    if (it == mCurrentPeers.end())
+    int* refcount = mCurrentPeers.find(peer.val);
+    if (!refcount)
     {
         PRESENCED_LOG_WARNING("removePeer: Unknown peer %s", peer.toString().c_str());
         return;
     }
-    if (--it->second > 0)
+    if (--(*refcount) > 0)
     {
         if (!force)
         {
@@ -1361,38 +1445,26 @@ void Client::removePeer(karere::Id peer, bool force)
     }
     else //refcount reched zero
     {
-        assert(it->second == 0);
+        assert(*refcount == 0);
     }
 
-    mCurrentPeers.erase(it);
+    mCurrentPeers.erase(peer.val);
 
     // Remove peer from mPeersLastGreen map if exists
     mPeersLastGreen.erase(peer.val);
 
-
-    size_t totalSize = sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint64_t);
-
-    Command cmd(OP_SNDELPEERS, totalSize);
-    cmd.append<uint64_t>(mLastScsn.val);
-    cmd.append<uint32_t>(1);
-    cmd.append<uint64_t>(peer.val);
-
-    sendCommand(std::move(cmd));
+    addPeerToDelta(peer, -1);
 }
 
 void Client::updatePeerPresence(karere::Id peer, karere::Presence pres)
 {
-    mPeersPresence[peer] = pres;
+    mPeersPresence[peer.val] = pres;
     CALL_LISTENER(onPresenceChange, peer, pres);
 }
 
 karere::Presence Client::peerPresence(karere::Id peer) const
 {
-    auto it = mPeersPresence.find(peer);
-    if (it == mPeersPresence.end())
-    {
-        return karere::Presence::kInvalid;
-    }
-    return it->second;
+    const karere::Presence* pres = mPeersPresence.find(peer.val);
+    return pres ? *pres : karere::Presence(karere::Presence::kInvalid);
 }
 }
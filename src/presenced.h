@@ -11,6 +11,7 @@
 #include <base/trackDelete.h>
 #include <net/websocketsIO.h>
 #include <base/retryHandler.h>
+#include "msgIndex.h"
 
 #define PRESENCED_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_presenced, fmtString, ##__VA_ARGS__)
 #define PRESENCED_LOG_INFO(fmtString,...) KARERE_LOG_INFO(krLogChannel_presenced, fmtString, ##__VA_ARGS__)
@@ -214,7 +215,7 @@ enum: uint8_t
        * between different clients sending outdated list of users. If presenced receives an outdated
        * list, the command will be discarded.
        *
-       * <sn.8> <1.4> <peerHandle.8>
+       * <sn.8> <numberOfPeers.4> <peerHandle1.8>...<peerHandleN.8>
        */
     OP_SNDELPEERS = 9,
 
@@ -307,15 +308,15 @@ public:
     virtual ~Command(){}
 };
 
-struct IdRefMap: public std::map<karere::Id, int>
+struct IdRefMap: public chatd::IdIndex<int>
 {
-    typedef std::map<karere::Id, int> Base;
+    typedef chatd::IdIndex<int> Base;
     int insert(karere::Id id)
     {
-        auto result = Base::insert(std::make_pair(id, 1));
+        auto result = Base::emplace(id.val, 1);
         return result.second
             ? 1 //we just inserted the peer
-            : ++result.first->second; //already have that peer
+            : ++(*result.first); //already have that peer
     }
 };
 
@@ -358,8 +359,11 @@ protected:
     /** Target IP address being used for the reconnection in-flight */
     std::string mTargetIp;
 
-    /** ip version to try first (both are tried) */
-    bool usingipv6 = false;
+    /** Timestamps (ms) of the start of the current connection attempt (including DNS
+     * resolution), and of its socket connection, to measure the time until the websocket
+     * is established */
+    int64_t mConnectStartTs = 0;
+    int64_t mSocketConnectTs = 0;
 
     /** RetryController that manages the reconnection's attempts */
     std::unique_ptr<karere::rh::IRetryController> mRetryCtrl;
@@ -397,14 +401,22 @@ protected:
      * (currently, it includes contacts and any user in our groupchats, except ex-contacts) */
     IdRefMap mCurrentPeers;
 
+    /** Changes to mCurrentPeers not sent to presenced yet: +1 for a peer to add, -1 for
+     * a peer to remove. They are accumulated while processing a burst of actionpackets
+     * and sent by flushPeers() as a single ADDPEERS and a single DELPEERS */
+    chatd::IdIndex<int> mPeersDelta;
+
+    /** Handler of the timer that calls flushPeers(), 0 if not scheduled */
+    megaHandle mFlushPeersTimer = 0;
+
     /** Map of userids (key) and presence (value) of any user wich we're allowed to receive it's presence */
-    std::map<uint64_t, karere::Presence> mPeersPresence;
+    chatd::IdIndex<karere::Presence> mPeersPresence;
 
     /** Map of userids (key) and last green (value) of any contact or any user in our groupchats, except ex-contacts */
     std::map<uint64_t, time_t> mPeersLastGreen;
 
     /** Map of chatids (key) and the list of peers (value) in every chat (updated only from API) */
-    std::map<uint64_t, karere::SetOfIds> mChatMembers;
+    chatd::IdIndex<karere::SetOfIds> mChatMembers;
 
     /** Map of userid of contacts (key) and their visibility (value) (updated only from API)
      * @note: ex-contacts are included.
@@ -441,6 +453,9 @@ protected:
     void addPeer(karere::Id peer);
     void removePeer(karere::Id peer, bool force=false);
     void pushPeers();
+    void addPeerToDelta(karere::Id peer, int change);
+    void flushPeers();
+    void cancelFlushPeers();
     bool isExContact(uint64_t userid);
 
     // mega::MegaGlobalListener interface, called by worker thread
@@ -484,6 +499,7 @@ public:
     // peers management
     void updatePeerPresence(karere::Id peer, karere::Presence pres);
     karere::Presence peerPresence(karere::Id peer) const;
+    const chatd::IdIndex<karere::Presence>& peersPresence() const { return mPeersPresence; }
 
     /** @brief Updates user last green if it's more recent than the current value.*/
     bool updateLastGreen(karere::Id userid, time_t lastGreen);
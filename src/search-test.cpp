@@ -0,0 +1,155 @@
+// Tests of the search index of the history (see ChatdSqliteDb::searchMessages()): prefix
+// matching, case folding, ranking, reindexing of edited and deleted messages, and the
+// multi-row inserts of the words of the messages.
+//
+// Usage: search-test
+// Built with the karere library when optKarereBuildTests is enabled.
+
+#include <asyncTest-framework.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "chatdDb.h"
+
+TESTS_INIT();
+using namespace karere;
+
+static const Id kChat1(0x1111);
+static const Id kChat2(0x2222);
+
+class SearchDb
+{
+public:
+    SqliteDb db;
+    SearchDb()
+    {
+        db.open(":memory:");
+        db.simpleQuery(gDbSchema);
+    }
+    // adds a normal message to history and to the search index, as the chat does
+    void add(Id chatid, Id msgid, const std::string& text, uint32_t ts)
+    {
+        chatd::Message msg(msgid, Id(1), ts, 0, text.data(), text.size(), false,
+                           CHATD_KEYID_INVALID, chatd::Message::kMsgNormal);
+        db.query("insert into history(idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) "
+                 "values(?,?,?,?,?,?,?,?,?,?,?)", mNextIdx++, chatid, msgid, msg.keyid, msg.type, msg.userid,
+                 msg.ts, msg.updated, msg, msg.backRefId, msg.isEncrypted());
+        ChatdSqliteDb::indexMessage(db, chatid, msgid, msg);
+    }
+    // updates a message in the search index, as ChatdSqliteDb::updateMsgInHistory() does
+    void edit(Id chatid, Id msgid, const std::string& text, uint16_t updated)
+    {
+        chatd::Message msg(msgid, Id(1), 1, updated, text.data(), text.size(), false,
+                           CHATD_KEYID_INVALID, chatd::Message::kMsgNormal);
+        ChatdSqliteDb::reindexMessage(db, chatid, msgid, msg);
+    }
+    std::vector<ChatdSearchResult> search(const std::string& text, Id chatid = Id::inval(), int limit = 10)
+    {
+        std::vector<ChatdSearchResult> results;
+        ChatdSqliteDb::searchMessages(db, chatid, text, limit, results);
+        return results;
+    }
+    std::vector<uint64_t> searchIds(const std::string& text, Id chatid = Id::inval())
+    {
+        std::vector<uint64_t> ids;
+        for (auto& result: search(text, chatid))
+        {
+            ids.push_back(result.msgid.val);
+        }
+        return ids;
+    }
+protected:
+    int mNextIdx = 0;
+};
+
+int main(int argc, char** argv)
+{
+TestGroup("Search index")
+{
+    syncTest("Words are matched by prefix")
+    {
+        SearchDb s;
+        s.add(kChat1, 1, "Hello wonderful world", 100);
+        s.add(kChat1, 2, "help me", 200);
+        s.add(kChat1, 3, "a shell", 300);
+        check((s.searchIds("hel") == std::vector<uint64_t>{2, 1}));   // same score, most recent first
+        check((s.searchIds("hello") == std::vector<uint64_t>{1}));
+        check((s.searchIds("wor") == std::vector<uint64_t>{1}));
+        check((s.searchIds("shell") == std::vector<uint64_t>{3}));
+        check(s.searchIds("ell").empty());      // only prefixes of words
+        check(s.searchIds("helloo").empty());
+    });
+    syncTest("ASCII letters are case-folded")
+    {
+        SearchDb s;
+        s.add(kChat1, 1, "MEGA Chat", 100);
+        s.add(kChat1, 2, "\xC3\x89" "cole", 200);     // "École"
+        check((s.searchIds("mega") == std::vector<uint64_t>{1}));
+        check((s.searchIds("CHAT") == std::vector<uint64_t>{1}));
+        check((s.searchIds("mEgA cHaT") == std::vector<uint64_t>{1}));
+        check((s.searchIds("\xC3\x89" "COLE") == std::vector<uint64_t>{2}));
+        check(s.searchIds("\xC3\xA9" "cole").empty());   // "école": non-ASCII letters are not folded
+    });
+    syncTest("Messages with more words found rank first")
+    {
+        SearchDb s;
+        s.add(kChat1, 1, "meeting tomorrow", 300);
+        s.add(kChat1, 2, "the meeting room is booked for tomorrow morning", 100);
+        s.add(kChat1, 3, "room", 200);
+        std::vector<ChatdSearchResult> results = s.search("room tomorrow meeting");
+        check(results.size() == 3);
+        check(results[0].msgid == Id(2) && results[0].score == 3);
+        check(results[1].msgid == Id(1) && results[1].score == 2);
+        check(results[2].msgid == Id(3) && results[2].score == 1);
+        check(s.search("room tomorrow meeting", Id::inval(), 1).size() == 1);
+    });
+    syncTest("Search is restricted to a chat")
+    {
+        SearchDb s;
+        s.add(kChat1, 1, "invoice", 100);
+        s.add(kChat2, 2, "invoice", 200);
+        check((s.searchIds("invoice") == std::vector<uint64_t>{2, 1}));
+        check((s.searchIds("invoice", kChat1) == std::vector<uint64_t>{1}));
+        std::vector<ChatdSearchResult> results = s.search("invoice", kChat2);
+        check(results.size() == 1 && results[0].chatid == kChat2 && results[0].ts == 200);
+    });
+    syncTest("Edited messages are reindexed")
+    {
+        SearchDb s;
+        s.add(kChat1, 1, "see you on monday", 100);
+        s.edit(kChat1, 1, "see you on tuesday", 1);
+        check(s.searchIds("monday").empty());
+        check((s.searchIds("tues") == std::vector<uint64_t>{1}));
+        check((s.searchIds("see") == std::vector<uint64_t>{1}));
+    });
+    syncTest("Deleted messages are removed from the index")
+    {
+        SearchDb s;
+        s.add(kChat1, 1, "secret plan", 100);
+        s.add(kChat1, 2, "public plan", 200);
+        s.edit(kChat1, 1, "", 1);
+        check(s.searchIds("secret").empty());
+        check((s.searchIds("plan") == std::vector<uint64_t>{2}));
+    });
+    syncTest("Messages with more words than a multi-row insert are fully indexed")
+    {
+        SearchDb s;
+        std::string text;
+        int wordCount = ChatdSqliteDb::kTermInsertChunkRows * 2 + 7;
+        for (int i = 0; i < wordCount; i++)
+        {
+            text.append("word").append(std::to_string(i)).push_back(' ');
+        }
+        s.add(kChat1, 1, text, 100);
+        SqliteStmt stmt(s.db, "select count(*) from history_terms where chatid = ? and msgid = ?");
+        stmt << kChat1 << Id(1);
+        check(stmt.step() && stmt.intCol(0) == wordCount);
+        for (int i: {0, (int)ChatdSqliteDb::kTermInsertChunkRows, wordCount - 1})
+        {
+            check((s.searchIds("word" + std::to_string(i)) == std::vector<uint64_t>{1}));
+        }
+    });
+});
+
+return test::gNumFailed;
+}
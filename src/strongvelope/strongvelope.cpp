@@ -35,6 +35,8 @@
 #endif
 #include <locale>
 #include <karereCommon.h>
+#include <base/gcmpp.h>
+#include <base/workerPool.h>
 
 namespace strongvelope
 {
@@ -118,6 +120,13 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     }
     Id chatid = mProtoHandler.chatid;
     STRONGVELOPE_LOG_DEBUG("Decrypting msg %s", outMsg.id().toString().c_str());
+    std::string cleartext = decryptPayload(key);
+    parsePayload(StaticBuffer(cleartext, false), outMsg);
+    outMsg.setEncrypted(Message::kNotEncrypted);
+}
+
+std::string ParsedMessage::decryptPayload(const StaticBuffer& key) const
+{
     Key<32> derivedNonce;
     // deriveNonceSecret() needs at least 32 bytes output buffer
     deriveNonceSecret(nonce, derivedNonce);
@@ -125,10 +134,8 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     // For AES CRT mode, we take the first 12 bytes as the nonce,
     // and the remaining 4 bytes as the counter, which is initialized to zero
     *reinterpret_cast<uint32_t*>(derivedNonce.buf()+SVCRYPTO_NONCE_SIZE) = 0;
-    std::string cleartext = aesCTRDecrypt(std::string(payload.buf(), payload.dataSize()),
+    return aesCTRDecrypt(std::string(payload.buf(), payload.dataSize()),
         key, derivedNonce);
-    parsePayload(StaticBuffer(cleartext, false), outMsg);
-    outMsg.setEncrypted(Message::kNotEncrypted);
 }
 
 /**
@@ -183,12 +190,25 @@ void ProtocolHandler::signMessage(const StaticBuffer& signedData,
 }
 
 bool ParsedMessage::verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey)
+{
+    Buffer messageStr(SVCRYPTO_SIG.size()+sendKey.dataSize()+signedContent.dataSize()+2);
+    return verifySignature(pubKey, sendKey, messageStr);
+}
+
+bool ParsedMessage::verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey,
+    Buffer& buf) const
+{
+    return verifySignature(protocolVersion, type, signedContent, signature, pubKey, sendKey, buf);
+}
+
+bool ParsedMessage::verifySignature(uint8_t protocolVersion, uint8_t type, const StaticBuffer& signedContent,
+    const StaticBuffer& signature, const StaticBuffer& pubKey, const SendKey& sendKey, Buffer& messageStr)
 {
     assert(pubKey.dataSize() == 32);
+    messageStr.clear();
     if (protocolVersion < 2)
     {
         //legacy
-        Buffer messageStr(SVCRYPTO_SIG.size()+signedContent.dataSize());
         messageStr.append(SVCRYPTO_SIG.c_str(), SVCRYPTO_SIG.size())
         .append(signedContent);
         return (crypto_sign_verify_detached(signature.ubuf(), messageStr.ubuf(),
@@ -196,8 +216,6 @@ bool ParsedMessage::verifySignature(const StaticBuffer& pubKey, const SendKey& s
     }
 
     assert(sendKey.dataSize() == 16);
-    Buffer messageStr(SVCRYPTO_SIG.size()+sendKey.dataSize()+signedContent.dataSize()+2);
-
     messageStr.append(SVCRYPTO_SIG.c_str(), SVCRYPTO_SIG.size())
     .append<uint8_t>(protocolVersion)
     .append<uint8_t>(type)
@@ -509,14 +527,94 @@ void ParsedMessage::parsePayload(const StaticBuffer &data, Message &msg)
     }
 }
 
+// the info string used to derive the key that encrypts the cached pairwise keys in the db
+static const std::string SVCRYPTO_KEY_CACHE_KEY = "strongvelope key cache\x01";
+
+PairwiseKeyCache::PairwiseKeyCache(SqliteDb& db, const StaticBuffer& privCu25519)
+: mDb(db)
+{
+    deriveSharedKey(privCu25519, mStorageKey, SVCRYPTO_KEY_CACHE_KEY);
+    loadFromDb();
+}
+
+void PairwiseKeyCache::loadFromDb()
+{
+    SqliteStmt stmt(mDb, "select userid, pubkey, key from pairwise_keys");
+    Buffer pubKey;
+    Buffer encKey;
+    while (stmt.step())
+    {
+        Id userid(stmt.uint64Col(0));
+        stmt.blobCol(1, pubKey);
+        stmt.blobCol(2, encKey);
+        if (pubKey.dataSize() != EcKey::bufSize() || encKey.dataSize() != AES::BLOCKSIZE)
+        {
+            KARERE_LOG_WARNING(krLogChannel_strongvelope, "Ignoring malformed cached pairwise key of user %s", userid.toString().c_str());
+            continue;
+        }
+        auto key = std::make_shared<SendKey>();
+        aesECBDecrypt(encKey, mStorageKey, *key);
+        mKeys.emplace(std::piecewise_construct,
+            std::forward_as_tuple(userid),
+            std::forward_as_tuple(pubKey, key));
+    }
+    KARERE_LOG_DEBUG(krLogChannel_strongvelope, "Loaded %zu pairwise keys from database", mKeys.size());
+}
+
+std::shared_ptr<SendKey> PairwiseKeyCache::get(Id userid, const StaticBuffer& pubKey) const
+{
+    auto it = mKeys.find(userid);
+    if (it == mKeys.end())
+        return nullptr;
+
+    const EcKey& cachedPubKey = it->second.pubKey;
+    if (pubKey.dataSize() != cachedPubKey.dataSize()
+     || memcmp(pubKey.buf(), cachedPubKey.buf(), pubKey.dataSize()))
+        return nullptr;
+
+    return it->second.key;
+}
+
+void PairwiseKeyCache::put(Id userid, const StaticBuffer& pubKey, const std::shared_ptr<SendKey>& key)
+{
+    assert(key->dataSize() == AES::BLOCKSIZE);
+    auto it = mKeys.find(userid);
+    if (it != mKeys.end())
+    {
+        it->second.pubKey.assign(pubKey.buf(), pubKey.dataSize());
+        it->second.key = key;
+    }
+    else
+    {
+        mKeys.emplace(std::piecewise_construct,
+            std::forward_as_tuple(userid),
+            std::forward_as_tuple(pubKey, key));
+    }
+
+    SendKey encKey;
+    aesECBEncrypt(*key, mStorageKey, encKey);
+    try
+    {
+        mDb.query("insert or replace into pairwise_keys(userid, pubkey, key) values(?,?,?)",
+            userid, pubKey, encKey);
+    }
+    catch(std::exception& e)
+    {
+        // not fatal, the key will be derived again on next startup
+        KARERE_LOG_ERROR(krLogChannel_strongvelope, "Exception while saving pairwise key to db: %s", e.what());
+    }
+}
+
 ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
     const StaticBuffer& privCu25519,
     const StaticBuffer& privEd25519,
     const StaticBuffer& privRsa,
-    karere::UserAttrCache& userAttrCache, SqliteDb &db, Id aChatId, void *ctx)
+    karere::UserAttrCache& userAttrCache, SqliteDb &db, Id aChatId, void *ctx,
+    karere::WorkerPool* workers, PairwiseKeyCache* pairwiseKeys)
 : chatd::ICrypto(ctx), mOwnHandle(ownHandle), myPrivCu25519(privCu25519),
  myPrivEd25519(privEd25519), myPrivRsaKey(privRsa),
- mUserAttrCache(userAttrCache), mDb(db), chatid(aChatId)
+ mUserAttrCache(userAttrCache), mDb(db), mPairwiseKeys(pairwiseKeys), mWorkers(workers),
+ chatid(aChatId)
 {
     getPubKeyFromPrivKey(myPrivEd25519, kKeyTypeEd25519, myPubEd25519);
     loadKeysFromDb();
@@ -677,12 +775,27 @@ ProtocolHandler::computeSymmetricKey(karere::Id userid, const std::string& padSt
 
         if (pubKey->empty())
             return promise::Error("Empty Cu25519 chat key for user "+userid.toString());
-        Key<crypto_scalarmult_BYTES> sharedSecret;
-        sharedSecret.setDataSize(crypto_scalarmult_BYTES);
-        auto ignore = crypto_scalarmult(sharedSecret.ubuf(), myPrivCu25519.ubuf(), pubKey->ubuf());
-        (void)ignore;
-        auto result = std::make_shared<SendKey>();
-        deriveSharedKey(sharedSecret, *result, padString);
+
+        // the persisted cache only has keys derived with the default padding
+        bool persist = mPairwiseKeys && (padString == SVCRYPTO_PAIRWISE_KEY);
+        std::shared_ptr<SendKey> result;
+        if (persist)
+        {
+            result = mPairwiseKeys->get(userid, *pubKey);
+        }
+        if (!result)
+        {
+            Key<crypto_scalarmult_BYTES> sharedSecret;
+            sharedSecret.setDataSize(crypto_scalarmult_BYTES);
+            auto ignore = crypto_scalarmult(sharedSecret.ubuf(), myPrivCu25519.ubuf(), pubKey->ubuf());
+            (void)ignore;
+            result = std::make_shared<SendKey>();
+            deriveSharedKey(sharedSecret, *result, padString);
+            if (persist)
+            {
+                mPairwiseKeys->put(userid, *pubKey, result);
+            }
+        }
         mSymmKeyCache.emplace(userid, result);
         return result;
     });
@@ -1077,6 +1190,11 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
                 return promise::Error("msgDecrypt: history was reloaded, ignore message", EINVAL, SVCRYPTO_ENOMSG);
             }
 
+            if (mWorkers)
+            {
+                return decryptOnWorker(parsedMsg, message, ctx->sendKey, ctx->edKey, cacheVersion);
+            }
+
             if (!parsedMsg->verifySignature(ctx->edKey, *ctx->sendKey))
             {
                 return promise::Error("Signature invalid for message "+
@@ -1100,6 +1218,166 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
     }
 }
 
+/** A message being verified and decrypted on a worker thread. The worker only reads
+ * the parsed message and the keys, and writes the results */
+struct ProtocolHandler::DecryptJob
+{
+    std::shared_ptr<ParsedMessage> parsedMsg;
+    std::shared_ptr<SendKey> sendKey;
+    EcKey edKey;
+    Message* message;
+    unsigned int cacheVersion;
+    Promise<Message*> pms;
+    // results
+    bool signatureValid = false;
+    std::string cleartext;
+    std::string error;  // set if the verification or decryption threw
+
+    DecryptJob(const std::shared_ptr<ParsedMessage>& aParsedMsg, Message* aMessage,
+        const std::shared_ptr<SendKey>& aSendKey, const EcKey& aEdKey, unsigned int aCacheVersion)
+    : parsedMsg(aParsedMsg), sendKey(aSendKey), message(aMessage), cacheVersion(aCacheVersion)
+    {
+        edKey.assign(aEdKey.buf(), aEdKey.dataSize());
+    }
+};
+
+/** The messages of a chat whose keys became known in the same iteration of the
+ * event loop (i.e. a history fetch), verified and decrypted by a single worker job.
+ * Everything but the results, including the release of the batch, is done on the
+ * app's thread */
+struct ProtocolHandler::DecryptBatch
+{
+    std::vector<std::unique_ptr<DecryptJob>> jobs;
+    karere::DeleteTrackable::Handle wptr;
+    DecryptBatch(ProtocolHandler& handler): wptr(handler.weakHandle()) {}
+};
+
+Promise<Message*> ProtocolHandler::decryptOnWorker(const std::shared_ptr<ParsedMessage>& parsedMsg,
+    Message* message, const std::shared_ptr<SendKey>& sendKey, const EcKey& edKey,
+    unsigned int cacheVersion)
+{
+    if (!mDecryptBatch)
+    {
+        // post the batch once all messages received so far are processed
+        mDecryptBatch = std::make_shared<DecryptBatch>(*this);
+        auto wptr = weakHandle();
+        marshallCall([this, wptr]()
+        {
+            if (wptr.deleted())
+                return;
+            postDecryptBatch();
+        }, appCtx);
+    }
+    mDecryptBatch->jobs.emplace_back(new DecryptJob(parsedMsg, message, sendKey, edKey, cacheVersion));
+    Promise<Message*> pms = mDecryptBatch->jobs.back()->pms;
+    if (mDecryptBatch->jobs.size() >= kMaxDecryptBatch)
+    {
+        postDecryptBatch();
+    }
+    return pms;
+}
+
+void ProtocolHandler::postDecryptBatch()
+{
+    if (!mDecryptBatch)
+        return;
+
+    std::shared_ptr<DecryptBatch> batch;
+    batch.swap(mDecryptBatch);
+    void* ctx = appCtx;
+    mWorkers->post(chatid.val, [this, batch, ctx]() mutable
+    {
+        // on the worker thread
+        verifyAndDecrypt(*batch);
+
+        // hand over our reference, so the batch is released on the app's thread
+        auto onDone = [this, batch]()
+        {
+            if (batch->wptr.deleted())
+            {
+                for (auto& job: batch->jobs)
+                {
+                    job->pms.reject("msgDecrypt: strongvelop deleted, ignore message", EINVAL, SVCRYPTO_EEXPIRED);
+                }
+                return;
+            }
+            for (auto& job: batch->jobs)
+            {
+                onDecryptJobDone(*job);
+            }
+        };
+        batch.reset();
+        marshallCall(std::move(onDone), ctx);
+    });
+}
+
+void ProtocolHandler::verifyAndDecrypt(DecryptBatch& batch)
+{
+    // Signatures are checked one by one, so a failure maps to its message directly.
+    // The signed data of the messages is built in the same buffer
+    Buffer signedData(1024);
+    for (auto& job: batch.jobs)
+    {
+        // an exception must not escape the worker thread, it's reported to the app's thread instead
+        try
+        {
+            job->signatureValid = job->parsedMsg->verifySignature(job->edKey, *job->sendKey, signedData);
+            if (job->signatureValid && !job->parsedMsg->payload.empty())
+            {
+                job->cleartext = job->parsedMsg->decryptPayload(*job->sendKey);
+            }
+        }
+        catch (std::exception& e)
+        {
+            job->error = e.what();
+        }
+        catch (...)
+        {
+            job->error = "unknown exception";
+        }
+    }
+}
+
+void ProtocolHandler::onDecryptJobDone(DecryptJob& job)
+{
+    if (job.cacheVersion != mCacheVersion)
+    {
+        job.pms.reject("msgDecrypt: history was reloaded, ignore message", EINVAL, SVCRYPTO_ENOMSG);
+        return;
+    }
+    Message* message = job.message;
+    if (!job.error.empty())
+    {
+        job.pms.reject("msgDecrypt: error verifying or decrypting message "+message->id().toString()
+                       +": "+job.error, EINVAL, SVCRYPTO_EMALFORMED);
+        return;
+    }
+    if (!job.signatureValid)
+    {
+        job.pms.reject("Signature invalid for message "+message->id().toString(), EINVAL, SVCRYPTO_ESIGNATURE);
+        return;
+    }
+
+    try
+    {
+        if (job.parsedMsg->payload.empty())
+        {
+            message->clear();
+        }
+        else
+        {
+            job.parsedMsg->parsePayload(StaticBuffer(job.cleartext, false), *message);
+        }
+        message->setEncrypted(Message::kNotEncrypted);
+    }
+    catch (std::runtime_error& e)
+    {
+        job.pms.reject(e.what(), EINVAL, SVCRYPTO_EMALFORMED);
+        return;
+    }
+    job.pms.resolve(message);
+}
+
 Promise<void>
 ProtocolHandler::legacyExtractKeys(const std::shared_ptr<ParsedMessage>& parsedMsg)
 {
@@ -9,6 +9,7 @@
 #define STRONGVELOPE_H_
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <string>
 #include <assert.h>
 #include <iostream>
@@ -21,6 +22,8 @@
 #include <karereCommon.h>
 #include <base/trackDelete.h>
 
+namespace karere { class WorkerPool; }
+
 #define STRONGVELOPE_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_strongvelope, "%s: " fmtString, chatid.toString().c_str(), ##__VA_ARGS__)
 #define STRONGVELOPE_LOG_WARNING(fmtString,...) KARERE_LOG_WARNING(krLogChannel_strongvelope, "%s: " fmtString, chatid.toString().c_str(), ##__VA_ARGS__)
 #define STRONGVELOPE_LOG_ERROR(fmtString,...) KARERE_LOG_ERROR(krLogChannel_strongvelope, "%s: " fmtString, chatid.toString().c_str(), ##__VA_ARGS__)
@@ -177,9 +180,19 @@ struct ParsedMessage: public karere::DeleteTrackable
     Buffer encryptedKey; //may contain also the prev key, concatenated
     ParsedMessage(const chatd::Message& src, ProtocolHandler& protoHandler);
     bool verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey);
+    /** Same as above, but builds the signed data in \c buf, so that its memory can be
+     * reused to verify a batch of messages. Can be called from a worker thread */
+    bool verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey, Buffer& buf) const;
+    /** Verifies the signature of a message with the specified fields, as the overloads
+     * above do. It doesn't need a parsed message (i.e. for benchmarks) */
+    static bool verifySignature(uint8_t protocolVersion, uint8_t type, const StaticBuffer& signedContent,
+        const StaticBuffer& signature, const StaticBuffer& pubKey, const SendKey& sendKey, Buffer& buf);
     void parsePayload(const StaticBuffer& data, chatd::Message& msg);
     void parsePayloadWithUtfBackrefs(const StaticBuffer& data, chatd::Message& msg);
     void symmetricDecrypt(const StaticBuffer& key, chatd::Message& outMsg);
+    /** Decrypts the payload, without parsing it. Doesn't access the protocol handler,
+     * so it can be called from a worker thread */
+    std::string decryptPayload(const StaticBuffer& key) const;
     promise::Promise<chatd::Message*> decryptChatTitle(chatd::Message* msg, bool msgCanBeDeleted);
     std::unique_ptr<chatd::Message::ManagementInfo> managementInfo;
     std::unique_ptr<chatd::Message::CallEndedInfo> callEndedInfo;
@@ -232,12 +245,56 @@ struct UserKeyId
         else
             return keyid < other.keyid;
     }
+    bool operator==(UserKeyId other) const
+    {
+        return (user == other.user) && (keyid == other.keyid);
+    }
+    struct Hash
+    {
+        size_t operator()(UserKeyId ukid) const
+        {
+            return std::hash<uint64_t>()(ukid.user.val ^ (ukid.keyid * 0x9e3779b97f4a7c15ULL));
+        }
+    };
 };
 
 class TlvWriter;
 extern const std::string SVCRYPTO_PAIRWISE_KEY;
 void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output, const std::string& padString=SVCRYPTO_PAIRWISE_KEY);
 
+/**
+ * @brief Cache of the symmetric keys shared with other users, derived from our
+ * private and their public Cu25519 keys. Unlike the keys of each chat, the pairwise
+ * key of a user is the same in all chats, so a single instance is shared by the
+ * protocol handlers of all chats. Keys are persisted in the db (encrypted with a key
+ * derived from our private Cu25519 key), and loaded all at once on creation, so they
+ * don't have to be derived again on every startup.
+ */
+class PairwiseKeyCache
+{
+protected:
+    struct Entry
+    {
+        EcKey pubKey; // the public key the symmetric key was derived from
+        std::shared_ptr<SendKey> key;
+        Entry(const StaticBuffer& aPubKey, const std::shared_ptr<SendKey>& aKey)
+        : pubKey(aPubKey), key(aKey) {}
+    };
+    SqliteDb& mDb;
+    SendKey mStorageKey;
+    std::unordered_map<karere::Id, Entry> mKeys;
+    void loadFromDb();
+
+public:
+    PairwiseKeyCache(SqliteDb& db, const StaticBuffer& privCu25519);
+    size_t size() const { return mKeys.size(); }
+    /** Returns the key shared with \c userid, if any was derived from the public key
+     * \c pubKey. Otherwise (i.e. the user's key changed) returns \c nullptr */
+    std::shared_ptr<SendKey> get(karere::Id userid, const StaticBuffer& pubKey) const;
+    /** Adds or replaces the key shared with \c userid, and saves it to the db */
+    void put(karere::Id userid, const StaticBuffer& pubKey, const std::shared_ptr<SendKey>& key);
+};
+
 /**
  * @brief The ProtocolHandler class implements ICrypto.
  * @see chatd::ICrypto for more details.
@@ -297,10 +354,12 @@ protected:
     bool mForceRsa = false; // for testing of legacy-mode
 
     // received and confirmed keys (doesn't include unconfirmed keys)
-    std::map<UserKeyId, KeyEntry> mKeys;
+    std::unordered_map<UserKeyId, KeyEntry, UserKeyId::Hash> mKeys;
 
     // cache of symmetric keys (pubCu255 * privCu255)
     std::map<karere::Id, std::shared_ptr<SendKey>> mSymmKeyCache;
+    // persisted cache of symmetric keys, shared by all chats, if any
+    PairwiseKeyCache* mPairwiseKeys = nullptr;
 
     // current list of participants (mapped to the `chatd::Client::mUsers`)
     karere::SetOfIds* mParticipants = nullptr;
@@ -308,6 +367,14 @@ protected:
     bool mIsDestroying = false;
     unsigned int mCacheVersion = 0; // updated if history is reloaded
 
+    // worker threads where signatures are verified and payloads decrypted, if any
+    karere::WorkerPool* mWorkers = nullptr;
+    struct DecryptJob;
+    struct DecryptBatch;
+    // messages with known keys, to be posted to the workers together
+    std::shared_ptr<DecryptBatch> mDecryptBatch;
+    enum { kMaxDecryptBatch = 256 };
+
 public:
     karere::Id chatid;
     karere::Id ownHandle() const { return mOwnHandle; }
@@ -316,7 +383,8 @@ public:
     ProtocolHandler(karere::Id ownHandle, const StaticBuffer& PrivCu25519,
         const StaticBuffer& PrivEd25519,
         const StaticBuffer& privRsa, karere::UserAttrCache& userAttrCache,
-        SqliteDb& db, karere::Id aChatId, void *ctx);
+        SqliteDb& db, karere::Id aChatId, void *ctx, karere::WorkerPool* workers = nullptr,
+        PairwiseKeyCache* pairwiseKeys = nullptr);
 
     promise::Promise<std::shared_ptr<SendKey>> //must be public to access from ParsedMessage
         decryptKey(std::shared_ptr<Buffer>& key, karere::Id sender, karere::Id receiver);
@@ -374,6 +442,19 @@ protected:
         const std::shared_ptr<ParsedMessage>& parsedMsg, chatd::Message* msg);
     chatd::Message* legacyMsgDecrypt(const std::shared_ptr<ParsedMessage>& parsedMsg,
         chatd::Message* msg, const SendKey& key);
+    /**
+     * Verifies the signature and decrypts the payload of a message on a worker thread,
+     * once its keys are known. Messages are collected in batches, posted at the next
+     * iteration of the event loop or when the batch is full. The message is updated on
+     * the app's thread, and jobs of the same chat complete in the order they were started.
+     */
+    promise::Promise<chatd::Message*> decryptOnWorker(const std::shared_ptr<ParsedMessage>& parsedMsg,
+        chatd::Message* msg, const std::shared_ptr<SendKey>& sendKey, const EcKey& edKey,
+        unsigned int cacheVersion);
+    void postDecryptBatch();
+    /** Called on a worker thread */
+    static void verifyAndDecrypt(DecryptBatch& batch);
+    void onDecryptJobDone(DecryptJob& job);
 
 
 // legacy RSA encryption methods
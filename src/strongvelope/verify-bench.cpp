@@ -0,0 +1,197 @@
+// Micro-benchmark of the verification of message signatures on the crypto workers:
+// one worker job (and one result marshalled back to the app's thread) per message,
+// against one job per batch of messages, as done for messages received together
+// (i.e. a history fetch). All messages have the same sender, as in a history fetch
+// of a 1on1 chat. Messages are verified by ParsedMessage::verifySignature(), reusing
+// the buffer of the signed data within a batch, as the decryption workers do.
+//
+// Usage: verify-bench [message-count]
+// Build (from src, with the MEGA SDK, and karere built as a static library):
+// g++ -std=c++11 -O2 -I. -Ibase -Istrongvelope -I<sdk>/include strongvelope/verify-bench.cpp
+//     -L<build> -lkarere -lservices -lmega <SDK dependencies> -o verify-bench
+// With CMake, enable optKarereBuildBenchmarks (target verify-bench).
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <deque>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sodium.h>
+#include "workerPool.h"
+#include "strongvelope.h"
+
+using namespace strongvelope;
+
+enum { kBatchSize = 256 };
+
+struct Msg
+{
+    uint8_t version = 3;
+    uint8_t type = 1;
+    SendKey sendKey;
+    Buffer signedContent;
+    Buffer signature;
+    bool valid = false;
+};
+
+static bool verify(const Msg& msg, const StaticBuffer& pubKey, Buffer& buf)
+{
+    return ParsedMessage::verifySignature(msg.version, msg.type, msg.signedContent, msg.signature,
+        pubKey, msg.sendKey, buf);
+}
+
+// the app's message queue, where workers marshal their results
+static std::mutex gMutex;
+static std::condition_variable gCond;
+static std::deque<std::function<void()>> gMessages;
+
+static void marshall(std::function<void()>&& func)
+{
+    std::lock_guard<std::mutex> lock(gMutex);
+    gMessages.push_back(std::move(func));
+    gCond.notify_one();
+}
+
+static void runLoopUntil(const size_t& done, size_t count)
+{
+    while (done < count)
+    {
+        std::function<void()> func;
+        {
+            std::unique_lock<std::mutex> lock(gMutex);
+            gCond.wait(lock, []() { return !gMessages.empty(); });
+            func = std::move(gMessages.front());
+            gMessages.pop_front();
+        }
+        func();
+    }
+}
+
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char* name, size_t count, double ms, size_t valid)
+{
+    printf("%-28s %zu msgs: %8.2f ms (%6.2f us/msg), %zu valid\n",
+           name, count, ms, ms * 1000 / count, valid);
+}
+
+// no workers: the app's thread verifies each message
+static void benchInline(std::vector<Msg>& msgs, const StaticBuffer& pubKey)
+{
+    auto start = std::chrono::steady_clock::now();
+    size_t valid = 0;
+    for (auto& msg: msgs)
+    {
+        // the buffer is allocated for each message, as by ParsedMessage::verifySignature(pubKey, sendKey)
+        Buffer buf;
+        valid += verify(msg, pubKey, buf);
+    }
+    report("inline, per message", msgs.size(), elapsedMs(start), valid);
+}
+
+// a worker job and a marshalled result per message
+static void benchPerMessage(std::vector<Msg>& msgs, const StaticBuffer& pubKey, karere::WorkerPool& pool)
+{
+    size_t done = 0, valid = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto& msg: msgs)
+    {
+        Msg* pmsg = &msg;
+        pool.post(1, [pmsg, &pubKey, &done, &valid]()
+        {
+            Buffer buf;
+            bool ok = verify(*pmsg, pubKey, buf);
+            marshall([pmsg, ok, &done, &valid]()
+            {
+                pmsg->valid = ok;
+                valid += ok;
+                done++;
+            });
+        });
+    }
+    runLoopUntil(done, msgs.size());
+    report("workers, per message", msgs.size(), elapsedMs(start), valid);
+}
+
+// a worker job and a marshalled result per batch
+static void benchBatched(std::vector<Msg>& msgs, const StaticBuffer& pubKey, karere::WorkerPool& pool)
+{
+    size_t done = 0, valid = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t first = 0; first < msgs.size(); first += kBatchSize)
+    {
+        Msg* begin = &msgs[first];
+        Msg* end = begin + std::min((size_t)kBatchSize, msgs.size() - first);
+        pool.post(1, [begin, end, &pubKey, &done, &valid]()
+        {
+            auto results = std::make_shared<std::vector<bool>>();
+            results->reserve(end - begin);
+            Buffer buf;     // reused within the batch
+            for (Msg* msg = begin; msg < end; msg++)
+            {
+                results->push_back(verify(*msg, pubKey, buf));
+            }
+            marshall([begin, end, results, &done, &valid]()
+            {
+                for (Msg* msg = begin; msg < end; msg++)
+                {
+                    msg->valid = (*results)[msg - begin];
+                    valid += msg->valid;
+                    done++;
+                }
+            });
+        });
+    }
+    runLoopUntil(done, msgs.size());
+    report("workers, batched", msgs.size(), elapsedMs(start), valid);
+}
+
+int main(int argc, char** argv)
+{
+    size_t count = (argc > 1) ? atoi(argv[1]) : 10000;
+    if (sodium_init() < 0)
+        return 1;
+
+    EcKey pubKey;
+    unsigned char privKey[crypto_sign_SECRETKEYBYTES];
+    crypto_sign_keypair(pubKey.ubuf(), privKey);
+
+    std::mt19937 rng(1234);
+    std::vector<Msg> msgs(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        Msg& msg = msgs[i];
+        randombytes_buf(msg.sendKey.buf(), msg.sendKey.dataSize());
+        std::string content(64 + rng() % 256, 0);
+        randombytes_buf(&content[0], content.size());
+        msg.signedContent.assign(content.data(), content.size());
+
+        // signed as by ProtocolHandler::signMessage()
+        Buffer toSign;
+        toSign.append("strongvelopesig")
+              .append<uint8_t>(msg.version)
+              .append<uint8_t>(msg.type)
+              .append(msg.sendKey)
+              .append(msg.signedContent);
+        msg.signature.setDataSize(crypto_sign_BYTES);
+        crypto_sign_detached(msg.signature.ubuf(), nullptr, toSign.ubuf(), toSign.dataSize(), privKey);
+        if (i % 1000 == 999)
+        {
+            msg.signature.ubuf()[0] ^= 1; // some tampered messages
+        }
+    }
+
+    karere::WorkerPool pool;
+    benchInline(msgs, pubKey);
+    benchPerMessage(msgs, pubKey, pool);
+    benchBatched(msgs, pubKey, pool);
+    return 0;
+}
@@ -180,6 +180,10 @@ UserAttrDesc gUserAttrDescs[21] =
 
 UserAttrCache::~UserAttrCache()
 {
+    if (mFetchTimer)
+    {
+        cancelTimeout(mFetchTimer, mClient.appCtx);
+    }
     mClient.api.sdk.removeGlobalListener(this);
 }
 
@@ -399,26 +403,110 @@ void UserAttrCache::fetchAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheIte
 {
     if (!mIsLoggedIn && !(key.attrType & USER_ATTR_FLAG_COMPOSITE))
         return;
+    if (key.attrType == USER_ATTR_FULLNAME)
+    {
+        // composed of other attributes, which are queued themselves
+        fetchUserFullName(key, item);
+        return;
+    }
+    queueFetch(key);
+}
+
+void UserAttrCache::queueFetch(UserAttrPair key)
+{
+    if (mFetchesInFlight.find(key) != mFetchesInFlight.end())
+        return; // the pending item will be resolved by the request in flight
+    if (!mFetchQueued.insert(key).second)
+        return; // already queued
+
+    bool isKey = (key.attrType == ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY)
+              || (key.attrType == ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY)
+              || (key.attrType == USER_ATTR_RSA_PUBKEY);
+    mFetchQueue[isKey ? 0 : 1].push_back(key);
+    if (mFetchTimer)
+        return;
+
+    // if nothing else is being fetched, there's no batch to wait for
+    bool isOnlyFetch = mFetchesInFlight.empty() && (mFetchQueued.size() == 1);
+    auto wptr = weakHandle();
+    mFetchTimer = setTimeout([wptr, this]()
+    {
+        if (wptr.deleted())
+            return;
+        mFetchTimer = 0;
+        sendQueuedFetches();
+    }, isOnlyFetch ? 0 : kFetchCoalesceMs, mClient.appCtx);
+}
+
+void UserAttrCache::sendQueuedFetches()
+{
+    if (!mIsLoggedIn)
+    {
+        // the items are still pending, and will be fetched again by onLogin()
+        for (auto& queue: mFetchQueue)
+        {
+            queue.clear();
+        }
+        mFetchQueued.clear();
+        return;
+    }
+
+    size_t count = 0;
+    for (auto& queue: mFetchQueue)
+    {
+        while (!queue.empty() && mFetchesInFlight.size() < (size_t)kMaxFetchesInFlight)
+        {
+            UserAttrPair key = queue.front();
+            queue.pop_front();
+            mFetchQueued.erase(key);
+            auto it = find(key);
+            if (it == end() || it->second->pending == kCacheFetchNotPending)
+                continue; // removed from the cache meanwhile
+
+            mFetchesInFlight.insert(key);
+            count++;
+            auto wptr = weakHandle();
+            sendFetch(key, it->second)
+            .fail([](const ::promise::Error& /*err*/)
+            {
+                return ::promise::_Void(); // already handled by the item
+            })
+            .then([wptr, this, key]()
+            {
+                if (wptr.deleted())
+                    return;
+                assert(mFetchesInFlight.count(key));
+                mFetchesInFlight.erase(key);
+                sendQueuedFetches();
+            });
+        }
+    }
+    if (count)
+    {
+        UACACHE_LOG_DEBUG("Sent %zu attribute requests (%zu in flight, %zu queued)",
+            count, mFetchesInFlight.size(), mFetchQueued.size());
+    }
+}
+
+::promise::Promise<void>
+UserAttrCache::sendFetch(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
+{
     switch (key.attrType)
     {
-        case USER_ATTR_FULLNAME:
-            fetchUserFullName(key, item);
-            break;
         case USER_ATTR_RSA_PUBKEY:
-            fetchRsaPubkey(key, item);
-            break;
+            return fetchRsaPubkey(key, item);
         case USER_ATTR_EMAIL:
-            fetchEmail(key, item);
-            break;
+            return fetchEmail(key, item);
         default:
-            fetchStandardAttr(key, item);
-            break;
+            return fetchStandardAttr(key, item);
     }
 }
-void UserAttrCache::fetchStandardAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
+
+::promise::Promise<void>
+UserAttrCache::fetchStandardAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
 {
     auto wptr = weakHandle();
-    mClient.api.call(&::mega::MegaApi::getUserAttribute,
+    return mClient.api.call(&::mega::MegaApi::getUserAttribute,
         key.user.toString().c_str(), (int)key.attrType)
     .then([wptr, this, key, item](ReqResult result)
     {
@@ -434,10 +522,11 @@ void UserAttrCache::fetchStandardAttr(UserAttrPair key, std::shared_ptr<UserAttr
     });
 }
 
-void UserAttrCache::fetchEmail(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
+::promise::Promise<void>
+UserAttrCache::fetchEmail(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
 {
     auto wptr = weakHandle();
-    mClient.api.call(&::mega::MegaApi::getUserEmail,
+    return mClient.api.call(&::mega::MegaApi::getUserEmail,
         key.user.val)
     .then([wptr, this, key, item](ReqResult result)
     {
@@ -518,10 +607,11 @@ void UserAttrCache::fetchUserFullName(UserAttrPair key, std::shared_ptr<UserAttr
     });
 }
 
-void UserAttrCache::fetchRsaPubkey(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
+::promise::Promise<void>
+UserAttrCache::fetchRsaPubkey(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
 {
     auto wptr = weakHandle();
-    mClient.api.call(&::mega::MegaApi::getUserData, key.user.toString().c_str())
+    return mClient.api.call(&::mega::MegaApi::getUserData, key.user.toString().c_str())
     .fail([wptr, this, key, item](const ::promise::Error& err)
     {
         wptr.throwIfDeleted();
@@ -588,4 +678,15 @@ UserAttrCache::getAttr(uint64_t user, unsigned attrType)
     return ret;
 }
 
+void UserAttrCache::prefetchAttrs(const std::vector<uint64_t>& users, const std::vector<unsigned>& types)
+{
+    for (auto user: users)
+    {
+        for (auto type: types)
+        {
+            getAttr(user, type, nullptr, nullptr); // no callback: only fetch it, if missing
+        }
+    }
+}
+
 }
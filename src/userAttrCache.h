@@ -4,7 +4,11 @@
 #include "karereId.h"
 #include <megaapi.h>
 #include <list>
+#include <deque>
+#include <set>
+#include <vector>
 #include <promise.h>
+#include <timers.hpp>
 #include <base/trackDelete.h>
 
 #define UACACHE_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_uacache, fmtString, ##__VA_ARGS__)
@@ -124,17 +128,34 @@ class UserAttrCache: public std::map<UserAttrPair, std::shared_ptr<UserAttrCache
                      public ::mega::MegaGlobalListener, public karere::DeleteTrackable
 {
 protected:
+    /** Attributes missing from the cache are not requested right away, but collected
+     * for a short time and then requested in parallel, so that the SDK can send them
+     * to the API in batches. A miss when no other attribute is being fetched is
+     * requested right after the current event, together with the misses of that event
+     */
+    enum
+    {
+        kFetchCoalesceMs = 10,      ///< time during which misses are collected
+        kMaxFetchesInFlight = 32    ///< max number of attribute requests sent to the SDK at a time
+    };
     Client& mClient;
     bool mIsLoggedIn = false;
+    std::deque<UserAttrPair> mFetchQueue[2]; // [0]: public keys, needed to decrypt messages, [1]: the rest
+    std::set<UserAttrPair> mFetchQueued;    // attributes in mFetchQueue
+    std::set<UserAttrPair> mFetchesInFlight; // attributes requested to the SDK, not queued again until answered
+    megaHandle mFetchTimer = 0;
     void dbWrite(UserAttrPair key, const Buffer& data);
     void dbWriteNull(UserAttrPair key);
     void dbInvalidateItem(UserAttrPair item);
     void fetchAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
+    void queueFetch(UserAttrPair key);
+    void sendQueuedFetches();
+    ::promise::Promise<void> sendFetch(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
 //actual attrib fetch backend functions
     void fetchUserFullName(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
-    void fetchStandardAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
-    void fetchRsaPubkey(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
-    void fetchEmail(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
+    ::promise::Promise<void> fetchStandardAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
+    ::promise::Promise<void> fetchRsaPubkey(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
+    ::promise::Promise<void> fetchEmail(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
 //==
     void onUserAttrChange(uint64_t userid, int changed);
     void onUserAttrChange(::mega::MegaUser& user);
@@ -175,6 +196,12 @@ public:
      * is implicitly one-shot, as a promise can be resolved only once.
      */
     promise::Promise<Buffer*> getAttr(uint64_t user, unsigned attrType);
+    /** @brief Fetches the attributes \c types of all \c users that are not in the
+     * cache yet, without registering any callback. The misses are requested together,
+     * so it's much faster than requesting them one by one when they are needed,
+     * i.e. when the members of a group chat are loaded.
+     */
+    void prefetchAttrs(const std::vector<uint64_t>& users, const std::vector<unsigned>& types);
     /** @brief Unregisters an attribute request/subsequent callbacks.
      * It can be a not-yet-fetched single shot request as well. Use this method
      * to unsubscribe from further calling the corresponding callback.
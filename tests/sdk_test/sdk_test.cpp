@@ -35,6 +35,7 @@ int main(int argc, char **argv)
     EXECUTE_TEST(t.TEST_SwitchAccounts(0, 1), "TEST Switch accounts");
     EXECUTE_TEST(t.TEST_ClearHistory(0, 1), "TEST Clear history");
     EXECUTE_TEST(t.TEST_EditAndDeleteMessages(0, 1), "TEST Edit & delete messages");
+    EXECUTE_TEST(t.TEST_HistoryEviction(0, 1), "TEST History eviction");
     EXECUTE_TEST(t.TEST_GroupChatManagement(0, 1), "TEST Groupchat management");
     EXECUTE_TEST(t.TEST_ResumeSession(0), "TEST Resume session");
     EXECUTE_TEST(t.TEST_Attachment(0, 1), "TEST Attachments");
@@ -1084,6 +1085,100 @@ void MegaChatApiTest::TEST_EditAndDeleteMessages(unsigned int a1, unsigned int a
     secondarySession = NULL;
 }
 
+/**
+ * @brief TEST_HistoryEviction
+ *
+ * Requirements:
+ * - Both accounts should be conctacts
+ * - The 1on1 chatroom between them should exist
+ * (if not accomplished, the test automatically solves the above)
+ *
+ * This test does the following:
+ *
+ * - Set a small history budget
+ * - Send more messages than the budget
+ * - Get every sent message (the oldest ones are reloaded from the cache)
+ * - Reopen the chatroom and load the history
+ * - Get every sent message again
+ *
+ */
+void MegaChatApiTest::TEST_HistoryEviction(unsigned int a1, unsigned int a2)
+{
+    char *primarySession = login(a1);
+    char *secondarySession = login(a2);
+
+    MegaUser *user = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
+    if (!user || (user->getVisibility() != MegaUser::VISIBILITY_VISIBLE))
+    {
+        makeContact(a1, a2);
+    }
+    delete user;
+    user = NULL;
+
+    MegaChatHandle chatid = getPeerToPeerChatRoom(a1, a2);
+
+    const unsigned int budget = 8;
+    const int numMessages = 4 * budget;
+    megaChatApi[a1]->setHistoryBudget(budget, 0);
+
+    TestChatRoomListener *chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    ASSERT_CHAT_TEST(megaChatApi[a2]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a2+1));
+
+    // Load some message to feed history
+    loadHistory(a1, chatid, chatroomListener);
+    loadHistory(a2, chatid, chatroomListener);
+
+    std::vector<std::pair<MegaChatHandle, std::string>> sent;
+    for (int i = 0; i < numMessages; i++)
+    {
+        std::string messageToSend = "HOLA " + mAccounts[a2].getEmail() + " - Testing history eviction. This message is the number " + std::to_string(i);
+        MegaChatMessage *msgSent = sendTextMessageOrUpdate(a1, a2, chatid, messageToSend, chatroomListener);
+        ASSERT_CHAT_TEST(msgSent, "Failed to send message " + std::to_string(i));
+        sent.push_back(std::make_pair(msgSent->getMsgId(), messageToSend));
+        delete msgSent;
+        msgSent = NULL;
+    }
+
+    // all the messages are still available, the evicted ones are reloaded from the cache
+    for (auto& item: sent)
+    {
+        MegaChatMessage *msg = megaChatApi[a1]->getMessage(chatid, item.first);
+        ASSERT_CHAT_TEST(msg, "Message not found after eviction: " + std::to_string(item.first));
+        ASSERT_CHAT_TEST(msg->getContent() && item.second == msg->getContent(), "Wrong content of message after eviction: " + std::to_string(item.first));
+        delete msg;
+        msg = NULL;
+    }
+
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    megaChatApi[a2]->closeChatRoom(chatid, chatroomListener);
+    delete chatroomListener;
+
+    // reopen the chatroom and load the history, which goes through the evicted messages
+    chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    int count = loadHistory(a1, chatid, chatroomListener);
+    ASSERT_CHAT_TEST(count >= numMessages, "Wrong count of messages: " + std::to_string(count));
+
+    for (auto& item: sent)
+    {
+        MegaChatMessage *msg = megaChatApi[a1]->getMessage(chatid, item.first);
+        ASSERT_CHAT_TEST(msg, "Message not found after reloading history: " + std::to_string(item.first));
+        ASSERT_CHAT_TEST(msg->getContent() && item.second == msg->getContent(), "Wrong content of message after reloading history: " + std::to_string(item.first));
+        delete msg;
+        msg = NULL;
+    }
+
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    delete chatroomListener;
+    megaChatApi[a1]->setHistoryBudget(0, 0);
+
+    delete [] primarySession;
+    primarySession = NULL;
+    delete [] secondarySession;
+    secondarySession = NULL;
+}
+
 /**
  * @brief TEST_GroupChatManagement
  *